@@ -24,6 +24,9 @@
 #define COMPAT_HAVE_WAIT_ON_BIT_LOCK_ACTION
 #define COMPAT_WAIT_FUNCTION_HAS_PARAM
 #endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0))
+#define COMPAT_HAVE_GENERIC_IO_ACCT
+#endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0))
 #define COMPAT_HAVE_BIO_BI_ERROR
 #define COMPAT_NO_BIO_GET_NR_VECS
@@ -32,15 +35,28 @@
 #define COMPAT_WAIT_FUNCTION_HAS_2_PARAM
 #define COMPAT_MAKE_REQUEST_FN_RET_BLK_QC_T
 #endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0))
+#define COMPAT_HAVE_BLK_QUEUE_WRITE_CACHE
+#endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0))
 #define COMPAT_NO_GENDISK_DRIVERFS_DEV
 #define COMPAT_HAVE_BIO_OPF
 #endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0))
+#define COMPAT_HAVE_GET_RANDOM_U32
+#endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
 #define COMPAT_HAVE_BIO_BI_STATUS
 #endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0))
 #define COMPAT_NO_BIO_BIDEV
+#define COMPAT_IO_ACCT_HAS_QUEUE
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0))
+#define COMPAT_HAVE_BLK_QUEUE_FLAG_SET
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0))
+#define COMPAT_IO_ACCT_HAS_OP
 #endif
 
 /*Include features backported to RedHat kernels*/
@@ -64,6 +80,7 @@
 #define EIO_REQ_PREFLUSH       REQ_PREFLUSH
 #define EIO_REQ_FUA            REQ_FUA
 #define EIO_REQ_SYNC           REQ_SYNC
+#define EIO_REQ_META           REQ_META
 
         /* long gone */
 #define EIO_REQ_HARDBARRIER    0
@@ -88,6 +105,7 @@
 #define EIO_REQ_DISCARD        (1UL << BIO_RW_DISCARD)
 #define EIO_REQ_SYNC           (1UL << BIO_RW_SYNCIO)
 #define EIO_REQ_UNPLUG         (1UL << BIO_RW_UNPLUG)
+#define EIO_REQ_META           (1UL << BIO_RW_META)
 
 #define REQ_RAHEAD             (1UL << BIO_RW_AHEAD)
 
@@ -97,6 +115,7 @@
 #define EIO_REQ_PREFLUSH       REQ_FLUSH
 #define EIO_REQ_FUA            REQ_FUA
 #define EIO_REQ_DISCARD        REQ_DISCARD
+#define EIO_REQ_META           REQ_META
 
 #ifdef REQ_HARDBARRIER
 #define EIO_REQ_HARDBARRIER    REQ_HARDBARRIER
@@ -123,6 +142,11 @@
 #endif
 /* END of bio -> bi_rw/bi_opf REQ_* and BIO_RW_* REQ_OP_* */
 
+/* The I/O priority of a bio, or else the one of its submitter */
+#define EIO_BIO_IOPRIO(BIO) \
+	(ioprio_valid(bio_prio(BIO)) ? bio_prio(BIO) : \
+	 (current->io_context ? current->io_context->ioprio : 0))
+
 
 #ifndef COMPAT_HAVE_BIO_OPF
 #define bi_opf bi_rw
@@ -334,3 +358,42 @@ static inline struct block_device *blkdev_get_by_path(const char *path, fmode_t
 	do { (DEST)->bi_bdev = (SRC)->bi_bdev; } while (0)
 #define EIO_BIO_GET_QUEUE(bio) bdev_get_queue((bio)->bi_bdev)
 #endif
+
+/* Disk statistics of the stacked device */
+#ifndef COMPAT_HAVE_GENERIC_IO_ACCT
+#define EIO_START_IO_ACCT(Q, BIO, PART) do {} while (0)
+#define EIO_END_IO_ACCT(Q, BIO, PART, START) do {} while (0)
+#elif defined COMPAT_IO_ACCT_HAS_OP
+#define EIO_START_IO_ACCT(Q, BIO, PART) \
+	generic_start_io_acct(Q, bio_op(BIO), bio_sectors(BIO), PART)
+#define EIO_END_IO_ACCT(Q, BIO, PART, START) \
+	generic_end_io_acct(Q, bio_op(BIO), PART, START)
+#elif defined COMPAT_IO_ACCT_HAS_QUEUE
+#define EIO_START_IO_ACCT(Q, BIO, PART) \
+	generic_start_io_acct(Q, bio_data_dir(BIO), bio_sectors(BIO), PART)
+#define EIO_END_IO_ACCT(Q, BIO, PART, START) \
+	generic_end_io_acct(Q, bio_data_dir(BIO), PART, START)
+#else
+#define EIO_START_IO_ACCT(Q, BIO, PART) \
+	generic_start_io_acct(bio_data_dir(BIO), bio_sectors(BIO), PART)
+#define EIO_END_IO_ACCT(Q, BIO, PART, START) \
+	generic_end_io_acct(bio_data_dir(BIO), PART, START)
+#endif
+
+#ifdef COMPAT_HAVE_BLK_QUEUE_FLAG_SET
+#define EIO_QUEUE_FLAG_SET(FLAG, Q) blk_queue_flag_set(FLAG, Q)
+#else
+#define EIO_QUEUE_FLAG_SET(FLAG, Q) queue_flag_set_unlocked(FLAG, Q)
+#endif
+
+#ifdef COMPAT_HAVE_BLK_QUEUE_WRITE_CACHE
+#define EIO_QUEUE_WRITE_CACHE(Q) blk_queue_write_cache(Q, true, true)
+#else
+#define EIO_QUEUE_WRITE_CACHE(Q) blk_queue_flush(Q, REQ_FLUSH | REQ_FUA)
+#endif
+
+#ifdef COMPAT_HAVE_GET_RANDOM_U32
+#define EIO_GET_RANDOM_U32(V) do { (V) = get_random_u32(); } while (0)
+#else
+#define EIO_GET_RANDOM_U32(V) get_random_bytes(&(V), sizeof(V))
+#endif
@@ -42,6 +42,7 @@
 #include <linux/slab.h>
 #include <linux/hash.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/workqueue.h>
 #include <linux/pagemap.h>
 #include <linux/random.h>
@@ -55,10 +56,17 @@
 #include <linux/device-mapper.h>
 #include <linux/dm-kcopyd.h>
 #include <linux/sort.h>         /* required for eio_subr.c */
+#include <linux/list_sort.h>
+#include <linux/crc32.h>
 #include <linux/kthread.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
 #include <linux/vmalloc.h>      /* for sysinfo (mem) variables */
 #include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
 #include <scsi/scsi_device.h>   /* required for SSD failure handling */
 /* resolve conflict with scsi/scsi_device.h */
 #include "compat.h"
@@ -144,6 +152,11 @@ extern struct work_struct _kcached_wq;
 extern int eio_force_warm_boot;
 extern atomic_t nr_cache_jobs;
 extern mempool_t *_job_pool;
+extern mempool_t *_bc_pool;
+extern mempool_t *_ebio_pool;
+extern mempool_t *_set_seq_pool;
+extern mempool_t *_mdreq_pool;
+extern mempool_t *_arena_pool;
 
 /*
  * This file has three sections as follows:
@@ -229,6 +242,7 @@ extern mempool_t *_job_pool;
 
 #define DEV_PATHLEN             128
 #define EIO_SUPERBLOCK_SIZE     4096
+#define EIO_MAX_PINS            16      /* pinned LBA ranges per cache */
 
 #define EIO_CLEAN_ABORT         0x00000000
 #define EIO_CLEAN_START         0x00000001
@@ -239,8 +253,9 @@ extern mempool_t *_job_pool;
 #define EIO_BAD_MAGIC           0xBADCAC6E
 
 /* EIO version */
-#define EIO_SB_VERSION          3       /* kernel superblock version */
+#define EIO_SB_VERSION          4       /* kernel superblock version */
 #define EIO_SB_MAGIC_VERSION    3       /* version in which magic number was introduced */
+#define EIO_SB_SUBBLOCK_VERSION 4       /* version in which sub-block maps were introduced */
 
 union eio_superblock {
 	struct superblock_fields {
@@ -269,6 +284,21 @@ union eio_superblock {
 		__le32 cache_wronly;
 		__le32 time_based_clean_interval;
 		__le32 autoclean_threshold;
+		__le32 seq_io_cutoff;
+		__le32 read_around;
+		__le32 lookup_filter;
+		__le32 admission;
+		__le32 io_hints;
+		__le32 nr_pins;                 /* pinned LBA ranges */
+		__le64 pin_start[EIO_MAX_PINS];
+		__le64 pin_end[EIO_MAX_PINS];
+		__le32 md_batch_usec;
+		__le32 md_journal;
+		__le64 jrnl_start;              /* md journal, 0 if none */
+		__le64 jrnl_tail;               /* oldest live journal block */
+		__le32 jrnl_sectors;
+		__le32 jrnl_id;                 /* tags the blocks of this cache */
+		__le32 clean_sort;
 	} sbf;
 	u_int8_t padding[EIO_SUPERBLOCK_SIZE];
 };
@@ -278,7 +308,8 @@ union eio_superblock {
  * and give it a full 4K.  Also, in addition to the single
  * "red-zone" buffer that separates metadata sectors from the
  * data sectors, we allocate extra sectors so that we can
- * align the data sectors on a 4K boundary.
+ * align the data sectors on a 4K boundary (a cache block boundary
+ * for blocks larger than 8K).
  *
  *    64K    4K  variable variable  8K variable  variable
  * +--------+--+--------+---------+---+--------+---------+
@@ -302,6 +333,11 @@ union eio_superblock {
 						 EIO_REDZONE_SECTORS + \
 						 EIO_ALIGN2_SECTORS(md_sects))
 
+/* Data of blocks larger than 8K starts on a block boundary as well */
+#define EIO_DATA_ALIGN(md_sects, blksize)       (((blksize) > BLKSIZE_8K) ? \
+						 ALIGN((md_sects), (sector_t)(blksize)) : \
+						 (md_sects))
+
 /*
  * We do metadata updates only when a block trasitions from DIRTY -> CLEAN
  * or from CLEAN -> DIRTY. Consequently, on an unclean shutdown, we only
@@ -310,15 +346,66 @@ union eio_superblock {
  * On a clean shutdown, we will sync the state for every block, and we will
  * load every block back into cache on a restart.
  */
+/*
+ * Bits 0-15 of cache_state hold the block state. Bits 16-31 hold the
+ * sub-blocks not valid in the cache and bits 32-47 the sub-blocks of a
+ * dirty block that need no writeback (see struct eio_sbmap). Metadata
+ * older than EIO_SB_SUBBLOCK_VERSION has zeros there, which means the
+ * whole block, as it always did.
+ */
 struct flash_cacheblock {
 	__le64 dbn;           /* Sector number of the cached block */
 	__le64 cache_state;
 };
 
+#define EIO_MD_SB_INVALID_SHIFT         16
+#define EIO_MD_SB_CLEAN_SHIFT           32
+#define EIO_MD_SB_MASK                  0xFFFF
+
+/*
+ * Write-back md journal. A WB cache created with this version reserves
+ * EIO_JRNL_SECTORS after the red zone for a circular log of 4K blocks.
+ * Block number seq lives in slot (seq % nr blocks); the blocks from the
+ * superblock's jrnl_tail on are live. With md_journal on, the group
+ * commit appends a record per block turning dirty instead of rewriting
+ * md sectors in place, and the sets it touched are checkpointed into
+ * the flat md in the background. A clean or a discard that rewrites a
+ * set with live records appends a set record, so that replay forgets
+ * the records of that set which come before it.
+ */
+#define EIO_JRNL_MAGIC                  0x4A4F4945      /* "EIOJ" */
+#define EIO_JRNL_SECTORS                2048            /* 1MB */
+#define EIO_JRNL_BLOCK_SIZE             4096
+#define EIO_JRNL_BLOCK_SECTORS          (EIO_JRNL_BLOCK_SIZE >> SECTOR_SHIFT)
+#define EIO_JRNL_RESERVE                8               /* blocks kept for set records */
+#define EIO_JRNL_REC_SET                (1ULL << 63)    /* in rec index: a set record */
+#define EIO_JRNL_NO_SEQ                 (~0ULL)
+
+struct eio_jrnl_header {
+	__le32 magic;
+	__le32 crc;             /* crc32 of the block, computed with crc 0 */
+	__le64 seq;
+	__le32 id;              /* sbf.jrnl_id */
+	__le32 nr_recs;
+};
+
+struct eio_jrnl_rec {
+	__le64 index;           /* cache block, or set | EIO_JRNL_REC_SET */
+	__le64 dbn;
+	__le64 cache_state;     /* as in struct flash_cacheblock */
+};
+
+#define EIO_JRNL_RECS_PER_BLOCK         ((EIO_JRNL_BLOCK_SIZE - \
+					  sizeof(struct eio_jrnl_header)) / \
+					 sizeof(struct eio_jrnl_rec))
+
 /* blksize in terms of no. of sectors */
 #define BLKSIZE_2K      4
 #define BLKSIZE_4K      8
 #define BLKSIZE_8K      16
+#define BLKSIZE_16K     32
+#define BLKSIZE_32K     64
+#define BLKSIZE_64K     128
 
 /*
  * Give me number of pages to allocated for the
@@ -339,6 +426,9 @@ struct flash_cacheblock {
 						   break;			   \
 					   case BLKSIZE_4K:			   \
 					   case BLKSIZE_8K:			   \
+					   case BLKSIZE_16K:			   \
+					   case BLKSIZE_32K:			   \
+					   case BLKSIZE_64K:			   \
 						   break;			   \
 					   }					   \
 					   count;				   \
@@ -380,8 +470,11 @@ struct flash_cacheblock {
 #define CACHE_REPL_FIFO         1
 #define CACHE_REPL_LRU          2
 #define CACHE_REPL_RANDOM       3
+#define CACHE_REPL_ARC          4
+#define CACHE_REPL_2Q           5
+#define CACHE_REPL_CLOCK        6
 #define CACHE_REPL_FIRST        CACHE_REPL_FIFO
-#define CACHE_REPL_LAST         CACHE_REPL_RANDOM
+#define CACHE_REPL_LAST         CACHE_REPL_CLOCK
 #define CACHE_REPL_DEFAULT      CACHE_REPL_FIFO
 
 struct eio_policy_and_name {
@@ -394,6 +487,9 @@ static const struct eio_policy_and_name eio_policy_names[] = {
 	{ CACHE_REPL_FIFO,   "fifo" },
 	{ CACHE_REPL_LRU,    "lru"  },
 	{ CACHE_REPL_RANDOM, "rand" },
+	{ CACHE_REPL_ARC,    "arc"  },
+	{ CACHE_REPL_2Q,     "2q"   },
+	{ CACHE_REPL_CLOCK,  "clock" },
 };
 
 
@@ -433,6 +529,7 @@ static const struct eio_policy_and_name eio_policy_names[] = {
 #define CACHE_FLAGS_SHUTDOWN_INPROG     (1 << 8)
 #define CACHE_FLAGS_MOD_INPROG          (1 << 9)        /* cache modification such as edit/delete in progress */
 #define CACHE_FLAGS_DELETED             (1 << 10)
+#define CACHE_FLAGS_STACKED             (1 << 11)       /* exported as its own block device */
 #define CACHE_FLAGS_INCORE_ONLY         (CACHE_FLAGS_DEGRADED |		\
 					 CACHE_FLAGS_SSD_ADD_INPROG |	\
 					 CACHE_FLAGS_FAILED |		\
@@ -465,7 +562,7 @@ enum dev_notifier {
  * Subsection 3.1: Definitions.
  */
 
-#define EIO_SB_VERSION          3       /* kernel superblock version */
+#define EIO_SB_VERSION          4       /* kernel superblock version */
 
 /* kcached/pending job states */
 #define READCACHE               1
@@ -501,6 +598,27 @@ enum dev_notifier {
 #define AUTOCLEAN_THRESH_DEF            128     /* Number of I/Os which puts a hold on time based cleaning */
 #define AUTOCLEAN_THRESH_MAX            1024    /* Number of I/Os which puts a hold on time based cleaning */
 
+#define SEQ_IO_CUTOFF_DEF               0       /* in KB, sequential bypass is off by default */
+#define SEQ_IO_CUTOFF_MAX               (4 * 1024 * 1024)       /* 4GB */
+#define EIO_SEQ_STREAMS                 16      /* streams tracked per cache */
+#define READ_AROUND_DEF                 0       /* partial read misses are not filled */
+#define LOOKUP_FILTER_DEF               0       /* no per-set lookup filter */
+#define ADMISSION_DEF                   0       /* every miss may evict a block */
+#define IO_HINTS_DEF                    0       /* bio hints are ignored */
+#define MD_BATCH_USEC_DEF               0       /* md group commit doesn't wait */
+#define MD_BATCH_USEC_MAX               10000
+#define EIO_MD_BATCH_MAX                64      /* sets committed at once */
+#define MD_JOURNAL_DEF                  0       /* md updates are written in place */
+#define CLEAN_SORT_DEF                  0       /* sets are cleaned one at a time */
+#define EIO_CLEAN_SORT_SETS             8       /* sets cleaned at once, sorted */
+
+/* Rules of the io_hints sysctl, a bitmask */
+#define EIO_HINT_RAHEAD_NOFILL          0x01    /* no cache allocation for readahead */
+#define EIO_HINT_META_ADMIT             0x02    /* metadata is always cached */
+#define EIO_HINT_IDLE_NOALLOC           0x04    /* no cache allocation for idle class I/O */
+#define EIO_HINT_VICTIM                 0x08    /* hints steer the replacement policy */
+#define EIO_HINT_ALL                    0x0f
+
 /* Inject a 5s delay between cleaning blocks and metadata */
 #define CLEAN_REMOVE_DELAY      5000
 
@@ -576,19 +694,24 @@ struct mdupdate_request {
 	struct eio_bio *pending_mdlist; /* ebios pending for md update */
 	struct eio_bio *inprog_mdlist;  /* ebios processed for md update */
 	int error;                      /* error during md update */
+	int fua;                        /* a FUA or flush write waits on the update */
 	struct mdupdate_request *next;  /* next mdreq in the mdreq list .TBD. Deprecate */
 };
 
 #define SETFLAG_CLEAN_INPROG    0x00000001      /* clean in progress on a set */
 #define SETFLAG_CLEAN_WHOLE     0x00000002      /* clean the set fully */
+#define SETFLAG_LOOKUP_FILTER   0x00000004      /* the set's lookup filter is in use */
 
 /* Structure used for doing operations and storing cache set level info */
 struct cache_set {
 	struct list_head list;
 	u_int32_t nr_dirty;             /* number of dirty blocks */
 	spinlock_t cs_lock;             /* spin lock to protect struct fields */
+	seqcount_t cs_seq;              /* bumped by block state/dbn changes */
 	struct rw_semaphore rw_lock;    /* lock for cache set clean */
 	unsigned int flags;             /* misc cache set specific flags */
+	int32_t nr_pinned;              /* VALID blocks of pinned ranges,
+					 * below 0 until a pin change is recounted */
 	struct mdupdate_request *mdreq; /* metadata update request pointer */
 };
 
@@ -603,55 +726,107 @@ struct eio_errors {
 };
 
 /*
- * Stats. Note that everything should be "atomic64_t" as
- * code relies on it.
+ * Stats. These are per-cpu counters, every field must be "int64_t"
+ * since eio_stats_sum() folds them as an array. Update them only
+ * through the EIO_STATS_* macros, which are safe in irq context.
  */
+#define EIO_STATS_INC(statval)	\
+	this_cpu_inc(statval)
+#define EIO_STATS_ADD(statval, val)	\
+	this_cpu_add(statval, val)
 #define SECTOR_STATS(statval, io_size)	\
-	atomic64_add(eio_to_sector(io_size), &statval);
+	this_cpu_add(statval, eio_to_sector(io_size));
 
 struct eio_stats {
-	atomic64_t reads;               /* Number of reads */
-	atomic64_t writes;              /* Number of writes */
-	atomic64_t read_hits;           /* Number of cache hits */
-	atomic64_t write_hits;          /* Number of write hits (includes dirty write hits) */
-	atomic64_t dirty_write_hits;    /* Number of "dirty" write hits */
-	atomic64_t cached_blocks;       /* Number of cached blocks */
-	atomic64_t rd_replace;          /* Number of read cache replacements. TBD modify def doc */
-	atomic64_t wr_replace;          /* Number of write cache replacements. TBD modify def doc */
-	atomic64_t noroom;              /* No room in set */
-	atomic64_t cleanings;           /* blocks cleaned TBD modify def doc */
-	atomic64_t md_write_dirty;      /* Metadata sector writes dirtying block */
-	atomic64_t md_write_clean;      /* Metadata sector writes cleaning block */
-	atomic64_t md_ssd_writes;       /* How many md ssd writes did we do ? */
-	atomic64_t uncached_reads;
-	atomic64_t uncached_writes;
-	atomic64_t uncached_map_size;
-	atomic64_t uncached_map_uncacheable;
-	atomic64_t disk_reads;
-	atomic64_t disk_writes;
-	atomic64_t ssd_reads;
-	atomic64_t ssd_writes;
-	atomic64_t ssd_readfills;
-	atomic64_t ssd_readfill_unplugs;
-	atomic64_t readdisk;
-	atomic64_t writedisk;
-	atomic64_t readcache;
-	atomic64_t readfill;
-	atomic64_t writecache;
-	atomic64_t wrtime_ms;   /* total write time in ms */
-	atomic64_t rdtime_ms;   /* total read time in ms */
-	atomic64_t readcount;   /* total reads received so far */
-	atomic64_t writecount;  /* total writes received so far */
-	atomic64_t unaligned_ios;
+	int64_t reads;                  /* Number of reads */
+	int64_t writes;                 /* Number of writes */
+	int64_t read_hits;              /* Number of cache hits */
+	int64_t write_hits;             /* Number of write hits (includes dirty write hits) */
+	int64_t dirty_write_hits;       /* Number of "dirty" write hits */
+	int64_t rd_replace;             /* Number of read cache replacements. TBD modify def doc */
+	int64_t wr_replace;             /* Number of write cache replacements. TBD modify def doc */
+	int64_t noroom;                 /* No room in set */
+	int64_t cleanings;              /* blocks cleaned TBD modify def doc */
+	int64_t md_write_dirty;         /* Metadata sector writes dirtying block */
+	int64_t md_write_clean;         /* Metadata sector writes cleaning block */
+	int64_t md_ssd_writes;          /* How many md ssd writes did we do ? */
+	int64_t md_commits;             /* md group commits, each of one or more sets */
+	int64_t jrnl_writes;            /* md journal blocks written */
+	int64_t jrnl_records;           /* dirty block records in them */
+	int64_t jrnl_checkpoints;       /* journal checkpoints into the flat md */
+	int64_t sorted_cleans;          /* sorted cleans, each of one or more sets */
+	int64_t sorted_clean_writes;    /* HDD writes of sorted cleans */
+	int64_t uncached_reads;
+	int64_t uncached_writes;
+	int64_t mixed_writes;           /* WB writes with blocks both cached and sent to HDD */
+	int64_t uncached_map_size;
+	int64_t uncached_map_uncacheable;
+	int64_t disk_reads;
+	int64_t disk_writes;
+	int64_t ssd_reads;
+	int64_t ssd_writes;
+	int64_t ssd_readfills;
+	int64_t ssd_readfill_unplugs;
+	int64_t readdisk;
+	int64_t writedisk;
+	int64_t readcache;
+	int64_t readfill;
+	int64_t writecache;
+	int64_t wrtime_ms;      /* total write time in ms */
+	int64_t rdtime_ms;      /* total read time in ms */
+	int64_t readcount;      /* total reads received so far */
+	int64_t writecount;     /* total writes received so far */
+	int64_t unaligned_ios;
+	int64_t discards;       /* discards passed to the source device */
+	int64_t seq_bypass_reads;       /* sectors read by sequential streams past the cutoff */
+	int64_t seq_bypass_writes;      /* sectors written by sequential streams past the cutoff */
+	int64_t readaround_fills;       /* partial read misses filled as a whole block */
+	int64_t subblock_writes;        /* partial-block writes kept in the cache */
+	int64_t ssd_coalesced_ios;      /* SSD I/Os saved by merging contiguous blocks */
+	int64_t lockless_peeks;         /* read lookups done without the set lock */
+	int64_t lookup_filter_skips;    /* lookups the filter found to be misses */
+	int64_t lookup_filter_false_pos;        /* filter said maybe, the set had no hit */
+	int64_t admit_accepted;         /* misses let in over a valid victim */
+	int64_t admit_rejected;         /* misses kept out, the victim was hotter */
+	int64_t hint_bypass;            /* bios kept out by io_hints, readahead or idle */
+	int64_t hint_admit;             /* metadata bios always cached by io_hints */
+	int64_t pin_skips;              /* pinned blocks passed over for eviction */
+	int64_t inline_completions;     /* SSD I/Os completed in their end_io */
 };
 
 #define PENDING_JOB_HASH_SIZE                   32
 #define PENDING_JOB_HASH(index)                 ((index) % PENDING_JOB_HASH_SIZE)
 #define SIZE_HIST                               (128 + 1)
+
+/*
+ * Latency histograms, one per final outcome of a bio. Bucket b counts
+ * the bios that took [2^(b-1), 2^b) ns, the last bucket takes the rest.
+ */
+enum eio_lat_op {
+	EIO_LAT_CACHED_READ = 0,
+	EIO_LAT_UNCACHED_READ,
+	EIO_LAT_READFILL,
+	EIO_LAT_CACHED_WRITE,
+	EIO_LAT_UNCACHED_WRITE,
+	EIO_LAT_DIRTY_WRITE,
+	EIO_LAT_MIXED_WRITE,
+	EIO_LAT_NR_OPS
+};
+
+#define EIO_LAT_BUCKETS                         40
+
+struct eio_lat_hist {
+	int64_t buckets[EIO_LAT_NR_OPS][EIO_LAT_BUCKETS];
+};
 #define EIO_COPY_PAGES                          1024    /* Number of pages for I/O */
 #define MIN_JOBS                                1024
 #define MIN_EIO_IO                              4096
 #define MIN_DMC_BIO_PAIR                        8192
+#define MIN_BIO_CONTAINERS                      1024
+#define MIN_EIO_BIOS                            1024
+#define MIN_SET_SEQS                            256
+#define MIN_MDREQS                              256
+#define MIN_EIO_ARENAS                          64
 
 /* Structure representing a sequence of sets(first to last set index) */
 struct set_seq {
@@ -673,6 +848,14 @@ struct eio_sysctl {
 	uint32_t dirty_low_threshold;
 	uint32_t dirty_set_high_threshold;
 	uint32_t dirty_set_low_threshold;
+	uint32_t seq_io_cutoff;                 /* in KB, 0 disables sequential bypass */
+	uint32_t read_around;                   /* fill the whole block on a partial read miss */
+	uint32_t lookup_filter;                 /* keep a filter of absent dbns per set */
+	uint32_t admission;                     /* frequency based admission of misses */
+	uint32_t io_hints;                      /* EIO_HINT_* rules on bio hints */
+	uint32_t md_batch_usec;                 /* md group commit window */
+	uint32_t md_journal;                    /* log md updates to the journal */
+	uint32_t clean_sort;                    /* clean sets together, in dbn order */
 	uint32_t time_based_clean_interval;    /* time after which dirty sets should clean */
 	int32_t autoclean_threshold;
 	int32_t mem_limit_pct;
@@ -684,6 +867,38 @@ struct eio_sysctl {
 /* forward declaration */
 struct lru_ls;
 
+/*
+ * A cache block is tracked in up to EIO_SUBBLOCKS_MAX sub-blocks of
+ * (1 << sb_shift) sectors each, so that partial writes can be cached.
+ * Both maps are zero for a block that is wholly valid / wholly dirty.
+ * Protected by the cache set cs_lock.
+ */
+#define EIO_SUBBLOCKS_MAX       16
+
+struct eio_sbmap {
+	u_int16_t sb_invalid;   /* sub-blocks not present in the cache */
+	u_int16_t sb_clean;     /* sub-blocks of a DIRTY block not needing writeback */
+};
+
+/*
+ * A sequential stream: I/O that keeps starting where the previous
+ * one ended. See eio_seq_detect(). The slots are updated without a lock.
+ */
+struct eio_seq_stream {
+	atomic64_t next_sector;         /* where the next I/O of the stream starts */
+	atomic64_t seq_bytes;           /* length of the sequential run so far */
+	unsigned long last_used;        /* jiffies, for replacement */
+};
+
+/*
+ * A range of source sectors whose blocks are never evicted, see
+ * eio_cache_pin().
+ */
+struct eio_pin_range {
+	sector_t start;
+	sector_t end;                   /* first sector past the range */
+};
+
 /* Replacement for 'struct dm_dev' */
 struct eio_bdev {
 	struct block_device *bdev;
@@ -698,6 +913,22 @@ struct eio_io_region {
 	sector_t count;         /* If zero the region is ignored */
 };
 
+/*
+ * Frequency sketch for admission control: a count-min sketch of
+ * EIO_ADMIT_DEPTH rows of 4 bit counters, keyed by dbn. All the
+ * counters are halved every "sample" accesses, so that old popularity
+ * fades away.
+ */
+#define EIO_ADMIT_DEPTH         4
+
+struct eio_admit_sketch {
+	u_int32_t *table;               /* rows of 2^width_bits counters, 8 per word */
+	u_int32_t width_bits;
+	int sample;                     /* accesses between two agings */
+	atomic_t ops;                   /* accesses since the last aging */
+	struct work_struct age_work;
+};
+
 /*
  * Cache context
  */
@@ -708,10 +939,19 @@ struct cache_c {
 
 	sector_t dev_start_sect;        /* HDD */
 	sector_t dev_end_sect;          /* HDD */
+	struct gendisk *stacked_disk;   /* stacked mode: our own block device */
+	atomic_t stacked_openers;
+	int stacked_closing;            /* delete in progress, no new opens */
 	int cache_rdonly;               /* protected by ttc_write lock */
 	struct eio_bdev *disk_dev;      /* Source device */
 	struct eio_bdev *cache_dev;     /* Cache device */
 	struct cacheblock *cache;       /* Hash table for cache blocks */
+	struct eio_sbmap *cache_sbmap;  /* Sub-block maps, after the cache blocks */
+	u_int8_t *cache_states;         /* Tag store: block states, after the sub-block maps */
+	u_int32_t *cache_tags;          /* Tag store: dbn tags, see eio_dbn_tag() */
+	u_int8_t *lookup_filter;        /* Per-set counting Bloom filters, or NULL */
+	u_int32_t lf_bits;              /* log2 of the filter counters per set */
+	struct eio_admit_sketch *admit_sketch;  /* allocated on first use of admission */
 	struct cache_set *cache_sets;
 	struct cache_c *next_cache;
 	struct kcached_job *readfill_queue;
@@ -727,6 +967,7 @@ struct cache_c {
 	struct page **clean_mdpages;    /* Metadata pages for clean set */
 	int dbvec_count;
 	int mdpage_count;
+	struct eio_clean_sort *clean_sort;      /* buffers of the sorted clean */
 	int clean_excess_dirty;         /* Clean in progress to bring cache dirty blocks in limits */
 	atomic_t clean_index;           /* set being cleaned, in case of force clean */
 
@@ -738,6 +979,8 @@ struct cache_c {
 	u_int32_t block_size;           /* Cache block size in 512b sectors */
 	u_int32_t block_shift;          /* Cache block size in bits */
 	u_int32_t block_mask;           /* Cache block mask */
+	u_int32_t sb_shift;             /* Sub-block size in bits */
+	u_int16_t sb_full;              /* Mask of all the sub-blocks of a block */
 	u_int32_t consecutive_shift;    /* Consecutive blocks size in bits */
 	u_int32_t persistence;          /* Create | Force create | Reload */
 	u_int32_t mode;                 /* CACHE_MODE_{WB, RO, WT} */
@@ -753,12 +996,14 @@ struct cache_c {
 	u_int32_t sb_version;   /* Superblock version */
 
 	int readfill_in_prog;
-	struct eio_stats eio_stats;     /* Run time stats */
+	struct eio_stats __percpu *eio_stats;   /* Run time stats, per cpu */
+	atomic64_t cached_blocks;               /* Number of cached blocks */
 	struct eio_errors eio_errors;   /* Error stats */
 	int clean_inprog;
 	atomic64_t nr_dirty;
-	atomic64_t nr_ios;
-	atomic64_t size_hist[SIZE_HIST];
+	struct percpu_counter nr_ios;           /* In flight bio_containers */
+	int64_t __percpu *size_hist;            /* SIZE_HIST buckets per cpu */
+	struct eio_lat_hist __percpu *lat_hist; /* Latency buckets per cpu */
 
 	void *sysctl_handle_common;
 	void *sysctl_handle_writeback;
@@ -792,7 +1037,29 @@ struct cache_c {
 	struct delayed_work clean_aged_sets_work;       /* work item for clean_aged_sets */
 	int is_clean_aged_sets_sched;                   /* to know whether clean aged sets is scheduled */
 	struct workqueue_struct *mdupdate_q;            /* Workqueue to handle md updates */
+	spinlock_t md_batch_lock;                       /* protects md_batch */
+	struct list_head md_batch;                      /* mdreqs waiting for the group commit */
+	unsigned md_batch_len;
+	struct delayed_work md_batch_work;              /* the group commit */
+	struct mutex sb_mutex;                          /* orders the superblock writes */
+	sector_t jrnl_start;                            /* md journal, 0 if the cache has none */
+	u_int32_t jrnl_nr_blocks;
+	u_int32_t jrnl_id;
+	spinlock_t jrnl_lock;                           /* protects the fields below */
+	u_int64_t jrnl_head;                            /* next block to write */
+	u_int64_t jrnl_tail;                            /* oldest live block */
+	u_int64_t jrnl_ckpt_tail;                       /* tail for the superblock */
+	unsigned long *jrnl_sets[2];                    /* sets with live records */
+	int jrnl_cur;                                   /* jrnl_sets[] new records go to */
+	struct page **jrnl_mdpages;                     /* set md pages of the checkpoint */
+	struct work_struct jrnl_ckpt_work;              /* the checkpoint */
+	struct workqueue_struct *jrnl_ckpt_q;           /* runs it, see eio_jrnl_alloc() */
 	struct workqueue_struct *callback_q;            /* Workqueue to handle io callbacks */
+	struct eio_seq_stream seq_streams[EIO_SEQ_STREAMS];
+	seqlock_t pin_lock;                             /* protects pins and nr_pins */
+	u_int32_t nr_pins;
+	struct eio_pin_range pins[EIO_MAX_PINS];
+	atomic64_t nr_pinned;                           /* VALID blocks of pinned ranges */
 };
 
 #define EIO_CACHE_IOSIZE                0
@@ -811,12 +1078,13 @@ struct cache_c {
 #define CACHE_MD8_IS_SET(dmc)                   (((dmc)->cache_flags & CACHE_FLAGS_MD8) ? 1 : 0)
 #define CACHE_FAILED_IS_SET(dmc)                (((dmc)->cache_flags & CACHE_FLAGS_FAILED) ? 1 : 0)
 #define CACHE_STALE_IS_SET(dmc)                 (((dmc)->cache_flags & CACHE_FLAGS_STALE) ? 1 : 0)
+#define CACHE_STACKED_IS_SET(dmc)               (((dmc)->cache_flags & CACHE_FLAGS_STACKED) ? 1 : 0)
 
 /* Device failure handling.  */
 #define CACHE_SRC_IS_ABSENT(dmc)                (((dmc)->eio_errors.no_source_dev == 1) ? 1 : 0)
 
 #define AUTOCLEAN_THRESHOLD_CROSSED(dmc)	\
-	((atomic64_read(&(dmc)->nr_ios) > (int64_t)(dmc)->sysctl_active.autoclean_threshold) ||	\
+	((percpu_counter_read_positive(&(dmc)->nr_ios) > (int64_t)(dmc)->sysctl_active.autoclean_threshold) ||	\
 	 ((dmc)->sysctl_active.autoclean_threshold == 0))
 
 #define DIRTY_CACHE_THRESHOLD_CROSSED(dmc)	\
@@ -846,6 +1114,28 @@ struct job_io_regions {
 #define EB_SUBORDINATE_IO 2
 #define EB_INVAL 4
 
+/* eio_bio eb_alloc */
+#define EB_ALLOC_POOL 0       /* from _ebio_pool, EB_INLINE_BVECS eb_rbv's */
+#define EB_ALLOC_ARENA 1      /* from the bc arena, freed along with the bc */
+#define EB_ALLOC_KMALLOC 2    /* kmalloc'ed, eb_rbv's don't fit inline */
+
+#define EB_INLINE_BVECS 4
+
+struct kcached_job {
+	struct list_head list;
+	struct work_struct work;
+	struct cache_c *dmc;
+	struct eio_bio *ebio;
+	struct job_io_regions job_io_regions;
+	index_t index;
+	int action;
+	int error;
+	struct flash_cacheblock *md_sector;
+	struct bio_vec md_io_bvec;
+	struct kcached_job *next;
+	int embedded;                   /* job is the eb_job of its ebio */
+};
+
 struct eio_bio {
 	int eb_iotype;
 	struct bio_container *eb_bc;
@@ -858,16 +1148,53 @@ struct eio_bio {
 	struct eio_bio *eb_next;        /*used for splitting reads*/
 	index_t eb_index;               /*for read bios - sector number in block_size sectors*/
 	atomic_t eb_holdcount;          /* ebio hold count, currently used only for dirty block I/O */
+	int eb_alloc;                   /* EB_ALLOC_* */
+	unsigned long eb_job_busy;      /* bit 0: eb_job is in use */
+	int eb_cached;                  /* write absorbed by the SSD alone */
+	struct bio_vec *eb_mergebv;     /* cache copy of a dirty block with holes */
+	int eb_nmergebv;
+	u_int16_t eb_mergemask;         /* sub-blocks to take from eb_mergebv */
+	struct kcached_job eb_job;      /* job for the ebio's own I/O */
 	struct bio_vec eb_rbv[0];
 };
 
+/*
+ * Ebios of a bio spanning multiple cache blocks are carved out of a
+ * single allocation hanging off the bio_container.
+ */
+struct eio_bio_arena {
+	int pooled;                     /* from _arena_pool, else kmalloc'ed */
+	unsigned nr_ebios;              /* slots in ebios[] */
+	unsigned used_ebios;
+	unsigned nr_bvecs;              /* slots in bvecs[] */
+	unsigned used_bvecs;
+	struct eio_bio *ebios;
+	struct bio_vec *bvecs;
+};
+
+/*
+ * Arenas of bios up to EIO_ARENA_BLOCKS blocks, the common sizes, come
+ * from _arena_pool, so that they don't depend on high order allocations.
+ * EIO_ARENA_BLOCKS is what fits in a page.
+ */
+#define EIO_ARENA_BLOCKS        ((unsigned)((PAGE_SIZE - \
+					     sizeof(struct eio_bio_arena) - \
+					     sizeof(struct eio_bio)) / \
+					    (sizeof(struct eio_bio) + \
+					     2 * sizeof(struct bio_vec))))
+#define EIO_ARENA_BVECS         (2 * EIO_ARENA_BLOCKS)
+#define EIO_ARENA_SIZE          (sizeof(struct eio_bio_arena) + \
+				 (EIO_ARENA_BLOCKS + 1) * sizeof(struct eio_bio) + \
+				 EIO_ARENA_BVECS * sizeof(struct bio_vec))
+
 enum eio_io_dir {
 	EIO_IO_INVALID_DIR = 0,
 	CACHED_WRITE,
 	CACHED_READ,
 	UNCACHED_WRITE,
 	UNCACHED_READ,
-	UNCACHED_READ_AND_READFILL
+	UNCACHED_READ_AND_READFILL,
+	MIXED_WRITE             /* write-back, part dirty on SSD, part to HDD */
 };
 
 /* ASK
@@ -887,7 +1214,16 @@ struct bio_container {
 	enum eio_io_dir bc_dir;                 /* bc I/O direction */
 	int bc_error;                           /* error encountered during processing bc */
 	unsigned long bc_iotime;                /* maintains i/o time in jiffies */
+	ktime_t bc_start;                       /* arrival time, for latency histograms */
+	int bc_mdupdate;                        /* cached write that needed an md update */
 	struct bio_container *bc_next;          /* next bc in the chain */
+	struct eio_bio_arena *bc_arena;         /* ebios of a multi block bio */
+	int bc_bypass;                          /* sequential: no cache allocation on miss */
+	int bc_readaround;                      /* partial read within one block, may read around */
+	int bc_admit;                           /* cache on miss, skip admission */
+	int bc_access;                          /* EIO_ACCESS_COLD/HOT for the policy */
+	struct bio_vec *bc_rabvecs;             /* whole block read from HDD for read-around */
+	int bc_rabvec_count;
 };
 
 /* structure used as callback context during synchronous I/O */
@@ -897,18 +1233,24 @@ struct sync_io_context {
 	unsigned long sio_error;
 };
 
-struct kcached_job {
-	struct list_head list;
-	struct work_struct work;
-	struct cache_c *dmc;
-	struct eio_bio *ebio;
-	struct job_io_regions job_io_regions;
+/* A block of a sorted clean */
+struct eio_clean_ent {
+	sector_t dbn;
 	index_t index;
-	int action;
-	int error;
-	struct flash_cacheblock *md_sector;
-	struct bio_vec md_io_bvec;
-	struct kcached_job *next;
+	index_t slot;                   /* block slot in dbvecs */
+};
+
+/*
+ * Buffers of the sorted clean, for EIO_CLEAN_SORT_SETS sets. Allocated
+ * the first time clean_sort is turned on.
+ */
+struct eio_clean_sort {
+	struct bio_vec *dbvecs;         /* data, a set's worth per set */
+	struct bio_vec *wbvecs;         /* dbvecs of the HDD write runs */
+	int dbvec_count;
+	struct eio_clean_ent *ents;
+	struct page **mdpages;          /* mdpage_count per set */
+	struct bio_vec *mdbvecs;
 };
 
 struct ssd_rm_list {
@@ -964,6 +1306,8 @@ void eio_comply_dirty_thresholds(struct cache_c *dmc, index_t set);
 void eio_clean_all(struct cache_c *dmc);
 void eio_clean_for_reboot(struct cache_c *dmc);
 void eio_clean_aged_sets(struct work_struct *work);
+void eio_md_batch_work(struct work_struct *work);
+void eio_jrnl_checkpoint(struct work_struct *work);
 void eio_comply_dirty_thresholds(struct cache_c *dmc, index_t set);
 #ifndef SSDCACHE
 void eio_reclaim_lru_movetail(struct cache_c *dmc, index_t index,
@@ -993,6 +1337,8 @@ void eio_procfs_ctr(struct cache_c *dmc);
 void eio_procfs_dtr(struct cache_c *dmc);
 
 int eio_sb_store(struct cache_c *dmc);
+void eio_stats_free(struct cache_c *dmc);
+int eio_clean_sort_alloc(struct cache_c *dmc);
 
 int eio_md_destroy(struct dm_target *tip, char *namep, char *srcp, char *cachep,
 		   int force);
@@ -1018,10 +1364,28 @@ extern void eio_md_write_kickoff(struct kcached_job *job);
 extern void eio_do_readfill(struct work_struct *work);
 extern void eio_check_dirty_thresholds(struct cache_c *dmc, index_t set);
 extern void eio_clean_all(struct cache_c *dmc);
+extern void eio_set_scan_init(void);
+extern int eio_lookup_filter_enable(struct cache_c *dmc);
+extern void eio_lookup_filter_disable(struct cache_c *dmc);
+extern int eio_admit_enable(struct cache_c *dmc);
+extern void eio_admit_free(struct cache_c *dmc);
+extern void eio_pin_recount(struct cache_c *dmc);
 extern int eio_clean_thread_proc(void *context);
 extern void eio_touch_set_lru(struct cache_c *dmc, index_t set);
 extern void eio_inval_range(struct cache_c *dmc, sector_t iosector,
 			    unsigned iosize);
+/*
+ * A discard overlapping several cached partitions, passed on to the
+ * source device once the dirty blocks of all of them are dropped.
+ */
+struct eio_discard_fwd {
+	atomic_t pending;
+	make_request_fn *origmfn;
+	struct bio *bio;
+};
+extern int eio_discard_range(struct cache_c *dmc, sector_t iosector,
+			     unsigned iosize, struct bio *bio,
+			     struct eio_discard_fwd *fwd);
 extern int eio_invalidate_sanity_check(struct cache_c *dmc, u_int64_t iosector,
 				       u_int64_t *iosize);
 /*
@@ -1046,6 +1410,8 @@ extern void eio_module_procfs_exit(void);
 extern void eio_procfs_ctr(struct cache_c *dmc);
 extern void eio_procfs_dtr(struct cache_c *dmc);
 extern int eio_version_query(size_t buf_sz, char *bufp);
+extern void eio_stats_sum(struct cache_c *dmc, struct eio_stats *sum);
+extern void eio_stats_zero(struct cache_c *dmc);
 
 /* eio_subr.c */
 extern void eio_free_cache_job(struct kcached_job *job);
@@ -1064,44 +1430,225 @@ extern void eio_put_cache_device(struct cache_c *dmc);
 extern void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note);
 extern void eio_resume_caching(struct cache_c *dmc, char *dev);
 
+/*
+ * Block state and dbn are changed under the set's cs_lock only, and
+ * every change bumps the set's cs_seq, so that a read lookup can search
+ * the set without the lock (see eio_read_peek_lockless()).
+ */
+static inline void eio_set_seq_begin(struct cache_c *dmc, u_int64_t index)
+{
+	if (dmc->cache_sets)
+		raw_write_seqcount_begin(
+			&dmc->cache_sets[EIO_DIV(index, dmc->assoc)].cs_seq);
+}
+
+static inline void eio_set_seq_end(struct cache_c *dmc, u_int64_t index)
+{
+	if (dmc->cache_sets)
+		raw_write_seqcount_end(
+			&dmc->cache_sets[EIO_DIV(index, dmc->assoc)].cs_seq);
+}
+
+/*
+ * The tag store keeps a copy of every block's state and a 32-bit tag of
+ * its dbn in two flat arrays, so that a set is scanned without unpacking
+ * the md4/md8 entries. A tag match is confirmed with EIO_DBN_GET().
+ */
+#define EIO_TAG_STORE_SIZE      (sizeof(u_int8_t) + sizeof(u_int32_t))
+
+static inline u_int32_t eio_dbn_tag(struct cache_c *dmc, sector_t dbn)
+{
+	return (u_int32_t)(dbn >> dmc->block_shift);
+}
+
+/*
+ * Lookup filter: an optional counting Bloom filter per set, over the tags
+ * of the set's VALID blocks. It has 4 counters of 4 bits per block and
+ * two hashes; a counter that reaches the top stays there. When one of
+ * the counters of a tag is zero, no block of the set holds that tag.
+ * A set's filter is used and updated under its cs_lock, and only while
+ * SETFLAG_LOOKUP_FILTER is set on it.
+ */
+#define EIO_LF_COUNTERS_PER_BLOCK       4
+#define EIO_LF_COUNTER_MAX              0xf
+
+static inline size_t eio_lookup_filter_size(struct cache_c *dmc)
+{
+	/* two counters per byte */
+	return (size_t)dmc->num_sets << (dmc->lf_bits - 1);
+}
+
+static inline u_int8_t *eio_lf_set_base(struct cache_c *dmc, index_t set)
+{
+	u_int8_t *lf = READ_ONCE(dmc->lookup_filter);
+
+	if (likely(lf == NULL) ||
+	    !(dmc->cache_sets[set].flags & SETFLAG_LOOKUP_FILTER))
+		return NULL;
+	return lf + ((size_t)set << (dmc->lf_bits - 1));
+}
+
+static inline void
+eio_lf_hash(struct cache_c *dmc, u_int32_t tag, u_int32_t *h1, u_int32_t *h2)
+{
+	u_int32_t h = (u_int32_t)hash_64(tag, 2 * dmc->lf_bits);
+
+	*h1 = h & ((1U << dmc->lf_bits) - 1);
+	*h2 = h >> dmc->lf_bits;
+}
+
+static inline unsigned eio_lf_get(const u_int8_t *base, u_int32_t i)
+{
+	return (base[i >> 1] >> ((i & 1) << 2)) & EIO_LF_COUNTER_MAX;
+}
+
+static inline void eio_lf_adj(u_int8_t *base, u_int32_t i, int delta)
+{
+	unsigned shift = (i & 1) << 2;
+	unsigned c = eio_lf_get(base, i);
+
+	if (c == EIO_LF_COUNTER_MAX || (delta < 0 && c == 0))
+		return;
+	c += delta;
+	base[i >> 1] = (base[i >> 1] & ~(EIO_LF_COUNTER_MAX << shift)) |
+		       (c << shift);
+}
+
+static inline void
+eio_lf_update(struct cache_c *dmc, u_int64_t index, u_int32_t tag, int delta)
+{
+	u_int8_t *base;
+	u_int32_t h1, h2;
+
+	if (likely(dmc->lookup_filter == NULL))
+		return;
+	base = eio_lf_set_base(dmc, EIO_DIV(index, dmc->assoc));
+	if (base == NULL)
+		return;
+	eio_lf_hash(dmc, tag, &h1, &h2);
+	eio_lf_adj(base, h1, delta);
+	eio_lf_adj(base, h2, delta);
+}
+
+/* 0 when no block of the set at base holds the tag */
+static inline int
+eio_lf_maybe(struct cache_c *dmc, const u_int8_t *base, u_int32_t tag)
+{
+	u_int32_t h1, h2;
+
+	eio_lf_hash(dmc, tag, &h1, &h2);
+	return eio_lf_get(base, h1) && eio_lf_get(base, h2);
+}
+
+static inline u_int64_t EIO_DBN_GET(struct cache_c *dmc, u_int64_t index)
+{
+	if (EIO_MD8(dmc))
+		return dmc->cache_md8[index].md8_u.u_i_md8 & EIO_MD8_DBN_MASK;
+
+	return eio_expand_dbn(dmc, index);
+}
+
+/* 1 when [start, end) overlaps a pinned range */
+static inline int
+eio_range_pinned(struct cache_c *dmc, sector_t start, sector_t end)
+{
+	unsigned seq;
+	u_int32_t i;
+	int pinned;
+
+	if (likely(!dmc->nr_pins))
+		return 0;
+
+	do {
+		seq = read_seqbegin(&dmc->pin_lock);
+		pinned = 0;
+		for (i = 0; i < dmc->nr_pins; i++) {
+			if (start < dmc->pins[i].end &&
+			    end > dmc->pins[i].start) {
+				pinned = 1;
+				break;
+			}
+		}
+	} while (read_seqretry(&dmc->pin_lock, seq));
+
+	return pinned;
+}
+
+/*
+ * Count a VALID block of dbn in or out of the pinned block counts. Called
+ * with the set locked, see eio_pin_recount().
+ */
+static inline void
+eio_pin_update(struct cache_c *dmc, u_int64_t index, sector_t dbn, int delta)
+{
+	if (likely(!dmc->nr_pins) || dmc->cache_sets == NULL)
+		return;
+	if (!eio_range_pinned(dmc, dbn, dbn + dmc->block_size))
+		return;
+	dmc->cache_sets[EIO_DIV(index, dmc->assoc)].nr_pinned += delta;
+	atomic64_add(delta, &dmc->nr_pinned);
+}
+
 static inline void
 EIO_DBN_SET(struct cache_c *dmc, u_int64_t index, sector_t dbn)
 {
+	eio_set_seq_begin(dmc, index);
+	if (dmc->cache_states[index] & VALID) {
+		eio_lf_update(dmc, index, dmc->cache_tags[index], -1);
+		eio_lf_update(dmc, index, eio_dbn_tag(dmc, dbn), 1);
+		eio_pin_update(dmc, index, EIO_DBN_GET(dmc, index), -1);
+		eio_pin_update(dmc, index, dbn, 1);
+	}
+	dmc->cache_tags[index] = eio_dbn_tag(dmc, dbn);
 	if (EIO_MD8(dmc))
 		eio_md8_dbn_set(dmc, index, dbn);
 	else
 		eio_md4_dbn_set(dmc, index, eio_shrink_dbn(dmc, dbn));
 	if (dbn == 0)
 		dmc->index_zero = index;
+	eio_set_seq_end(dmc, index);
 }
 
-static inline u_int64_t EIO_DBN_GET(struct cache_c *dmc, u_int64_t index)
+/*
+ * For the sp_find_reclaim_dbn() implementations: the block at index
+ * lies in a pinned range and must not be evicted.
+ */
+static inline int eio_blk_pinned(struct cache_c *dmc, index_t index)
 {
-	if (EIO_MD8(dmc))
-		return dmc->cache_md8[index].md8_u.u_i_md8 & EIO_MD8_DBN_MASK;
+	sector_t dbn;
 
-	return eio_expand_dbn(dmc, index);
+	if (likely(!dmc->nr_pins))
+		return 0;
+
+	dbn = EIO_DBN_GET(dmc, index);
+	if (!eio_range_pinned(dmc, dbn, dbn + dmc->block_size))
+		return 0;
+	EIO_STATS_INC(dmc->eio_stats->pin_skips);
+	return 1;
 }
 
 static inline void
 EIO_CACHE_STATE_SET(struct cache_c *dmc, u_int64_t index, u_int8_t cache_state)
 {
+	eio_set_seq_begin(dmc, index);
+	if ((dmc->cache_states[index] ^ cache_state) & VALID) {
+		eio_lf_update(dmc, index, dmc->cache_tags[index],
+			      (cache_state & VALID) ? 1 : -1);
+		eio_pin_update(dmc, index, EIO_DBN_GET(dmc, index),
+			       (cache_state & VALID) ? 1 : -1);
+	}
+	dmc->cache_states[index] = cache_state;
 	if (EIO_MD8(dmc))
 		dmc->cache_md8[index].md8_u.u_s_md8.cache_state = cache_state;
 	else
 		dmc->cache[index].md4_u.u_s_md4.cache_state = cache_state;
+	eio_set_seq_end(dmc, index);
 }
 
 static inline u_int8_t
 EIO_CACHE_STATE_GET(struct cache_c *dmc, u_int64_t index)
 {
-	u_int8_t cache_state;
-
-	if (EIO_MD8(dmc))
-		cache_state = dmc->cache_md8[index].md8_u.u_s_md8.cache_state;
-	else
-		cache_state = dmc->cache[index].md4_u.u_s_md4.cache_state;
-	return cache_state;
+	return dmc->cache_states[index];
 }
 
 static inline void
@@ -1122,6 +1669,51 @@ EIO_CACHE_STATE_ON(struct cache_c *dmc, index_t index, u_int8_t bitmask)
 	EIO_CACHE_STATE_SET(dmc, index, cache_state);
 }
 
+/*
+ * The sub-block maps, then the tag store, are allocated along with, and
+ * right after, the in-core cache blocks, so they are released with them.
+ * dmc->size is a multiple of the associativity, which keeps the set
+ * slices of cache_states word aligned.
+ */
+static inline void eio_sbmap_init(struct cache_c *dmc)
+{
+	if (EIO_MD8(dmc))
+		dmc->cache_sbmap = (struct eio_sbmap *)(dmc->cache_md8 +
+							dmc->size);
+	else
+		dmc->cache_sbmap = (struct eio_sbmap *)(dmc->cache + dmc->size);
+	memset(dmc->cache_sbmap, 0, dmc->size * sizeof(struct eio_sbmap));
+
+	dmc->cache_states = (u_int8_t *)(dmc->cache_sbmap + dmc->size);
+	dmc->cache_tags = (u_int32_t *)(dmc->cache_states + dmc->size);
+	memset(dmc->cache_states, INVALID, dmc->size);
+	memset(dmc->cache_tags, 0, dmc->size * sizeof(u_int32_t));
+}
+
+/* Sub-block maps from an on-disk cache_state */
+static inline void
+eio_sbmap_load(struct cache_c *dmc, index_t index, u_int64_t md_state)
+{
+	dmc->cache_sbmap[index].sb_invalid = dmc->sb_full &
+		(md_state >> EIO_MD_SB_INVALID_SHIFT);
+	dmc->cache_sbmap[index].sb_clean = (md_state & DIRTY) ?
+		(dmc->sb_full & (md_state >> EIO_MD_SB_CLEAN_SHIFT)) : 0;
+}
+
+/* On-disk cache_state for a block recorded with the given state */
+static inline u_int64_t
+eio_md_cache_state(struct cache_c *dmc, index_t index, u_int64_t state)
+{
+	if (!(state & VALID))
+		return state;
+	state |= (u_int64_t)dmc->cache_sbmap[index].sb_invalid <<
+		 EIO_MD_SB_INVALID_SHIFT;
+	if (state & DIRTY)
+		state |= (u_int64_t)dmc->cache_sbmap[index].sb_clean <<
+			 EIO_MD_SB_CLEAN_SHIFT;
+	return state;
+}
+
 void eio_set_warm_boot(void);
 #endif                          /* defined(__KERNEL__) */
 
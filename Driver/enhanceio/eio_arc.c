@@ -0,0 +1,524 @@
+/*
+ *  eio_arc.c
+ *
+ *  Scan resistant replacement policies: ARC and 2Q.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Both policies keep, per set, the blocks in two lists linked through
+ * set-relative offsets like LRU, and a ring of ghost entries: the tags
+ * (shrunk dbns, see eio_dbn_tag()) of blocks recently evicted. A ghost
+ * costs 4 bytes; ARC keeps up to 2 ghosts per block, 2Q 1 per 2 blocks.
+ *
+ * ARC: list 0 is T1 (seen once), list 1 is T2 (seen again). A hit moves
+ * the block to the MRU end of T2. Evictions go to the B1 or B2 ghost
+ * ring of their list. A miss found in B1 grows the target size p of T1,
+ * one found in B2 shrinks it; either way the block enters T2, otherwise
+ * it enters T1. The victim comes from T1 while T1 is above p.
+ *
+ * 2Q: list 0 is A1in, a FIFO of a quarter of the set, list 1 is Am, an
+ * LRU. Blocks evicted from A1in go to the A1out ghost ring. A miss found
+ * in A1out enters Am, otherwise it enters A1in. Hits in A1in are ignored.
+ *
+ * All the functions are called with the set's cs_lock held.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "eio.h"
+
+/* Generic policy functions prototypes */
+int eio_arc_init(struct cache_c *);
+void eio_arc_exit(void);
+int eio_arc_cache_sets_init(struct eio_policy *);
+int eio_arc_cache_blk_init(struct eio_policy *);
+void eio_arc_find_reclaim_dbn(struct eio_policy *, index_t, index_t *);
+int eio_arc_clean_set(struct eio_policy *, index_t, int);
+void eio_arc_blk_access(struct eio_policy *, index_t, sector_t, int);
+/* Per policy instance initialization */
+struct eio_policy *eio_arc_instance_init(void);
+struct eio_policy *eio_2q_instance_init(void);
+
+#define EIO_ARC_T1              0       /* ARC T1, 2Q A1in */
+#define EIO_ARC_T2              1       /* ARC T2, 2Q Am */
+#define EIO_ARC_GHOST_NONE      0       /* empty ghost slot, ghosts are tag + 1 */
+
+struct eio_arc_list {
+	u_int16_t head, tail;           /* LRU end, MRU end */
+	u_int16_t count;
+};
+
+/* Per cache set data structure */
+struct eio_arc_cache_set {
+	struct eio_arc_list l[2];
+	u_int16_t p;                    /* ARC: target size of T1 */
+	u_int16_t ghost_next[2];        /* next ghost slot to overwrite */
+	u_int16_t ghost_count[2];       /* ghosts held */
+} __aligned(4);                         /* the ghost rings follow */
+
+/* Per cache block data structure */
+struct eio_arc_cache_block {
+	u_int16_t prev, next;
+	u_int8_t list;
+};
+
+static struct eio_policy_header eio_arc_ops = {
+	.sph_name		= CACHE_REPL_ARC,
+	.sph_instance_init	= eio_arc_instance_init,
+};
+
+static struct eio_policy_header eio_2q_ops = {
+	.sph_name		= CACHE_REPL_2Q,
+	.sph_instance_init	= eio_2q_instance_init,
+};
+
+/* Size of the ghost ring of a list, 0 for none */
+static inline u_int32_t
+eio_arc_ghost_cap(struct eio_policy *p_ops, int list)
+{
+	u_int32_t assoc = p_ops->sp_dmc->assoc;
+
+	if (p_ops->sp_name == CACHE_REPL_ARC)
+		return assoc;
+	return (list == EIO_ARC_T1) ? assoc / 2 : 0;
+}
+
+static inline struct eio_arc_cache_set *
+eio_arc_set(struct cache_c *dmc, index_t set)
+{
+	return (struct eio_arc_cache_set *)dmc->sp_cache_set + set;
+}
+
+static inline struct eio_arc_cache_block *
+eio_arc_blk(struct cache_c *dmc, index_t index)
+{
+	return (struct eio_arc_cache_block *)dmc->sp_cache_blk + index;
+}
+
+static inline const char *eio_arc_name(struct eio_policy *p_ops)
+{
+	return (p_ops->sp_name == CACHE_REPL_ARC) ? "arc" : "2q";
+}
+
+/* The ghost rings of all the sets follow the set structures */
+static inline u_int32_t *
+eio_arc_ghosts(struct eio_policy *p_ops, index_t set, int list)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	u_int32_t *base = (u_int32_t *)((struct eio_arc_cache_set *)
+					dmc->sp_cache_set +
+					(dmc->size >> dmc->consecutive_shift));
+	size_t stride = eio_arc_ghost_cap(p_ops, EIO_ARC_T1) +
+			eio_arc_ghost_cap(p_ops, EIO_ARC_T2);
+
+	return base + set * stride +
+	       (list ? eio_arc_ghost_cap(p_ops, EIO_ARC_T1) : 0);
+}
+
+static void eio_arc_unlink(struct cache_c *dmc, index_t index)
+{
+	index_t start_index = (index / dmc->assoc) * dmc->assoc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, index / dmc->assoc);
+	struct eio_arc_cache_block *blk = eio_arc_blk(dmc, index);
+	struct eio_arc_list *l = &cs->l[blk->list];
+
+	if (blk->prev != EIO_LRU_NULL)
+		eio_arc_blk(dmc, blk->prev + start_index)->next = blk->next;
+	else
+		l->head = blk->next;
+	if (blk->next != EIO_LRU_NULL)
+		eio_arc_blk(dmc, blk->next + start_index)->prev = blk->prev;
+	else
+		l->tail = blk->prev;
+	l->count--;
+}
+
+/* Link a block at the LRU end of a list, to go first */
+static void eio_arc_link_cold(struct cache_c *dmc, index_t index, int list)
+{
+	index_t start_index = (index / dmc->assoc) * dmc->assoc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, index / dmc->assoc);
+	struct eio_arc_cache_block *blk = eio_arc_blk(dmc, index);
+	struct eio_arc_list *l = &cs->l[list];
+	u_int16_t rel = (u_int16_t)(index - start_index);
+
+	blk->list = (u_int8_t)list;
+	blk->prev = EIO_LRU_NULL;
+	blk->next = l->head;
+	if (l->head == EIO_LRU_NULL)
+		l->tail = rel;
+	else
+		eio_arc_blk(dmc, l->head + start_index)->prev = rel;
+	l->head = rel;
+	l->count++;
+}
+
+/* Link a block at the MRU end of a list */
+static void eio_arc_link(struct cache_c *dmc, index_t index, int list)
+{
+	index_t start_index = (index / dmc->assoc) * dmc->assoc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, index / dmc->assoc);
+	struct eio_arc_cache_block *blk = eio_arc_blk(dmc, index);
+	struct eio_arc_list *l = &cs->l[list];
+	u_int16_t rel = (u_int16_t)(index - start_index);
+
+	blk->list = (u_int8_t)list;
+	blk->next = EIO_LRU_NULL;
+	blk->prev = l->tail;
+	if (l->tail == EIO_LRU_NULL)
+		l->head = rel;
+	else
+		eio_arc_blk(dmc, l->tail + start_index)->next = rel;
+	l->tail = rel;
+	l->count++;
+}
+
+static void
+eio_arc_ghost_add(struct eio_policy *p_ops, index_t set, int list,
+		  u_int32_t tag)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, set);
+	u_int32_t cap = eio_arc_ghost_cap(p_ops, list);
+	u_int32_t *ring;
+
+	if (cap == 0)
+		return;
+
+	ring = eio_arc_ghosts(p_ops, set, list);
+	if (ring[cs->ghost_next[list]] == EIO_ARC_GHOST_NONE)
+		cs->ghost_count[list]++;
+	ring[cs->ghost_next[list]] = tag + 1;
+	if (++cs->ghost_next[list] == cap)
+		cs->ghost_next[list] = 0;
+}
+
+/* Remove the ghost of tag from a ring. Returns 1 if it was there */
+static int
+eio_arc_ghost_take(struct eio_policy *p_ops, index_t set, int list,
+		   u_int32_t tag)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, set);
+	u_int32_t cap = eio_arc_ghost_cap(p_ops, list);
+	u_int32_t *ring = eio_arc_ghosts(p_ops, set, list);
+	u_int32_t i;
+
+	if (cs->ghost_count[list] == 0)
+		return 0;
+
+	for (i = 0; i < cap; i++) {
+		if (ring[i] == tag + 1) {
+			ring[i] = EIO_ARC_GHOST_NONE;
+			cs->ghost_count[list]--;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Intialize ARC and 2Q. Called from ctr.
+ */
+int eio_arc_init(struct cache_c *dmc)
+{
+	return 0;
+}
+
+/*
+ * Initialize the per set lists and ghost rings. All the blocks start
+ * in list 0, cold.
+ */
+int eio_arc_cache_sets_init(struct eio_policy *p_ops)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	index_t nr_sets = dmc->size >> dmc->consecutive_shift;
+	struct eio_arc_cache_set *cs;
+	struct eio_arc_cache_block *blk;
+	index_t i;
+	int l;
+
+	dmc->sp_cache_set = vzalloc((size_t)nr_sets *
+				    (sizeof(struct eio_arc_cache_set) +
+				     (eio_arc_ghost_cap(p_ops, EIO_ARC_T1) +
+				      eio_arc_ghost_cap(p_ops, EIO_ARC_T2)) *
+				     sizeof(u_int32_t)));
+	if (dmc->sp_cache_set == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_sets; i++) {
+		cs = eio_arc_set(dmc, i);
+		for (l = 0; l < 2; l++) {
+			cs->l[l].head = EIO_LRU_NULL;
+			cs->l[l].tail = EIO_LRU_NULL;
+		}
+	}
+	for (i = 0; i < (index_t)dmc->size; i++) {
+		blk = eio_arc_blk(dmc, i);
+		blk->prev = EIO_LRU_NULL;
+		blk->next = EIO_LRU_NULL;
+		eio_arc_link(dmc, i, EIO_ARC_T1);
+	}
+	pr_info("Initialized %ld sets in %s", (long)nr_sets,
+		eio_arc_name(p_ops));
+
+	return 0;
+}
+
+/*
+ * Initialize per block data structures
+ */
+int eio_arc_cache_blk_init(struct eio_policy *p_ops)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+
+	dmc->sp_cache_blk = vmalloc((size_t)dmc->size *
+				    sizeof(struct eio_arc_cache_block));
+	if (dmc->sp_cache_blk == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static struct eio_policy *eio_arc_new_instance(int name)
+{
+	struct eio_policy *new_instance;
+
+	new_instance = vmalloc(sizeof(struct eio_policy));
+	if (new_instance == NULL) {
+		pr_err("eio_arc_instance_init: vmalloc failed");
+		return NULL;
+	}
+
+	new_instance->sp_name = name;
+	new_instance->sp_policy.lru = NULL;
+	new_instance->sp_repl_init = eio_arc_init;
+	new_instance->sp_repl_exit = eio_arc_exit;
+	new_instance->sp_repl_sets_init = eio_arc_cache_sets_init;
+	new_instance->sp_repl_blk_init = eio_arc_cache_blk_init;
+	new_instance->sp_find_reclaim_dbn = eio_arc_find_reclaim_dbn;
+	new_instance->sp_clean_set = eio_arc_clean_set;
+	new_instance->sp_blk_access = eio_arc_blk_access;
+	new_instance->sp_dmc = NULL;
+
+	try_module_get(THIS_MODULE);
+
+	pr_info("eio_arc_instance_init: created new instance of %s",
+		eio_arc_name(new_instance));
+
+	return new_instance;
+}
+
+/*
+ * Allocate a new instance of eio_policy per dmc
+ */
+struct eio_policy *eio_arc_instance_init(void)
+{
+	return eio_arc_new_instance(CACHE_REPL_ARC);
+}
+
+struct eio_policy *eio_2q_instance_init(void)
+{
+	return eio_arc_new_instance(CACHE_REPL_2Q);
+}
+
+/*
+ * Cleanup an instance of eio_policy (called from dtr).
+ */
+void eio_arc_exit(void)
+{
+	module_put(THIS_MODULE);
+}
+
+/* First VALID and unpinned block of a list, from its LRU end, or -1 */
+static index_t
+eio_arc_first_valid(struct cache_c *dmc, index_t start_index,
+		    struct eio_arc_list *l)
+{
+	u_int16_t rel = l->head;
+
+	while (rel != EIO_LRU_NULL) {
+		if (EIO_CACHE_STATE_GET(dmc, rel + start_index) == VALID &&
+		    !eio_blk_pinned(dmc, rel + start_index))
+			return rel + start_index;
+		rel = eio_arc_blk(dmc, rel + start_index)->next;
+	}
+	return -1;
+}
+
+/*
+ * Find a victim block to evict and return it in index. The lists are
+ * left as they are: the victim goes to a ghost ring and is relinked by
+ * the miss access, once the slot is claimed.
+ */
+void
+eio_arc_find_reclaim_dbn(struct eio_policy *p_ops,
+			 index_t start_index, index_t *index)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	index_t set = start_index / dmc->assoc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, set);
+	u_int32_t target;
+	index_t victim;
+	int list;
+
+	if (p_ops->sp_name == CACHE_REPL_ARC)
+		target = cs->p;
+	else
+		target = dmc->assoc / 4;
+
+	list = (cs->l[EIO_ARC_T1].count > target ||
+		cs->l[EIO_ARC_T2].count == 0) ? EIO_ARC_T1 : EIO_ARC_T2;
+	victim = eio_arc_first_valid(dmc, start_index, &cs->l[list]);
+	if (victim == -1) {
+		list = !list;
+		victim = eio_arc_first_valid(dmc, start_index, &cs->l[list]);
+	}
+	if (victim == -1)
+		return;
+
+	*index = victim;
+}
+
+/*
+ * An access to the block at index, either a hit or a miss that is
+ * going to put dbn in it. On a miss, a VALID block still in the slot is
+ * evicted to the ghost ring of its list. Background I/O does not
+ * promote a block and fills it at the LRU end of list 0. Latency
+ * critical I/O fills it in list 1.
+ */
+void
+eio_arc_blk_access(struct eio_policy *p_ops, index_t index, sector_t dbn,
+		   int flags)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	index_t set = index / dmc->assoc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, set);
+	struct eio_arc_cache_block *blk = eio_arc_blk(dmc, index);
+	u_int32_t tag, b1, b2, delta;
+
+	if (flags & EIO_ACCESS_HIT) {
+		if (flags & EIO_ACCESS_COLD)
+			return;
+		/* 2Q leaves the blocks of A1in in FIFO order */
+		if (p_ops->sp_name == CACHE_REPL_2Q &&
+		    blk->list == EIO_ARC_T1 && !(flags & EIO_ACCESS_HOT))
+			return;
+		eio_arc_unlink(dmc, index);
+		eio_arc_link(dmc, index, EIO_ARC_T2);
+		return;
+	}
+
+	if (EIO_CACHE_STATE_GET(dmc, index) & VALID)
+		eio_arc_ghost_add(p_ops, set, blk->list,
+				  dmc->cache_tags[index]);
+	eio_arc_unlink(dmc, index);
+	tag = eio_dbn_tag(dmc, dbn);
+
+	if (flags & EIO_ACCESS_COLD) {
+		eio_arc_link_cold(dmc, index, EIO_ARC_T1);
+		return;
+	}
+
+	if (p_ops->sp_name == CACHE_REPL_2Q) {
+		if (eio_arc_ghost_take(p_ops, set, EIO_ARC_T1, tag) ||
+		    (flags & EIO_ACCESS_HOT))
+			eio_arc_link(dmc, index, EIO_ARC_T2);
+		else
+			eio_arc_link(dmc, index, EIO_ARC_T1);
+		return;
+	}
+
+	b1 = cs->ghost_count[EIO_ARC_T1];
+	b2 = cs->ghost_count[EIO_ARC_T2];
+	if (eio_arc_ghost_take(p_ops, set, EIO_ARC_T1, tag)) {
+		/* Recently evicted from T1: T1 was too small */
+		delta = max_t(u_int32_t, b1 ? b2 / b1 : 1, 1);
+		cs->p = (u_int16_t)min_t(u_int32_t, cs->p + delta, dmc->assoc);
+		eio_arc_link(dmc, index, EIO_ARC_T2);
+	} else if (eio_arc_ghost_take(p_ops, set, EIO_ARC_T2, tag)) {
+		/* Recently evicted from T2: T2 was too small */
+		delta = max_t(u_int32_t, b2 ? b1 / b2 : 1, 1);
+		cs->p = (cs->p > delta) ? cs->p - delta : 0;
+		eio_arc_link(dmc, index, EIO_ARC_T2);
+	} else if (flags & EIO_ACCESS_HOT)
+		eio_arc_link(dmc, index, EIO_ARC_T2);
+	else
+		eio_arc_link(dmc, index, EIO_ARC_T1);
+}
+
+/*
+ * Clean from the LRU end of list 0, then of list 1.
+ */
+int eio_arc_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_arc_cache_set *cs = eio_arc_set(dmc, set);
+	index_t start_index = set * dmc->assoc;
+	index_t dmc_idx;
+	u_int16_t rel;
+	int nr_writes = 0;
+	int l;
+
+	for (l = 0; l < 2 && nr_writes < to_clean; l++) {
+		rel = cs->l[l].head;
+		while ((rel != EIO_LRU_NULL) && (nr_writes < to_clean)) {
+			dmc_idx = rel + start_index;
+			if ((EIO_CACHE_STATE_GET(dmc, dmc_idx) &
+			     (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
+				EIO_CACHE_STATE_ON(dmc, dmc_idx,
+						   DISKWRITEINPROG);
+				nr_writes++;
+			}
+			rel = eio_arc_blk(dmc, dmc_idx)->next;
+		}
+	}
+
+	return nr_writes;
+}
+
+static
+int __init arc_register(void)
+{
+	int ret;
+
+	ret = eio_register_policy(&eio_arc_ops);
+	if (ret != 0) {
+		pr_info("eio_arc already registered");
+		return ret;
+	}
+	ret = eio_register_policy(&eio_2q_ops);
+	if (ret != 0) {
+		pr_info("eio_2q already registered");
+		eio_unregister_policy(&eio_arc_ops);
+	}
+
+	return ret;
+}
+
+static
+void __exit arc_unregister(void)
+{
+	if (eio_unregister_policy(&eio_2q_ops) != 0)
+		pr_err("eio_2q unregister failed");
+	if (eio_unregister_policy(&eio_arc_ops) != 0)
+		pr_err("eio_arc unregister failed");
+}
+
+module_init(arc_register);
+module_exit(arc_unregister);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ARC and 2Q policies for EnhanceIO");
@@ -0,0 +1,316 @@
+/*
+ *  eio_clock.c
+ *
+ *  CLOCK replacement policy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An approximation of LRU that costs one reference bit per block, in a
+ * bitmap over the whole cache, and one hand per set. An access only
+ * sets the block's bit. Eviction sweeps the set from its hand, clearing
+ * the bits it passes, and takes the first VALID block found unreferenced.
+ * The victim is only looked for at lookup; the sweep is done when a miss
+ * fills its slot, so that a lookup without a fill changes nothing.
+ *
+ * All the functions are called with the set's cs_lock held, so the
+ * non-atomic bit operations are enough, unless the sets are so small
+ * that several of them share a word of the bitmap.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "eio.h"
+
+/* Generic policy functions prototypes */
+int eio_clock_init(struct cache_c *);
+void eio_clock_exit(void);
+int eio_clock_cache_sets_init(struct eio_policy *);
+int eio_clock_cache_blk_init(struct eio_policy *);
+void eio_clock_find_reclaim_dbn(struct eio_policy *, index_t, index_t *);
+int eio_clock_clean_set(struct eio_policy *, index_t, int);
+void eio_clock_blk_access(struct eio_policy *, index_t, sector_t, int);
+/* Per policy instance initialization */
+struct eio_policy *eio_clock_instance_init(void);
+
+/* Per cache set data structure */
+struct eio_clock_cache_set {
+	u_int16_t hand;                 /* set-relative offset of the hand */
+};
+
+/*
+ * Context that captures the CLOCK replacement policy
+ */
+static struct eio_policy_header eio_clock_ops = {
+	.sph_name		= CACHE_REPL_CLOCK,
+	.sph_instance_init	= eio_clock_instance_init,
+};
+
+static inline void
+eio_clock_set_ref(struct cache_c *dmc, unsigned long *ref, index_t i)
+{
+	if (likely(dmc->assoc >= BITS_PER_LONG))
+		__set_bit(i, ref);
+	else
+		set_bit(i, ref);
+}
+
+static inline int
+eio_clock_test_clear_ref(struct cache_c *dmc, unsigned long *ref, index_t i)
+{
+	if (likely(dmc->assoc >= BITS_PER_LONG))
+		return __test_and_clear_bit(i, ref);
+	return test_and_clear_bit(i, ref);
+}
+
+/*
+ * Intialize CLOCK. Called from ctr.
+ */
+int eio_clock_init(struct cache_c *dmc)
+{
+	return 0;
+}
+
+/*
+ * Initialize the per set hands.
+ */
+int eio_clock_cache_sets_init(struct eio_policy *p_ops)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	sector_t order;
+
+	order = (dmc->size >> dmc->consecutive_shift) *
+		sizeof(struct eio_clock_cache_set);
+
+	dmc->sp_cache_set = vzalloc((size_t)order);
+	if (dmc->sp_cache_set == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Allocate the reference bitmap, all clear.
+ */
+int eio_clock_cache_blk_init(struct eio_policy *p_ops)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+
+	dmc->sp_cache_blk = vzalloc(BITS_TO_LONGS(dmc->size) *
+				    sizeof(unsigned long));
+	if (dmc->sp_cache_blk == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Allocate a new instance of eio_policy per dmc
+ */
+struct eio_policy *eio_clock_instance_init(void)
+{
+	struct eio_policy *new_instance;
+
+	new_instance = vmalloc(sizeof(struct eio_policy));
+	if (new_instance == NULL) {
+		pr_err("eio_clock_instance_init: vmalloc failed");
+		return NULL;
+	}
+
+	/* Initialize the CLOCK specific functions and variables */
+	new_instance->sp_name = CACHE_REPL_CLOCK;
+	new_instance->sp_policy.lru = NULL;
+	new_instance->sp_repl_init = eio_clock_init;
+	new_instance->sp_repl_exit = eio_clock_exit;
+	new_instance->sp_repl_sets_init = eio_clock_cache_sets_init;
+	new_instance->sp_repl_blk_init = eio_clock_cache_blk_init;
+	new_instance->sp_find_reclaim_dbn = eio_clock_find_reclaim_dbn;
+	new_instance->sp_clean_set = eio_clock_clean_set;
+	new_instance->sp_blk_access = eio_clock_blk_access;
+	new_instance->sp_dmc = NULL;
+
+	try_module_get(THIS_MODULE);
+
+	pr_info("eio_clock_instance_init: created new instance of CLOCK");
+
+	return new_instance;
+}
+
+/*
+ * Cleanup an instance of eio_policy (called from dtr).
+ */
+void eio_clock_exit(void)
+{
+	module_put(THIS_MODULE);
+}
+
+/* Can the hand take the block at i? */
+static inline int eio_clock_evictable(struct cache_c *dmc, index_t i)
+{
+	return EIO_CACHE_STATE_GET(dmc, i) == VALID && !eio_blk_pinned(dmc, i);
+}
+
+/*
+ * Find the block the hand would evict and return it in index: the first
+ * evictable block unreferenced from the hand on, or else the first
+ * evictable one, as all the bits are cleared by the first turn.
+ */
+void
+eio_clock_find_reclaim_dbn(struct eio_policy *p_ops,
+			   index_t start_index, index_t *index)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	unsigned long *ref = (unsigned long *)dmc->sp_cache_blk;
+	struct eio_clock_cache_set *cs;
+	u_int32_t hand, steps;
+	index_t i, first = -1;
+
+	cs = (struct eio_clock_cache_set *)dmc->sp_cache_set +
+	     start_index / dmc->assoc;
+	hand = cs->hand;
+
+	for (steps = 0; steps < dmc->assoc; steps++) {
+		i = start_index + hand;
+		if (++hand == dmc->assoc)
+			hand = 0;
+		if (!eio_clock_evictable(dmc, i))
+			continue;
+		if (!test_bit(i, ref)) {
+			*index = i;
+			return;
+		}
+		if (first == -1)
+			first = i;
+	}
+	if (first != -1)
+		*index = first;
+}
+
+/*
+ * Sweep the hand of the set of index past it, as the search of
+ * eio_clock_find_reclaim_dbn() would have: clearing the bits of the
+ * blocks it passes, and of all of them if index was referenced.
+ */
+static void eio_clock_evict(struct cache_c *dmc, unsigned long *ref,
+			    index_t index)
+{
+	index_t start_index = index - index % dmc->assoc;
+	struct eio_clock_cache_set *cs;
+	u_int32_t hand, steps;
+	index_t i;
+
+	cs = (struct eio_clock_cache_set *)dmc->sp_cache_set +
+	     index / dmc->assoc;
+	hand = cs->hand;
+	steps = test_bit(index, ref) ? dmc->assoc : 0;
+	steps += (u_int32_t)(index - start_index + dmc->assoc - hand) %
+		 dmc->assoc;
+	while (steps--) {
+		i = start_index + hand;
+		if (++hand == dmc->assoc)
+			hand = 0;
+		if (eio_clock_evictable(dmc, i))
+			eio_clock_test_clear_ref(dmc, ref, i);
+	}
+	if (++hand == dmc->assoc)
+		hand = 0;
+	cs->hand = (u_int16_t)hand;
+}
+
+/*
+ * A hit, or a miss about to fill the block: mark the block referenced.
+ * A miss evicting a VALID block moves the hand past it first.
+ * Background I/O leaves a hit block as it is, and a filled one
+ * unreferenced, so that it goes first.
+ */
+void
+eio_clock_blk_access(struct eio_policy *p_ops, index_t index, sector_t dbn,
+		     int flags)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	unsigned long *ref = (unsigned long *)dmc->sp_cache_blk;
+
+	if (!(flags & EIO_ACCESS_HIT) &&
+	    (EIO_CACHE_STATE_GET(dmc, index) & VALID))
+		eio_clock_evict(dmc, ref, index);
+
+	if (!(flags & EIO_ACCESS_COLD))
+		eio_clock_set_ref(dmc, ref, index);
+	else if (!(flags & EIO_ACCESS_HIT))
+		eio_clock_test_clear_ref(dmc, ref, index);
+}
+
+/*
+ * Clean from the hand on, the dirty blocks not referenced first.
+ */
+int eio_clock_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	unsigned long *ref = (unsigned long *)dmc->sp_cache_blk;
+	struct eio_clock_cache_set *cs;
+	index_t start_index = set * dmc->assoc;
+	u_int32_t hand, scanned;
+	int nr_writes = 0;
+	int pass;
+	index_t i;
+
+	cs = (struct eio_clock_cache_set *)dmc->sp_cache_set + set;
+
+	for (pass = 0; pass < 2 && nr_writes < to_clean; pass++) {
+		hand = cs->hand;
+		for (scanned = 0; scanned < dmc->assoc && nr_writes < to_clean;
+		     scanned++) {
+			i = start_index + hand;
+			if (++hand == dmc->assoc)
+				hand = 0;
+			if (!pass && test_bit(i, ref))
+				continue;
+			if ((EIO_CACHE_STATE_GET(dmc, i) &
+			     (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
+				EIO_CACHE_STATE_ON(dmc, i, DISKWRITEINPROG);
+				nr_writes++;
+			}
+		}
+	}
+
+	return nr_writes;
+}
+
+static
+int __init clock_register(void)
+{
+	int ret;
+
+	ret = eio_register_policy(&eio_clock_ops);
+	if (ret != 0)
+		pr_info("eio_clock already registered");
+
+	return ret;
+}
+
+static
+void __exit clock_unregister(void)
+{
+	int ret;
+
+	ret = eio_unregister_policy(&eio_clock_ops);
+	if (ret != 0)
+		pr_err("eio_clock unregister failed");
+}
+
+module_init(clock_register);
+module_exit(clock_unregister);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("CLOCK policy for EnhanceIO");
@@ -42,6 +42,11 @@
 #define KMEM_CACHE_JOB          "eio-kcached-jobs"
 #define KMEM_EIO_IO             "eio-io-context"
 #define KMEM_DMC_BIO_PAIR       "eio-dmc-bio-pair"
+#define KMEM_BIO_CONTAINER      "eio-bio-container"
+#define KMEM_EIO_BIO            "eio-bio"
+#define KMEM_SET_SEQ            "eio-set-seq"
+#define KMEM_MDREQ              "eio-mdupdate-request"
+#define KMEM_EIO_ARENA          "eio-bio-arena"
 /* #define KMEM_CACHE_PENDING_JOB	"eio-pending-jobs" */
 
 static struct cache_c *cache_list_head;
@@ -51,6 +56,16 @@ static struct kmem_cache *_job_cache;
 struct kmem_cache *_io_cache;   /* cache of eio_context objects */
 mempool_t *_job_pool;
 mempool_t *_io_pool;            /* pool of eio_context object */
+static struct kmem_cache *_bc_cache;
+static struct kmem_cache *_ebio_cache;
+static struct kmem_cache *_set_seq_cache;
+static struct kmem_cache *_mdreq_cache;
+static struct kmem_cache *_arena_cache;
+mempool_t *_bc_pool;            /* pool of bio_container objects */
+mempool_t *_ebio_pool;          /* pool of eio_bio objects */
+mempool_t *_set_seq_pool;       /* pool of set_seq objects */
+mempool_t *_mdreq_pool;         /* pool of mdupdate_request objects */
+mempool_t *_arena_pool;         /* pool of eio_bio_arena objects */
 
 atomic_t nr_cache_jobs;
 
@@ -172,6 +187,10 @@ static int eio_jobs_init(void)
 
 	_job_cache = _io_cache = NULL;
 	_job_pool = _io_pool = NULL;
+	_bc_cache = _ebio_cache = _set_seq_cache = _mdreq_cache = NULL;
+	_bc_pool = _ebio_pool = _set_seq_pool = _mdreq_pool = NULL;
+	_arena_cache = NULL;
+	_arena_pool = NULL;
 
 	_job_cache = kmem_cache_create(KMEM_CACHE_JOB,
 				       sizeof(struct kcached_job),
@@ -196,9 +215,86 @@ static int eio_jobs_init(void)
 	if (!_io_pool)
 		goto out;
 
+	_bc_cache = kmem_cache_create(KMEM_BIO_CONTAINER,
+				      sizeof(struct bio_container),
+				      __alignof__(struct bio_container), 0, NULL);
+	if (!_bc_cache)
+		goto out;
+
+	_bc_pool = mempool_create(MIN_BIO_CONTAINERS, mempool_alloc_slab,
+				  mempool_free_slab, _bc_cache);
+	if (!_bc_pool)
+		goto out;
+
+	/* Room for a few residual bvecs, see eio_new_ebio() */
+	_ebio_cache = kmem_cache_create(KMEM_EIO_BIO,
+					sizeof(struct eio_bio) +
+					EB_INLINE_BVECS * sizeof(struct bio_vec),
+					__alignof__(struct eio_bio), 0, NULL);
+	if (!_ebio_cache)
+		goto out;
+
+	_ebio_pool = mempool_create(MIN_EIO_BIOS, mempool_alloc_slab,
+				    mempool_free_slab, _ebio_cache);
+	if (!_ebio_pool)
+		goto out;
+
+	_set_seq_cache = kmem_cache_create(KMEM_SET_SEQ,
+					   sizeof(struct set_seq),
+					   __alignof__(struct set_seq), 0, NULL);
+	if (!_set_seq_cache)
+		goto out;
+
+	_set_seq_pool = mempool_create(MIN_SET_SEQS, mempool_alloc_slab,
+				       mempool_free_slab, _set_seq_cache);
+	if (!_set_seq_pool)
+		goto out;
+
+	_mdreq_cache = kmem_cache_create(KMEM_MDREQ,
+					 sizeof(struct mdupdate_request),
+					 __alignof__(struct mdupdate_request),
+					 0, NULL);
+	if (!_mdreq_cache)
+		goto out;
+
+	_mdreq_pool = mempool_create(MIN_MDREQS, mempool_alloc_slab,
+				     mempool_free_slab, _mdreq_cache);
+	if (!_mdreq_pool)
+		goto out;
+
+	_arena_cache = kmem_cache_create(KMEM_EIO_ARENA, EIO_ARENA_SIZE,
+					 __alignof__(struct eio_bio), 0, NULL);
+	if (!_arena_cache)
+		goto out;
+
+	_arena_pool = mempool_create(MIN_EIO_ARENAS, mempool_alloc_slab,
+				     mempool_free_slab, _arena_cache);
+	if (!_arena_pool)
+		goto out;
+
 	return 0;
 
 out:
+	if (_arena_pool)
+		mempool_destroy(_arena_pool);
+	if (_arena_cache)
+		kmem_cache_destroy(_arena_cache);
+	if (_mdreq_pool)
+		mempool_destroy(_mdreq_pool);
+	if (_mdreq_cache)
+		kmem_cache_destroy(_mdreq_cache);
+	if (_set_seq_pool)
+		mempool_destroy(_set_seq_pool);
+	if (_set_seq_cache)
+		kmem_cache_destroy(_set_seq_cache);
+	if (_ebio_pool)
+		mempool_destroy(_ebio_pool);
+	if (_ebio_cache)
+		kmem_cache_destroy(_ebio_cache);
+	if (_bc_pool)
+		mempool_destroy(_bc_pool);
+	if (_bc_cache)
+		kmem_cache_destroy(_bc_cache);
 	if (_io_pool)
 		mempool_destroy(_io_pool);
 	if (_io_cache)
@@ -210,19 +306,84 @@ out:
 
 	_job_pool = _io_pool = NULL;
 	_job_cache = _io_cache = NULL;
+	_bc_cache = _ebio_cache = _set_seq_cache = _mdreq_cache = NULL;
+	_bc_pool = _ebio_pool = _set_seq_pool = _mdreq_pool = NULL;
+	_arena_cache = NULL;
+	_arena_pool = NULL;
 	return -ENOMEM;
 }
 
 static void eio_jobs_exit(void)
 {
 
+	mempool_destroy(_arena_pool);
+	mempool_destroy(_mdreq_pool);
+	mempool_destroy(_set_seq_pool);
+	mempool_destroy(_ebio_pool);
+	mempool_destroy(_bc_pool);
 	mempool_destroy(_io_pool);
 	mempool_destroy(_job_pool);
+	kmem_cache_destroy(_arena_cache);
+	kmem_cache_destroy(_mdreq_cache);
+	kmem_cache_destroy(_set_seq_cache);
+	kmem_cache_destroy(_ebio_cache);
+	kmem_cache_destroy(_bc_cache);
 	kmem_cache_destroy(_io_cache);
 	kmem_cache_destroy(_job_cache);
 
 	_job_pool = _io_pool = NULL;
 	_job_cache = _io_cache = NULL;
+	_bc_cache = _ebio_cache = _set_seq_cache = _mdreq_cache = NULL;
+	_bc_pool = _ebio_pool = _set_seq_pool = _mdreq_pool = NULL;
+	_arena_cache = NULL;
+	_arena_pool = NULL;
+}
+
+/*
+ * The run time stats, the io size and latency histograms and the in
+ * flight bio count are per-cpu so that the I/O path does not bounce shared cache lines.
+ */
+static int eio_stats_alloc(struct cache_c *dmc)
+{
+
+	dmc->eio_stats = alloc_percpu(struct eio_stats);
+	if (!dmc->eio_stats)
+		return -ENOMEM;
+
+	dmc->size_hist = __alloc_percpu(sizeof(int64_t) * SIZE_HIST,
+					__alignof__(int64_t));
+	if (!dmc->size_hist)
+		goto out;
+
+	dmc->lat_hist = alloc_percpu(struct eio_lat_hist);
+	if (!dmc->lat_hist)
+		goto out;
+
+	if (percpu_counter_init(&dmc->nr_ios, 0, GFP_KERNEL))
+		goto out;
+
+	return 0;
+
+out:
+	free_percpu(dmc->lat_hist);
+	free_percpu(dmc->size_hist);
+	free_percpu(dmc->eio_stats);
+	dmc->lat_hist = NULL;
+	dmc->size_hist = NULL;
+	dmc->eio_stats = NULL;
+	return -ENOMEM;
+}
+
+void eio_stats_free(struct cache_c *dmc)
+{
+
+	percpu_counter_destroy(&dmc->nr_ios);
+	free_percpu(dmc->lat_hist);
+	free_percpu(dmc->size_hist);
+	free_percpu(dmc->eio_stats);
+	dmc->lat_hist = NULL;
+	dmc->size_hist = NULL;
+	dmc->eio_stats = NULL;
 }
 
 static int eio_kcached_init(struct cache_c *dmc)
@@ -245,7 +406,9 @@ int eio_sb_store(struct cache_c *dmc)
 {
 	union eio_superblock *sb = NULL;
 	struct eio_io_region where;
+	unsigned seq;
 	int error;
+	int i;
 
 	struct bio_vec *sb_pages;
 	int nr_pages;
@@ -275,6 +438,8 @@ int eio_sb_store(struct cache_c *dmc)
 	page_index = 0;
 	sb = (union eio_superblock *)kmap(sb_pages[page_index].bv_page);
 
+	/* A stale journal tail must not land over a newer one */
+	mutex_lock(&dmc->sb_mutex);
 	sb->sbf.cache_sb_state = cpu_to_le32(dmc->sb_state);
 	sb->sbf.block_size = cpu_to_le32(dmc->block_size);
 	sb->sbf.size = cpu_to_le32(dmc->size);
@@ -315,12 +480,41 @@ int eio_sb_store(struct cache_c *dmc)
 		cpu_to_le32(dmc->sysctl_active.time_based_clean_interval);
 	sb->sbf.autoclean_threshold = cpu_to_le32(dmc->sysctl_active.autoclean_threshold);
 	sb->sbf.cache_wronly = cpu_to_le32(dmc->sysctl_active.cache_wronly);
+	sb->sbf.seq_io_cutoff = cpu_to_le32(dmc->sysctl_active.seq_io_cutoff);
+	sb->sbf.read_around = cpu_to_le32(dmc->sysctl_active.read_around);
+	sb->sbf.lookup_filter = cpu_to_le32(dmc->sysctl_active.lookup_filter);
+	sb->sbf.admission = cpu_to_le32(dmc->sysctl_active.admission);
+	sb->sbf.io_hints = cpu_to_le32(dmc->sysctl_active.io_hints);
+	sb->sbf.md_batch_usec = cpu_to_le32(dmc->sysctl_active.md_batch_usec);
+	sb->sbf.md_journal = cpu_to_le32(dmc->sysctl_active.md_journal);
+	sb->sbf.jrnl_start = cpu_to_le64(dmc->jrnl_start);
+	sb->sbf.jrnl_sectors =
+		cpu_to_le32(dmc->jrnl_nr_blocks * EIO_JRNL_BLOCK_SECTORS);
+	sb->sbf.jrnl_id = cpu_to_le32(dmc->jrnl_id);
+	sb->sbf.clean_sort = cpu_to_le32(dmc->sysctl_active.clean_sort);
+	spin_lock(&dmc->jrnl_lock);
+	sb->sbf.jrnl_tail = cpu_to_le64(dmc->jrnl_ckpt_tail);
+	spin_unlock(&dmc->jrnl_lock);
+	do {
+		seq = read_seqbegin(&dmc->pin_lock);
+		sb->sbf.nr_pins = cpu_to_le32(dmc->nr_pins);
+		for (i = 0; i < EIO_MAX_PINS; i++) {
+			sb->sbf.pin_start[i] = cpu_to_le64(dmc->pins[i].start);
+			sb->sbf.pin_end[i] = cpu_to_le64(dmc->pins[i].end);
+		}
+	} while (read_seqretry(&dmc->pin_lock, seq));
 
-	/* write out to ssd */
+	/*
+	 * write out to ssd. The journal tail in it may only become stable
+	 * after the flat md the checkpoint wrote below it.
+	 */
 	where.bdev = dmc->cache_dev->bdev;
 	where.sector = EIO_SUPERBLOCK_START;
 	where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
-	error = eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, sb_pages, nr_pages);
+	error = eio_io_sync_vm(dmc, &where, REQ_OP_WRITE,
+			       EIO_REQ_PREFLUSH | EIO_REQ_FUA, sb_pages,
+			       nr_pages);
+	mutex_unlock(&dmc->sb_mutex);
 	if (error) {
 		pr_err
 			("sb_store: Could not write out superblock to sector %llu (error %d) for cache \"%s\".\n",
@@ -426,8 +620,10 @@ int eio_md_store(struct cache_c *dmc)
 		if (EIO_CACHE_STATE_GET(dmc, (index_t)i) & DIRTY)
 			num_dirty++;
 		next_ptr->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
-		next_ptr->cache_state = cpu_to_le64(EIO_CACHE_STATE_GET(dmc, (index_t)i) &
-					(INVALID | VALID | DIRTY));
+		next_ptr->cache_state =
+			cpu_to_le64(eio_md_cache_state(dmc, (index_t)i,
+				    EIO_CACHE_STATE_GET(dmc, (index_t)i) &
+				    (INVALID | VALID | DIRTY)));
 
 		next_ptr++;
 		slots_written++;
@@ -541,6 +737,10 @@ int eio_md_store(struct cache_c *dmc)
 			dmc->sb_state = CACHE_MD_STATE_CLEAN;
 		else
 			dmc->sb_state = CACHE_MD_STATE_FASTCLEAN;
+		/* The flat md now has everything the journal had */
+		spin_lock(&dmc->jrnl_lock);
+		dmc->jrnl_tail = dmc->jrnl_ckpt_tail = dmc->jrnl_head;
+		spin_unlock(&dmc->jrnl_lock);
 	} else
 		dmc->sb_state = CACHE_MD_STATE_UNSTABLE;
 
@@ -581,6 +781,7 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	int j, error;
 	uint64_t cache_size, dev_size;
 	sector_t order;
+	sector_t jrnl_sectors;
 	sector_t sectors_written = 0, sectors_expected = 0;     /* debug */
 	int slots_written = 0;                                  /* How many cache slots did we fill in this MD io block ? */
 
@@ -644,15 +845,23 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	/*
 	 * Compute the size of the metadata including header.
 	 * and here we also are making sure that metadata and userdata
-	 * on SSD is aligned at 8K boundary.
+	 * on SSD is aligned at 8K boundary, or at the cache block size
+	 * if that is larger.
 	 *
 	 * Note dmc->size is in raw sectors
+	 *
+	 * A write-back cache also gets its md journal between the red zone
+	 * and the data, on a 4K boundary.
 	 */
+	jrnl_sectors = (dmc->mode == CACHE_MODE_WB) ?
+		       EIO_JRNL_SECTORS + EIO_JRNL_BLOCK_SECTORS * 2 : 0;
 	dmc->md_start_sect = EIO_METADATA_START(dmc->cache_dev_start_sect);
 	dmc->md_sectors =
 		INDEX_TO_MD_SECTOR(EIO_DIV(dmc->size, (sector_t)dmc->block_size));
 	dmc->md_sectors +=
 		EIO_EXTRA_SECTORS(dmc->cache_dev_start_sect, dmc->md_sectors);
+	dmc->md_sectors += jrnl_sectors;
+	dmc->md_sectors = EIO_DATA_ALIGN(dmc->md_sectors, dmc->block_size);
 	dmc->size -= dmc->md_sectors;   /* total sectors available for cache */
 	do_div(dmc->size, dmc->block_size);
 	dmc->size = EIO_DIV(dmc->size, dmc->assoc) * (sector_t)dmc->assoc;
@@ -660,6 +869,23 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	dmc->md_sectors = INDEX_TO_MD_SECTOR(dmc->size);
 	dmc->md_sectors +=
 		EIO_EXTRA_SECTORS(dmc->cache_dev_start_sect, dmc->md_sectors);
+	dmc->md_sectors += jrnl_sectors;
+	dmc->md_sectors = EIO_DATA_ALIGN(dmc->md_sectors, dmc->block_size);
+
+	dmc->jrnl_start = 0;
+	dmc->jrnl_nr_blocks = 0;
+	if (jrnl_sectors) {
+		dmc->jrnl_start = ALIGN(dmc->md_start_sect +
+					INDEX_TO_MD_SECTOR(dmc->size) +
+					EIO_REDZONE_SECTORS,
+					(sector_t)EIO_JRNL_BLOCK_SECTORS);
+		dmc->jrnl_nr_blocks = EIO_JRNL_SECTORS / EIO_JRNL_BLOCK_SECTORS;
+		EIO_ASSERT(dmc->jrnl_start + EIO_JRNL_SECTORS <=
+			   dmc->md_sectors);
+	}
+	/* Blocks left in the region by an earlier cache don't match the id */
+	EIO_GET_RANDOM_U32(dmc->jrnl_id);
+	dmc->jrnl_head = dmc->jrnl_tail = dmc->jrnl_ckpt_tail = 0;
 
 	error = eio_mem_init(dmc);
 	if (error == -1) {
@@ -687,8 +913,9 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 
 	order =
 		dmc->size *
-		(EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) :
-		 sizeof(struct cacheblock));
+		((EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) :
+		  sizeof(struct cacheblock)) + sizeof(struct eio_sbmap) +
+		 EIO_TAG_STORE_SIZE);
 	i = EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) : sizeof(struct
 								  cacheblock);
 	pr_info("Allocate %lluKB (%lluB per) mem for %llu-entry cache "	\
@@ -722,6 +949,7 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 			ret = -ENOMEM;
 			goto free_header;
 		}
+		eio_sbmap_init(dmc);
 	}
 	if (eio_repl_blk_init(dmc->policy_ops) != 0) {
 		pr_err
@@ -952,6 +1180,151 @@ free_header:
 	return ret;
 }
 
+/*
+ * Load the flat md of a set again, the way eio_md_load() does.
+ */
+static int eio_md_load_set(struct cache_c *dmc, index_t set,
+			   int clean_shutdown, struct page **mdpages,
+			   int nr_mdpages)
+{
+	struct flash_cacheblock *md_blocks;
+	struct eio_io_region where;
+	void *pg_virt_addr[2] = { NULL };
+	index_t i, start_index;
+	u_int64_t state;
+	int error, k;
+
+	start_index = set * dmc->assoc;
+	where.bdev = dmc->cache_dev->bdev;
+	where.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index);
+	where.count = eio_to_sector(dmc->assoc *
+				    sizeof(struct flash_cacheblock));
+	error = eio_io_sync_pages(dmc, &where, REQ_OP_READ, 0, mdpages,
+				  nr_mdpages);
+	if (error)
+		return error;
+
+	for (k = 0; k < nr_mdpages; k++)
+		pg_virt_addr[k] = kmap(mdpages[k]);
+	for (i = 0; i < dmc->assoc; i++) {
+		md_blocks = (struct flash_cacheblock *)
+			    pg_virt_addr[INDEX_TO_MD_PAGE(i)] +
+			    INDEX_TO_MD_PAGE_OFFSET(i);
+		state = le64_to_cpu(md_blocks->cache_state);
+		if (clean_shutdown || (state & DIRTY)) {
+			EIO_CACHE_STATE_SET(dmc, start_index + i,
+					    (u_int8_t)state & ~QUEUED);
+			eio_sbmap_load(dmc, start_index + i, state);
+			EIO_DBN_SET(dmc, start_index + i,
+				    le64_to_cpu(md_blocks->dbn));
+		} else
+			eio_invalidate_md(dmc, start_index + i);
+	}
+	for (k = 0; k < nr_mdpages; k++)
+		kunmap(mdpages[k]);
+
+	return 0;
+}
+
+/*
+ * Replay the live md journal blocks over the flat md just loaded, in
+ * sequence order. All the slots are read, as a block may be missing
+ * between live ones: the commits complete out of order. A set record
+ * puts its set back to the flat md, which is newer than the records
+ * before it. Sets the journal head past the last live block.
+ * Returns the number of block records applied.
+ */
+static int eio_jrnl_replay(struct cache_c *dmc, int clean_shutdown)
+{
+	struct eio_jrnl_header *hdr;
+	struct eio_jrnl_rec *rec;
+	struct eio_io_region where;
+	struct page *page;
+	struct page *mdpages[2] = { NULL };
+	u_int64_t seq, index, head;
+	u_int32_t crc, nr_recs, k;
+	int nr_mdpages;
+	int applied = 0;
+	int error = 0;
+
+	nr_mdpages = IO_PAGE_COUNT(dmc->assoc * sizeof(struct flash_cacheblock));
+	EIO_ASSERT(nr_mdpages <= 2);
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+	if (eio_alloc_wb_pages(mdpages, nr_mdpages)) {
+		put_page(page);
+		return -ENOMEM;
+	}
+	hdr = (struct eio_jrnl_header *)kmap(page);
+
+	head = dmc->jrnl_tail;
+	where.bdev = dmc->cache_dev->bdev;
+	where.count = EIO_JRNL_BLOCK_SECTORS;
+	for (seq = dmc->jrnl_tail;
+	     seq < dmc->jrnl_tail + dmc->jrnl_nr_blocks; seq++) {
+		where.sector = dmc->jrnl_start + EIO_JRNL_BLOCK_SECTORS *
+			       (sector_t)EIO_REM(seq, dmc->jrnl_nr_blocks);
+		error = eio_io_sync_pages(dmc, &where, REQ_OP_READ, 0, &page, 1);
+		if (error)
+			break;
+		if (le32_to_cpu(hdr->magic) != EIO_JRNL_MAGIC ||
+		    le32_to_cpu(hdr->id) != dmc->jrnl_id ||
+		    le64_to_cpu(hdr->seq) != seq)
+			continue;
+		nr_recs = le32_to_cpu(hdr->nr_recs);
+		crc = le32_to_cpu(hdr->crc);
+		hdr->crc = 0;
+		if (nr_recs > EIO_JRNL_RECS_PER_BLOCK ||
+		    crc32_le(~0, (u8 *)hdr, EIO_JRNL_BLOCK_SIZE) != crc) {
+			pr_err("md_load: Torn md journal block %llu skipped",
+			       (unsigned long long)seq);
+			continue;
+		}
+
+		head = seq + 1;
+		rec = (struct eio_jrnl_rec *)(hdr + 1);
+		for (k = 0; k < nr_recs; k++, rec++) {
+			index = le64_to_cpu(rec->index);
+			if (index & EIO_JRNL_REC_SET) {
+				index &= ~EIO_JRNL_REC_SET;
+				if (index >= (dmc->size >> dmc->consecutive_shift))
+					continue;
+				error = eio_md_load_set(dmc, (index_t)index,
+							clean_shutdown,
+							mdpages, nr_mdpages);
+				if (error)
+					goto out;
+				continue;
+			}
+			if (index >= dmc->size)
+				continue;
+			EIO_CACHE_STATE_SET(dmc, index,
+				(u_int8_t)le64_to_cpu(rec->cache_state) &
+				~QUEUED);
+			eio_sbmap_load(dmc, index,
+				       le64_to_cpu(rec->cache_state));
+			EIO_DBN_SET(dmc, index, le64_to_cpu(rec->dbn));
+			applied++;
+		}
+	}
+
+out:
+	kunmap(page);
+	put_page(page);
+	eio_free_wb_pages(mdpages, nr_mdpages);
+	if (error)
+		return error;
+
+	dmc->jrnl_head = head;
+	if (head != dmc->jrnl_tail)
+		pr_info("md_load: Replayed md journal blocks %llu-%llu, " \
+			"%d dirty block records",
+			(unsigned long long)dmc->jrnl_tail,
+			(unsigned long long)head - 1, applied);
+	return applied;
+}
+
 static int eio_md_load(struct cache_c *dmc)
 {
 	struct flash_cacheblock *meta_data_cacheblock, *next_ptr;
@@ -1002,8 +1375,13 @@ static int eio_md_load(struct cache_c *dmc)
 		goto free_header;
 	}
 
-	/* check ondisk superblock version */
-	if (le32_to_cpu(header->sbf.cache_version) != EIO_SB_VERSION) {
+	/*
+	 * check ondisk superblock version. Metadata without sub-block maps
+	 * reads as whole blocks, so it is loaded as is.
+	 */
+	if (le32_to_cpu(header->sbf.cache_version) != EIO_SB_VERSION &&
+	    le32_to_cpu(header->sbf.cache_version) !=
+	    EIO_SB_SUBBLOCK_VERSION - 1) {
 		pr_info("md_load: Cache superblock mismatch detected." \
 			" (current: %u, ondisk: %u)", EIO_SB_VERSION,
 			header->sbf.cache_version);
@@ -1147,6 +1525,63 @@ static int eio_md_load(struct cache_c *dmc)
 		le32_to_cpu(header->sbf.time_based_clean_interval);
 	dmc->sysctl_active.autoclean_threshold =
 		le32_to_cpu(header->sbf.autoclean_threshold);
+	/*
+	 * The fields below came with the sub-block maps. An older superblock
+	 * doesn't have them, whatever its padding holds: it gets the
+	 * defaults, and no journal.
+	 */
+	if (le32_to_cpu(header->sbf.cache_version) < EIO_SB_SUBBLOCK_VERSION) {
+		dmc->sysctl_active.seq_io_cutoff = SEQ_IO_CUTOFF_DEF;
+		dmc->sysctl_active.read_around = READ_AROUND_DEF;
+		dmc->sysctl_active.lookup_filter = LOOKUP_FILTER_DEF;
+		dmc->sysctl_active.admission = ADMISSION_DEF;
+		dmc->sysctl_active.io_hints = IO_HINTS_DEF;
+		dmc->sysctl_active.md_batch_usec = MD_BATCH_USEC_DEF;
+		dmc->sysctl_active.md_journal = 0;
+		dmc->sysctl_active.clean_sort = CLEAN_SORT_DEF;
+		dmc->jrnl_start = 0;
+		dmc->jrnl_nr_blocks = 0;
+		dmc->jrnl_id = 0;
+		dmc->jrnl_head = dmc->jrnl_tail = dmc->jrnl_ckpt_tail = 0;
+		dmc->nr_pins = 0;
+	} else {
+		dmc->sysctl_active.seq_io_cutoff =
+			min_t(u_int32_t, le32_to_cpu(header->sbf.seq_io_cutoff),
+			      SEQ_IO_CUTOFF_MAX);
+		dmc->sysctl_active.read_around =
+			le32_to_cpu(header->sbf.read_around);
+		dmc->sysctl_active.lookup_filter =
+			le32_to_cpu(header->sbf.lookup_filter);
+		dmc->sysctl_active.admission =
+			le32_to_cpu(header->sbf.admission);
+		dmc->sysctl_active.io_hints =
+			le32_to_cpu(header->sbf.io_hints) & EIO_HINT_ALL;
+		dmc->sysctl_active.md_batch_usec =
+			min_t(u_int32_t, le32_to_cpu(header->sbf.md_batch_usec),
+			      MD_BATCH_USEC_MAX);
+		dmc->jrnl_start = le64_to_cpu(header->sbf.jrnl_start);
+		dmc->jrnl_nr_blocks = le32_to_cpu(header->sbf.jrnl_sectors) /
+				      EIO_JRNL_BLOCK_SECTORS;
+		if (!dmc->jrnl_start || !dmc->jrnl_nr_blocks) {
+			dmc->jrnl_start = 0;
+			dmc->jrnl_nr_blocks = 0;
+		}
+		dmc->jrnl_id = le32_to_cpu(header->sbf.jrnl_id);
+		dmc->jrnl_tail = le64_to_cpu(header->sbf.jrnl_tail);
+		dmc->jrnl_head = dmc->jrnl_ckpt_tail = dmc->jrnl_tail;
+		dmc->sysctl_active.md_journal = (dmc->jrnl_start &&
+						 le32_to_cpu(header->sbf.md_journal));
+		dmc->sysctl_active.clean_sort =
+			!!le32_to_cpu(header->sbf.clean_sort);
+		dmc->nr_pins = min_t(u_int32_t,
+				     le32_to_cpu(header->sbf.nr_pins),
+				     EIO_MAX_PINS);
+		for (i = 0; i < (int)dmc->nr_pins; i++) {
+			dmc->pins[i].start =
+				le64_to_cpu(header->sbf.pin_start[i]);
+			dmc->pins[i].end = le64_to_cpu(header->sbf.pin_end[i]);
+		}
+	}
 
 	i = eio_mem_init(dmc);
 	if (i == -1) {
@@ -1157,8 +1592,9 @@ static int eio_md_load(struct cache_c *dmc)
 
 	order =
 		dmc->size *
-		((i ==
-		  1) ? sizeof(struct cacheblock_md8) : sizeof(struct cacheblock));
+		(((i ==
+		   1) ? sizeof(struct cacheblock_md8) : sizeof(struct cacheblock)) +
+		 sizeof(struct eio_sbmap) + EIO_TAG_STORE_SIZE);
 	data_size = dmc->size * dmc->block_size;
 	size =
 		EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) : sizeof(struct
@@ -1181,6 +1617,7 @@ static int eio_md_load(struct cache_c *dmc)
 		vfree((void *)header);
 		return 1;
 	}
+	eio_sbmap_init(dmc);
 
 	if (eio_repl_blk_init(dmc->policy_ops) != 0) {
 		vfree((void *)EIO_CACHE(dmc));
@@ -1275,6 +1712,8 @@ static int eio_md_load(struct cache_c *dmc)
 				EIO_CACHE_STATE_SET(dmc, i,
 					(u_int8_t)le64_to_cpu(next_ptr->
 					cache_state) & ~QUEUED);
+				eio_sbmap_load(dmc, i,
+					       le64_to_cpu(next_ptr->cache_state));
 
 				EIO_ASSERT((EIO_CACHE_STATE_GET(dmc, i) &
 					    (VALID | INVALID))
@@ -1291,6 +1730,27 @@ static int eio_md_load(struct cache_c *dmc)
 		size -= slots_read;
 	}
 
+	/* The journal may have dirty blocks the flat md doesn't have yet */
+	if (dmc->jrnl_start) {
+		error = eio_jrnl_replay(dmc, clean_shutdown);
+		if (error < 0) {
+			vfree((void *)EIO_CACHE(dmc));
+			pr_err("md_load: Could not replay the md journal " \
+			       "(error %d)", error);
+			ret = -EIO;
+			goto free_md;
+		}
+		if (error > 0) {
+			num_valid = dirty_loaded = 0;
+			for (j = 0; j < dmc->size; j++) {
+				if (EIO_CACHE_STATE_GET(dmc, j) & VALID)
+					num_valid++;
+				if (EIO_CACHE_STATE_GET(dmc, j) & DIRTY)
+					dirty_loaded++;
+			}
+		}
+	}
+
 	/*
 	 * If the cache contains dirty data, the only valid mode is write back.
 	 */
@@ -1479,11 +1939,24 @@ int eio_cache_create(struct cache_rec_short *cache)
 		goto bad;
 	}
 
+	error = eio_stats_alloc(dmc);
+	if (error) {
+		strerr = "Failed to allocate memory for cache stats";
+		kfree(dmc);
+		goto bad;
+	}
+
 	/*
 	 * Source device.
 	 */
 
-	error = eio_ttc_get_device(cache->cr_src_devname, mode, &dmc->disk_dev);
+	/*
+	 * A stacked cache leaves the source queue alone, so nothing else may
+	 * write or discard the source behind its back.
+	 */
+	error = eio_ttc_get_device(cache->cr_src_devname,
+				   (cache->cr_flags & CACHE_FLAGS_STACKED) ?
+				   mode | FMODE_EXCL : mode, &dmc->disk_dev);
 	if (error) {
 		strerr = "get_device for source device failed";
 		goto bad1;
@@ -1544,10 +2017,11 @@ int eio_cache_create(struct cache_rec_short *cache)
 	eio_init_srcdev_props(dmc);
 
 	/*
-	 * Initialize the io callback queue.
+	 * Initialize the io callback queue. Completions of different blocks
+	 * don't depend on each other, they may run on all the cpus.
 	 */
 
-	dmc->callback_q = create_singlethread_workqueue("eio_callback");
+	dmc->callback_q = alloc_workqueue("eio_callback", WQ_MEM_RECLAIM, 0);
 	if (!dmc->callback_q) {
 		error = -ENOMEM;
 		strerr = "Failed to initialize callback workqueue";
@@ -1585,6 +2059,9 @@ int eio_cache_create(struct cache_rec_short *cache)
 	}
 
 	spin_lock_init(&dmc->cache_spin_lock);
+	seqlock_init(&dmc->pin_lock);
+	mutex_init(&dmc->sb_mutex);
+	spin_lock_init(&dmc->jrnl_lock);
 	/*
 	 * We need to determine the requested cache mode before we call
 	 * eio_md_load becuase it examines dmc->mode. The cache mode is
@@ -1669,6 +2146,10 @@ int eio_cache_create(struct cache_rec_short *cache)
 	if (cache->cr_flags) {
 		int flags;
 		flags = cache->cr_flags;
+		if (flags & CACHE_FLAGS_STACKED) {
+			dmc->cache_flags |= CACHE_FLAGS_STACKED;
+			flags &= ~CACHE_FLAGS_STACKED;
+		}
 		if (flags == 0)
 			dmc->cache_flags &= ~CACHE_FLAGS_INVALIDATE;
 		else if (flags == 1) {
@@ -1686,7 +2167,9 @@ int eio_cache_create(struct cache_rec_short *cache)
 
 	if (cache->cr_blksize) {
 		dmc->block_size = cache->cr_blksize >> SECTOR_SHIFT;
-		if (dmc->block_size & (dmc->block_size - 1)) {
+		if ((dmc->block_size & (dmc->block_size - 1)) ||
+		    (dmc->block_size && dmc->block_size < BLKSIZE_2K) ||
+		    dmc->block_size > BLKSIZE_64K) {
 			strerr = "Invalid block size";
 			error = -EINVAL;
 			goto bad5;
@@ -1752,6 +2235,14 @@ int eio_cache_create(struct cache_rec_short *cache)
 	dmc->sysctl_active.dirty_set_high_threshold = DIRTY_SET_HIGH_THRESH_DEF;
 	dmc->sysctl_active.dirty_set_low_threshold = DIRTY_SET_LOW_THRESH_DEF;
 	dmc->sysctl_active.autoclean_threshold = AUTOCLEAN_THRESH_DEF;
+	dmc->sysctl_active.seq_io_cutoff = SEQ_IO_CUTOFF_DEF;
+	dmc->sysctl_active.read_around = READ_AROUND_DEF;
+	dmc->sysctl_active.lookup_filter = LOOKUP_FILTER_DEF;
+	dmc->sysctl_active.admission = ADMISSION_DEF;
+	dmc->sysctl_active.io_hints = IO_HINTS_DEF;
+	dmc->sysctl_active.md_batch_usec = MD_BATCH_USEC_DEF;
+	dmc->sysctl_active.md_journal = MD_JOURNAL_DEF;
+	dmc->sysctl_active.clean_sort = CLEAN_SORT_DEF;
 	dmc->sysctl_active.time_based_clean_interval =
 		TIME_BASED_CLEAN_INTERVAL_DEF(dmc);
 
@@ -1792,10 +2283,15 @@ init:
 	for (i = 0; i < (dmc->size >> dmc->consecutive_shift); i++) {
 		dmc->cache_sets[i].nr_dirty = 0;
 		spin_lock_init(&dmc->cache_sets[i].cs_lock);
+		seqcount_init(&dmc->cache_sets[i].cs_seq);
 		init_rwsem(&dmc->cache_sets[i].rw_lock);
 		dmc->cache_sets[i].mdreq = NULL;
 		dmc->cache_sets[i].flags = 0;
+		dmc->cache_sets[i].nr_pinned = 0;
 	}
+	atomic64_set(&dmc->nr_pinned, 0);
+	if (dmc->nr_pins)
+		eio_pin_recount(dmc);
 	error = eio_repl_sets_init(dmc->policy_ops);
 	if (error < 0) {
 		strerr = "Failed to allocate memory for cache policy";
@@ -1821,8 +2317,6 @@ init:
 
 	atomic_set(&dmc->clean_index, 0);
 
-	atomic64_set(&dmc->nr_ios, 0);
-
 	/*
 	 * sysctl_mem_limit_pct [0 - 100]. Before doing a vmalloc()
 	 * make sure that the allocation size requested is less than
@@ -1845,7 +2339,7 @@ init:
 	prev_set = -1;
 	for (i = 0; i < dmc->size; i++) {
 		if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
-			atomic64_inc(&dmc->eio_stats.cached_blocks);
+			atomic64_inc(&dmc->cached_blocks);
 		if (EIO_CACHE_STATE_GET(dmc, i) & DIRTY) {
 			dmc->cache_sets[EIO_DIV(i, dmc->assoc)].nr_dirty++;
 			atomic64_inc(&dmc->nr_dirty);
@@ -1854,6 +2348,10 @@ init:
 				/* Move the given set at the head of the set LRU list */
 				eio_touch_set_lru(dmc, cur_set);
 				prev_set = cur_set;
+				/* Its dirty blocks may be in the journal only */
+				if (dmc->jrnl_sets[0] &&
+				    dmc->jrnl_head != dmc->jrnl_tail)
+					__set_bit(cur_set, dmc->jrnl_sets[0]);
 			}
 		}
 	}
@@ -1866,6 +2364,12 @@ init:
 
 	dmc->index_zero = dmc->assoc;
 
+	if (dmc->sysctl_active.lookup_filter &&
+	    eio_lookup_filter_enable(dmc))
+		dmc->sysctl_active.lookup_filter = 0;
+	if (dmc->sysctl_active.admission && eio_admit_enable(dmc))
+		dmc->sysctl_active.admission = 0;
+
 	eio_procfs_ctr(dmc);
 
 	/*
@@ -1889,6 +2393,8 @@ bad6:
 		eio_stop_async_tasks(dmc);
 		eio_free_wb_resources(dmc);
 	}
+	eio_lookup_filter_disable(dmc);
+	eio_admit_free(dmc);
 	vfree((void *)dmc->cache_sets);
 	vfree((void *)EIO_CACHE(dmc));
 
@@ -1915,6 +2421,7 @@ bad2:
 	eio_ttc_put_device(&dmc->disk_dev);
 bad1:
 	eio_policy_free(dmc);
+	eio_stats_free(dmc);
 	kfree(dmc);
 bad:
 	if (strerr)
@@ -1991,6 +2498,27 @@ int eio_cache_delete(char *cache_name, int do_delete)
 		}
 	}
 
+	/*
+	 * The stacked device must not go away under its users. Refuse new
+	 * opens before the count is looked at, an open can't slip in
+	 * before del_gendisk() then.
+	 */
+	if (dmc->stacked_disk) {
+		spin_lock_irqsave(&dmc->cache_spin_lock,
+				  dmc->cache_spin_lock_flags);
+		if (atomic_read(&dmc->stacked_openers)) {
+			dmc->cache_flags &= ~CACHE_FLAGS_MOD_INPROG;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock,
+					       dmc->cache_spin_lock_flags);
+			pr_err("cache_delete: /dev/%s of cache \"%s\" is in use.",
+			       dmc->stacked_disk->disk_name, dmc->cache_name);
+			return -EBUSY;
+		}
+		dmc->stacked_closing = 1;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock,
+				       dmc->cache_spin_lock_flags);
+	}
+
 	eio_stop_async_tasks(dmc);
 
 	/*
@@ -2042,6 +2570,8 @@ force_delete:
 	}
 
 	eio_free_wb_resources(dmc);
+	eio_lookup_filter_disable(dmc);
+	eio_admit_free(dmc);
 	vfree((void *)EIO_CACHE(dmc));
 	vfree((void *)dmc->cache_sets);
 	eio_ttc_put_device(&dmc->disk_dev);
@@ -2074,6 +2604,8 @@ out:
 	dmc->cache_flags &= ~CACHE_FLAGS_MOD_INPROG;
 	if (!ret)
 		dmc->cache_flags |= CACHE_FLAGS_DELETED;
+	else
+		dmc->stacked_closing = 0;
 	spin_unlock_irqrestore(&dmc->cache_spin_lock,
 			       dmc->cache_spin_lock_flags);
 
@@ -2085,8 +2617,10 @@ out:
 		 * no more accessible via lookup.
 		 */
 
-		if (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG))
+		if (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG)) {
+			eio_stats_free(dmc);
 			kfree(dmc);
+		}
 	}
 
 	return ret;
@@ -2168,6 +2702,7 @@ int eio_ctr_ssd_add(struct cache_c *dmc, char *dev)
 			("ctr_ssd_add: Failed to create md, continuing in degraded mode");
 		goto out;
 	}
+	eio_pin_recount(dmc);
 
 	r = eio_repl_sets_init(dmc->policy_ops);
 	if (r < 0) {
@@ -2176,9 +2711,11 @@ int eio_ctr_ssd_add(struct cache_c *dmc, char *dev)
 		goto out;
 	}
 	eio_policy_lru_pushblks(dmc->policy_ops);
-	if (dmc->mode != CACHE_MODE_WB)
+	if (dmc->mode != CACHE_MODE_WB) {
 		/* Cold cache will reset the stats */
-		memset(&dmc->eio_stats, 0, sizeof(dmc->eio_stats));
+		eio_stats_zero(dmc);
+		atomic64_set(&dmc->cached_blocks, 0);
+	}
 
 	return 0;
 out:
@@ -2232,6 +2769,138 @@ int eio_start_clean_thread(struct cache_c *dmc)
 	return 0;
 }
 
+static void eio_jrnl_free(struct cache_c *dmc)
+{
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		if (dmc->jrnl_sets[k])
+			vfree(dmc->jrnl_sets[k]);
+		dmc->jrnl_sets[k] = NULL;
+	}
+	if (dmc->jrnl_mdpages) {
+		eio_free_wb_pages(dmc->jrnl_mdpages, dmc->mdpage_count);
+		kfree(dmc->jrnl_mdpages);
+		dmc->jrnl_mdpages = NULL;
+	}
+	if (dmc->jrnl_ckpt_q) {
+		destroy_workqueue(dmc->jrnl_ckpt_q);
+		dmc->jrnl_ckpt_q = NULL;
+	}
+}
+
+/* Live set maps and the checkpoint md pages of the md journal */
+static int eio_jrnl_alloc(struct cache_c *dmc)
+{
+	size_t size;
+	int k;
+
+	size = BITS_TO_LONGS(dmc->size >> dmc->consecutive_shift) *
+	       sizeof(unsigned long);
+	for (k = 0; k < 2; k++) {
+		dmc->jrnl_sets[k] = vzalloc(size);
+		if (!dmc->jrnl_sets[k])
+			goto nomem;
+	}
+	dmc->jrnl_cur = 0;
+
+	dmc->jrnl_mdpages = kmalloc(sizeof(struct page *) * dmc->mdpage_count,
+				    GFP_KERNEL);
+	if (!dmc->jrnl_mdpages)
+		goto nomem;
+	if (eio_alloc_wb_pages(dmc->jrnl_mdpages, dmc->mdpage_count)) {
+		kfree(dmc->jrnl_mdpages);
+		dmc->jrnl_mdpages = NULL;
+		goto nomem;
+	}
+
+	/*
+	 * The checkpoint waits on set rw_locks that the I/O completions on
+	 * callback_q and mdupdate_q release: it can't share their rescuer.
+	 */
+	dmc->jrnl_ckpt_q = alloc_workqueue("eio_jrnl_ckpt", WQ_MEM_RECLAIM, 1);
+	if (!dmc->jrnl_ckpt_q)
+		goto nomem;
+	return 0;
+
+nomem:
+	eio_jrnl_free(dmc);
+	return -ENOMEM;
+}
+
+static void eio_clean_sort_free(struct eio_clean_sort *cs, int mdpage_count,
+				unsigned block_size)
+{
+	if (cs->dbvecs) {
+		eio_free_wb_bvecs(cs->dbvecs, cs->dbvec_count, block_size);
+		kfree(cs->dbvecs);
+	}
+	if (cs->mdpages) {
+		eio_free_wb_pages(cs->mdpages,
+				  EIO_CLEAN_SORT_SETS * mdpage_count);
+		kfree(cs->mdpages);
+	}
+	kfree(cs->mdbvecs);
+	vfree(cs->ents);
+	vfree(cs->wbvecs);
+	kfree(cs);
+}
+
+/*
+ * Buffers of the sorted clean. They stay until the write-back resources
+ * are freed, the clean thread may be using them.
+ */
+int eio_clean_sort_alloc(struct cache_c *dmc)
+{
+	struct eio_clean_sort *cs;
+	unsigned iosize;
+	int nr_pages;
+
+	if (dmc->clean_sort)
+		return 0;
+
+	cs = kzalloc(sizeof(*cs), GFP_KERNEL);
+	if (cs == NULL)
+		return -ENOMEM;
+
+	iosize = (dmc->block_size * dmc->assoc) << SECTOR_SHIFT;
+	cs->dbvec_count = EIO_CLEAN_SORT_SETS *
+			  IO_BVEC_COUNT(iosize, dmc->block_size);
+	cs->dbvecs = kmalloc(sizeof(struct bio_vec) * cs->dbvec_count,
+			     GFP_KERNEL);
+	if (cs->dbvecs == NULL)
+		goto nomem;
+	if (eio_alloc_wb_bvecs(cs->dbvecs, cs->dbvec_count, dmc->block_size)) {
+		kfree(cs->dbvecs);
+		cs->dbvecs = NULL;
+		goto nomem;
+	}
+	cs->wbvecs = vmalloc(sizeof(struct bio_vec) * cs->dbvec_count);
+	cs->ents = vmalloc(sizeof(struct eio_clean_ent) *
+			   EIO_CLEAN_SORT_SETS * dmc->assoc);
+	nr_pages = EIO_CLEAN_SORT_SETS * dmc->mdpage_count;
+	cs->mdbvecs = kmalloc(sizeof(struct bio_vec) * nr_pages, GFP_KERNEL);
+	if (!cs->wbvecs || !cs->ents || !cs->mdbvecs)
+		goto nomem;
+	cs->mdpages = kmalloc(sizeof(struct page *) * nr_pages, GFP_KERNEL);
+	if (cs->mdpages == NULL)
+		goto nomem;
+	if (eio_alloc_wb_pages(cs->mdpages, nr_pages)) {
+		kfree(cs->mdpages);
+		cs->mdpages = NULL;
+		goto nomem;
+	}
+
+	/* Two sysctl writers may race here */
+	if (cmpxchg(&dmc->clean_sort, NULL, cs) != NULL)
+		eio_clean_sort_free(cs, dmc->mdpage_count, dmc->block_size);
+	return 0;
+
+nomem:
+	eio_clean_sort_free(cs, dmc->mdpage_count, dmc->block_size);
+	return -ENOMEM;
+}
+
 int eio_allocate_wb_resources(struct cache_c *dmc)
 {
 	int nr_bvecs, nr_pages;
@@ -2306,7 +2975,20 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 		ret = eio_clean_thread_init(dmc);
 	}
 	EIO_ASSERT(dmc->mdupdate_q == NULL);
-	dmc->mdupdate_q = create_singlethread_workqueue("eio_mdupdate");
+	spin_lock_init(&dmc->md_batch_lock);
+	INIT_LIST_HEAD(&dmc->md_batch);
+	dmc->md_batch_len = 0;
+	INIT_DELAYED_WORK(&dmc->md_batch_work, eio_md_batch_work);
+	INIT_WORK(&dmc->jrnl_ckpt_work, eio_jrnl_checkpoint);
+	if (ret == 0 && dmc->jrnl_start)
+		ret = eio_jrnl_alloc(dmc);
+	/* Without its buffers, the sets are cleaned one at a time */
+	if (ret == 0 && dmc->sysctl_active.clean_sort &&
+	    eio_clean_sort_alloc(dmc))
+		pr_err("cache_create: No memory for the sorted clean of " \
+		       "cache \"%s\".\n", dmc->cache_name);
+	/* md updates of different sets may complete concurrently */
+	dmc->mdupdate_q = alloc_workqueue("eio_mdupdate", WQ_MEM_RECLAIM, 0);
 	if (!dmc->mdupdate_q)
 		ret = -ENOMEM;
 
@@ -2317,6 +2999,7 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 			lru_uninit(dmc->dirty_set_lru);
 			dmc->dirty_set_lru = NULL;
 		}
+		eio_jrnl_free(dmc);
 
 		eio_free_wb_pages(dmc->clean_mdpages, dmc->mdpage_count);
 		eio_free_wb_bvecs(dmc->clean_dbvecs, dmc->dbvec_count,
@@ -2346,14 +3029,28 @@ void eio_free_wb_resources(struct cache_c *dmc)
 {
 
 	if (dmc->mdupdate_q) {
+		/* Commit what still waits in the group commit window */
+		flush_delayed_work(&dmc->md_batch_work);
 		flush_workqueue(dmc->mdupdate_q);
+		flush_delayed_work(&dmc->md_batch_work);
 		destroy_workqueue(dmc->mdupdate_q);
 		dmc->mdupdate_q = NULL;
 	}
+	if (dmc->jrnl_sets[0]) {
+		/* Leave no live records behind, e.g. on a switch to WT */
+		queue_work(dmc->jrnl_ckpt_q, &dmc->jrnl_ckpt_work);
+		flush_work(&dmc->jrnl_ckpt_work);
+		eio_jrnl_free(dmc);
+	}
 	if (dmc->dirty_set_lru) {
 		lru_uninit(dmc->dirty_set_lru);
 		dmc->dirty_set_lru = NULL;
 	}
+	if (dmc->clean_sort) {
+		eio_clean_sort_free(dmc->clean_sort, dmc->mdpage_count,
+				    dmc->block_size);
+		dmc->clean_sort = NULL;
+	}
 	if (dmc->clean_mdpages) {
 		eio_free_wb_pages(dmc->clean_mdpages, dmc->mdpage_count);
 		kfree(dmc->clean_mdpages);
@@ -2537,14 +3234,20 @@ static int __init eio_init(void)
 	int r;
 	extern struct bus_type scsi_bus_type;
 
-	eio_ttc_init();
-	r = eio_create_misc_device();
+	eio_set_scan_init();
+	r = eio_ttc_init();
 	if (r)
 		return r;
+	r = eio_create_misc_device();
+	if (r) {
+		eio_ttc_exit();
+		return r;
+	}
 
 	r = eio_jobs_init();
 	if (r) {
 		eio_delete_misc_device();
+		eio_ttc_exit();
 		return r;
 	}
 	atomic_set(&nr_cache_jobs, 0);
@@ -2556,6 +3259,7 @@ static int __init eio_init(void)
 	if (eio_control == NULL) {
 		pr_err("init: Cannot allocate memory for eio_control");
 		eio_delete_misc_device();
+		eio_ttc_exit();
 		return -ENOMEM;
 	}
 	eio_control->synch_flags = 0;
@@ -2565,6 +3269,7 @@ static int __init eio_init(void)
 	if (r) {
 		pr_err("init: bus register notifier failed %d", r);
 		eio_delete_misc_device();
+		eio_ttc_exit();
 	}
 	return r;
 }
@@ -2590,6 +3295,7 @@ static void eio_exit(void)
 		eio_control = NULL;
 	}
 	eio_delete_misc_device();
+	eio_ttc_exit();
 }
 
 /*
@@ -113,7 +113,8 @@ eio_fifo_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 	while (slots_searched < (int)dmc->assoc) {
 		EIO_ASSERT(i >= start_index);
 		EIO_ASSERT(i < end_index);
-		if (EIO_CACHE_STATE_GET(dmc, i) == VALID) {
+		if (EIO_CACHE_STATE_GET(dmc, i) == VALID &&
+		    !eio_blk_pinned(dmc, i)) {
 			*index = i;
 			break;
 		}
@@ -192,6 +193,7 @@ struct eio_policy *eio_fifo_instance_init(void)
 	new_instance->sp_repl_blk_init = eio_fifo_cache_blk_init;
 	new_instance->sp_find_reclaim_dbn = eio_fifo_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_fifo_clean_set;
+	new_instance->sp_blk_access = NULL;
 	new_instance->sp_dmc = NULL;
 
 	try_module_get(THIS_MODULE);
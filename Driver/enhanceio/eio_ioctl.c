@@ -36,6 +36,7 @@ long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
 	struct cache_rec_short *cache;
 	uint64_t ncaches;
 	enum dev_notifier note;
+	struct eio_pin_rec pin;
 	int do_delete = 0;
 
 	switch (cmd) {
@@ -141,6 +142,17 @@ long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
 	case EIO_IOC_SRC_ADD:
 		break;
 
+	case EIO_IOC_PIN:
+	case EIO_IOC_UNPIN:
+		if (copy_from_user(&pin, (void __user *)arg,
+				   sizeof(struct eio_pin_rec)))
+			return -EFAULT;
+		pin.pr_name[CACHE_NAME_LEN] = '\0';
+		error = eio_cache_pin(pin.pr_name, (sector_t)pin.pr_start,
+				      (sector_t)pin.pr_len,
+				      cmd == EIO_IOC_PIN);
+		break;
+
 	case EIO_IOC_NOTIFY_REBOOT:
 		eio_reboot_handling();
 		break;
@@ -53,6 +53,8 @@
 #define EIO_IOC_NOTIFY_REBOOT _IO('E', 11)
 #define EIO_IOC_SET_WARM_BOOT _IO('E', 12)
 #define EIO_IOC_UNUSED _IO('E', 13)
+#define EIO_IOC_PIN _IOW('E', 14, struct eio_pin_rec)
+#define EIO_IOC_UNPIN _IOW('E', 15, struct eio_pin_rec)
 
 
 struct cache_rec_short {
@@ -73,6 +75,13 @@ struct cache_rec_short {
 	uint64_t cr_assoc;
 };
 
+/* A range of source sectors to pin in, or unpin from, a cache */
+struct eio_pin_rec {
+	char pr_name[CACHE_NAME_SZ];
+	uint64_t pr_start;      /* first sector */
+	uint64_t pr_len;        /* in sectors */
+};
+
 struct cache_list {
 	uint64_t ncaches;
 	struct cache_rec_short *cachelist;
@@ -144,6 +144,7 @@ struct eio_policy *eio_lru_instance_init(void)
 	new_instance->sp_repl_blk_init = eio_lru_cache_blk_init;
 	new_instance->sp_find_reclaim_dbn = eio_lru_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_lru_clean_set;
+	new_instance->sp_blk_access = NULL;
 	new_instance->sp_dmc = NULL;
 
 	try_module_get(THIS_MODULE);
@@ -162,7 +163,8 @@ void eio_lru_exit(void)
 }
 
 /*
- * Find a victim block to evict and return it in index.
+ * Find a victim block to evict and return it in index. It is moved to
+ * the tail by the fill that claims it, see eio_policy_fill().
  */
 void
 eio_lru_find_reclaim_dbn(struct eio_policy *p_ops,
@@ -182,13 +184,13 @@ eio_lru_find_reclaim_dbn(struct eio_policy *p_ops,
 		lru_blk =
 			((struct eio_lru_cache_block *)dmc->sp_cache_blk +
 			 lru_rel_index + start_index);
-		if (EIO_CACHE_STATE_GET(dmc, (lru_rel_index + start_index)) ==
-		    VALID) {
+		if ((EIO_CACHE_STATE_GET(dmc, (lru_rel_index + start_index)) ==
+		     VALID) &&
+		    !eio_blk_pinned(dmc, lru_rel_index + start_index)) {
 			EIO_ASSERT((lru_blk - (struct eio_lru_cache_block *)
 				    dmc->sp_cache_blk) ==
 				   (lru_rel_index + start_index));
 			*index = lru_rel_index + start_index;
-			eio_reclaim_lru_movetail(dmc, *index, p_ops);
 			break;
 		}
 		lru_rel_index = lru_blk->lru_next;
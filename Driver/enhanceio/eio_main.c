@@ -37,6 +37,9 @@
 #include "eio.h"
 #include "eio_ttc.h"
 
+#define CREATE_TRACE_POINTS
+#include "eio_trace.h"
+
 #define CTRACE(X) { }
 
 /*
@@ -65,6 +68,10 @@ static int eio_release_io_resources(struct cache_c *dmc,
 				    struct bio_container *bc);
 static void eio_clean_set(struct cache_c *dmc, index_t set, int whole,
 			  int force);
+static void eio_clean_sets_sorted(struct cache_c *dmc, index_t *sets,
+				  int nr_sets, int force);
+static int eio_set_md_store(struct cache_c *dmc, index_t set,
+			    struct page **mdpages);
 static void eio_do_mdupdate(struct work_struct *work);
 static void eio_mdupdate_callback(int error, void *context);
 static void eio_enq_mdupdate(struct bio_container *bc);
@@ -75,6 +82,7 @@ static void eio_check_dirty_set_thresholds(struct cache_c *dmc, index_t set);
 static void eio_check_dirty_cache_thresholds(struct cache_c *dmc);
 static void eio_post_mdupdate(struct work_struct *work);
 static void eio_post_io_callback(struct work_struct *work);
+static void eio_jrnl_undo(struct work_struct *work);
 
 static void bc_addfb(struct bio_container *bc, struct eio_bio *ebio)
 {
@@ -84,6 +92,176 @@ static void bc_addfb(struct bio_container *bc, struct eio_bio *ebio)
 	ebio->eb_bc = bc;
 }
 
+/*
+ * Allocates private pages for "size" bytes of data, described by the
+ * returned bvecs. Used where the data for an ebio can't go straight to
+ * or from the application pages.
+ */
+static struct bio_vec *eio_alloc_bounce(unsigned size, gfp_t gfp,
+					int *nr_bvecs)
+{
+	struct bio_vec *bvecs;
+	int nr_pages, i;
+
+	nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	bvecs = kcalloc(nr_pages, sizeof(struct bio_vec), gfp);
+	if (!bvecs)
+		return NULL;
+	for (i = 0; i < nr_pages; i++) {
+		bvecs[i].bv_page = alloc_page(gfp);
+		if (!bvecs[i].bv_page) {
+			while (i--)
+				__free_page(bvecs[i].bv_page);
+			kfree(bvecs);
+			return NULL;
+		}
+		bvecs[i].bv_len = min_t(unsigned, size, PAGE_SIZE);
+		bvecs[i].bv_offset = 0;
+		size -= bvecs[i].bv_len;
+	}
+	*nr_bvecs = nr_pages;
+	return bvecs;
+}
+
+static void eio_free_bounce(struct bio_vec *bvecs, int nr_bvecs)
+{
+	int i;
+
+	for (i = 0; i < nr_bvecs; i++)
+		__free_page(bvecs[i].bv_page);
+	kfree(bvecs);
+}
+
+/*
+ * Copies "len" bytes from "soff" bytes into the data of bvecs "src" to
+ * "doff" bytes into the data of bvecs "dst".
+ */
+static void eio_copy_bvecs(struct bio_vec *dst, unsigned doff,
+			   struct bio_vec *src, unsigned soff, unsigned len)
+{
+	char *saddr, *daddr;
+	unsigned chunk;
+
+	while (soff >= src->bv_len) {
+		soff -= src->bv_len;
+		src++;
+	}
+	while (doff >= dst->bv_len) {
+		doff -= dst->bv_len;
+		dst++;
+	}
+
+	while (len) {
+		chunk = min(src->bv_len - soff, dst->bv_len - doff);
+		chunk = min(chunk, len);
+		saddr = kmap(src->bv_page);
+		daddr = kmap(dst->bv_page);
+		memcpy(daddr + dst->bv_offset + doff,
+		       saddr + src->bv_offset + soff, chunk);
+		kunmap(dst->bv_page);
+		kunmap(src->bv_page);
+		flush_dcache_page(dst->bv_page);
+
+		len -= chunk;
+		soff += chunk;
+		doff += chunk;
+		if (soff == src->bv_len) {
+			src++;
+			soff = 0;
+		}
+		if (doff == dst->bv_len) {
+			dst++;
+			doff = 0;
+		}
+	}
+}
+
+/* Sub-blocks of its cache block wholly covered by the ebio */
+static u_int16_t eio_sb_covered(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	unsigned off = ebio->eb_sector - EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	unsigned end = off + eio_to_sector(ebio->eb_size);
+	unsigned first, last;
+
+	first = (off + (1 << dmc->sb_shift) - 1) >> dmc->sb_shift;
+	last = end >> dmc->sb_shift;
+	if (last <= first)
+		return 0;
+	return (u_int16_t)((1U << last) - (1U << first));
+}
+
+/* Sub-blocks of its cache block the ebio reads or writes any part of */
+static u_int16_t eio_sb_touched(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	unsigned off = ebio->eb_sector - EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	unsigned end = off + eio_to_sector(ebio->eb_size);
+	unsigned first, last;
+
+	first = off >> dmc->sb_shift;
+	last = (end + (1 << dmc->sb_shift) - 1) >> dmc->sb_shift;
+	return (u_int16_t)((1U << last) - (1U << first));
+}
+
+/* Releases the whole block buffer of a read-around bio */
+static void eio_free_rabvecs(struct bio_container *bc)
+{
+	if (!bc->bc_rabvecs)
+		return;
+	eio_free_bounce(bc->bc_rabvecs, bc->bc_rabvec_count);
+	bc->bc_rabvecs = NULL;
+	bc->bc_rabvec_count = 0;
+}
+
+/* Accounts the latency of a finished bio to the histogram of its path */
+static void eio_lat_account(struct cache_c *dmc, struct bio_container *bc)
+{
+	enum eio_lat_op op;
+	u64 ns;
+	int b;
+
+	switch (bc->bc_dir) {
+	case CACHED_READ:
+		op = EIO_LAT_CACHED_READ;
+		break;
+	case UNCACHED_READ:
+		op = EIO_LAT_UNCACHED_READ;
+		break;
+	case UNCACHED_READ_AND_READFILL:
+		op = EIO_LAT_READFILL;
+		break;
+	case CACHED_WRITE:
+		op = bc->bc_mdupdate ? EIO_LAT_DIRTY_WRITE :
+		     EIO_LAT_CACHED_WRITE;
+		break;
+	case UNCACHED_WRITE:
+		op = EIO_LAT_UNCACHED_WRITE;
+		break;
+	case MIXED_WRITE:
+		op = EIO_LAT_MIXED_WRITE;
+		break;
+	default:
+		/* bios that never reached eio_read or eio_write */
+		return;
+	}
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), bc->bc_start));
+	b = min(fls64(ns), EIO_LAT_BUCKETS - 1);
+	EIO_STATS_INC(dmc->lat_hist->buckets[op][b]);
+}
+
+static void eio_free_arena(struct bio_container *bc)
+{
+	struct eio_bio_arena *arena = bc->bc_arena;
+
+	if (!arena)
+		return;
+	if (arena->pooled)
+		mempool_free(arena, _arena_pool);
+	else
+		kfree(arena);
+	bc->bc_arena = NULL;
+}
+
 static void bc_put(struct bio_container *bc)
 {
 	struct cache_c *dmc;
@@ -103,31 +281,61 @@ static void bc_put(struct bio_container *bc)
 		elapsed = (long)jiffies_to_msecs(jiffies - bc->bc_iotime);
 
 		if (data_dir == READ)
-			atomic64_add(elapsed, &dmc->eio_stats.rdtime_ms);
+			EIO_STATS_ADD(dmc->eio_stats->rdtime_ms, elapsed);
 		else
-			atomic64_add(elapsed, &dmc->eio_stats.wrtime_ms);
-
+			EIO_STATS_ADD(dmc->eio_stats->wrtime_ms, elapsed);
+		eio_lat_account(dmc, bc);
+		trace_eio_bio_complete(dmc, bc->bc_bio, bc->bc_dir,
+				       bc->bc_error);
+
+		if (CACHE_STACKED_IS_SET(dmc))
+			EIO_END_IO_ACCT(dmc->stacked_disk->queue, bc->bc_bio,
+					&dmc->stacked_disk->part0,
+					bc->bc_iotime);
 		EIO_BIO_ENDIO(bc->bc_bio, bc->bc_error);
-		atomic64_dec(&bc->bc_dmc->nr_ios);
+		percpu_counter_dec(&bc->bc_dmc->nr_ios);
 		spin_unlock_irqrestore(&bc->bc_lock, flags);
-		kfree(bc);
+		eio_free_rabvecs(bc);
+		eio_free_arena(bc);
+		mempool_free(bc, _bc_pool);
+	}
+}
+
+static void eb_free(struct eio_bio *ebio)
+{
+
+	EIO_ASSERT(!ebio->eb_job_busy);
+
+	if (ebio->eb_mergebv)
+		eio_free_bounce(ebio->eb_mergebv, ebio->eb_nmergebv);
+
+	switch (ebio->eb_alloc) {
+	case EB_ALLOC_POOL:
+		mempool_free(ebio, _ebio_pool);
+		break;
+	case EB_ALLOC_KMALLOC:
+		kfree(ebio);
+		break;
+	default:
+		/* Arena ebios go away with their bc */
+		break;
 	}
 }
 
 static void eb_endio(struct eio_bio *ebio, int error)
 {
+	struct bio_container *bc = ebio->eb_bc;
 
-	EIO_ASSERT(ebio->eb_bc);
+	EIO_ASSERT(bc);
 
 	/*Propagate only main io errors and sizes*/
-	if (ebio->eb_iotype == EB_MAIN_IO) {
-		if (error)
-			ebio->eb_bc->bc_error = error;
-		bc_put(ebio->eb_bc);
-	} else
-		bc_put(ebio->eb_bc);
+	if (ebio->eb_iotype == EB_MAIN_IO && error)
+		bc->bc_error = error;
 	ebio->eb_bc = NULL;
-	kfree(ebio);
+
+	/* Free the ebio first, an arena ebio is released by the bc_put() */
+	eb_free(ebio);
+	bc_put(bc);
 }
 
 static int
@@ -207,8 +415,7 @@ static inline void eio_flag_abio(struct cache_c *dmc, struct eio_bio *abio,
 			else {
 				EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 				                    INVALID);
-				atomic64_dec_if_positive(&dmc->eio_stats.
-				                         cached_blocks);
+				atomic64_dec_if_positive(&dmc->cached_blocks);
 			}
 		} else {
 			if (cwip_on)
@@ -219,9 +426,7 @@ static inline void eio_flag_abio(struct cache_c *dmc, struct eio_bio *abio,
 					QUEUED) {
 					EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 					                    INVALID);
-					atomic64_dec_if_positive(&dmc->
-					                         eio_stats.
-					                         cached_blocks);
+					atomic64_dec_if_positive(&dmc->cached_blocks);
 				} else {
 					EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 					                    VALID);
@@ -273,20 +478,23 @@ static void eio_disk_io_callback(int error, void *context)
 	spin_lock_irqsave(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
 	/* Invalidate the cache block */
 	EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-	atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+	atomic64_dec_if_positive(&dmc->cached_blocks);
 	spin_unlock_irqrestore(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
 
-	if (unlikely(error))
+	if (unlikely(error)) {
 		pr_err("disk_io_callback: io error %d block %llu action %d",
 		       error,
 		       (unsigned long long)job->job_io_regions.disk.sector,
 		       job->action);
+		trace_eio_io_error(dmc, job->action, eb_cacheset,
+				   job->job_io_regions.disk.sector, error);
+	}
 
-	eb_endio(ebio, error);
-	ebio = NULL;
 	job->ebio = NULL;
 	eio_free_cache_job(job);
 	job = NULL;
+	eb_endio(ebio, error);
+	ebio = NULL;
 }
 
 /* part of eio_uncached_read_done */
@@ -304,7 +512,7 @@ static inline void eio_uncached_read_done_bio(struct cache_c *dmc,
 
 	if (unlikely(EIO_CACHE_STATE_GET(dmc, iebio->eb_index) & QUEUED)) {
 		EIO_CACHE_STATE_SET(dmc, iebio->eb_index, INVALID);
-		atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
 	} else if (EIO_CACHE_STATE_GET(dmc, iebio->eb_index) &
 		CACHEREADINPROG) {
 		/*turn off the cache read in prog flag*/
@@ -319,6 +527,54 @@ static inline void eio_uncached_read_done_bio(struct cache_c *dmc,
 	eb_endio(iebio, 0);
 }
 
+/*
+ * Read-around: the HDD read brought the whole block into bc_rabvecs.
+ * Copy the part the application asked for into its pages, then point
+ * the ebio at the whole block so that READFILL writes all of it.
+ */
+static void eio_readaround_done(struct cache_c *dmc, struct eio_bio *iebio)
+{
+	struct bio_container *bc = iebio->eb_bc;
+
+	EIO_ASSERT(iebio->eb_next == NULL);
+
+	eio_copy_bvecs(iebio->eb_bv, 0, bc->bc_rabvecs,
+		       to_bytes(iebio->eb_sector -
+				EIO_ROUND_SECTOR(dmc, iebio->eb_sector)),
+		       iebio->eb_size);
+
+	iebio->eb_sector = EIO_ROUND_SECTOR(dmc, iebio->eb_sector);
+	iebio->eb_size = to_bytes(dmc->block_size);
+	iebio->eb_bv = bc->bc_rabvecs;
+	iebio->eb_nbvec = bc->bc_rabvec_count;
+}
+
+/*
+ * A dirty block with holes was read from SSD into eb_mergebv, over data
+ * read from HDD. Copy in the sub-blocks that are valid in the cache.
+ */
+static void eio_sb_merge(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	sector_t bstart = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	sector_t eend = ebio->eb_sector + eio_to_sector(ebio->eb_size);
+	sector_t start, end;
+	unsigned off;
+	int i;
+
+	for (i = 0; i < EIO_SUBBLOCKS_MAX; i++) {
+		if (!(ebio->eb_mergemask & (1 << i)))
+			continue;
+		start = max_t(sector_t, bstart + (i << dmc->sb_shift),
+			      ebio->eb_sector);
+		end = min_t(sector_t, bstart + ((i + 1) << dmc->sb_shift), eend);
+		if (start >= end)
+			continue;
+		off = to_bytes(start - ebio->eb_sector);
+		eio_copy_bvecs(ebio->eb_bv, off, ebio->eb_mergebv, off,
+			       to_bytes(end - start));
+	}
+}
+
 static void eio_uncached_read_done(struct kcached_job *job)
 {
 	struct eio_bio *ebio = job->ebio;
@@ -334,26 +590,57 @@ static void eio_uncached_read_done(struct kcached_job *job)
 			eio_uncached_read_done_bio(dmc, iebio);
 			iebio = nebio;
 		}
-		eb_endio(ebio, 0);
 		eio_free_cache_job(job);
+		eb_endio(ebio, 0);
 	} else if (ebio->eb_bc->bc_dir == UNCACHED_READ_AND_READFILL) {
+		if (ebio->eb_bc->bc_rabvecs)
+			eio_readaround_done(dmc, ebio->eb_next);
 		/*
 		 * Kick off the READFILL. It will also do a read
 		 * from SSD, in case of ALREADY_DIRTY block
 		 */
 		job->action = READFILL;
+		trace_eio_readfill_enqueue(dmc, ebio->eb_sector, job->index, 0);
 		eio_enqueue_readfill(dmc, job);
 	} else
 		/* Should never reach here for uncached read */
 		EIO_ASSERT(0);
 }
 
+/*
+ * A successful cache read, or a cache write with no metadata update to
+ * follow, only needs the block state updated under the set lock and its
+ * ebio ended. That is done right away in the end_io context, the rest
+ * goes through callback_q.
+ */
+static int eio_job_done_inline(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+
+	if (job->error)
+		return 0;
+
+	switch (job->action) {
+	case READCACHE:
+		return job->ebio->eb_mergebv == NULL;
+	case WRITECACHE:
+		return EIO_CACHE_STATE_GET(dmc, job->index) != DIRTY_INPROG;
+	default:
+		return 0;
+	}
+}
+
 static void eio_io_callback(int error, void *context)
 {
 	struct kcached_job *job = (struct kcached_job *)context;
 	struct cache_c *dmc = job->dmc;
 
 	job->error = error;
+	if (eio_job_done_inline(job)) {
+		EIO_STATS_INC(dmc->eio_stats->inline_completions);
+		eio_post_io_callback(&job->work);
+		return;
+	}
 	INIT_WORK(&job->work, eio_post_io_callback);
 	queue_work(dmc->callback_q, &job->work);
 	return;
@@ -383,16 +670,19 @@ static void eio_post_io_callback(struct work_struct *work)
 	EIO_ASSERT(ebio->eb_bc);
 
 	eb_cacheset = ebio->eb_cacheset;
-	if (error)
+	if (error) {
 		pr_err("io_callback: io error %d block %llu action %d",
 		       error,
 		       (unsigned long long)job->job_io_regions.disk.sector,
 		       job->action);
+		trace_eio_io_error(dmc, job->action, eb_cacheset,
+				   job->job_io_regions.disk.sector, error);
+	}
 
 	switch (job->action) {
 	case WRITEDISK:
 
-		atomic64_inc(&dmc->eio_stats.writedisk);
+		EIO_STATS_INC(dmc->eio_stats->writedisk);
 		if (unlikely(error))
 			dmc->eio_errors.disk_write_errors++;
 		if (unlikely(error) || (ebio->eb_iotype & EB_INVAL))
@@ -400,9 +690,9 @@ static void eio_post_io_callback(struct work_struct *work)
 		if (ebio->eb_next)
 			eio_flag_abios(dmc, ebio->eb_next,
 				       error || (ebio->eb_iotype & EB_INVAL));
-		eb_endio(ebio, error);
 		job->ebio = NULL;
 		eio_free_cache_job(job);
+		eb_endio(ebio, error);
 		return;
 
 	case READDISK:
@@ -417,15 +707,15 @@ static void eio_post_io_callback(struct work_struct *work)
 			eio_uncached_read_done(job);
 			return;
 		}
-		eb_endio(ebio, error);
 		job->ebio = NULL;
 		eio_free_cache_job(job);
+		eb_endio(ebio, error);
 		return;
 
 	case READCACHE:
 
-		/*atomic64_inc(&dmc->eio_stats.readcache);*/
-		/*SECTOR_STATS(dmc->eio_stats.ssd_reads, ebio->eb_size);*/
+		/*EIO_STATS_INC(dmc->eio_stats->readcache);*/
+		/*SECTOR_STATS(dmc->eio_stats->ssd_reads, ebio->eb_size);*/
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) ==
 			   EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
@@ -451,14 +741,17 @@ static void eio_post_io_callback(struct work_struct *work)
 				return;
 			}
 		}
+		if (!error && ebio->eb_mergebv)
+			eio_sb_merge(dmc, ebio);
 		callendio = 1;
 		break;
 
 	case READFILL:
 
-		/*atomic64_inc(&dmc->eio_stats.readfill);*/
-		/*SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);*/
+		/*EIO_STATS_INC(dmc->eio_stats->readfill);*/
+		/*SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);*/
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) == ebio->eb_sector);
+		trace_eio_readfill_done(dmc, ebio->eb_sector, index, error);
 		if (unlikely(error))
 			dmc->eio_errors.ssd_write_errors++;
 		if (!(EIO_CACHE_STATE_GET(dmc, index) & CACHEWRITEINPROG)) {
@@ -472,8 +765,8 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case WRITECACHE:
 
-		/*SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);*/
-		/*atomic64_inc(&dmc->eio_stats.writecache);*/
+		/*SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);*/
+		/*EIO_STATS_INC(dmc->eio_stats->writecache);*/
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) ==
 			   EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
@@ -532,7 +825,7 @@ static void eio_post_io_callback(struct work_struct *work)
 		/* Error or QUEUED is set: mark block as INVALID for non-DIRTY blocks */
 		if (cstate != ALREADY_DIRTY) {
 			EIO_CACHE_STATE_SET(dmc, index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 		}
 	} else if (cstate & VALID) {
 		EIO_CACHE_STATE_OFF(dmc, index, BLOCK_IO_INPROG);
@@ -554,14 +847,148 @@ static void eio_post_io_callback(struct work_struct *work)
 			EIO_CACHE_STATE_OFF(dmc, index, VALID);
 	}
 
+	/*
+	 * Free the job before dropping the lock; it may be embedded in
+	 * the ebio, which the other holder can end once we unlock.
+	 */
+	eio_free_cache_job(job);
+	job = NULL;
+
 	spin_unlock_irqrestore(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
 
 	if (callendio)
 		eb_endio(ebio, error);
+}
 
-	eio_free_cache_job(job);
-	job = NULL;
+/*
+ * Jobs whose SSD regions follow each other are sent as one I/O, a run.
+ * Each job is still completed by eio_post_io_callback() for its own
+ * block, all of them from the single completion of the run.
+ */
+struct eio_job_run {
+	struct work_struct work;
+	struct cache_c *dmc;
+	int error;
+	int nr_jobs;
+	struct kcached_job **jobs;
+	struct bio_vec *bvecs;          /* bvecs of all the jobs, in order */
+};
+
+/* Undoes a job whose I/O could not be issued, and ends its ebio */
+typedef void (*eio_job_fail_fn)(struct cache_c *dmc, struct eio_bio *ebio,
+				struct kcached_job *job, int error);
+
+static void eio_post_run_callback(struct work_struct *work)
+{
+	struct eio_job_run *run = container_of(work, struct eio_job_run, work);
+	int i;
+
+	for (i = 0; i < run->nr_jobs; i++) {
+		run->jobs[i]->error = run->error;
+		eio_post_io_callback(&run->jobs[i]->work);
+	}
+	kfree(run);
+}
+
+static void eio_run_callback(int error, void *context)
+{
+	struct eio_job_run *run = (struct eio_job_run *)context;
+	int i;
+
+	run->error = error;
+	for (i = 0; i < run->nr_jobs; i++) {
+		run->jobs[i]->error = error;
+		if (!eio_job_done_inline(run->jobs[i]))
+			break;
+	}
+	if (i == run->nr_jobs) {
+		EIO_STATS_ADD(run->dmc->eio_stats->inline_completions,
+			      run->nr_jobs);
+		eio_post_run_callback(&run->work);
+		return;
+	}
+	INIT_WORK(&run->work, eio_post_run_callback);
+	queue_work(run->dmc->callback_q, &run->work);
+}
+
+/*
+ * Issues the SSD I/O of the jobs linked through job->next, all doing
+ * "op" on their ebio data. Runs of jobs contiguous on the SSD, up to what
+ * fits in one bio, go as a single I/O. A job whose I/O can't be issued
+ * is passed to "fail".
+ */
+static void eio_issue_jobs(struct cache_c *dmc, struct kcached_job *jobs,
+			   unsigned op, unsigned op_flags, eio_job_fail_fn fail)
+{
+	struct kcached_job *job, *last, *next;
+	struct eio_job_run *run;
+	struct eio_io_region where;
+	struct bio_vec *bv;
+	unsigned nr_bvecs;
+	int nr_jobs, i, err;
+
+	for (job = jobs; job != NULL; job = next) {
+		where = job->job_io_regions.cache;
+		nr_bvecs = job->ebio->eb_nbvec;
+		nr_jobs = 1;
+		for (last = job; last->next != NULL; last = next) {
+			next = last->next;
+			if (next->job_io_regions.cache.sector !=
+			    where.sector + where.count ||
+			    nr_bvecs + next->ebio->eb_nbvec > dmc->bio_nr_pages)
+				break;
+			where.count += next->job_io_regions.cache.count;
+			nr_bvecs += next->ebio->eb_nbvec;
+			nr_jobs++;
+		}
+		next = last->next;
+
+		run = NULL;
+		if (nr_jobs > 1)
+			run = kmalloc(sizeof(*run) +
+				      nr_jobs * sizeof(struct kcached_job *) +
+				      nr_bvecs * sizeof(struct bio_vec),
+				      GFP_NOIO);
+		if (run == NULL) {
+			/* Single job, or no memory for the run: one I/O each */
+			while (job != next) {
+				last = job->next;
+				err = eio_io_async_bvec(dmc,
+							&job->job_io_regions.cache,
+							op, op_flags,
+							job->ebio->eb_bv,
+							job->ebio->eb_nbvec,
+							eio_io_callback, job, 0);
+				if (err)
+					fail(dmc, job->ebio, job, err);
+				job = last;
+			}
+			continue;
+		}
+
+		run->dmc = dmc;
+		run->error = 0;
+		run->nr_jobs = nr_jobs;
+		run->jobs = (struct kcached_job **)(run + 1);
+		run->bvecs = (struct bio_vec *)(run->jobs + nr_jobs);
+		bv = run->bvecs;
+		for (i = 0; i < nr_jobs; i++, job = job->next) {
+			run->jobs[i] = job;
+			memcpy(bv, job->ebio->eb_bv,
+			       job->ebio->eb_nbvec * sizeof(struct bio_vec));
+			bv += job->ebio->eb_nbvec;
+		}
 
+		err = eio_io_async_bvec(dmc, &where, op, op_flags, run->bvecs,
+					nr_bvecs, eio_run_callback, run, 0);
+		if (err) {
+			for (i = 0; i < nr_jobs; i++)
+				fail(dmc, run->jobs[i]->ebio, run->jobs[i], err);
+			kfree(run);
+		} else
+			EIO_STATS_ADD(dmc->eio_stats->ssd_coalesced_ios,
+				      nr_jobs - 1);
+	}
 }
 
 /*
@@ -598,8 +1025,8 @@ void eio_ssderror_diskread(struct kcached_job *job)
 
 	EIO_ASSERT(ebio->eb_dir == READ);
 
-	atomic64_inc(&dmc->eio_stats.readdisk);
-	SECTOR_STATS(dmc->eio_stats.disk_reads, ebio->eb_size);
+	EIO_STATS_INC(dmc->eio_stats->readdisk);
+	SECTOR_STATS(dmc->eio_stats->disk_reads, ebio->eb_size);
 	job->action = READDISK;
 
 	error = eio_io_async_bvec(dmc, &job->job_io_regions.disk, REQ_OP_READ, 0,
@@ -625,12 +1052,12 @@ out:
 	spin_unlock_irqrestore(&dmc->cache_sets[index / dmc->assoc].cs_lock,
 			       flags);
 
-	atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+	atomic64_dec_if_positive(&dmc->cached_blocks);
 
-	eb_endio(ebio, error);
-	ebio = NULL;
 	job->ebio = NULL;
 	eio_free_cache_job(job);
+	eb_endio(ebio, error);
+	ebio = NULL;
 }
 
 /* Adds clean set request to clean queue. */
@@ -669,6 +1096,8 @@ int eio_clean_thread_proc(void *context)
 	unsigned long flags = 0;
 	u_int64_t systime;
 	index_t index;
+	index_t sorted[EIO_CLEAN_SORT_SETS];
+	int nr_sorted;
 
 	/* Sync makes sense only for writeback cache */
 	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
@@ -736,6 +1165,23 @@ int eio_clean_thread_proc(void *context)
 
 		systime = jiffies;
 		while (!list_empty(&setlist)) {
+			/* Clean the queued sets together, in dbn order */
+			if (dmc->sysctl_active.clean_sort && dmc->clean_sort &&
+			    !dmc->sysctl_active.fast_remove) {
+				for (nr_sorted = 0;
+				     !list_empty(&setlist) &&
+				     nr_sorted < EIO_CLEAN_SORT_SETS;
+				     nr_sorted++) {
+					set = list_entry((&setlist)->next,
+							 struct cache_set, list);
+					list_del(&set->list);
+					sorted[nr_sorted] = set - dmc->cache_sets;
+				}
+				eio_clean_sets_sorted(dmc, sorted, nr_sorted, 0);
+				atomic64_sub(nr_sorted, &dmc->clean_pendings);
+				continue;
+			}
+
 			set =
 				list_entry((&setlist)->next, struct cache_set,
 					   list);
@@ -810,9 +1256,33 @@ static void eio_enqueue_readfill(struct cache_c *dmc, struct kcached_job *job)
 		schedule_work(&dmc->readfill_wq);
 }
 
-/* part of eio_do_readfill */
+/* part of eio_do_readfill, also called back by eio_issue_jobs() */
+static void eio_readfill_fail(struct cache_c *dmc, struct eio_bio *iebio,
+			      struct kcached_job *job, int err)
+{
+	unsigned long flags;
+
+	pr_err("eio_do_readfill: IO submission failed, block %llu",
+	       EIO_DBN_GET(dmc, iebio->eb_index));
+	spin_lock_irqsave(&dmc->cache_sets[iebio->eb_cacheset].cs_lock, flags);
+	EIO_CACHE_STATE_SET(dmc, iebio->eb_index, INVALID);
+	spin_unlock_irqrestore(&dmc->cache_sets[iebio->eb_cacheset].cs_lock,
+			       flags);
+	atomic64_dec_if_positive(&dmc->cached_blocks);
+	if (job) {
+		eio_free_cache_job(job);
+		job = NULL;
+	}
+	eb_endio(iebio, err);
+}
+
+/*
+ * part of eio_do_readfill. SSD writes of the readfill are appended at
+ * "tail", to be issued together.
+ */
 static inline void eio_do_readfill_bio(struct cache_c *dmc,
-				       struct eio_bio *iebio)
+				       struct eio_bio *iebio,
+				       struct kcached_job ***tail)
 {
 	int err;
 	unsigned long flags;
@@ -835,7 +1305,7 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 		EIO_CACHE_STATE_SET(dmc, index, INVALID);
 		spin_unlock_irqrestore(&dmc->cache_sets[iebio->eb_cacheset].
 		                       cs_lock, flags);
-		atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
 		eb_endio(iebio, 0);
 		iebio = NULL;
 	} else if ((EIO_CACHE_STATE_GET(dmc, index) &
@@ -846,41 +1316,23 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 		spin_unlock_irqrestore(&dmc->cache_sets[iebio->eb_cacheset].
 		                       cs_lock, flags);
 		job = eio_new_job(dmc, iebio, iebio->eb_index);
-		if (unlikely(job == NULL))
-			err = -ENOMEM;
-		else {
-			err = 0;
-			job->action = READFILL;
-			atomic_inc(&dmc->nr_jobs);
-			SECTOR_STATS(dmc->eio_stats.ssd_readfills,
-			             iebio->eb_size);
-			SECTOR_STATS(dmc->eio_stats.ssd_writes, iebio->eb_size);
-			atomic64_inc(&dmc->eio_stats.readfill);
-			atomic64_inc(&dmc->eio_stats.writecache);
-			err = eio_io_async_bvec(dmc, &job->job_io_regions.cache,
-			                        REQ_OP_WRITE, 0, iebio->eb_bv,
-			                        iebio->eb_nbvec,
-			                        eio_io_callback, job, 0);
-		}
-		if (err) {
-			pr_err("eio_do_readfill: IO submission failed, block %llu",
-			EIO_DBN_GET(dmc, index));
-			spin_lock_irqsave(&dmc->cache_sets[iebio->eb_cacheset].
-			                  cs_lock, flags);
-			EIO_CACHE_STATE_SET(dmc, iebio->eb_index, INVALID);
-			spin_unlock_irqrestore(&dmc->cache_sets
-			                       [iebio->eb_cacheset].cs_lock,
-			                       flags);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
-			eb_endio(iebio, err);
-
-			if (job) {
-				eio_free_cache_job(job);
-				job = NULL;
-			}
+		if (unlikely(job == NULL)) {
+			eio_readfill_fail(dmc, iebio, NULL, -ENOMEM);
+			return;
 		}
+		job->action = READFILL;
+		atomic_inc(&dmc->nr_jobs);
+		SECTOR_STATS(dmc->eio_stats->ssd_readfills, iebio->eb_size);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, iebio->eb_size);
+		EIO_STATS_INC(dmc->eio_stats->readfill);
+		EIO_STATS_INC(dmc->eio_stats->writecache);
+		job->next = NULL;
+		**tail = job;
+		*tail = &job->next;
 	} else
 		if (EIO_CACHE_STATE_GET(dmc, index) == ALREADY_DIRTY) {
+		u_int16_t holes = dmc->cache_sbmap[index].sb_invalid &
+				  eio_sb_touched(dmc, iebio);
 
 		spin_unlock_irqrestore(&dmc->cache_sets[iebio->eb_cacheset].
 		                       cs_lock, flags);
@@ -888,30 +1340,55 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 		/*
 		 * DIRTY block handling:
 		 * Read the dirty data from the cache block to update
-		 * the data buffer already read from the disk
+		 * the data buffer already read from the disk. If the
+		 * block has holes in the range, read it aside and copy
+		 * only its valid sub-blocks over the disk data.
 		 */
-		job = eio_new_job(dmc, iebio, iebio->eb_index);
-		if (unlikely(job == NULL))
-			err = -ENOMEM;
-		else {
+		job = NULL;
+		err = 0;
+		if (holes) {
+			iebio->eb_mergebv = eio_alloc_bounce(iebio->eb_size,
+							     GFP_NOIO,
+							     &iebio->eb_nmergebv);
+			if (!iebio->eb_mergebv)
+				err = -ENOMEM;
+			iebio->eb_mergemask = eio_sb_touched(dmc, iebio) &
+					      ~holes;
+		}
+		if (!err) {
+			job = eio_new_job(dmc, iebio, iebio->eb_index);
+			if (unlikely(job == NULL))
+				err = -ENOMEM;
+		}
+		if (!err) {
 			job->action = READCACHE;
-			SECTOR_STATS(dmc->eio_stats.ssd_reads, iebio->eb_size);
-			atomic64_inc(&dmc->eio_stats.readcache);
-			err = eio_io_async_bvec(dmc, &job->job_io_regions.cache,
-			                        REQ_OP_READ, 0, iebio->eb_bv,
-			                        iebio->eb_nbvec,
-			                        eio_io_callback, job, 0);
+			SECTOR_STATS(dmc->eio_stats->ssd_reads, iebio->eb_size);
+			EIO_STATS_INC(dmc->eio_stats->readcache);
+			if (iebio->eb_mergebv)
+				err = eio_io_async_bvec(dmc,
+							&job->job_io_regions.cache,
+							REQ_OP_READ, 0,
+							iebio->eb_mergebv,
+							iebio->eb_nmergebv,
+							eio_io_callback, job, 0);
+			else
+				err = eio_io_async_bvec(dmc,
+							&job->job_io_regions.cache,
+							REQ_OP_READ, 0,
+							iebio->eb_bv,
+							iebio->eb_nbvec,
+							eio_io_callback, job, 0);
 		}
 
 		if (err) {
 			pr_err("eio_do_readfill: dirty block read IO submission failed, block %llu",
 			EIO_DBN_GET(dmc, index));
 			/* can't invalidate the DIRTY block, just return error */
-			eb_endio(iebio, err);
 			if (job) {
 				eio_free_cache_job(job);
 				job = NULL;
 			}
+			eb_endio(iebio, err);
 		}
 	} else
 		if ((EIO_CACHE_STATE_GET(dmc, index) &
@@ -937,6 +1414,7 @@ void eio_do_readfill(struct work_struct *work)
 	struct eio_bio *ebio;
 	unsigned long flags = 0;
 	struct kcached_job *nextjob = NULL;
+	struct kcached_job *fills, **tail;
 	struct cache_c *dmc = container_of(work, struct cache_c, readfill_wq);
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
@@ -947,6 +1425,8 @@ void eio_do_readfill(struct work_struct *work)
 		joblist = dmc->readfill_queue;
 		dmc->readfill_queue = NULL; /* <--- we are not going to make another loop spin */
 		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		fills = NULL;
+		tail = &fills;
 		for (job = joblist; job != NULL; job = nextjob) {
 			struct eio_bio *iebio;
 			struct eio_bio *next;
@@ -962,19 +1442,21 @@ void eio_do_readfill(struct work_struct *work)
 			 */
 			do {
 				next = iebio->eb_next;
-				eio_do_readfill_bio(dmc, iebio);
+				eio_do_readfill_bio(dmc, iebio, &tail);
 				iebio = next;
 			} while (iebio);
+			eio_free_cache_job(job);
 			eb_endio(ebio, 0);
 			ebio = NULL;
-			eio_free_cache_job(job);
 		}
+		/* The queue is in cache sector order, so fills often adjoin */
+		eio_issue_jobs(dmc, fills, REQ_OP_WRITE, 0, eio_readfill_fail);
 		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	}
 	dmc->readfill_in_prog = 0;
 out:
 	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-	atomic64_inc(&dmc->eio_stats.ssd_readfill_unplugs);
+	EIO_STATS_INC(dmc->eio_stats->ssd_readfill_unplugs);
 	eio_unplug_cache_device(dmc);
 }
 
@@ -989,79 +1471,451 @@ static u_int32_t hash_block(struct cache_c *dmc, sector_t dbn)
 	return set_number;
 }
 
+/*
+ * Set scan: in one pass over the tag store of a set, find the VALID block
+ * holding dbn and, failing that, the first INVALID block. Either is -1
+ * when not found; *invalid is meaningless on a hit.
+ */
 static void
-find_valid_dbn(struct cache_c *dmc, sector_t dbn,
-	       index_t start_index, index_t *index)
+eio_scan_set_scalar(struct cache_c *dmc, sector_t dbn, index_t start_index,
+		    index_t *valid, index_t *invalid)
 {
-	index_t i;
+	const u_int8_t *states = dmc->cache_states;
+	const u_int32_t *tags = dmc->cache_tags;
+	u_int32_t tag = eio_dbn_tag(dmc, dbn);
 	index_t end_index = start_index + dmc->assoc;
+	index_t i;
 
+	*valid = -1;
+	*invalid = -1;
 	for (i = start_index; i < end_index; i++) {
-		if ((EIO_CACHE_STATE_GET(dmc, i) & VALID)
-		    && EIO_DBN_GET(dmc, i) == dbn) {
-			*index = i;
-			if ((EIO_CACHE_STATE_GET(dmc, i) & BLOCK_IO_INPROG) ==
-			    0)
-				eio_policy_reclaim_lru_movetail(dmc, i,
-								dmc->
-								policy_ops);
+		if (states[i] == INVALID) {
+			if (*invalid == -1)
+				*invalid = i;
+		} else if (tags[i] == tag && (states[i] & VALID) &&
+			   EIO_DBN_GET(dmc, i) == dbn) {
+			*valid = i;
 			return;
 		}
 	}
-	*index = -1;
 }
 
-static index_t find_invalid_dbn(struct cache_c *dmc, index_t start_index)
+/* Bytes of x that are zero get their top bit set, the others are cleared */
+static inline unsigned long eio_zero_bytes(unsigned long x)
 {
-	index_t i;
-	index_t end_index = start_index + dmc->assoc;
+	const unsigned long low7 = REPEAT_BYTE(0x7f);
 
-	/* Find INVALID slot that we can reuse */
-	for (i = start_index; i < end_index; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, i) == INVALID) {
-			eio_policy_reclaim_lru_movetail(dmc, i,
-							dmc->policy_ops);
-			return i;
+	return ~(((x & low7) + low7) | x | low7);
+}
+
+/* Offset in memory of the first byte flagged by eio_zero_bytes() */
+static inline unsigned eio_first_byte(unsigned long mask)
+{
+#ifdef __BIG_ENDIAN
+	return (BITS_PER_LONG - 1 - __fls(mask)) >> 3;
+#else
+	return __ffs(mask) >> 3;
+#endif
+}
+
+/*
+ * Word at a time version of eio_scan_set_scalar(). The states of a set are
+ * read a word at a time: a word without a VALID block costs a single
+ * test, and the first INVALID block falls out of the same load. The tags
+ * are only compared for the words that hold VALID blocks.
+ */
+static void
+eio_scan_set_word(struct cache_c *dmc, sector_t dbn, index_t start_index,
+		  index_t *valid, index_t *invalid)
+{
+	const unsigned long *words;
+	const u_int32_t *tags = dmc->cache_tags;
+	u_int32_t tag = eio_dbn_tag(dmc, dbn);
+	unsigned long w, m;
+	index_t i, k, end, nwords;
+
+	/* Tiny sets are not worth it, and would not fill a word */
+	if (dmc->assoc % sizeof(unsigned long)) {
+		eio_scan_set_scalar(dmc, dbn, start_index, valid, invalid);
+		return;
+	}
+
+	*valid = -1;
+	*invalid = -1;
+	words = (const unsigned long *)(dmc->cache_states + start_index);
+	nwords = dmc->assoc / sizeof(unsigned long);
+	for (i = 0; i < nwords; i++) {
+		w = words[i];
+		k = start_index + i * sizeof(unsigned long);
+		if (*invalid == -1) {
+			m = eio_zero_bytes(w ^ REPEAT_BYTE(INVALID));
+			if (m)
+				*invalid = k + eio_first_byte(m);
+		}
+		if (!(w & REPEAT_BYTE(VALID)))
+			continue;
+		for (end = k + sizeof(unsigned long); k < end; k++) {
+			if (tags[k] == tag &&
+			    (dmc->cache_states[k] & VALID) &&
+			    EIO_DBN_GET(dmc, k) == dbn) {
+				*valid = k;
+				return;
+			}
 		}
 	}
-	return -1;
 }
 
-/* Search for a slot that we can reclaim */
-static void
-find_reclaim_dbn(struct cache_c *dmc, index_t start_index, index_t *index)
+static void (*eio_scan_set)(struct cache_c *dmc, sector_t dbn,
+			    index_t start_index, index_t *valid,
+			    index_t *invalid) = eio_scan_set_scalar;
+
+/* Pick the set scan at module init */
+void eio_set_scan_init(void)
 {
-	eio_find_reclaim_dbn(dmc->policy_ops, start_index, index);
+	if (BITS_PER_LONG == 64) {
+		eio_scan_set = eio_scan_set_word;
+		pr_info("set scan: word at a time");
+	} else {
+		eio_scan_set = eio_scan_set_scalar;
+		pr_info("set scan: scalar");
+	}
 }
 
-void eio_set_warm_boot(void)
+/* First INVALID block of a set, for a lookup that skipped the scan */
+static index_t eio_find_invalid(struct cache_c *dmc, index_t start_index)
 {
-	eio_force_warm_boot = 1;
-	return;
+	const u_int8_t *p;
+
+	p = memchr(dmc->cache_states + start_index, INVALID, dmc->assoc);
+	return p ? p - dmc->cache_states : -1;
 }
 
 /*
- * dbn is the starting sector.
+ * Build the lookup filters from the current content of the sets. A set
+ * uses its filter as soon as it is built, the others still scan.
  */
-static int
-eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
+int eio_lookup_filter_enable(struct cache_c *dmc)
 {
-	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
-	u_int32_t set_number;
-	index_t invalid, oldest_clean = -1;
-	index_t start_index;
+	u_int8_t *lf, *base;
+	index_t set, i, start_index;
+	u_int32_t h1, h2;
+	unsigned long flags;
 
-	/*ASK it is assumed that the lookup is being done for a single block*/
-	set_number = hash_block(dmc, dbn);
-	start_index = dmc->assoc * set_number;
-	find_valid_dbn(dmc, dbn, start_index, index);
-	if (*index >= 0)
-		/* We found the exact range of blocks we are looking for */
-		return VALID;
+	if (dmc->lookup_filter)
+		return 0;
 
-	invalid = find_invalid_dbn(dmc, start_index);
-	if (invalid == -1)
-		/* We didn't find an invalid entry, search for oldest valid entry */
+	dmc->lf_bits = ilog2(dmc->assoc * EIO_LF_COUNTERS_PER_BLOCK);
+	lf = vzalloc(eio_lookup_filter_size(dmc));
+	if (lf == NULL) {
+		pr_err("lookup_filter: Cannot allocate %zu bytes for cache \"%s\"",
+		       eio_lookup_filter_size(dmc), dmc->cache_name);
+		return -ENOMEM;
+	}
+	/* Two sysctl writers may race here */
+	if (cmpxchg(&dmc->lookup_filter, NULL, lf) != NULL) {
+		vfree(lf);
+		return 0;
+	}
+
+	for (set = 0; set < (index_t)dmc->num_sets; set++) {
+		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+		/* A disable meanwhile frees lf once past this set */
+		if (READ_ONCE(dmc->lookup_filter) != lf) {
+			spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock,
+					       flags);
+			break;
+		}
+		base = lf + ((size_t)set << (dmc->lf_bits - 1));
+		start_index = set * dmc->assoc;
+		for (i = start_index; i < start_index + dmc->assoc; i++) {
+			if (!(EIO_CACHE_STATE_GET(dmc, i) & VALID))
+				continue;
+			eio_lf_hash(dmc, dmc->cache_tags[i], &h1, &h2);
+			eio_lf_adj(base, h1, 1);
+			eio_lf_adj(base, h2, 1);
+		}
+		dmc->cache_sets[set].flags |= SETFLAG_LOOKUP_FILTER;
+		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+	}
+	return 0;
+}
+
+/*
+ * Once no set uses its filter any more, the filters can go. A clean
+ * updates the block states of a set under its rw_lock only, so that
+ * is waited out as well as the cs_lock.
+ */
+void eio_lookup_filter_disable(struct cache_c *dmc)
+{
+	u_int8_t *lf;
+	unsigned long flags;
+	index_t set;
+
+	lf = xchg(&dmc->lookup_filter, NULL);
+	if (lf == NULL)
+		return;
+
+	for (set = 0; set < (index_t)dmc->num_sets; set++) {
+		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+		dmc->cache_sets[set].flags &= ~SETFLAG_LOOKUP_FILTER;
+		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+		down_write(&dmc->cache_sets[set].rw_lock);
+		up_write(&dmc->cache_sets[set].rw_lock);
+	}
+	vfree(lf);
+}
+
+/*
+ * Admission control. Every access is counted in the frequency sketch
+ * of the cache. A miss that would evict a VALID block may take its slot
+ * only if its dbn is estimated to be accessed at least as often as the
+ * victim's, so that one-hit wonders from scans do not flush the working
+ * set. The counters are updated without a lock, with a cmpxchg on
+ * the word holding them so that a counter saturates instead of carrying
+ * into its neighbour. A lost update against an aging only makes an
+ * estimate less precise.
+ */
+static const u64 eio_admit_seeds[EIO_ADMIT_DEPTH] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+	0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL,
+};
+
+static inline size_t
+eio_admit_slot(struct eio_admit_sketch *s, int row, sector_t dbn)
+{
+	return ((size_t)row << s->width_bits) +
+	       hash_64((u64)dbn ^ eio_admit_seeds[row], s->width_bits);
+}
+
+static inline unsigned int
+eio_admit_get(struct eio_admit_sketch *s, size_t slot)
+{
+	return (READ_ONCE(s->table[slot >> 3]) >> ((slot & 7) << 2)) & 0xf;
+}
+
+static inline void eio_admit_inc(struct eio_admit_sketch *s, size_t slot)
+{
+	u_int32_t *word = &s->table[slot >> 3];
+	unsigned int shift = (slot & 7) << 2;
+	u_int32_t old, cur;
+
+	cur = READ_ONCE(*word);
+	do {
+		if (((cur >> shift) & 0xf) == 0xf)
+			return;
+		old = cur;
+		cur = cmpxchg(word, old, old + (1U << shift));
+	} while (cur != old);
+}
+
+static void eio_admit_record(struct cache_c *dmc, sector_t dbn)
+{
+	struct eio_admit_sketch *s = dmc->admit_sketch;
+	size_t slot;
+	int row;
+
+	if (likely(!dmc->sysctl_active.admission) || s == NULL)
+		return;
+
+	for (row = 0; row < EIO_ADMIT_DEPTH; row++) {
+		slot = eio_admit_slot(s, row, dbn);
+		eio_admit_inc(s, slot);
+	}
+	if (atomic_inc_return(&s->ops) == s->sample)
+		queue_work(dmc->callback_q, &s->age_work);
+}
+
+static unsigned int eio_admit_estimate(struct eio_admit_sketch *s,
+				       sector_t dbn)
+{
+	unsigned int est = 0xf, c;
+	int row;
+
+	for (row = 0; row < EIO_ADMIT_DEPTH; row++) {
+		c = eio_admit_get(s, eio_admit_slot(s, row, dbn));
+		if (c < est)
+			est = c;
+	}
+	return est;
+}
+
+/*
+ * May the block of ebio replace the VALID block at victim? Called with
+ * the set locked.
+ */
+static int
+eio_admit(struct cache_c *dmc, struct eio_bio *ebio, index_t victim)
+{
+	struct eio_admit_sketch *s = dmc->admit_sketch;
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+
+	if (likely(!dmc->sysctl_active.admission) || s == NULL ||
+	    ebio->eb_bc->bc_admit)
+		return 1;
+
+	if (eio_admit_estimate(s, dbn) >=
+	    eio_admit_estimate(s, EIO_DBN_GET(dmc, victim))) {
+		EIO_STATS_INC(dmc->eio_stats->admit_accepted);
+		return 1;
+	}
+	EIO_STATS_INC(dmc->eio_stats->admit_rejected);
+	return 0;
+}
+
+/* Halve all the counters of the sketch */
+static void eio_admit_age(struct work_struct *work)
+{
+	struct eio_admit_sketch *s =
+		container_of(work, struct eio_admit_sketch, age_work);
+	size_t i, n = (size_t)EIO_ADMIT_DEPTH << (s->width_bits - 3);
+
+	for (i = 0; i < n; i++) {
+		WRITE_ONCE(s->table[i], (READ_ONCE(s->table[i]) >> 1) &
+			   0x77777777);
+		if ((i & 0x3fff) == 0x3fff)
+			cond_resched();
+	}
+	atomic_set(&s->ops, 0);
+}
+
+/*
+ * Allocate the sketch, about 2 bytes per cache block. It stays until
+ * the cache goes away, turning admission off only stops using it.
+ */
+int eio_admit_enable(struct cache_c *dmc)
+{
+	struct eio_admit_sketch *s;
+	u_int32_t bits;
+
+	if (dmc->admit_sketch)
+		return 0;
+
+	bits = clamp_t(u_int32_t, order_base_2(dmc->size), 4, 30);
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (s)
+		s->table = vzalloc(sizeof(u_int32_t) *
+				   ((size_t)EIO_ADMIT_DEPTH << (bits - 3)));
+	if (s == NULL || s->table == NULL) {
+		pr_err("admission: Cannot allocate the sketch for cache \"%s\"",
+		       dmc->cache_name);
+		kfree(s);
+		return -ENOMEM;
+	}
+	s->width_bits = bits;
+	s->sample = (int)min_t(u64, 10 * (u64)dmc->size, INT_MAX);
+	atomic_set(&s->ops, 0);
+	INIT_WORK(&s->age_work, eio_admit_age);
+
+	if (cmpxchg(&dmc->admit_sketch, NULL, s) != NULL) {
+		/* lost a race with another enable */
+		vfree(s->table);
+		kfree(s);
+	}
+	return 0;
+}
+
+void eio_admit_free(struct cache_c *dmc)
+{
+	struct eio_admit_sketch *s = dmc->admit_sketch;
+
+	if (s == NULL)
+		return;
+
+	dmc->admit_sketch = NULL;
+	cancel_work_sync(&s->age_work);
+	vfree(s->table);
+	kfree(s);
+}
+
+/*
+ * Recount the VALID blocks of the pinned ranges after they changed, set
+ * by set under its lock. Once a set is recounted, its fills and
+ * invalidations see the new ranges and keep the counts with
+ * eio_pin_update(), so the pinned_blocks stat is read without a scan.
+ */
+void eio_pin_recount(struct cache_c *dmc)
+{
+	index_t nr_sets = dmc->size >> dmc->consecutive_shift;
+	index_t set, i, start_index;
+	unsigned long flags;
+	sector_t dbn;
+	u_int32_t n;
+
+	for (set = 0; set < nr_sets; set++) {
+		start_index = set * dmc->assoc;
+		n = 0;
+		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+		for (i = start_index; i < start_index + dmc->assoc; i++) {
+			if (!(EIO_CACHE_STATE_GET(dmc, i) & VALID))
+				continue;
+			dbn = EIO_DBN_GET(dmc, i);
+			if (eio_range_pinned(dmc, dbn, dbn + dmc->block_size))
+				n++;
+		}
+		atomic64_add((s64)n - (s64)dmc->cache_sets[set].nr_pinned,
+			     &dmc->nr_pinned);
+		dmc->cache_sets[set].nr_pinned = n;
+		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+		if ((set & 0xff) == 0xff)
+			cond_resched();
+	}
+}
+
+/* Search for a slot that we can reclaim */
+static void
+find_reclaim_dbn(struct cache_c *dmc, index_t start_index, index_t *index)
+{
+	eio_find_reclaim_dbn(dmc->policy_ops, start_index, index);
+}
+
+void eio_set_warm_boot(void)
+{
+	eio_force_warm_boot = 1;
+	return;
+}
+
+/*
+ * dbn is the starting sector.
+ */
+static int
+eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
+{
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	u_int32_t set_number;
+	index_t invalid, oldest_clean = -1;
+	index_t start_index;
+	int access = ebio->eb_bc->bc_access;
+	u_int8_t *lf;
+
+	/*ASK it is assumed that the lookup is being done for a single block*/
+	set_number = hash_block(dmc, dbn);
+	start_index = dmc->assoc * set_number;
+	lf = eio_lf_set_base(dmc, set_number);
+	if (lf && !eio_lf_maybe(dmc, lf, eio_dbn_tag(dmc, dbn))) {
+		/* Definitely not in the set */
+		EIO_STATS_INC(dmc->eio_stats->lookup_filter_skips);
+		*index = -1;
+		invalid = eio_find_invalid(dmc, start_index);
+	} else {
+		eio_scan_set(dmc, dbn, start_index, index, &invalid);
+		if (lf && *index < 0)
+			EIO_STATS_INC(dmc->eio_stats->lookup_filter_false_pos);
+	}
+	if (*index >= 0) {
+		/* We found the exact range of blocks we are looking for */
+		if ((EIO_CACHE_STATE_GET(dmc, *index) & BLOCK_IO_INPROG) == 0) {
+			if (!(access & EIO_ACCESS_COLD))
+				eio_policy_reclaim_lru_movetail(dmc, *index,
+								dmc->policy_ops);
+			eio_policy_blk_access(dmc->policy_ops, *index, dbn,
+					      access | EIO_ACCESS_HIT);
+		}
+		trace_eio_lookup(dmc, dbn, set_number, *index, EIO_LOOKUP_HIT);
+		return VALID;
+	}
+
+	if (invalid == -1)
+		/* We didn't find an invalid entry, search for oldest valid entry */
 		find_reclaim_dbn(dmc, start_index, &oldest_clean);
 	/*
 	 * Cache miss :
@@ -1071,14 +1925,580 @@ eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
 	*index = start_index + dmc->assoc;
 	if (invalid != -1) {
 		*index = invalid;
+		trace_eio_lookup(dmc, dbn, set_number, *index,
+				 EIO_LOOKUP_INVALID);
 		return INVALID;
 	} else if (oldest_clean != -1) {
 		*index = oldest_clean;
+		trace_eio_lookup(dmc, dbn, set_number, *index,
+				 EIO_LOOKUP_RECLAIM);
 		return VALID;
 	}
+	trace_eio_lookup(dmc, dbn, set_number, -1, EIO_LOOKUP_NOROOM);
 	return -1;
 }
 
+/*
+ * A miss claims the slot at index for the block of ebio. The policy
+ * sees the miss only now, with the slot still holding the block it
+ * evicts, if any: a lookup that ends up not filling the slot, as for
+ * bypassed or hinted I/O, leaves the policy state alone. Called with
+ * the set locked.
+ */
+static void eio_policy_fill(struct cache_c *dmc, struct eio_bio *ebio,
+			    index_t index)
+{
+	if (!(ebio->eb_bc->bc_access & EIO_ACCESS_COLD))
+		eio_policy_reclaim_lru_movetail(dmc, index, dmc->policy_ops);
+	eio_policy_blk_access(dmc->policy_ops, index,
+			      EIO_ROUND_SECTOR(dmc, ebio->eb_sector),
+			      ebio->eb_bc->bc_access);
+}
+
+/*
+ * Group commit of the md updates. The mdreqs of the sets with dirty
+ * blocks to record are collected for md_batch_usec, or until
+ * EIO_MD_BATCH_MAX of them wait, then sorted in set order. Each run of
+ * neighbour sets is written by its own work on mdupdate_q, under a
+ * plug, so that the block layer merges its md writes while the runs go
+ * out in parallel. With no window, the updates that come in while a
+ * commit runs go together in the next one.
+ */
+static void eio_md_batch_add(struct cache_c *dmc,
+			     struct mdupdate_request *mdreq)
+{
+	unsigned long delay;
+	unsigned long flags;
+
+	delay = usecs_to_jiffies(dmc->sysctl_active.md_batch_usec);
+
+	spin_lock_irqsave(&dmc->md_batch_lock, flags);
+	list_add_tail(&mdreq->list, &dmc->md_batch);
+	if (++dmc->md_batch_len >= EIO_MD_BATCH_MAX || !delay)
+		mod_delayed_work(dmc->mdupdate_q, &dmc->md_batch_work, 0);
+	else
+		queue_delayed_work(dmc->mdupdate_q, &dmc->md_batch_work,
+				   delay);
+	spin_unlock_irqrestore(&dmc->md_batch_lock, flags);
+}
+
+static int eio_mdreq_cmp(void *priv, struct list_head *a,
+			 struct list_head *b)
+{
+	struct mdupdate_request *ma, *mb;
+
+	ma = list_entry(a, struct mdupdate_request, list);
+	mb = list_entry(b, struct mdupdate_request, list);
+	if (ma->set == mb->set)
+		return 0;
+	return ma->set < mb->set ? -1 : 1;
+}
+
+/*
+ * A group commit written to the md journal: its blocks, and the mdreqs
+ * to complete once they are all on the SSD.
+ */
+struct eio_jrnl_io {
+	struct cache_c *dmc;
+	struct list_head mdreqs;
+	atomic_t holdcount;
+	int error;
+	sector_t sector;        /* of the first record block */
+	unsigned nr_blocks;
+	struct bio_vec bvecs[0];
+};
+
+static sector_t eio_jrnl_sector(struct cache_c *dmc, u_int64_t seq)
+{
+	return dmc->jrnl_start + EIO_JRNL_BLOCK_SECTORS *
+	       (sector_t)EIO_REM(seq, dmc->jrnl_nr_blocks);
+}
+
+static void eio_jrnl_seal(struct cache_c *dmc, struct eio_jrnl_header *hdr,
+			  u_int64_t seq, unsigned nr_recs)
+{
+	hdr->magic = cpu_to_le32(EIO_JRNL_MAGIC);
+	hdr->seq = cpu_to_le64(seq);
+	hdr->id = cpu_to_le32(dmc->jrnl_id);
+	hdr->nr_recs = cpu_to_le32(nr_recs);
+	hdr->crc = 0;
+	hdr->crc = cpu_to_le32(crc32_le(~0, (u8 *)hdr, EIO_JRNL_BLOCK_SIZE));
+}
+
+static void eio_jrnl_io_free(struct eio_jrnl_io *jio)
+{
+	unsigned b;
+
+	for (b = 0; b < jio->nr_blocks; b++)
+		__free_page(jio->bvecs[b].bv_page);
+	kfree(jio);
+}
+
+/*
+ * Take the pending dirty blocks of the batch's sets, as eio_do_mdupdate()
+ * does. Returns the number of records they need.
+ */
+static unsigned
+eio_jrnl_take(struct cache_c *dmc, struct list_head *batch, int *fua)
+{
+	struct mdupdate_request *mdreq;
+	struct cache_set *set;
+	struct eio_bio *ebio;
+	unsigned long flags;
+	unsigned nr_recs = 0;
+
+	list_for_each_entry(mdreq, batch, list) {
+		set = &dmc->cache_sets[mdreq->set];
+		spin_lock_irqsave(&set->cs_lock, flags);
+		EIO_ASSERT(mdreq->inprog_mdlist == NULL);
+		mdreq->inprog_mdlist = mdreq->pending_mdlist;
+		mdreq->pending_mdlist = NULL;
+		if (mdreq->fua)
+			*fua = 1;
+		mdreq->fua = 0;
+		spin_unlock_irqrestore(&set->cs_lock, flags);
+		for (ebio = mdreq->inprog_mdlist; ebio; ebio = ebio->eb_next)
+			nr_recs++;
+	}
+	return nr_recs;
+}
+
+/* Undo eio_jrnl_take(), for the batch to be written in place */
+static void
+eio_jrnl_giveback(struct cache_c *dmc, struct list_head *batch, int fua)
+{
+	struct mdupdate_request *mdreq;
+	struct cache_set *set;
+	struct eio_bio *ebio;
+	unsigned long flags;
+
+	list_for_each_entry(mdreq, batch, list) {
+		set = &dmc->cache_sets[mdreq->set];
+		spin_lock_irqsave(&set->cs_lock, flags);
+		ebio = mdreq->inprog_mdlist;
+		if (ebio) {
+			while (ebio->eb_next)
+				ebio = ebio->eb_next;
+			ebio->eb_next = mdreq->pending_mdlist;
+			mdreq->pending_mdlist = mdreq->inprog_mdlist;
+			mdreq->inprog_mdlist = NULL;
+		}
+		if (fua)
+			mdreq->fua = 1;
+		spin_unlock_irqrestore(&set->cs_lock, flags);
+	}
+}
+
+static void eio_jrnl_callback(int error, void *context)
+{
+	struct eio_jrnl_io *jio = (struct eio_jrnl_io *)context;
+	struct mdupdate_request *mdreq, *next;
+
+	if (error && !(jio->error))
+		jio->error = error;
+	if (!atomic_dec_and_test(&jio->holdcount))
+		return;
+
+	if (jio->error)
+		trace_eio_io_error(jio->dmc, EIO_IOERR_JOURNAL, -1,
+				   jio->sector, jio->error);
+	list_for_each_entry_safe(mdreq, next, &jio->mdreqs, list) {
+		list_del_init(&mdreq->list);
+		mdreq->error = jio->error;
+		if (jio->error)
+			INIT_WORK(&mdreq->work, eio_jrnl_undo);
+		else
+			INIT_WORK(&mdreq->work, eio_post_mdupdate);
+		queue_work(jio->dmc->mdupdate_q, &mdreq->work);
+	}
+	eio_jrnl_io_free(jio);
+}
+
+/*
+ * Write a group commit to the md journal: a record per block turning
+ * dirty, packed in as few blocks as they need, at the head, in one or
+ * two I/Os. Returns non-zero, the batch left as it was, when they don't
+ * fit: the caller then updates the md in place.
+ */
+static int eio_jrnl_commit(struct cache_c *dmc, struct list_head *batch)
+{
+	struct mdupdate_request *mdreq;
+	struct eio_jrnl_header *hdr;
+	struct eio_jrnl_rec *rec = NULL;
+	struct eio_io_region region;
+	struct eio_jrnl_io *jio;
+	struct cache_set *set;
+	struct eio_bio *ebio;
+	unsigned long flags;
+	unsigned nr_recs, nr_blocks, b, run, n;
+	unsigned op_flags;
+	u_int64_t seq, used;
+	int fua = 0;
+	int error;
+
+	nr_recs = eio_jrnl_take(dmc, batch, &fua);
+	nr_blocks = DIV_ROUND_UP(nr_recs, (unsigned)EIO_JRNL_RECS_PER_BLOCK);
+	if (!nr_blocks)
+		goto giveback;
+
+	jio = kzalloc(sizeof(*jio) + nr_blocks * sizeof(struct bio_vec),
+		      GFP_NOIO);
+	if (!jio)
+		goto giveback;
+	for (b = 0; b < nr_blocks; b++) {
+		jio->bvecs[b].bv_page = alloc_page(GFP_NOIO | __GFP_ZERO);
+		if (!jio->bvecs[b].bv_page)
+			goto free;
+		jio->bvecs[b].bv_len = EIO_JRNL_BLOCK_SIZE;
+		jio->bvecs[b].bv_offset = 0;
+		jio->nr_blocks++;
+	}
+
+	spin_lock(&dmc->jrnl_lock);
+	used = dmc->jrnl_head - dmc->jrnl_tail;
+	if (used + nr_blocks > dmc->jrnl_nr_blocks - EIO_JRNL_RESERVE) {
+		spin_unlock(&dmc->jrnl_lock);
+		queue_work(dmc->jrnl_ckpt_q, &dmc->jrnl_ckpt_work);
+		goto free;
+	}
+	seq = dmc->jrnl_head;
+	dmc->jrnl_head += nr_blocks;
+	list_for_each_entry(mdreq, batch, list)
+		__set_bit(mdreq->set, dmc->jrnl_sets[dmc->jrnl_cur]);
+	spin_unlock(&dmc->jrnl_lock);
+	if (used + nr_blocks > dmc->jrnl_nr_blocks / 2)
+		queue_work(dmc->jrnl_ckpt_q, &dmc->jrnl_ckpt_work);
+
+	/* The records, in as many blocks, sealed once full */
+	b = 0;
+	n = EIO_JRNL_RECS_PER_BLOCK;
+	hdr = NULL;
+	list_for_each_entry(mdreq, batch, list) {
+		set = &dmc->cache_sets[mdreq->set];
+		spin_lock_irqsave(&set->cs_lock, flags);
+		for (ebio = mdreq->inprog_mdlist; ebio; ebio = ebio->eb_next) {
+			EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, ebio->eb_index) ==
+				   DIRTY_INPROG);
+			if (n == EIO_JRNL_RECS_PER_BLOCK) {
+				if (hdr)
+					eio_jrnl_seal(dmc, hdr, seq + b - 1, n);
+				hdr = page_address(jio->bvecs[b++].bv_page);
+				rec = (struct eio_jrnl_rec *)(hdr + 1);
+				n = 0;
+			}
+			rec->index = cpu_to_le64(ebio->eb_index);
+			rec->dbn = cpu_to_le64(EIO_DBN_GET(dmc, ebio->eb_index));
+			rec->cache_state =
+				cpu_to_le64(eio_md_cache_state(dmc,
+							       ebio->eb_index,
+							       VALID | DIRTY));
+			rec++;
+			n++;
+		}
+		spin_unlock_irqrestore(&set->cs_lock, flags);
+	}
+	EIO_ASSERT(b == nr_blocks);
+	eio_jrnl_seal(dmc, hdr, seq + b - 1, n);
+
+	jio->dmc = dmc;
+	jio->sector = eio_jrnl_sector(dmc, seq);
+	INIT_LIST_HEAD(&jio->mdreqs);
+	list_splice_init(batch, &jio->mdreqs);
+	atomic_set(&jio->holdcount, 1);
+	EIO_STATS_ADD(dmc->eio_stats->jrnl_records, nr_recs);
+
+	/* A FUA or flush write waits on these, as in eio_do_mdupdate() */
+	op_flags = EIO_REQ_SYNC;
+	if (fua)
+		op_flags |= EIO_REQ_PREFLUSH | EIO_REQ_FUA;
+
+	region.bdev = dmc->cache_dev->bdev;
+	for (b = 0; b < nr_blocks; b += run) {
+		/* Split where the log wraps around */
+		run = min_t(unsigned, nr_blocks - b, dmc->jrnl_nr_blocks -
+			    EIO_REM(seq + b, dmc->jrnl_nr_blocks));
+		region.sector = eio_jrnl_sector(dmc, seq + b);
+		region.count = run * EIO_JRNL_BLOCK_SECTORS;
+		EIO_STATS_ADD(dmc->eio_stats->jrnl_writes, run);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, to_bytes(region.count));
+		atomic_inc(&jio->holdcount);
+		error = eio_io_async_bvec(dmc, &region, REQ_OP_WRITE, op_flags,
+					  &jio->bvecs[b], run,
+					  eio_jrnl_callback, jio, 0);
+		if (error) {
+			if (!jio->error)
+				jio->error = error;
+			atomic_dec(&jio->holdcount);
+		}
+	}
+	eio_jrnl_callback(0, jio);
+	return 0;
+
+free:
+	eio_jrnl_io_free(jio);
+giveback:
+	eio_jrnl_giveback(dmc, batch, fua);
+	return -ENOSPC;
+}
+
+/*
+ * A clean or a discard rewriting the flat md of a set needs a set record
+ * after it, if the journal still has records of the set: replay would
+ * bring them back otherwise. Reserve its block before the set is
+ * touched, so that running out of journal only defers the clean.
+ * Called with the set rw_lock held for write, or from eio_jrnl_undo().
+ */
+static int
+eio_jrnl_set_reserve(struct cache_c *dmc, index_t set, u_int64_t *seq)
+{
+	*seq = EIO_JRNL_NO_SEQ;
+	if (!dmc->jrnl_sets[0])
+		return 0;
+
+	spin_lock(&dmc->jrnl_lock);
+	if (dmc->jrnl_head == dmc->jrnl_tail ||
+	    (!test_bit(set, dmc->jrnl_sets[0]) &&
+	     !test_bit(set, dmc->jrnl_sets[1]))) {
+		spin_unlock(&dmc->jrnl_lock);
+		return 0;
+	}
+	if (dmc->jrnl_head - dmc->jrnl_tail >= dmc->jrnl_nr_blocks) {
+		spin_unlock(&dmc->jrnl_lock);
+		queue_work(dmc->jrnl_ckpt_q, &dmc->jrnl_ckpt_work);
+		return -ENOSPC;
+	}
+	*seq = dmc->jrnl_head++;
+	__set_bit(set, dmc->jrnl_sets[dmc->jrnl_cur]);
+	spin_unlock(&dmc->jrnl_lock);
+	return 0;
+}
+
+/* Write the set record reserved by eio_jrnl_set_reserve() */
+static int eio_jrnl_set_commit(struct cache_c *dmc, index_t set, u_int64_t seq)
+{
+	struct eio_jrnl_header *hdr;
+	struct eio_jrnl_rec *rec;
+	struct eio_io_region where;
+	struct page *page;
+	int error;
+
+	if (seq == EIO_JRNL_NO_SEQ)
+		return 0;
+
+	page = alloc_page(GFP_NOIO | __GFP_ZERO);
+	if (!page)
+		return -ENOMEM;
+	hdr = page_address(page);
+	rec = (struct eio_jrnl_rec *)(hdr + 1);
+	rec->index = cpu_to_le64((u_int64_t)set | EIO_JRNL_REC_SET);
+	eio_jrnl_seal(dmc, hdr, seq, 1);
+
+	where.bdev = dmc->cache_dev->bdev;
+	where.sector = eio_jrnl_sector(dmc, seq);
+	where.count = EIO_JRNL_BLOCK_SECTORS;
+	EIO_STATS_INC(dmc->eio_stats->jrnl_writes);
+	SECTOR_STATS(dmc->eio_stats->ssd_writes, EIO_JRNL_BLOCK_SIZE);
+	/*
+	 * Not stable before the flat md it stands for, and stable before
+	 * the blocks it drops are reused.
+	 */
+	error = eio_io_sync_pages(dmc, &where, REQ_OP_WRITE, EIO_REQ_SYNC |
+				  EIO_REQ_PREFLUSH | EIO_REQ_FUA, &page, 1);
+	__free_page(page);
+	return error;
+}
+
+/*
+ * A failed journal write may still have put some of its records on the
+ * SSD, and replay would bring back the blocks given up here. Rewrite the
+ * flat md of the set, where they are still DIRTY_INPROG and so INVALID,
+ * and a set record over the records before the blocks are released. The
+ * set rw_lock can't be taken for that: the I/O of the batch holds it for
+ * read until the md update is over, which keeps off cleans, discards
+ * and checkpoints of the set all the same. The md pages of the mdreq
+ * are free until then too. If that fails as well, the md is updated in
+ * place instead, which leaves the records right.
+ */
+static void eio_jrnl_undo(struct work_struct *work)
+{
+	struct mdupdate_request *mdreq;
+	struct cache_c *dmc;
+	struct page *mdpages[2] = { NULL };
+	LIST_HEAD(batch);
+	u_int64_t jseq = EIO_JRNL_NO_SEQ;
+	int error;
+	int k;
+
+	mdreq = container_of(work, struct mdupdate_request, work);
+	dmc = mdreq->dmc;
+
+	EIO_ASSERT(mdreq->mdbvec_count == dmc->mdpage_count);
+	for (k = 0; k < dmc->mdpage_count; k++)
+		mdpages[k] = mdreq->mdblk_bvecs[k].bv_page;
+	error = eio_jrnl_set_reserve(dmc, mdreq->set, &jseq);
+	if (!error)
+		error = eio_set_md_store(dmc, mdreq->set, mdpages);
+	if (!error)
+		error = eio_jrnl_set_commit(dmc, mdreq->set, jseq);
+	if (!error) {
+		eio_post_mdupdate(work);
+		return;
+	}
+
+	pr_err("md journal write failed for cache \"%s\" set %lu, " \
+	       "updating the md in place (error %d)",
+	       dmc->cache_name, (unsigned long)mdreq->set, error);
+	/* As the batch may have had a FUA write */
+	list_add(&mdreq->list, &batch);
+	eio_jrnl_giveback(dmc, &batch, 1);
+	list_del_init(&mdreq->list);
+	eio_do_mdupdate(work);
+}
+
+/*
+ * Checkpoint of the md journal: write the flat md of the sets with live
+ * records from their in-core state, then move the tail up to where the
+ * head was when it started. The set rw_lock waits out the md updates
+ * in flight on the set. Sets journaled meanwhile go to the other map.
+ */
+void eio_jrnl_checkpoint(struct work_struct *work)
+{
+	struct cache_c *dmc;
+	unsigned long *done;
+	unsigned long nr_sets;
+	unsigned long set;
+	u_int64_t target;
+	int error = 0;
+
+	dmc = container_of(work, struct cache_c, jrnl_ckpt_work);
+	nr_sets = (unsigned long)(dmc->size >> dmc->consecutive_shift);
+
+	spin_lock(&dmc->jrnl_lock);
+	target = dmc->jrnl_head;
+	if (target == dmc->jrnl_tail) {
+		spin_unlock(&dmc->jrnl_lock);
+		return;
+	}
+	done = dmc->jrnl_sets[dmc->jrnl_cur];
+	dmc->jrnl_cur ^= 1;
+	spin_unlock(&dmc->jrnl_lock);
+
+	for_each_set_bit(set, done, nr_sets) {
+		down_write(&dmc->cache_sets[set].rw_lock);
+		error = eio_set_md_store(dmc, (index_t)set, dmc->jrnl_mdpages);
+		up_write(&dmc->cache_sets[set].rw_lock);
+		if (error)
+			break;
+	}
+
+	/* The space is reused only once the new tail is in the superblock */
+	if (!error) {
+		spin_lock(&dmc->jrnl_lock);
+		if (target > dmc->jrnl_ckpt_tail)
+			dmc->jrnl_ckpt_tail = target;
+		spin_unlock(&dmc->jrnl_lock);
+		error = eio_sb_store(dmc);
+	}
+
+	spin_lock(&dmc->jrnl_lock);
+	if (error)
+		bitmap_or(dmc->jrnl_sets[dmc->jrnl_cur],
+			  dmc->jrnl_sets[dmc->jrnl_cur], done, nr_sets);
+	else if (target > dmc->jrnl_tail)
+		dmc->jrnl_tail = target;
+	bitmap_zero(done, nr_sets);
+	spin_unlock(&dmc->jrnl_lock);
+
+	if (error) {
+		pr_err("md journal checkpoint failed for cache \"%s\" " \
+		       "(error %d)", dmc->cache_name, error);
+		trace_eio_io_error(dmc, EIO_IOERR_JOURNAL, -1,
+				   eio_jrnl_sector(dmc, target), error);
+	} else
+		EIO_STATS_INC(dmc->eio_stats->jrnl_checkpoints);
+}
+
+/* A run of neighbour sets of a group commit, see eio_md_batch_work() */
+struct eio_md_run {
+	struct work_struct work;
+	struct list_head mdreqs;
+};
+
+static void eio_md_run_do(struct list_head *run)
+{
+	struct mdupdate_request *mdreq, *next;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(mdreq, next, run, list) {
+		list_del_init(&mdreq->list);
+		eio_do_mdupdate(&mdreq->work);
+	}
+	blk_finish_plug(&plug);
+}
+
+static void eio_md_run_work(struct work_struct *work)
+{
+	struct eio_md_run *r = container_of(work, struct eio_md_run, work);
+
+	eio_md_run_do(&r->mdreqs);
+	kfree(r);
+}
+
+void eio_md_batch_work(struct work_struct *work)
+{
+	struct cache_c *dmc;
+	struct mdupdate_request *mdreq, *last;
+	struct eio_md_run *r;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	LIST_HEAD(run);
+
+	dmc = container_of(work, struct cache_c, md_batch_work.work);
+
+	spin_lock_irqsave(&dmc->md_batch_lock, flags);
+	list_splice_init(&dmc->md_batch, &batch);
+	dmc->md_batch_len = 0;
+	spin_unlock_irqrestore(&dmc->md_batch_lock, flags);
+
+	if (list_empty(&batch))
+		return;
+
+	EIO_STATS_INC(dmc->eio_stats->md_commits);
+	list_sort(NULL, &batch, eio_mdreq_cmp);
+	if (dmc->sysctl_active.md_journal && !eio_jrnl_commit(dmc, &batch))
+		return;
+
+	/*
+	 * Hand each run of neighbour sets but the last to a work of its
+	 * own, the last one is written from here. Without memory for a
+	 * run, it is written from here too.
+	 */
+	while (!list_empty(&batch)) {
+		last = list_first_entry(&batch, struct mdupdate_request, list);
+		list_for_each_entry_continue(last, &batch, list) {
+			mdreq = list_entry(last->list.prev,
+					   struct mdupdate_request, list);
+			if (last->set != mdreq->set + 1)
+				break;
+		}
+		last = list_entry(last->list.prev, struct mdupdate_request,
+				  list);
+		list_cut_position(&run, &batch, &last->list);
+		r = NULL;
+		if (!list_empty(&batch))
+			r = kmalloc(sizeof(*r), GFP_NOIO);
+		if (r == NULL) {
+			eio_md_run_do(&run);
+			continue;
+		}
+		INIT_WORK(&r->work, eio_md_run_work);
+		INIT_LIST_HEAD(&r->mdreqs);
+		list_splice_init(&run, &r->mdreqs);
+		queue_work(dmc->mdupdate_q, &r->work);
+	}
+}
+
 /* Do metadata update for a set */
 static void eio_do_mdupdate(struct work_struct *work)
 {
@@ -1100,6 +2520,7 @@ static void eio_do_mdupdate(struct work_struct *work)
 	void *pg_virt_addr[2] = { NULL };
 	u_int8_t sector_bits[2] = { 0 };
 	int startbit, endbit;
+	unsigned op_flags;
 
 	mdreq = container_of(work, struct mdupdate_request, work);
 	dmc = mdreq->dmc;
@@ -1132,7 +2553,9 @@ static void eio_do_mdupdate(struct work_struct *work)
 		cstate = EIO_CACHE_STATE_GET(dmc, i);
 		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
 		if (cstate == ALREADY_DIRTY)
-			md_blocks->cache_state = cpu_to_le64((VALID | DIRTY));
+			md_blocks->cache_state =
+				cpu_to_le64(eio_md_cache_state(dmc, i,
+							       VALID | DIRTY));
 		else
 			md_blocks->cache_state = cpu_to_le64(INVALID);
 		md_blocks++;
@@ -1162,7 +2585,9 @@ static void eio_do_mdupdate(struct work_struct *work)
 		sector_bits[pindex] |= (1 << INDEX_TO_MD_SECTOR(blk_index));
 
 		md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-		md_blocks[blk_index].cache_state = (VALID | DIRTY);
+		md_blocks[blk_index].cache_state =
+			cpu_to_le64(eio_md_cache_state(dmc, ebio->eb_index,
+						       VALID | DIRTY));
 
 		ebio = ebio->eb_next;
 	}
@@ -1184,6 +2609,16 @@ static void eio_do_mdupdate(struct work_struct *work)
 	mdreq->inprog_mdlist = mdreq->pending_mdlist;
 	mdreq->pending_mdlist = NULL;
 
+	/*
+	 * Set SYNC for making metadata writes as high priority. A FUA or
+	 * flush write waiting on the update needs its data and the md
+	 * stable on the SSD.
+	 */
+	op_flags = EIO_REQ_SYNC;
+	if (mdreq->fua)
+		op_flags |= EIO_REQ_PREFLUSH | EIO_REQ_FUA;
+	mdreq->fua = 0;
+
 	spin_unlock_irqrestore(&set->cs_lock, flags);
 
 	for (k = 0; k < (int)mdreq->mdbvec_count; k++)
@@ -1223,15 +2658,13 @@ static void eio_do_mdupdate(struct work_struct *work)
 
 		EIO_ASSERT(region.sector <=
 			   (dmc->md_start_sect + INDEX_TO_MD_SECTOR(end_index)));
-		atomic64_inc(&dmc->eio_stats.md_ssd_writes);
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, to_bytes(region.count));
+		EIO_STATS_INC(dmc->eio_stats->md_ssd_writes);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, to_bytes(region.count));
 		atomic_inc(&mdreq->holdcount);
-
-		/*
-		 * Set SYNC for making metadata
-		 * writes as high priority.
-		 */
-		error = eio_io_async_bvec(dmc, &region, REQ_OP_WRITE, EIO_REQ_SYNC,
+		trace_eio_mdupdate_submit(dmc, mdreq->set, region.sector,
+					  region.count);
+
+		error = eio_io_async_bvec(dmc, &region, REQ_OP_WRITE, op_flags,
 					  &mdreq->mdblk_bvecs[i], 1,
 					  eio_mdupdate_callback, work, 0);
 		if (error && !(mdreq->error))
@@ -1277,6 +2710,11 @@ static void eio_post_mdupdate(struct work_struct *work)
 	set_index = mdreq->set;
 	set = &dmc->cache_sets[set_index];
 	error = mdreq->error;
+	if (error)
+		trace_eio_io_error(dmc, EIO_IOERR_MDUPDATE, set_index,
+				   dmc->md_start_sect +
+				   INDEX_TO_MD_SECTOR(set_index * dmc->assoc),
+				   error);
 
 	/* Update in-core cache metadata */
 
@@ -1293,12 +2731,12 @@ static void eio_post_mdupdate(struct work_struct *work)
 			   DIRTY_INPROG);
 		if (unlikely(error)) {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 		} else {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, ALREADY_DIRTY);
 			set->nr_dirty++;
 			atomic64_inc(&dmc->nr_dirty);
-			atomic64_inc(&dmc->eio_stats.md_write_dirty);
+			EIO_STATS_INC(dmc->eio_stats->md_write_dirty);
 		}
 		ebio = ebio->eb_next;
 	}
@@ -1342,11 +2780,10 @@ static void eio_post_mdupdate(struct work_struct *work)
 
 	if (more_pending_mdupdates) {
 		/*
-		 * Schedule work to process the new
-		 * pending mdupdate requests
+		 * Queue the new pending mdupdate requests
+		 * for the next group commit
 		 */
-		INIT_WORK(&mdreq->work, eio_do_mdupdate);
-		queue_work(dmc->mdupdate_q, &mdreq->work);
+		eio_md_batch_add(dmc, mdreq);
 	} else {
 		/*
 		 * No more pending mdupdates.
@@ -1359,7 +2796,7 @@ static void eio_post_mdupdate(struct work_struct *work)
 			kfree(mdreq->mdblk_bvecs);
 		}
 
-		kfree(mdreq);
+		mempool_free(mdreq, _mdreq_pool);
 	}
 }
 
@@ -1372,7 +2809,9 @@ static void eio_enq_mdupdate(struct bio_container *bc)
 	struct cache_set *set = NULL;
 	struct mdupdate_request *mdreq;
 	int do_schedule;
+	int fua;
 
+	fua = (bio_flags(bc->bc_bio) & (EIO_REQ_FUA | EIO_REQ_PREFLUSH)) != 0;
 	ebio = bc->bc_mdlist;
 	set_index = -1;
 	do_schedule = 0;
@@ -1405,12 +2844,14 @@ static void eio_enq_mdupdate(struct bio_container *bc)
 			mdreq->pending_mdlist = ebio;
 		}
 
+		if (fua)
+			mdreq->fua = 1;
+
 		ebio = bc->bc_mdlist;
 		if (!ebio || ebio->eb_cacheset != set_index) {
 			spin_unlock(&set->cs_lock);
 			if (do_schedule) {
-				INIT_WORK(&mdreq->work, eio_do_mdupdate);
-				queue_work(dmc->mdupdate_q, &mdreq->work);
+				eio_md_batch_add(dmc, mdreq);
 				do_schedule = 0;
 			}
 		}
@@ -1428,6 +2869,9 @@ void eio_md_write(struct kcached_job *job)
 	struct bio_container *bc = ebio->eb_bc;
 	unsigned long flags;
 
+	/* The ebio may be ended by the md update as soon as it is queued */
+	eio_free_cache_job(job);
+
 	/*
 	 * ebios are stored in ascending order of cache sets.
 	 */
@@ -1451,8 +2895,6 @@ void eio_md_write(struct kcached_job *job)
 	if (bc->bc_mdwait == 0)
 		eio_enq_mdupdate(bc);
 	spin_unlock_irqrestore(&bc->bc_lock, flags);
-
-	eio_free_cache_job(job);
 }
 
 /* Ensure cache level dirty thresholds compliance. If required, trigger cache-wide clean */
@@ -1536,55 +2978,60 @@ void eio_comply_dirty_thresholds(struct cache_c *dmc, index_t set)
 	eio_check_dirty_cache_thresholds(dmc);
 }
 
-/* Do read from cache */
+/* part of eio_cached_read, also called back by eio_issue_jobs() */
+static void eio_cached_read_fail(struct cache_c *dmc, struct eio_bio *ebio,
+				 struct kcached_job *job, int err)
+{
+	unsigned long flags;
+
+	pr_err("eio_cached_read: IO submission failed, block %llu",
+	       EIO_DBN_GET(dmc, ebio->eb_index));
+	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	/*
+	 * For already DIRTY block, invalidation is too costly, skip it.
+	 * For others, mark the block as INVALID and return error.
+	 */
+	if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) != ALREADY_DIRTY) {
+		EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
+	}
+	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+			       flags);
+	if (job) {
+		job->ebio = NULL;
+		eio_free_cache_job(job);
+		job = NULL;
+	}
+	eb_endio(ebio, err);
+	ebio = NULL;
+}
+
+/*
+ * Do read from cache. The job is appended at "tail", for the caller to
+ * issue with the other hits of the bio.
+ */
 static void
-eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigned op_flags)
+eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio,
+		struct kcached_job ***tail)
 {
 	struct kcached_job *job;
-	index_t index = ebio->eb_index;
-	int err = 0;
 
-	job = eio_new_job(dmc, ebio, index);
+	job = eio_new_job(dmc, ebio, ebio->eb_index);
+	if (unlikely(job == NULL)) {
+		eio_cached_read_fail(dmc, ebio, NULL, -ENOMEM);
+		return;
+	}
 
-	if (unlikely(job == NULL))
-		err = -ENOMEM;
-	else {
-		job->action = READCACHE;        /* Fetch data from cache */
-		atomic_inc(&dmc->nr_jobs);
+	job->action = READCACHE;        /* Fetch data from cache */
+	atomic_inc(&dmc->nr_jobs);
 
-		SECTOR_STATS(dmc->eio_stats.read_hits, ebio->eb_size);
-		SECTOR_STATS(dmc->eio_stats.ssd_reads, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.readcache);
-		err =
-			eio_io_async_bvec(dmc, &job->job_io_regions.cache, op, op_flags,
-					  ebio->eb_bv, ebio->eb_nbvec,
-					  eio_io_callback, job, 0);
+	SECTOR_STATS(dmc->eio_stats->read_hits, ebio->eb_size);
+	SECTOR_STATS(dmc->eio_stats->ssd_reads, ebio->eb_size);
+	EIO_STATS_INC(dmc->eio_stats->readcache);
 
-	}
-	if (err) {
-		unsigned long flags;
-		pr_err("eio_cached_read: IO submission failed, block %llu",
-		       EIO_DBN_GET(dmc, index));
-		spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
-				  flags);
-		/*
-		 * For already DIRTY block, invalidation is too costly, skip it.
-		 * For others, mark the block as INVALID and return error.
-		 */
-		if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) != ALREADY_DIRTY) {
-			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
-		}
-		spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].
-				       cs_lock, flags);
-		eb_endio(ebio, err);
-		ebio = NULL;
-		if (job) {
-			job->ebio = NULL;
-			eio_free_cache_job(job);
-			job = NULL;
-		}
-	}
+	job->next = NULL;
+	**tail = job;
+	*tail = &job->next;
 }
 
 /*
@@ -1616,8 +3063,7 @@ eio_inval_block_set_range(struct cache_c *dmc, int set, sector_t iosector,
 			    (EIO_CACHE_STATE_GET(dmc, i) &
 			     (BLOCK_IO_INPROG | DIRTY | QUEUED))) {
 				EIO_CACHE_STATE_SET(dmc, i, INVALID);
-				atomic64_dec_if_positive(&dmc->eio_stats.
-							 cached_blocks);
+				atomic64_dec_if_positive(&dmc->cached_blocks);
 				if (multiblk)
 					continue;
 				return 0;
@@ -1693,6 +3139,220 @@ void eio_inval_range(struct cache_c *dmc, sector_t iosector, unsigned iosize)
 	}
 }
 
+/*
+ * Mark the dirty blocks of a set that lie wholly inside a discarded range
+ * CLEAN_INPROG, so that eio_set_md_store() writes them as INVALID. Writes
+ * to them go to HDD from now on. Called with cs_lock held.
+ */
+static int
+eio_discard_mark_dirty(struct cache_c *dmc, index_t set, sector_t iosector,
+		       unsigned iosize)
+{
+	index_t i, start_index, end_index;
+	sector_t endsector = iosector + eio_to_sector(iosize);
+	sector_t start_dbn;
+	int ndrop = 0;
+
+	start_index = dmc->assoc * set;
+	end_index = start_index + dmc->assoc;
+	for (i = start_index; i < end_index; i++) {
+		if (EIO_CACHE_STATE_GET(dmc, i) != ALREADY_DIRTY)
+			continue;
+		start_dbn = EIO_DBN_GET(dmc, i);
+		if (start_dbn < iosector ||
+		    start_dbn + dmc->block_size > endsector)
+			continue;
+		EIO_CACHE_STATE_SET(dmc, i, CLEAN_INPROG);
+		ndrop++;
+	}
+	return ndrop;
+}
+
+/*
+ * Persist and then drop the dirty blocks marked by eio_discard_mark_dirty().
+ * If the metadata write fails, or there are no md pages for it, they are
+ * left dirty, as a failed clean does.
+ * Called with the set rw_lock held for write.
+ */
+static void
+eio_discard_drop_dirty(struct cache_c *dmc, index_t set, struct page **mdpages)
+{
+	index_t i, start_index, end_index;
+	unsigned long flags;
+	u_int64_t jseq = EIO_JRNL_NO_SEQ;
+	int error;
+
+	error = mdpages[dmc->mdpage_count - 1] ? 0 : -ENOMEM;
+	if (!error)
+		error = eio_jrnl_set_reserve(dmc, set, &jseq);
+	if (!error)
+		error = eio_set_md_store(dmc, set, mdpages);
+	if (!error)
+		error = eio_jrnl_set_commit(dmc, set, jseq);
+
+	start_index = dmc->assoc * set;
+	end_index = start_index + dmc->assoc;
+	spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+	for (i = start_index; i < end_index; i++) {
+		if (EIO_CACHE_STATE_GET(dmc, i) != CLEAN_INPROG)
+			continue;
+		if (error) {
+			EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
+			continue;
+		}
+		EIO_CACHE_STATE_SET(dmc, i, INVALID);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
+		EIO_ASSERT(dmc->cache_sets[set].nr_dirty > 0);
+		dmc->cache_sets[set].nr_dirty--;
+		atomic64_dec(&dmc->nr_dirty);
+	}
+	spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+	if (error)
+		pr_err("eio_discard_range: md update failed for set %lu, " \
+		       "dirty blocks kept (error %d)",
+		       (unsigned long)set, error);
+}
+
+/* Dropping the dirty blocks of a discard, on the mdupdate workqueue */
+struct eio_discard_req {
+	struct work_struct work;
+	struct cache_c *dmc;
+	struct bio *bio;                /* forwarded when done, if ours */
+	struct eio_discard_fwd *fwd;    /* or put, for an overlapping one */
+	sector_t sector;
+	unsigned size;
+};
+
+/*
+ * Drop the dirty blocks a discard marked CLEAN_INPROG. Like a clean,
+ * this holds the set rw_lock for write, so that no application I/O or
+ * md update is in flight on the set, and rewrites the set metadata
+ * before the blocks become free. A clean of the set meanwhile takes the
+ * marked blocks along. The discard goes on to the source device after
+ * that, so that a clean can't write the dropped data over it.
+ */
+static void eio_discard_work(struct work_struct *work)
+{
+	struct eio_discard_req *dreq;
+	struct cache_c *dmc;
+	struct page *mdpages[2] = { NULL };
+	u_int32_t bset;
+	sector_t snum;
+	sector_t snext;
+	unsigned ioinset, iosize;
+	unsigned long flags;
+	index_t i, start_index;
+	int totalsshift;
+	int ndrop;
+	int k;
+
+	dreq = container_of(work, struct eio_discard_req, work);
+	dmc = dreq->dmc;
+	totalsshift = dmc->block_shift + dmc->consecutive_shift;
+
+	/* Without md pages, the marked blocks go back to dirty */
+	EIO_ASSERT(dmc->mdpage_count <= 2);
+	for (k = 0; k < dmc->mdpage_count; k++) {
+		mdpages[k] = alloc_page(GFP_NOIO | __GFP_ZERO);
+		if (!mdpages[k])
+			break;
+	}
+
+	snum = dreq->sector;
+	iosize = dreq->size;
+	while (iosize) {
+		bset = hash_block(dmc, snum);
+		snext = ((snum >> totalsshift) + 1) << totalsshift;
+		ioinset = (unsigned)to_bytes(snext - snum);
+		if (ioinset > iosize)
+			ioinset = iosize;
+		down_write(&dmc->cache_sets[bset].rw_lock);
+		start_index = dmc->assoc * bset;
+		ndrop = 0;
+		spin_lock_irqsave(&dmc->cache_sets[bset].cs_lock, flags);
+		for (i = start_index; i < start_index + dmc->assoc; i++)
+			if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG)
+				ndrop++;
+		spin_unlock_irqrestore(&dmc->cache_sets[bset].cs_lock, flags);
+		if (ndrop)
+			eio_discard_drop_dirty(dmc, bset, mdpages);
+		up_write(&dmc->cache_sets[bset].rw_lock);
+		snum = snext;
+		iosize -= ioinset;
+	}
+
+	for (k = 0; k < dmc->mdpage_count; k++)
+		if (mdpages[k])
+			put_page(mdpages[k]);
+	if (dreq->bio)
+		eio_discard_forward(dmc, dreq->bio);
+	else
+		eio_discard_fwd_put(dreq->fwd);
+	percpu_counter_dec(&dmc->nr_ios);
+	kfree(dreq);
+}
+
+/*
+ * Invalidate the cache blocks covered by a discard. It is called in the
+ * bio submit path, so only the clean blocks are invalidated here. In WB
+ * mode the dirty blocks lying wholly inside the range are marked, and
+ * eio_discard_work() drops them, as that needs the set locks and md
+ * writes. Partly covered dirty blocks are kept.
+ * Returns 1 if the work took "bio" over, to forward it when done, or a
+ * reference to "fwd", to put it, 0 if the caller goes on with them.
+ * Without either, the dirty blocks are kept.
+ */
+int eio_discard_range(struct cache_c *dmc, sector_t iosector, unsigned iosize,
+		      struct bio *bio, struct eio_discard_fwd *fwd)
+{
+	struct eio_discard_req *dreq = NULL;
+	u_int32_t bset;
+	sector_t snum;
+	sector_t snext;
+	unsigned ioinset, size;
+	unsigned long flags;
+	int totalsshift = dmc->block_shift + dmc->consecutive_shift;
+	int ndrop = 0;
+
+	/* Without memory, the dirty blocks are kept */
+	if (dmc->mode == CACHE_MODE_WB && atomic64_read(&dmc->nr_dirty) &&
+	    (bio || fwd))
+		dreq = kmalloc(sizeof(*dreq), GFP_NOWAIT);
+
+	snum = iosector;
+	size = iosize;
+	while (size) {
+		bset = hash_block(dmc, snum);
+		snext = ((snum >> totalsshift) + 1) << totalsshift;
+		ioinset = (unsigned)to_bytes(snext - snum);
+		if (ioinset > size)
+			ioinset = size;
+		spin_lock_irqsave(&dmc->cache_sets[bset].cs_lock, flags);
+		if (dreq && dmc->cache_sets[bset].nr_dirty)
+			ndrop += eio_discard_mark_dirty(dmc, bset, snum,
+							ioinset);
+		eio_inval_block_set_range(dmc, bset, snum, ioinset, 1);
+		spin_unlock_irqrestore(&dmc->cache_sets[bset].cs_lock, flags);
+		snum = snext;
+		size -= ioinset;
+	}
+
+	if (!ndrop) {
+		kfree(dreq);
+		return 0;
+	}
+
+	INIT_WORK(&dreq->work, eio_discard_work);
+	dreq->dmc = dmc;
+	dreq->bio = bio;
+	dreq->fwd = fwd;
+	dreq->sector = iosector;
+	dreq->size = iosize;
+	percpu_counter_inc(&dmc->nr_ios);
+	queue_work(dmc->mdupdate_q, &dreq->work);
+	return bio != NULL;
+}
+
 /*
  * Invalidates all cached blocks without waiting for them to complete
  * Should be called with incoming IO suspended
@@ -1780,8 +3440,8 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		err = -ENOMEM;
 	else {
 		job->action = WRITECACHE;
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.writecache);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);
+		EIO_STATS_INC(dmc->eio_stats->writecache);
 		err = eio_io_async_bvec(dmc, &job->job_io_regions.cache, REQ_OP_WRITE, 0,
 					ebio->eb_bv, ebio->eb_nbvec,
 					eio_io_callback, job, 0);
@@ -1803,7 +3463,7 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		else {
 			/* Mark the block as INVALID for non-DIRTY block. */
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 			/* Set the INVAL flag to ensure block is marked invalid at the end */
 			ebio->eb_iotype |= EB_INVAL;
 			ebio->eb_index = -1;
@@ -1820,12 +3480,44 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 	return err;
 }
 
-/* Serving write I/Os that can be fulfilled just by SSD */
-static int
-eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigned op_flags)
+/* part of eio_cached_write, also called back by eio_issue_jobs() */
+static void eio_cached_write_fail(struct cache_c *dmc, struct eio_bio *ebio,
+				  struct kcached_job *job, int err)
+{
+	unsigned long flags;
+	u_int8_t cstate;
+
+	pr_err("eio_cached_write: IO submission failed, block %llu",
+	       EIO_DBN_GET(dmc, ebio->eb_index));
+	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	cstate = EIO_CACHE_STATE_GET(dmc, ebio->eb_index);
+	if (cstate == DIRTY_INPROG) {
+		/* A DIRTY(inprog) block should be invalidated on error */
+		EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
+	} else
+		/* An already DIRTY block don't have an option but just return error. */
+		EIO_ASSERT(cstate == ALREADY_DIRTY);
+	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+			       flags);
+	if (job) {
+		job->ebio = NULL;
+		eio_free_cache_job(job);
+		job = NULL;
+	}
+	eb_endio(ebio, err);
+	ebio = NULL;
+}
+
+/*
+ * Serving write I/Os that can be fulfilled just by SSD. The job is
+ * appended at "tail", for the caller to issue with the rest of the bio.
+ */
+static void
+eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio,
+		 struct kcached_job ***tail)
 {
 	struct kcached_job *job;
-	int err = 0;
 	index_t index = ebio->eb_index;
 	unsigned long flags = 0;
 	u_int8_t cstate;
@@ -1848,52 +3540,237 @@ eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigne
 	cstate = EIO_CACHE_STATE_GET(dmc, index);
 	if (!(cstate & DIRTY)) {
 		EIO_ASSERT(cstate & CACHEWRITEINPROG);
-		/* make sure the block is marked DIRTY inprogress */
+		/*
+		 * make sure the block is marked DIRTY inprogress. Only the
+		 * sub-blocks being written become dirty.
+		 */
 		EIO_CACHE_STATE_SET(dmc, index, DIRTY_INPROG);
+		dmc->cache_sbmap[index].sb_clean =
+			dmc->sb_full & ~eio_sb_covered(dmc, ebio);
 	}
 	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
 			       flags);
 
 	job = eio_new_job(dmc, ebio, index);
-	if (unlikely(job == NULL))
-		err = -ENOMEM;
-	else {
-		job->action = WRITECACHE;
+	if (unlikely(job == NULL)) {
+		eio_cached_write_fail(dmc, ebio, NULL, -ENOMEM);
+		return;
+	}
+
+	job->action = WRITECACHE;
+
+	SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);
+	EIO_STATS_INC(dmc->eio_stats->writecache);
+
+	job->next = NULL;
+	**tail = job;
+	*tail = &job->next;
+}
 
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.writecache);
-		EIO_ASSERT(op == REQ_OP_WRITE);
-		err = eio_io_async_bvec(dmc, &job->job_io_regions.cache, op, op_flags,
-					  ebio->eb_bv, ebio->eb_nbvec,
-					  eio_io_callback, job, 0);
+/*
+ * Allocate an ebio with room for "nr_rbvecs" residual bvecs, which
+ * eb_bv then points to. Take it from the bc arena if there is one,
+ * else from _ebio_pool when the bvecs fit inline.
+ */
+static struct eio_bio *eb_alloc(struct bio_container *bc, int nr_rbvecs)
+{
+	struct eio_bio_arena *arena = bc->bc_arena;
+	struct eio_bio *ebio;
 
+	if (arena && arena->used_ebios < arena->nr_ebios &&
+	    arena->used_bvecs + nr_rbvecs <= arena->nr_bvecs) {
+		ebio = &arena->ebios[arena->used_ebios++];
+		ebio->eb_alloc = EB_ALLOC_ARENA;
+		ebio->eb_bv = &arena->bvecs[arena->used_bvecs];
+		arena->used_bvecs += nr_rbvecs;
+		return ebio;
 	}
 
-	if (err) {
-		pr_err("eio_cached_write: IO submission failed, block %llu",
-		       EIO_DBN_GET(dmc, index));
-		spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
-				  flags);
-		cstate = EIO_CACHE_STATE_GET(dmc, index);
-		if (cstate == DIRTY_INPROG) {
-			/* A DIRTY(inprog) block should be invalidated on error */
-			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
-		} else
-			/* An already DIRTY block don't have an option but just return error. */
-			EIO_ASSERT(cstate == ALREADY_DIRTY);
-		spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].
-				       cs_lock, flags);
-		eb_endio(ebio, err);
-		ebio = NULL;
-		if (job) {
-			job->ebio = NULL;
-			eio_free_cache_job(job);
-			job = NULL;
+	if (nr_rbvecs <= EB_INLINE_BVECS) {
+		ebio = mempool_alloc(_ebio_pool, GFP_NOWAIT);
+		if (!ebio)
+			return NULL;
+		ebio->eb_alloc = EB_ALLOC_POOL;
+	} else {
+		ebio = kmalloc(sizeof(struct eio_bio) +
+			       nr_rbvecs * sizeof(struct bio_vec), GFP_NOWAIT);
+		if (!ebio)
+			return NULL;
+		ebio->eb_alloc = EB_ALLOC_KMALLOC;
+	}
+	ebio->eb_bv = ebio->eb_rbv;
+	return ebio;
+}
+
+/*
+ * A read may be widened to a whole cache block (read_around) when it is
+ * smaller than a block, stays within one block and the block lies
+ * entirely on the source device.
+ */
+static int eio_readaround_ok(struct cache_c *dmc, struct bio *bio)
+{
+	sector_t start = EIO_ROUND_SECTOR(dmc, EIO_BIO_BI_SECTOR(bio));
+	sector_t end = EIO_BIO_BI_SECTOR(bio) +
+		       eio_to_sector(EIO_BIO_BI_SIZE(bio));
+
+	if (eio_to_sector(EIO_BIO_BI_SIZE(bio)) >= dmc->block_size)
+		return 0;
+	if (end > start + dmc->block_size)
+		return 0;
+	if (start + dmc->block_size > dmc->disk_size)
+		return 0;
+	return 1;
+}
+
+/*
+ * Sequential stream detection. A bio that starts where one of the
+ * tracked streams ended extends that stream, otherwise it starts a new
+ * one in place of the least recently used. Once a stream has run for
+ * seq_io_cutoff KB, its bios no longer allocate cache blocks on a miss:
+ * hits are still served from and kept coherent in the cache, misses go
+ * to the source device only.
+ * The slots are claimed with a cmpxchg on next_sector, so that of two
+ * bios racing for a slot only one moves it on. The other retries once
+ * and is then treated as random I/O; the detection is a heuristic.
+ * Returns 1 if the bio is to bypass cache allocation.
+ */
+static int eio_seq_detect(struct cache_c *dmc, struct bio *bio)
+{
+	struct eio_seq_stream *stream, *lru;
+	sector_t sector = EIO_BIO_BI_SECTOR(bio);
+	unsigned size = EIO_BIO_BI_SIZE(bio);
+	sector_t next = sector + eio_to_sector(size);
+	u_int64_t cutoff;
+	u_int64_t seq_bytes = 0;
+	s64 old;
+	int bypass;
+	int retry;
+	int i;
+
+	cutoff = (u_int64_t)dmc->sysctl_active.seq_io_cutoff << 10;
+	if (!cutoff)
+		return 0;
+
+	for (retry = 0; retry < 2; retry++) {
+		lru = NULL;
+		for (i = 0; i < EIO_SEQ_STREAMS; i++) {
+			stream = &dmc->seq_streams[i];
+			if (atomic64_read(&stream->seq_bytes) &&
+			    atomic64_read(&stream->next_sector) == sector)
+				break;
+			if (!lru || time_before(READ_ONCE(stream->last_used),
+						READ_ONCE(lru->last_used)))
+				lru = stream;
+		}
+		if (i < EIO_SEQ_STREAMS) {
+			if (atomic64_cmpxchg(&stream->next_sector, sector,
+					     next) != sector)
+				continue;
+			seq_bytes = atomic64_add_return(size,
+							&stream->seq_bytes);
+		} else {
+			stream = lru;
+			old = atomic64_read(&stream->next_sector);
+			if (atomic64_cmpxchg(&stream->next_sector, old,
+					     next) != old)
+				continue;
+			atomic64_set(&stream->seq_bytes, size);
+			seq_bytes = size;
 		}
+		WRITE_ONCE(stream->last_used, jiffies);
+		break;
 	}
+	bypass = (seq_bytes >= cutoff);
 
-	return err;
+	if (bypass) {
+		if (bio_data_dir(bio) == READ)
+			SECTOR_STATS(dmc->eio_stats->seq_bypass_reads, size);
+		else
+			SECTOR_STATS(dmc->eio_stats->seq_bypass_writes, size);
+	}
+	return bypass;
+}
+
+/*
+ * Apply the io_hints rules to a bio: readahead and idle class I/O may be
+ * kept out of the cache, metadata may be cached past the sequential
+ * bypass and admission. With EIO_HINT_VICTIM the hints also go to the
+ * replacement policy, so that background I/O does not push out the
+ * blocks of latency critical I/O.
+ */
+static void
+eio_bio_hints(struct cache_c *dmc, struct bio_container *bc, struct bio *bio)
+{
+	uint32_t rules = dmc->sysctl_active.io_hints;
+	int class = IOPRIO_PRIO_CLASS(EIO_BIO_IOPRIO(bio));
+	int rahead = (bio->bi_opf & REQ_RAHEAD) != 0;
+	int meta = (bio->bi_opf & EIO_REQ_META) != 0;
+
+	if (meta && (rules & EIO_HINT_META_ADMIT)) {
+		bc->bc_bypass = 0;
+		bc->bc_admit = 1;
+		EIO_STATS_INC(dmc->eio_stats->hint_admit);
+	} else if ((rahead && (rules & EIO_HINT_RAHEAD_NOFILL)) ||
+		   (class == IOPRIO_CLASS_IDLE &&
+		    (rules & EIO_HINT_IDLE_NOALLOC))) {
+		if (!bc->bc_bypass)
+			EIO_STATS_INC(dmc->eio_stats->hint_bypass);
+		bc->bc_bypass = 1;
+	}
+
+	if (rules & EIO_HINT_VICTIM) {
+		if (meta || class == IOPRIO_CLASS_RT)
+			bc->bc_access = EIO_ACCESS_HOT;
+		else if (rahead || class == IOPRIO_CLASS_IDLE)
+			bc->bc_access = EIO_ACCESS_COLD;
+	}
+}
+
+/*
+ * Set up the ebio arena for a bio spanning more than one cache block.
+ * Every block gets an ebio, plus one for the whole bio in case it
+ * goes to disk. A bvec split at a block boundary needs one more
+ * residual bvec per block. Without an arena the ebios come from the pool,
+ * as do the extra disk ebios of a write split between SSD and HDD.
+ * Arenas of the common sizes come from _arena_pool, larger ones are
+ * kmalloc'ed.
+ */
+static void eio_alloc_arena(struct cache_c *dmc, struct bio_container *bc)
+{
+	struct bio *bio = bc->bc_bio;
+	struct eio_bio_arena *arena;
+	sector_t first, last;
+	unsigned nr_blocks, nr_bvecs;
+
+	first = EIO_BIO_BI_SECTOR(bio) >> dmc->block_shift;
+	last = (EIO_BIO_BI_SECTOR(bio) +
+		eio_to_sector(EIO_BIO_BI_SIZE(bio)) - 1) >> dmc->block_shift;
+	nr_blocks = (unsigned)(last - first) + 1;
+	if (nr_blocks < 2)
+		return;
+	nr_bvecs = bio->bi_vcnt + nr_blocks;
+
+	if (nr_blocks <= EIO_ARENA_BLOCKS && nr_bvecs <= EIO_ARENA_BVECS) {
+		arena = mempool_alloc(_arena_pool, GFP_NOWAIT);
+		if (!arena)
+			return;
+		arena->pooled = 1;
+		nr_blocks = EIO_ARENA_BLOCKS;
+		nr_bvecs = EIO_ARENA_BVECS;
+	} else {
+		arena = kmalloc(sizeof(*arena) +
+				(nr_blocks + 1) * sizeof(struct eio_bio) +
+				nr_bvecs * sizeof(struct bio_vec), GFP_NOWAIT);
+		if (!arena)
+			return;
+		arena->pooled = 0;
+	}
+	arena->ebios = (struct eio_bio *)(arena + 1);
+	arena->bvecs = (struct bio_vec *)(arena->ebios + nr_blocks + 1);
+	arena->nr_ebios = nr_blocks + 1;
+	arena->nr_bvecs = nr_bvecs;
+	arena->used_ebios = arena->used_bvecs = 0;
+	bc->bc_arena = arena;
 }
 
 static struct eio_bio *eio_new_ebio(struct cache_c *dmc, struct bio *bio,
@@ -1937,39 +3814,34 @@ static struct eio_bio *eio_new_ebio(struct cache_c *dmc, struct bio *bio,
 			ios -= len;
 			bvecindex++;
 		}
-		ebio =
-			kmalloc(sizeof(struct eio_bio) +
-				numbvecs * sizeof(struct bio_vec), GFP_NOWAIT);
-
+		ebio = eb_alloc(bc, numbvecs);
 		if (!ebio)
 			return ERR_PTR(-ENOMEM);
 
 		rbvindex = 0;
 		ios = iosize;
 		while (ios > 0) {
-			ebio->eb_rbv[rbvindex].bv_page =
+			ebio->eb_bv[rbvindex].bv_page =
 				bio->bi_io_vec[EIO_BIO_BI_IDX(bio)].bv_page;
-			ebio->eb_rbv[rbvindex].bv_offset =
+			ebio->eb_bv[rbvindex].bv_offset =
 				bio->bi_io_vec[EIO_BIO_BI_IDX(bio)].bv_offset +
 				residual_biovec;
-			ebio->eb_rbv[rbvindex].bv_len =
+			ebio->eb_bv[rbvindex].bv_len =
 				bio->bi_io_vec[EIO_BIO_BI_IDX(bio)].bv_len -
 				residual_biovec;
-			if (ebio->eb_rbv[rbvindex].bv_len > (unsigned)ios) {
+			if (ebio->eb_bv[rbvindex].bv_len > (unsigned)ios) {
 				residual_biovec += ios;
-				ebio->eb_rbv[rbvindex].bv_len = ios;
+				ebio->eb_bv[rbvindex].bv_len = ios;
 			} else {
 				residual_biovec = 0;
 				EIO_BIO_BI_IDX(bio)++;
 			}
-			ios -= ebio->eb_rbv[rbvindex].bv_len;
+			ios -= ebio->eb_bv[rbvindex].bv_len;
 			rbvindex++;
 		}
 		EIO_ASSERT(rbvindex == numbvecs);
-		ebio->eb_bv = ebio->eb_rbv;
 	} else {
-		ebio = kmalloc(sizeof(struct eio_bio), GFP_NOWAIT);
-
+		ebio = eb_alloc(bc, 0);
 		if (!ebio)
 			return ERR_PTR(-ENOMEM);
 		ebio->eb_bv = bio->bi_io_vec + EIO_BIO_BI_IDX(bio);
@@ -2001,6 +3873,10 @@ static struct eio_bio *eio_new_ebio(struct cache_c *dmc, struct bio *bio,
 	ebio->eb_index = -1;
 	ebio->eb_iotype = iotype;
 	ebio->eb_nbvec = numbvecs;
+	ebio->eb_job_busy = 0;
+	ebio->eb_mergebv = NULL;
+	ebio->eb_nmergebv = 0;
+	ebio->eb_mergemask = 0;
 
 	bc_addfb(bc, ebio);
 
@@ -2010,22 +3886,30 @@ static struct eio_bio *eio_new_ebio(struct cache_c *dmc, struct bio *bio,
 	return ebio;
 }
 
-/* Issues HDD I/O */
+/*
+ * Issues HDD I/O for "size" bytes of the bio from sector "snum", with
+ * the ebios of the blocks in that range anchored to it.
+ */
 static void
-eio_disk_io(struct cache_c *dmc, struct bio *bio,
-	    struct eio_bio *anchored_bios, struct bio_container *bc,
-	    int force_inval)
+eio_disk_io_range(struct cache_c *dmc, struct bio *bio,
+		  struct eio_bio *anchored_bios, struct bio_container *bc,
+		  sector_t snum, unsigned size, int force_inval)
 {
 	struct eio_bio *ebio;
 	struct kcached_job *job;
-	int residual_biovec = 0;
+	unsigned skip = (unsigned)to_bytes(snum - EIO_BIO_BI_SECTOR(bio));
+	int residual_biovec;
 	int error = 0;
 
-	/*disk io happens on whole bio. Reset bi_idx*/
+	/* Reset bi_idx and seek to the start of the range */
 	EIO_BIO_BI_IDX(bio) = bc->bio_idx;
-	ebio =
-		eio_new_ebio(dmc, bio, &residual_biovec, EIO_BIO_BI_SECTOR(bio),
-				 EIO_BIO_BI_SIZE(bio), bc, EB_MAIN_IO);
+	while (skip && skip >= bio->bi_io_vec[EIO_BIO_BI_IDX(bio)].bv_len) {
+		skip -= bio->bi_io_vec[EIO_BIO_BI_IDX(bio)].bv_len;
+		EIO_BIO_BI_IDX(bio)++;
+	}
+	residual_biovec = skip;
+	ebio = eio_new_ebio(dmc, bio, &residual_biovec, snum, size, bc,
+			    EB_MAIN_IO);
 
 	if (unlikely(IS_ERR(ebio))) {
 		bc->bc_error = error = PTR_ERR(ebio);
@@ -2035,6 +3919,13 @@ eio_disk_io(struct cache_c *dmc, struct bio *bio,
 
 	if (force_inval)
 		ebio->eb_iotype |= EB_INVAL;
+	if (bc->bc_rabvecs) {
+		/* Read-around: read the whole block into the bc's pages */
+		ebio->eb_sector = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+		ebio->eb_size = to_bytes(dmc->block_size);
+		ebio->eb_bv = bc->bc_rabvecs;
+		ebio->eb_nbvec = bc->bc_rabvec_count;
+	}
 	ebio->eb_next = anchored_bios; /*Anchor the ebio list to this super bio*/
 	job = eio_new_job(dmc, ebio, -1);
 
@@ -2045,12 +3936,12 @@ eio_disk_io(struct cache_c *dmc, struct bio *bio,
 	atomic_inc(&dmc->nr_jobs);
 	if (ebio->eb_dir == READ) {
 		job->action = READDISK;
-		SECTOR_STATS(dmc->eio_stats.disk_reads, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.readdisk);
+		SECTOR_STATS(dmc->eio_stats->disk_reads, ebio->eb_size);
+		EIO_STATS_INC(dmc->eio_stats->readdisk);
 	} else {
 		job->action = WRITEDISK;
-		SECTOR_STATS(dmc->eio_stats.disk_writes, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.writedisk);
+		SECTOR_STATS(dmc->eio_stats->disk_writes, size);
+		EIO_STATS_INC(dmc->eio_stats->writedisk);
 	}
 
 	/*
@@ -2071,7 +3962,7 @@ eio_disk_io(struct cache_c *dmc, struct bio *bio,
 	return;
 
 errout:
-	eio_inval_range(dmc, EIO_BIO_BI_SECTOR(bio), EIO_BIO_BI_SIZE(bio));
+	eio_inval_range(dmc, snum, size);
 	eio_flag_abios(dmc, anchored_bios, error);
 
 	if (ebio)
@@ -2079,6 +3970,16 @@ errout:
 	return;
 }
 
+/* Issues HDD I/O for the whole bio */
+static void
+eio_disk_io(struct cache_c *dmc, struct bio *bio,
+	    struct eio_bio *anchored_bios, struct bio_container *bc,
+	    int force_inval)
+{
+	eio_disk_io_range(dmc, bio, anchored_bios, bc, EIO_BIO_BI_SECTOR(bio),
+			  EIO_BIO_BI_SIZE(bio), force_inval);
+}
+
 /*Given a sector number and biosize, returns cache io size*/
 static unsigned int
 eio_get_iosize(struct cache_c *dmc, sector_t snum, unsigned int biosize)
@@ -2133,7 +4034,7 @@ insert_set_seq(struct set_seq **seq_list, index_t first_set, index_t last_set)
 		first_set = cur_seq->last_set + 1;
 	}
 
-	new_seq = kmalloc(sizeof(struct set_seq), GFP_NOWAIT);
+	new_seq = mempool_alloc(_set_seq_pool, GFP_NOWAIT);
 	if (new_seq == NULL)
 		return -ENOMEM;
 	new_seq->first_set = first_set;
@@ -2222,9 +4123,13 @@ static int eio_acquire_set_locks(struct cache_c *dmc, struct bio_container *bc)
 			goto err_out;
 	}
 
+	/*
+	 * Released by bc_put(), from a callback_q worker or from end_io
+	 * (see eio_job_done_inline()), not by this task.
+	 */
 	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next)
 		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++)
-			down_read(&dmc->cache_sets[i].rw_lock);
+			down_read_non_owner(&dmc->cache_sets[i].rw_lock);
 	return 0;
 
 err_out:
@@ -2233,7 +4138,7 @@ err_out:
 	if (bc->bc_setspan != &bc->bc_singlesspan) {
 		for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = next_seq) {
 			next_seq = cur_seq->next;
-			kfree(cur_seq);
+			mempool_free(cur_seq, _set_seq_pool);
 		}
 	}
 	return error;
@@ -2253,8 +4158,9 @@ static int eio_alloc_mdreqs(struct cache_c *dmc, struct bio_container *bc)
 
 	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next) {
 		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++) {
-			mdreq = kzalloc(sizeof(*mdreq), GFP_NOWAIT);
+			mdreq = mempool_alloc(_mdreq_pool, GFP_NOWAIT);
 			if (mdreq) {
+				memset(mdreq, 0, sizeof(*mdreq));
 
 				/* nr_bvecs is the number of pages required to fit all 
 				 * flash_cacheblock structures in. Must be 1 or 2 (hardcoded)
@@ -2299,7 +4205,7 @@ static int eio_alloc_mdreqs(struct cache_c *dmc, struct bio_container *bc)
 								  BLKSIZE_4K);
 						kfree(mdreq->mdblk_bvecs);
 					}
-					kfree(mdreq);
+					mempool_free(mdreq, _mdreq_pool);
 					mdreq = nmdreq;
 				}
 				bc->mdreqs = NULL;
@@ -2332,14 +4238,14 @@ eio_release_io_resources(struct cache_c *dmc, struct bio_container *bc)
 	/* Release read locks on the sets in the set span */
 	for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = cur_seq->next) {
 		for (i = cur_seq->first_set; i <= cur_seq->last_set; i++)
-			up_read(&dmc->cache_sets[i].rw_lock);
+			up_read_non_owner(&dmc->cache_sets[i].rw_lock);
 	}
 
 	/* Free the seqs in the set span, unless it is single span */
 	if (bc->bc_setspan != &bc->bc_singlesspan) {
 		for (cur_seq = bc->bc_setspan; cur_seq; cur_seq = next_seq) {
 			next_seq = cur_seq->next;
-			kfree(cur_seq);
+			mempool_free(cur_seq, _set_seq_pool);
 		}
 	}
 
@@ -2352,7 +4258,7 @@ eio_release_io_resources(struct cache_c *dmc, struct bio_container *bc)
 					  BLKSIZE_4K);
 			kfree(mdreq->mdblk_bvecs);
 		}
-		kfree(mdreq);
+		mempool_free(mdreq, _mdreq_pool);
 		mdreq = nmdreq;
 	}
 	bc->mdreqs = NULL;
@@ -2387,19 +4293,11 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	if (EIO_BIO_BI_IDX(bio) != 0)
 		pr_debug("in eio_map bio_idx is %u", EIO_BIO_BI_IDX(bio));
 
-	if (bio_op(bio) == REQ_OP_DISCARD) {
-		pr_debug
-			("eio_map: Discard IO received. Invalidate incore start=%lu totalsectors=%d.\n",
-			(unsigned long)EIO_BIO_BI_SECTOR(bio),
-			(int)eio_to_sector(EIO_BIO_BI_SIZE(bio)));
-		EIO_BIO_ENDIO(bio, 0);
-		pr_err
-			("eio_map: I/O with Discard flag received. Discard flag is not supported.\n");
-		return 0;
-	}
+	trace_eio_map_enter(dmc, bio, EIO_IO_INVALID_DIR, 0);
 
 	if (unlikely(dmc->cache_rdonly)) {
 		if (data_dir != READ) {
+			trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, -EPERM);
 			EIO_BIO_ENDIO(bio, -EPERM);
 			pr_debug
 				("eio_map: cache is read only, write not permitted\n");
@@ -2407,15 +4305,37 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		}
 	}
 
+	if (bio_op(bio) == REQ_OP_DISCARD) {
+		pr_debug
+			("eio_map: Discard IO received. Invalidate incore start=%lu totalsectors=%d.\n",
+			(unsigned long)EIO_BIO_BI_SECTOR(bio),
+			(int)eio_to_sector(EIO_BIO_BI_SIZE(bio)));
+		if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
+			trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, -ENODEV);
+			EIO_BIO_ENDIO(bio, -ENODEV);
+			return DM_MAPIO_SUBMITTED;
+		}
+		EIO_STATS_INC(dmc->eio_stats->discards);
+		/*
+		 * Hold an in-flight reference across the inline invalidation
+		 * so that a drain does not race with the discard.
+		 */
+		percpu_counter_inc(&dmc->nr_ios);
+		trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, 0);
+		eio_process_discard_bio(dmc, bio);
+		percpu_counter_dec(&dmc->nr_ios);
+		return DM_MAPIO_SUBMITTED;
+	}
+
 	if (sectors < SIZE_HIST)
-		atomic64_inc(&dmc->size_hist[sectors]);
+		EIO_STATS_INC(dmc->size_hist[sectors]);
 
 	if (data_dir == READ) {
-		SECTOR_STATS(dmc->eio_stats.reads, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.readcount);
+		SECTOR_STATS(dmc->eio_stats->reads, EIO_BIO_BI_SIZE(bio));
+		EIO_STATS_INC(dmc->eio_stats->readcount);
 	} else {
-		SECTOR_STATS(dmc->eio_stats.writes, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.writecount);
+		SECTOR_STATS(dmc->eio_stats->writes, EIO_BIO_BI_SIZE(bio));
+		EIO_STATS_INC(dmc->eio_stats->writecount);
 	}
 
 	/*
@@ -2427,6 +4347,7 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		/* Source device is not available. */
 		CTRACE
 			("eio_map:2 source device is not present. Cache is in Failed state\n");
+		trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, -ENODEV);
 		EIO_BIO_ENDIO(bio, -ENODEV);
 		bio = NULL;
 		return DM_MAPIO_SUBMITTED;
@@ -2438,9 +4359,9 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		force_uncached = 1;
 	} else if (data_dir == WRITE && dmc->mode == CACHE_MODE_RO) {
 		if (to_sector(EIO_BIO_BI_SIZE(bio)) != dmc->block_size)
-			atomic64_inc(&dmc->eio_stats.uncached_map_size);
+			EIO_STATS_INC(dmc->eio_stats->uncached_map_size);
 		else
-			atomic64_inc(&dmc->eio_stats.uncached_map_uncacheable);
+			EIO_STATS_INC(dmc->eio_stats->uncached_map_uncacheable);
 		force_uncached = 1;
 	}
 
@@ -2449,24 +4370,43 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	 * to both HDD and SSD.
 	 */
 	if (EIO_BIO_BI_SIZE(bio) == 0) {
+		trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, 0);
 		eio_process_zero_size_bio(dmc, bio);
 		return DM_MAPIO_SUBMITTED;
 	}
 
 	/* Create a bio container */
 
-	bc = kzalloc(sizeof(struct bio_container), GFP_NOWAIT);
+	bc = mempool_alloc(_bc_pool, GFP_NOWAIT);
 	if (!bc) {
+		trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, -ENOMEM);
 		EIO_BIO_ENDIO(bio, -ENOMEM);
 		return DM_MAPIO_SUBMITTED;
 	}
+	memset(bc, 0, sizeof(*bc));
 	bc->bc_iotime = jiffies;
+	bc->bc_start = ktime_get();
 	bc->bc_bio = bio;
 	bc->bio_idx = EIO_BIO_BI_IDX(bio);
 	bc->bc_dmc = dmc;
 	spin_lock_init(&bc->bc_lock);
 	atomic_set(&bc->bc_holdcount, 1);
 	bc->bc_error = 0;
+	if (!force_uncached) {
+		eio_alloc_arena(dmc, bc);
+		bc->bc_bypass = eio_seq_detect(dmc, bio);
+		if (unlikely(dmc->sysctl_active.io_hints))
+			eio_bio_hints(dmc, bc, bio);
+		if (eio_range_pinned(dmc, EIO_BIO_BI_SECTOR(bio),
+				     EIO_BIO_BI_SECTOR(bio) +
+				     eio_to_sector(EIO_BIO_BI_SIZE(bio)))) {
+			bc->bc_bypass = 0;
+			bc->bc_admit = 1;
+		}
+		if (data_dir == READ && !bc->bc_bypass &&
+		    dmc->sysctl_active.read_around)
+			bc->bc_readaround = eio_readaround_ok(dmc, bio);
+	}
 
 	snum = EIO_BIO_BI_SECTOR(bio);
 	totalio = EIO_BIO_BI_SIZE(bio);
@@ -2483,13 +4423,18 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		 */
 		ret = eio_acquire_set_locks(dmc, bc);
 		if (ret) {
+			trace_eio_map_exit(dmc, bio, EIO_IO_INVALID_DIR, ret);
 			EIO_BIO_ENDIO(bio, ret);
-			kfree(bc);
+			eio_free_arena(bc);
+			mempool_free(bc, _bc_pool);
 			return DM_MAPIO_SUBMITTED;
 		}
 	}
 
-	atomic64_inc(&dmc->nr_ios);
+	percpu_counter_inc(&dmc->nr_ios);
+	if (CACHE_STACKED_IS_SET(dmc))
+		EIO_START_IO_ACCT(dmc->stacked_disk->queue, bio,
+				  &dmc->stacked_disk->part0);
 
 	/*
 	 * Prepare for I/O processing.
@@ -2554,9 +4499,9 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	if (force_uncached) {
 		EIO_ASSERT(dmc->mode != CACHE_MODE_WB);
 		if (data_dir == READ)
-			atomic64_inc(&dmc->eio_stats.uncached_reads);
+			EIO_STATS_INC(dmc->eio_stats->uncached_reads);
 		else
-			atomic64_inc(&dmc->eio_stats.uncached_writes);
+			EIO_STATS_INC(dmc->eio_stats->uncached_writes);
 		eio_disk_io(dmc, bio, ebegin, bc, 1);
 	} else if (data_dir == READ) {
 
@@ -2568,12 +4513,94 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 
 out:
 
-	if (bc)
+	if (bc) {
+		trace_eio_map_exit(dmc, bio, bc->bc_dir, bc->bc_error);
 		bc_put(bc);
+	}
 
 	return DM_MAPIO_SUBMITTED;
 }
 
+/*
+ * Lockless front end of eio_read_peek(). The set is searched under its
+ * cs_seq instead of cs_lock; the lock is then taken only to mark a hit
+ * block CACHEREADINPROG, once the block is seen to be unchanged.
+ *
+ * Return values
+ * 1: cache hit
+ * 0: cache miss that does not need a cache block
+ * -1: undecided, the caller must use the locked path
+ */
+static int eio_read_peek_lockless(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	struct cache_set *set = &dmc->cache_sets[ebio->eb_cacheset];
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	index_t index, invalid;
+	u_int8_t cstate = 0;
+	unsigned long flags;
+	unsigned seq;
+
+	/* An odd count is a writer at work, do not wait for it */
+	seq = raw_read_seqcount(&set->cs_seq);
+	if (seq & 1)
+		return -1;
+
+	eio_scan_set(dmc, dbn, dmc->assoc * ebio->eb_cacheset, &index,
+		     &invalid);
+	if (index >= 0)
+		cstate = EIO_CACHE_STATE_GET(dmc, index);
+	if (read_seqcount_retry(&set->cs_seq, seq))
+		return -1;
+
+	if (index < 0) {
+		/*
+		 * Without a block to fill, a miss is all eio_read_peek()
+		 * could find as well.
+		 */
+		if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly ||
+		    ebio->eb_bc->bc_bypass ||
+		    (eio_to_sector(ebio->eb_size) != dmc->block_size &&
+		     !ebio->eb_bc->bc_readaround))
+			goto miss;
+		return -1;
+	}
+
+	/* Block busy: read from disk, as eio_read_peek() would */
+	if (cstate & (BLOCK_IO_INPROG | QUEUED))
+		goto miss;
+
+	if (dmc->cache_sbmap[index].sb_invalid & eio_sb_touched(dmc, ebio))
+		return -1;
+
+	spin_lock_irqsave(&set->cs_lock, flags);
+	if (EIO_CACHE_STATE_GET(dmc, index) != cstate ||
+	    EIO_DBN_GET(dmc, index) != dbn ||
+	    (dmc->cache_sbmap[index].sb_invalid & eio_sb_touched(dmc, ebio))) {
+		spin_unlock_irqrestore(&set->cs_lock, flags);
+		return -1;
+	}
+	if (!(ebio->eb_bc->bc_access & EIO_ACCESS_COLD))
+		eio_policy_reclaim_lru_movetail(dmc, index, dmc->policy_ops);
+	eio_policy_blk_access(dmc->policy_ops, index, dbn,
+			      ebio->eb_bc->bc_access | EIO_ACCESS_HIT);
+	if (cstate == ALREADY_DIRTY) {
+		/* See eio_read_peek() */
+		ebio->eb_iotype = EB_MAIN_IO;
+		ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
+	} else
+		EIO_CACHE_STATE_ON(dmc, index, CACHEREADINPROG);
+	spin_unlock_irqrestore(&set->cs_lock, flags);
+
+	ebio->eb_index = index;
+	EIO_STATS_INC(dmc->eio_stats->lockless_peeks);
+	return 1;
+
+miss:
+	ebio->eb_index = -1;
+	EIO_STATS_INC(dmc->eio_stats->lockless_peeks);
+	return 0;
+}
+
 /*
  * Checks the cache block state, for deciding cached/uncached read.
  * Also reserves/allocates the cache block, wherever necessary.
@@ -2586,17 +4613,24 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 {
 	index_t index;
 	int res;
+	int hit;
 	int retval = 0;
 	unsigned long flags;
 	u_int8_t cstate;
 
+	eio_admit_record(dmc, EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
+
+	res = eio_read_peek_lockless(dmc, ebio);
+	if (res >= 0)
+		return res;
+
 	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
 
 	res = eio_lookup(dmc, ebio, &index);
 	ebio->eb_index = -1;
 
 	if (res < 0) {
-		atomic64_inc(&dmc->eio_stats.noroom);
+		EIO_STATS_INC(dmc->eio_stats->noroom);
 		goto out;
 	}
 
@@ -2614,8 +4648,24 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 
 	if (res == VALID) {
 		EIO_ASSERT(cstate & VALID);
-		if ((EIO_DBN_GET(dmc, index) ==
-		     EIO_ROUND_SECTOR(dmc, ebio->eb_sector))) {
+		hit = (EIO_DBN_GET(dmc, index) ==
+		       EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
+		if (hit && (dmc->cache_sbmap[index].sb_invalid &
+			    eio_sb_touched(dmc, ebio))) {
+			/*
+			 * Part of the read is not in the cache block. A dirty
+			 * block is read from HDD and its valid sub-blocks are
+			 * then merged in from SSD (see eio_do_readfill_bio()).
+			 * A clean one is refilled below like a recycled block.
+			 */
+			if (cstate == ALREADY_DIRTY) {
+				ebio->eb_iotype = EB_MAIN_IO;
+				ebio->eb_bc->bc_dir =
+					UNCACHED_READ_AND_READFILL;
+				ebio->eb_index = index;
+				goto out;
+			}
+		} else if (hit) {
 			/*
 			 * Read/write should be done on already DIRTY block
 			 * without any inprog flag.
@@ -2638,9 +4688,12 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 			goto out;
 		}
 
-		/* cache is marked readonly or set to wronly mode. */
-		/* Do not allow READFILL on SSD */
-		if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly)
+		/*
+		 * cache is marked readonly or set to wronly mode, or this
+		 * is a sequential stream. Do not allow READFILL on SSD
+		 */
+		if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly ||
+		    ebio->eb_bc->bc_bypass)
 			goto out;
 
 		/*
@@ -2648,11 +4701,23 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 		 * Its guranteed that it will be a non-DIRTY block
 		 */
 		EIO_ASSERT(!(cstate & DIRTY));
-		if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
-			/*We can recycle and then READFILL only if iosize is block size*/
-			atomic64_inc(&dmc->eio_stats.rd_replace);
+		if (eio_to_sector(ebio->eb_size) == dmc->block_size ||
+		    ebio->eb_bc->bc_readaround) {
+			/*
+			 * We can recycle and then READFILL only if iosize is
+			 * block size, or the read is widened to the block.
+			 * Another dbn's block goes only to a hotter dbn.
+			 */
+			if (!hit && !eio_admit(dmc, ebio, index))
+				goto out;
+			if (!hit) {
+				EIO_STATS_INC(dmc->eio_stats->rd_replace);
+				eio_policy_fill(dmc, ebio, index);
+			}
 			EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
-			EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+			EIO_DBN_SET(dmc, index,
+				    EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
+			dmc->cache_sbmap[index].sb_invalid = 0;
 			ebio->eb_index = index;
 			ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
 		}
@@ -2660,19 +4725,26 @@ static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	}
 	EIO_ASSERT(res == INVALID);
 	
-	/* cache is marked readonly or set to wronly mode. */
-	/* Do not allow READFILL on SSD */
-	if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly)
+	/*
+	 * cache is marked readonly or set to wronly mode, or this
+	 * is a sequential stream. Do not allow READFILL on SSD
+	 */
+	if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly ||
+	    ebio->eb_bc->bc_bypass)
 		goto out;
 	/*
 	 * Found an invalid block to be used.
-	 * Can recycle only if iosize is block size
+	 * Can recycle only if iosize is block size, or the read is
+	 * widened to the block
 	 */
-	if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
+	if (eio_to_sector(ebio->eb_size) == dmc->block_size ||
+	    ebio->eb_bc->bc_readaround) {
 		EIO_ASSERT(cstate & INVALID);
+		eio_policy_fill(dmc, ebio, index);
 		EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
-		atomic64_inc(&dmc->eio_stats.cached_blocks);
-		EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+		atomic64_inc(&dmc->cached_blocks);
+		EIO_DBN_SET(dmc, index, EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
+		dmc->cache_sbmap[index].sb_invalid = 0;
 		ebio->eb_index = index;
 		ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
 	}
@@ -2708,6 +4780,10 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	int retval;
 	u_int8_t cstate;
 	unsigned long flags;
+	u_int16_t covered, touched;
+	struct eio_sbmap *sbmap;
+
+	eio_admit_record(dmc, EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
 
 	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
 
@@ -2717,7 +4793,7 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 
 	if (res < 0) {
 		/* cache block not found and new block couldn't be allocated */
-		atomic64_inc(&dmc->eio_stats.noroom);
+		EIO_STATS_INC(dmc->eio_stats->noroom);
 		ebio->eb_iotype |= EB_INVAL;
 		goto out;
 	}
@@ -2730,6 +4806,10 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 		goto out;
 	}
 
+	sbmap = &dmc->cache_sbmap[index];
+	covered = eio_sb_covered(dmc, ebio);
+	touched = eio_sb_touched(dmc, ebio);
+
 	if ((res == VALID) && (EIO_DBN_GET(dmc, index) ==
 			       EIO_ROUND_SECTOR(dmc, ebio->eb_sector))) {
 		/*
@@ -2737,47 +4817,66 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 		 * All except an already DIRTY block should have an INPROG flag.
 		 * If it is a cached write, a DIRTY flag would be added later.
 		 */
-		SECTOR_STATS(dmc->eio_stats.write_hits, ebio->eb_size);
+		SECTOR_STATS(dmc->eio_stats->write_hits, ebio->eb_size);
 		if (cstate != ALREADY_DIRTY)
 			EIO_CACHE_STATE_ON(dmc, index, CACHEWRITEINPROG);
 		else
-			atomic64_inc(&dmc->eio_stats.dirty_write_hits);
+			EIO_STATS_INC(dmc->eio_stats->dirty_write_hits);
 		ebio->eb_index = index;
 		/*
-		 * A VALID block should get upgraded to DIRTY, only when we
-		 * are updating the entire cache block(not partially).
-		 * Otherwise, 2 sequential partial writes can lead to missing
-		 * data when one write upgrades the cache block to DIRTY, while
-		 * the other just writes to HDD. Subsequent read would be
-		 * served from the cache block, which won't have the data from
-		 * 2nd write.
+		 * A write to a DIRTY block stays in the cache only if it
+		 * falls in its dirty sub-blocks: growing the dirty part would
+		 * need a metadata update. Otherwise it goes to both SSD and
+		 * HDD, and the sub-blocks it covers become valid and clean.
+		 * A VALID block gets upgraded to DIRTY only for the
+		 * sub-blocks wholly written: a partially written sub-block
+		 * must reach HDD as well, so that write goes to both.
 		 */
-		if ((cstate == ALREADY_DIRTY) ||
-		    (eio_to_sector(ebio->eb_size) == dmc->block_size))
-			retval = 1;
-		else
-			retval = 0;
+		if (cstate == ALREADY_DIRTY) {
+			if (!(sbmap->sb_clean & touched))
+				retval = 1;
+			else {
+				sbmap->sb_invalid &= ~covered;
+				sbmap->sb_clean |= covered;
+				retval = 0;
+			}
+		} else {
+			sbmap->sb_invalid &= ~covered;
+			retval = (covered && covered == touched);
+		}
 		goto out;
 
 	}
 
 	/*
 	 * cache miss with a new block allocated for recycle.
-	 * Set INPROG flag, if the ebio size is equal to cache block size
+	 * Set INPROG flag, if the ebio wholly covers at least one sub-block,
+	 * is not part of a sequential stream and, when it would evict a
+	 * valid block, passes admission. Sub-blocks not covered are marked
+	 * invalid.
 	 */
 	EIO_ASSERT(!(EIO_CACHE_STATE_GET(dmc, index) & DIRTY));
-	if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
+	if (covered && !ebio->eb_bc->bc_bypass &&
+	    (res != VALID ||
+	     eio_admit(dmc, ebio, index))) {
 		if (res == VALID)
-			atomic64_inc(&dmc->eio_stats.wr_replace);
+			EIO_STATS_INC(dmc->eio_stats->wr_replace);
 		else
-			atomic64_inc(&dmc->eio_stats.cached_blocks);
+			atomic64_inc(&dmc->cached_blocks);
+		eio_policy_fill(dmc, ebio, index);
 		EIO_CACHE_STATE_SET(dmc, index, VALID | CACHEWRITEINPROG);
-		EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+		EIO_DBN_SET(dmc, index, EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
+		sbmap->sb_invalid = dmc->sb_full & ~covered;
+		sbmap->sb_clean = 0;
 		ebio->eb_index = index;
-		retval = 1;
+		/* A partially written sub-block must reach HDD as well */
+		retval = (covered == touched);
+		if (covered != dmc->sb_full)
+			EIO_STATS_INC(dmc->eio_stats->subblock_writes);
 	} else {
 		/*
-		 * eb iosize smaller than cache block size shouldn't
+		 * eb iosize smaller than a sub-block, a sequential
+		 * stream, or a miss colder than its victim, shouldn't
 		 * do cache write on a cache miss
 		 */
 		retval = 0;
@@ -2803,6 +4902,40 @@ out:
 	return retval;
 }
 
+/*
+ * eio_read_peek() reserved a block for a partial read miss. Allocate the
+ * buffer the whole block is read into. Without memory, release the
+ * block and let the read go to HDD like any other partial miss.
+ */
+static void
+eio_readaround_prep(struct cache_c *dmc, struct bio_container *bc,
+		    struct eio_bio *ebio)
+{
+	unsigned long flags;
+
+	EIO_ASSERT(ebio->eb_next == NULL);
+	EIO_ASSERT(bc->bc_dir == UNCACHED_READ_AND_READFILL);
+
+	/* A dirty block with holes is merged on readfill instead */
+	if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) & DIRTY)
+		return;
+
+	bc->bc_rabvecs = eio_alloc_bounce(to_bytes(dmc->block_size),
+					  GFP_NOWAIT, &bc->bc_rabvec_count);
+	if (bc->bc_rabvecs) {
+		EIO_STATS_INC(dmc->eio_stats->readaround_fills);
+		return;
+	}
+
+	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
+	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+			       flags);
+	atomic64_dec_if_positive(&dmc->cached_blocks);
+	ebio->eb_index = -1;
+	bc->bc_dir = UNCACHED_READ;
+}
+
 /* Top level read function, called from eio_map */
 static void
 eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
@@ -2810,6 +4943,7 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 	int ucread = 0;
 	struct eio_bio *ebio;
 	struct eio_bio *enext;
+	struct kcached_job *jobs = NULL, **tail = &jobs;
 
 	bc->bc_dir = UNCACHED_READ;
 	ebio = ebegin;
@@ -2820,13 +4954,16 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 		ebio = enext;
 	}
 
+	if (ucread && bc->bc_readaround && ebegin->eb_index != -1)
+		eio_readaround_prep(dmc, bc, ebegin);
+
 	if (ucread) {
 		/*
 		 * Uncached read.
 		 * Start HDD I/O. Once that is finished
 		 * readfill or dirty block re-read would start
 		 */
-		atomic64_inc(&dmc->eio_stats.uncached_reads);
+		EIO_STATS_INC(dmc->eio_stats->uncached_reads);
 		eio_disk_io(dmc, bc->bc_bio, ebegin, bc, 0);
 	} else {
 		/* Cached read. Serve the read from SSD */
@@ -2843,9 +4980,10 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 		while (ebio) {
 			enext = ebio->eb_next;
 			ebio->eb_iotype = EB_MAIN_IO;
-			eio_cached_read(dmc, ebio, REQ_OP_READ, 0);
+			eio_cached_read(dmc, ebio, &tail);
 			ebio = enext;
 		}
+		eio_issue_jobs(dmc, jobs, REQ_OP_READ, 0, eio_cached_read_fail);
 	}
 }
 
@@ -2865,20 +5003,82 @@ static inline void eio_cached_write_error(struct cache_c *dmc,
 		 */
 
 		EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-		atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
 	}
 	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
 	                       flags);
 }
 
+/*
+ * Write-back write of a bio with some blocks the cache can't absorb:
+ * the cacheable blocks are written dirty to SSD, each run of the other
+ * blocks goes to HDD as one I/O with its ebios anchored to it. The bc
+ * completes once both are done.
+ * Returns nonzero, with nothing issued, if the metadata update can't be
+ * set up; the caller then writes the whole bio through.
+ */
+static int
+eio_write_mixed(struct cache_c *dmc, struct bio_container *bc,
+		struct eio_bio *ebegin)
+{
+	struct eio_bio *ebio;
+	struct eio_bio *enext;
+	struct eio_bio *run = NULL, *rtail = NULL;
+	struct kcached_job *jobs = NULL, **tail = &jobs;
+
+	if (bc->bc_mdwait) {
+		if (eio_alloc_mdreqs(dmc, bc))
+			return -ENOMEM;
+		bc->bc_mdupdate = 1;
+	}
+
+	EIO_STATS_INC(dmc->eio_stats->mixed_writes);
+	bc->bc_dir = MIXED_WRITE;
+	VERIFY_BIO_FLAGS(ebegin);
+
+	/*
+	 * eb_next is taken over by the disk I/O anchors and the md update
+	 * list, so the chain is split as it is walked.
+	 */
+	ebio = ebegin;
+	while (ebio) {
+		enext = ebio->eb_next;
+		ebio->eb_next = NULL;
+		if (ebio->eb_cached) {
+			ebio->eb_iotype = EB_MAIN_IO;
+			eio_cached_write(dmc, ebio, &tail);
+		} else {
+			if (run)
+				rtail->eb_next = ebio;
+			else
+				run = ebio;
+			rtail = ebio;
+			eio_uncached_write(dmc, ebio);
+		}
+		if (run && (!enext || enext->eb_cached)) {
+			eio_disk_io_range(dmc, bc->bc_bio, run, bc,
+					  run->eb_sector,
+					  (unsigned)to_bytes(rtail->eb_sector -
+							     run->eb_sector) +
+					  rtail->eb_size, 0);
+			run = NULL;
+		}
+		ebio = enext;
+	}
+	eio_issue_jobs(dmc, jobs, REQ_OP_WRITE, 0, eio_cached_write_fail);
+	return 0;
+}
+
 /* Top level write function called from eio_map */
 static void
 eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 {
 	int ucwrite = 0;
 	int error = 0;
+	int nr_ebios = 0, nr_cached = 0;
 	struct eio_bio *ebio;
 	struct eio_bio *enext;
+	struct kcached_job *jobs = NULL, **tail = &jobs;
 
 	if ((dmc->mode != CACHE_MODE_WB) ||
 	    (dmc->sysctl_active.do_clean & EIO_CLEAN_KEEP))
@@ -2887,17 +5087,25 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 	ebio = ebegin;
 	while (ebio) {
 		enext = ebio->eb_next;
-		if (eio_write_peek(dmc, ebio) == 0)
-			ucwrite = 1;
+		ebio->eb_cached = eio_write_peek(dmc, ebio);
+		nr_cached += ebio->eb_cached;
+		nr_ebios++;
 		ebio = enext;
 	}
 
+	/* Keep write-back for the blocks that can have it */
+	if (!ucwrite && nr_cached != nr_ebios) {
+		if (nr_cached && !eio_write_mixed(dmc, bc, ebegin))
+			return;
+		ucwrite = 1;
+	}
+
 	if (ucwrite) {
 		/*
 		 * Uncached write.
 		 * Start both SSD and HDD writes
 		 */
-		atomic64_inc(&dmc->eio_stats.uncached_writes);
+		EIO_STATS_INC(dmc->eio_stats->uncached_writes);
 		bc->bc_mdwait = 0;
 		bc->bc_dir = UNCACHED_WRITE;
 		ebio = ebegin;
@@ -2912,6 +5120,7 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 		/* Cached write. Start writes to SSD blocks */
 		bc->bc_dir = CACHED_WRITE;
 		if (bc->bc_mdwait) {
+			bc->bc_mdupdate = 1;
 
 			/*
 			 * mdreqs are required only if the write would cause a metadata
@@ -2933,13 +5142,14 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 			ebio->eb_iotype = EB_MAIN_IO;
 
 			if (!error) {
-				eio_cached_write(dmc, ebio, REQ_OP_WRITE, 0);
+				eio_cached_write(dmc, ebio, &tail);
 			} else {
 				eio_cached_write_error(dmc, ebio);
 				eb_endio(ebio, error);
 			}
 			ebio = enext;
 		}
+		eio_issue_jobs(dmc, jobs, REQ_OP_WRITE, 0, eio_cached_write_fail);
 	}
 }
 
@@ -2951,6 +5161,9 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 void eio_clean_all(struct cache_c *dmc)
 {
 	unsigned long flags = 0;
+	index_t sorted[EIO_CLEAN_SORT_SETS];
+	int nr_sorted = 0;
+	index_t set;
 
 	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
 	for (atomic_set(&dmc->clean_index, 0);
@@ -2968,9 +5181,22 @@ void eio_clean_all(struct cache_c *dmc)
 			break;
 		}
 
-		eio_clean_set(dmc, (index_t)(atomic_read(&dmc->clean_index)),
-				/* whole */ 1, /* force */ 1);
+		set = (index_t)(atomic_read(&dmc->clean_index));
+		if (dmc->sysctl_active.clean_sort && dmc->clean_sort) {
+			if (dmc->cache_sets[set].nr_dirty)
+				sorted[nr_sorted++] = set;
+			if (nr_sorted == EIO_CLEAN_SORT_SETS) {
+				eio_clean_sets_sorted(dmc, sorted, nr_sorted,
+						      /* force */ 1);
+				nr_sorted = 0;
+			}
+			continue;
+		}
+
+		eio_clean_set(dmc, set, /* whole */ 1, /* force */ 1);
 	}
+	if (nr_sorted)
+		eio_clean_sets_sorted(dmc, sorted, nr_sorted, /* force */ 1);
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	dmc->sysctl_active.do_clean &= ~EIO_CLEAN_START;
@@ -3033,56 +5259,310 @@ eio_get_setblks_to_clean(struct cache_c *dmc, index_t set, int *ncleans)
 		nr_writes =
 			eio_policy_clean_set(dmc->policy_ops, set, max_clean);
 
-	*ncleans = nr_writes;
+	*ncleans = nr_writes;
+}
+
+/* Callback function, when synchronous I/O completes */
+static void eio_sync_io_callback(int error, void *context)
+{
+	struct sync_io_context *sioc = (struct sync_io_context *)context;
+
+	if (error)
+		sioc->sio_error = error;
+	if (atomic_dec_and_test(&sioc->pending))
+		complete(&sioc->done);
+}
+
+/*
+ * Setup biovecs for preallocated biovecs per cache set.
+ */
+
+struct bio_vec *setup_bio_vecs(struct bio_vec *bvec, index_t block_index,
+			       unsigned block_size, unsigned total,
+			       unsigned *num_bvecs)
+{
+	struct bio_vec *data = NULL;
+	index_t iovec_index;
+
+	switch (block_size) {
+	case BLKSIZE_2K:
+		*num_bvecs = total;
+		iovec_index = block_index;
+		data = &bvec[iovec_index];
+		break;
+
+	case BLKSIZE_4K:
+		*num_bvecs = total;
+		iovec_index = block_index;
+		data = &bvec[iovec_index];
+		break;
+
+	case BLKSIZE_8K:
+	case BLKSIZE_16K:
+	case BLKSIZE_32K:
+	case BLKSIZE_64K:
+		/*
+		 * For data blocks larger than a page, we need one
+		 * bio_vec per page of the data block.
+		 */
+		*num_bvecs = total * (to_bytes(block_size) / PAGE_SIZE);
+		iovec_index = block_index * (to_bytes(block_size) / PAGE_SIZE);
+		data = &bvec[iovec_index];
+		break;
+	}
+
+	return data;
+}
+
+/*
+ * Fill dmc->mdpage_count pages with the on-disk metadata of a cache set,
+ * from its in-core state. CLEAN_INPROG blocks are written as INVALID.
+ */
+static void eio_set_md_fill(struct cache_c *dmc, index_t set,
+			    struct page **mdpages)
+{
+	struct flash_cacheblock *md_blocks;
+	void *pg_virt_addr[2] = { NULL };
+	index_t i, start_index, end_index;
+	int pindex, k;
+
+	/* TBD. Do we have to consider sector alignment here ? */
+
+	/*
+	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock);
+	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
+	 */
+
+	start_index = set * dmc->assoc;
+	end_index = start_index + dmc->assoc;
+
+	EIO_ASSERT(dmc->mdpage_count <= 2);
+	for (k = 0; k < dmc->mdpage_count; k++)
+		pg_virt_addr[k] = kmap(mdpages[k]);
+
+	pindex = 0;
+	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
+	k = MD_BLOCKS_PER_PAGE;
+
+	for (i = start_index; i < end_index; i++) {
+
+		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
+
+		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG)
+			md_blocks->cache_state = cpu_to_le64(INVALID);
+		else if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY)
+			md_blocks->cache_state =
+				cpu_to_le64(eio_md_cache_state(dmc, i,
+							       VALID | DIRTY));
+		else
+			md_blocks->cache_state = cpu_to_le64(INVALID);
+
+		/* This was missing earlier. */
+		md_blocks++;
+		k--;
+
+		if (k == 0) {
+			md_blocks =
+				(struct flash_cacheblock *)pg_virt_addr[++pindex];
+			k = MD_BLOCKS_PER_PAGE;
+		}
+	}
+
+	for (k = 0; k < dmc->mdpage_count; k++)
+		kunmap(mdpages[k]);
+}
+
+/*
+ * Write the on-disk metadata of a cache set from its in-core state.
+ * The caller holds the set rw_lock for write, or else keeps the set's
+ * md updates, cleans and checkpoints off as eio_jrnl_undo() does, and
+ * provides dmc->mdpage_count pages.
+ */
+static int eio_set_md_store(struct cache_c *dmc, index_t set,
+			    struct page **mdpages)
+{
+	struct eio_io_region where;
+
+	eio_set_md_fill(dmc, set, mdpages);
+
+	where.bdev = dmc->cache_dev->bdev;
+	where.sector = dmc->md_start_sect +
+		       INDEX_TO_MD_SECTOR(set * dmc->assoc);
+	where.count = eio_to_sector(dmc->assoc *
+				    sizeof(struct flash_cacheblock));
+	return eio_io_sync_pages(dmc, &where, REQ_OP_WRITE, 0, mdpages,
+				 dmc->mdpage_count);
+}
+
+/*
+ * bvecs describing the dirty runs of partially dirty blocks. They must
+ * stay around until the writes complete, as unaligned I/O keeps a
+ * reference to them.
+ */
+struct eio_sbvecs {
+	struct eio_sbvecs *next;
+	unsigned nr_bvecs;
+	struct bio_vec bvecs[0];
+};
+
+static void eio_free_sbvecs(struct eio_sbvecs **list)
+{
+	struct eio_sbvecs *sbv;
+
+	while (*list) {
+		sbv = *list;
+		*list = sbv->next;
+		kfree(sbv);
+	}
 }
 
-/* Callback function, when synchronous I/O completes */
-static void eio_sync_io_callback(int error, void *context)
+/*
+ * Writes back only the dirty sub-blocks of cache block "index", whose
+ * data was read into "bvecs".
+ */
+static int eio_clean_subblocks(struct cache_c *dmc, index_t index,
+			       struct bio_vec *bvecs, unsigned nr_bvecs,
+			       struct sync_io_context *sioc,
+			       struct eio_sbvecs **list)
 {
-	struct sync_io_context *sioc = (struct sync_io_context *)context;
+	u_int16_t dirty = dmc->sb_full & ~dmc->cache_sbmap[index].sb_clean;
+	unsigned nr_sb = dmc->block_size >> dmc->sb_shift;
+	struct eio_io_region where;
+	struct eio_sbvecs *sbv;
+	unsigned first, last, skip, len, k;
+	struct bio_vec *src;
+	int error;
 
-	if (error)
-		sioc->sio_error = error;
-	if (atomic_dec_and_test(&sioc->pending))
-		complete(&sioc->done);
+	for (first = 0; first < nr_sb; first = last) {
+		if (!(dirty & (1 << first))) {
+			last = first + 1;
+			continue;
+		}
+		for (last = first; last < nr_sb && (dirty & (1 << last)); last++)
+			;
+
+		/* carve the run out of the block's bvecs */
+		sbv = kmalloc(sizeof(*sbv) + nr_bvecs * sizeof(struct bio_vec),
+			      GFP_NOIO);
+		if (!sbv)
+			return -ENOMEM;
+		sbv->next = *list;
+		*list = sbv;
+		sbv->nr_bvecs = 0;
+		skip = to_bytes(first << dmc->sb_shift);
+		len = to_bytes((last - first) << dmc->sb_shift);
+		for (src = bvecs, k = 0; k < nr_bvecs && len; k++, src++) {
+			if (skip >= src->bv_len) {
+				skip -= src->bv_len;
+				continue;
+			}
+			sbv->bvecs[sbv->nr_bvecs].bv_page = src->bv_page;
+			sbv->bvecs[sbv->nr_bvecs].bv_offset =
+				src->bv_offset + skip;
+			sbv->bvecs[sbv->nr_bvecs].bv_len =
+				min(src->bv_len - skip, len);
+			len -= sbv->bvecs[sbv->nr_bvecs].bv_len;
+			skip = 0;
+			sbv->nr_bvecs++;
+		}
+
+		where.bdev = dmc->disk_dev->bdev;
+		where.sector = EIO_DBN_GET(dmc, index) + (first << dmc->sb_shift);
+		where.count = (last - first) << dmc->sb_shift;
+
+		SECTOR_STATS(dmc->eio_stats->disk_writes, to_bytes(where.count));
+		atomic_inc(&sioc->pending);
+		error = eio_io_async_bvec(dmc, &where, REQ_OP_WRITE,
+					  EIO_REQ_SYNC, sbv->bvecs,
+					  sbv->nr_bvecs, eio_sync_io_callback,
+					  sioc, 1);
+		if (error) {
+			atomic_dec(&sioc->pending);
+			return error;
+		}
+	}
+
+	return 0;
 }
 
 /*
- * Setup biovecs for preallocated biovecs per cache set.
+ * Step 7 of a set clean, update in-core cache metadata for clean_inprog
+ * blocks. If there was an error, set them back to ALREADY_DIRTY.
+ * If no error, set them to VALID.
  */
+static void
+eio_clean_set_update(struct cache_c *dmc, index_t set, int ncleans, int error)
+{
+	index_t i;
+	index_t start_index = set * dmc->assoc;
+	index_t end_index = start_index + dmc->assoc;
 
-struct bio_vec *setup_bio_vecs(struct bio_vec *bvec, index_t block_index,
-			       unsigned block_size, unsigned total,
-			       unsigned *num_bvecs)
+	for (i = start_index; i < end_index; i++) {
+		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
+			if (error)
+				EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
+			else {
+				EIO_CACHE_STATE_SET(dmc, i, VALID);
+				dmc->cache_sbmap[i].sb_clean = 0;
+				EIO_ASSERT(dmc->cache_sets[set].nr_dirty > 0);
+				dmc->cache_sets[set].nr_dirty--;
+				atomic64_dec(&dmc->nr_dirty);
+			}
+		}
+	}
+	if (error)
+		trace_eio_io_error(dmc, EIO_IOERR_CLEAN, set,
+				   dmc->md_start_sect +
+				   INDEX_TO_MD_SECTOR(start_index), error);
+	trace_eio_clean_set_end(dmc, set, ncleans,
+				(u64)ncleans * to_bytes(dmc->block_size),
+				error);
+}
+
+/* Done with a set clean, the set rw_lock is released */
+static void eio_clean_set_finish(struct cache_c *dmc, index_t set, int force)
 {
-	struct bio_vec *data = NULL;
-	index_t iovec_index;
+	unsigned long flags;
 
-	switch (block_size) {
-	case BLKSIZE_2K:
-		*num_bvecs = total;
-		iovec_index = block_index;
-		data = &bvec[iovec_index];
-		break;
+	/* Reset clean flags on the set */
 
-	case BLKSIZE_4K:
-		*num_bvecs = total;
-		iovec_index = block_index;
-		data = &bvec[iovec_index];
-		break;
+	if (!force) {
+		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+		dmc->cache_sets[set].flags &=
+			~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE);
+		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+	}
 
-	case BLKSIZE_8K:
+	if (dmc->cache_sets[set].nr_dirty)
 		/*
-		 * For 8k data block size, we need 2 bio_vecs
-		 * per data block.
+		 * Lru touch the set, so that it can be picked
+		 * up for whole set clean by clean thread later
 		 */
-		*num_bvecs = total * 2;
-		iovec_index = block_index * 2;
-		data = &bvec[iovec_index];
-		break;
-	}
+		eio_touch_set_lru(dmc, set);
+}
 
-	return data;
+/*
+ * Step 3 of a set clean, mark the blocks to clean CLEAN_INPROG.
+ * Returns their number.
+ */
+static int eio_clean_set_mark(struct cache_c *dmc, index_t set, int whole)
+{
+	index_t i;
+	index_t start_index = set * dmc->assoc;
+	index_t end_index = start_index + dmc->assoc;
+	int ncleans = 0;
+
+	if (!whole)
+		eio_get_setblks_to_clean(dmc, set, &ncleans);
+	else {
+		for (i = start_index; i < end_index; i++) {
+			if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY) {
+				EIO_CACHE_STATE_SET(dmc, i, CLEAN_INPROG);
+				ncleans++;
+			}
+		}
+	}
+	return ncleans;
 }
 
 /* Cleans a given cache set */
@@ -3097,15 +5577,12 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	index_t end_index;
 	struct sync_io_context sioc;
 	int ncleans = 0;
-	int alloc_size;
-	struct flash_cacheblock *md_blocks = NULL;
-	unsigned long flags;
 
-	int pindex, k;
 	index_t blkindex;
 	struct bio_vec *bvecs;
 	unsigned nr_bvecs = 0, total;
-	void *pg_virt_addr[2] = { NULL };
+	struct eio_sbvecs *sbvecs = NULL;
+	u_int64_t jseq = EIO_JRNL_NO_SEQ;
 
 	/* Cache is failed mode, do nothing. */
 	if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
@@ -3147,21 +5624,19 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 		goto err_out2;
 
 	/* 3. identify and mark cache blocks to clean */
-	if (!whole)
-		eio_get_setblks_to_clean(dmc, set, &ncleans);
-	else {
-		for (i = start_index; i < end_index; i++) {
-			if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY) {
-				EIO_CACHE_STATE_SET(dmc, i, CLEAN_INPROG);
-				ncleans++;
-			}
-		}
-	}
+	ncleans = eio_clean_set_mark(dmc, set, whole);
 
 	/* If nothing to clean, return */
 	if (!ncleans)
 		goto err_out2;
 
+	trace_eio_clean_set_start(dmc, set, whole, ncleans);
+
+	/* With no room for its set record, the set waits for a checkpoint */
+	error = eio_jrnl_set_reserve(dmc, set, &jseq);
+	if (error)
+		goto err_out3;
+
 	/*
 	 * From this point onwards, make sure to reset
 	 * the clean inflag on cache blocks before returning
@@ -3196,14 +5671,14 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 			EIO_ASSERT(bvecs != NULL);
 			EIO_ASSERT(nr_bvecs > 0);
 			/* This I/O is aligned to block_size, as md_sectors is
-			 * aligned to 8192.
+			 * aligned to 8192, or to block_size if larger.
 			 */
 			where.bdev = dmc->cache_dev->bdev;
 			where.sector =
 				(i << dmc->block_shift) + dmc->md_sectors;
 			where.count = total * dmc->block_size;
 
-			SECTOR_STATS(dmc->eio_stats.ssd_reads,
+			SECTOR_STATS(dmc->eio_stats->ssd_reads,
 				     to_bytes(where.count));
 			atomic_inc(&sioc.pending);
 			error =
@@ -3257,11 +5732,24 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 			EIO_ASSERT(bvecs != NULL);
 			EIO_ASSERT(nr_bvecs > 0);
 
+			/* Partially dirty block, write back its dirty runs */
+			if (dmc->cache_sbmap[i].sb_clean) {
+				error = eio_clean_subblocks(dmc, i, bvecs,
+							    nr_bvecs, &sioc,
+							    &sbvecs);
+				if (error) {
+					sioc.sio_error = error;
+					break;
+				}
+				bvecs = NULL;
+				continue;
+			}
+
 			where.bdev = dmc->disk_dev->bdev;
 			where.sector = EIO_DBN_GET(dmc, i);
 			where.count = dmc->block_size;
 
-			SECTOR_STATS(dmc->eio_stats.disk_writes,
+			SECTOR_STATS(dmc->eio_stats->disk_writes,
 				     to_bytes(where.count));
 			atomic_inc(&sioc.pending);
 			error = eio_io_async_bvec(dmc, &where, REQ_OP_WRITE, EIO_REQ_SYNC,
@@ -3283,105 +5771,299 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	}
 
 	error = sioc.sio_error;
+	eio_free_sbvecs(&sbvecs);
 	if (error)
 		goto err_out3;
 
 	/* 6. update on-disk cache metadata */
+	error = eio_set_md_store(dmc, set, dmc->clean_mdpages);
+	if (!error)
+		error = eio_jrnl_set_commit(dmc, set, jseq);
+	if (error)
+		goto err_out3;
 
-	/* TBD. Do we have to consider sector alignment here ? */
+err_out3:
 
-	/*
-	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock);
-	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
-	 */
+	/* 7. update in-core cache metadata for clean_inprog blocks */
+	eio_clean_set_update(dmc, set, ncleans, error);
 
-	EIO_ASSERT(dmc->mdpage_count <= 2);
-	for (k = 0; k < dmc->mdpage_count; k++)
-		pg_virt_addr[k] = kmap(dmc->clean_mdpages[k]);
+err_out2:
 
-	alloc_size = dmc->assoc * sizeof(struct flash_cacheblock);
-	pindex = 0;
-	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-	k = MD_BLOCKS_PER_PAGE;
+	up_write(&dmc->cache_sets[set].rw_lock);
 
-	for (i = start_index; i < end_index; i++) {
+err_out1:
 
-		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
+	eio_clean_set_finish(dmc, set, force);
+	return;
+}
 
-		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG)
-			md_blocks->cache_state = cpu_to_le64(INVALID);
-		else if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY)
-			md_blocks->cache_state = cpu_to_le64((VALID | DIRTY));
-		else
-			md_blocks->cache_state = cpu_to_le64(INVALID);
+static int eio_index_cmp(const void *a, const void *b)
+{
+	index_t x = *(const index_t *)a;
+	index_t y = *(const index_t *)b;
 
-		/* This was missing earlier. */
-		md_blocks++;
-		k--;
+	return (x > y) - (x < y);
+}
 
-		if (k == 0) {
-			md_blocks =
-				(struct flash_cacheblock *)pg_virt_addr[++pindex];
-			k = MD_BLOCKS_PER_PAGE;
+static int eio_clean_ent_cmp(const void *a, const void *b)
+{
+	const struct eio_clean_ent *x = a;
+	const struct eio_clean_ent *y = b;
+
+	return (x->dbn > y->dbn) - (x->dbn < y->dbn);
+}
+
+/*
+ * Cleans up to EIO_CLEAN_SORT_SETS sets at once. The sets are hashed,
+ * so the blocks of one set are scattered all over the HDD, while those
+ * of many sets fill in each other's gaps. The dirty blocks of all the
+ * sets are read from the ssd, sorted by dbn and written to the HDD with
+ * one I/O per run of consecutive dbns. The md of the sets is written
+ * after all the data, in parallel.
+ *
+ * The set rw_locks are taken in ascending set order, the order a bio
+ * spanning several sets takes them in.
+ */
+static void
+eio_clean_sets_sorted(struct cache_c *dmc, index_t *sets, int nr_sets,
+		      int force)
+{
+	struct eio_clean_sort *cs = dmc->clean_sort;
+	struct sync_io_context sioc;
+	struct sync_io_context mdsioc[EIO_CLEAN_SORT_SETS];
+	index_t cleaning[EIO_CLEAN_SORT_SETS];
+	int ncleans[EIO_CLEAN_SORT_SETS];
+	u_int64_t jseq[EIO_CLEAN_SORT_SETS];
+	int set_error[EIO_CLEAN_SORT_SETS];
+	struct eio_io_region where;
+	struct eio_sbvecs *sbvecs = NULL;
+	struct eio_clean_ent *ent;
+	struct page **mdpages;
+	struct bio_vec *bvecs;
+	unsigned nr_bvecs, nr_run, md_size;
+	index_t i, j, set, start_index, end_index;
+	int nr_cleaning = 0;
+	int nr_ents = 0;
+	int whole, error, k, e, f, w;
+
+	EIO_ASSERT(cs != NULL);
+	EIO_ASSERT(nr_sets <= EIO_CLEAN_SORT_SETS);
+	sort(sets, nr_sets, sizeof(index_t), eio_index_cmp, NULL);
+
+	/* 1-3. lock the sets and mark the blocks to clean, as a set clean */
+	for (k = 0; k < nr_sets; k++) {
+		set = sets[k];
+		if (unlikely(CACHE_FAILED_IS_SET(dmc)) ||
+		    dmc->cache_sets[set].nr_dirty == 0) {
+			eio_clean_set_finish(dmc, set, force);
+			continue;
+		}
+		if ((!force) && AUTOCLEAN_THRESHOLD_CROSSED(dmc)) {
+			eio_touch_set_lru(dmc, set);
+			eio_clean_set_finish(dmc, set, force);
+			continue;
+		}
+		whole = force ||
+			(dmc->cache_sets[set].flags & SETFLAG_CLEAN_WHOLE);
+
+		down_write(&dmc->cache_sets[set].rw_lock);
+		ncleans[nr_cleaning] = 0;
+		if (dmc->cache_sets[set].nr_dirty)
+			ncleans[nr_cleaning] = eio_clean_set_mark(dmc, set,
+								  whole);
+		if (!ncleans[nr_cleaning]) {
+			up_write(&dmc->cache_sets[set].rw_lock);
+			eio_clean_set_finish(dmc, set, force);
+			continue;
+		}
+		trace_eio_clean_set_start(dmc, set, whole, ncleans[nr_cleaning]);
+
+		error = eio_jrnl_set_reserve(dmc, set, &jseq[nr_cleaning]);
+		if (error) {
+			eio_clean_set_update(dmc, set, ncleans[nr_cleaning],
+					     error);
+			up_write(&dmc->cache_sets[set].rw_lock);
+			eio_clean_set_finish(dmc, set, force);
+			continue;
 		}
+		set_error[nr_cleaning] = 0;
+		cleaning[nr_cleaning++] = set;
 	}
 
-	for (k = 0; k < dmc->mdpage_count; k++)
-		kunmap(dmc->clean_mdpages[k]);
+	if (!nr_cleaning)
+		return;
+	EIO_STATS_INC(dmc->eio_stats->sorted_cleans);
 
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index);
-	where.count = eio_to_sector(alloc_size);
-	error =
-		eio_io_sync_pages(dmc, &where, REQ_OP_WRITE, 0, dmc->clean_mdpages,
-				  dmc->mdpage_count);
+	/*
+	 * 4. read the data of all the sets, set k into the k-th set's worth
+	 * of dbvecs
+	 */
+	atomic_set(&sioc.pending, 1);
+	init_completion(&sioc.done);
+	sioc.sio_error = 0;
 
-	if (error)
-		goto err_out3;
+	for (k = 0; k < nr_cleaning; k++) {
+		start_index = cleaning[k] * dmc->assoc;
+		end_index = start_index + dmc->assoc;
+		for (i = start_index; i < end_index; i++) {
+			if (EIO_CACHE_STATE_GET(dmc, i) != CLEAN_INPROG)
+				continue;
+			for (j = i; ((j < end_index) &&
+				(EIO_CACHE_STATE_GET(dmc, j) == CLEAN_INPROG));
+				j++);
 
-err_out3:
+			bvecs = setup_bio_vecs(cs->dbvecs,
+					       k * dmc->assoc + (i - start_index),
+					       dmc->block_size, j - i,
+					       &nr_bvecs);
+			EIO_ASSERT(bvecs != NULL);
+			EIO_ASSERT(nr_bvecs > 0);
+			where.bdev = dmc->cache_dev->bdev;
+			where.sector =
+				(i << dmc->block_shift) + dmc->md_sectors;
+			where.count = (j - i) * dmc->block_size;
+
+			SECTOR_STATS(dmc->eio_stats->ssd_reads,
+				     to_bytes(where.count));
+			atomic_inc(&sioc.pending);
+			error = eio_io_async_bvec(dmc, &where, REQ_OP_READ, 0,
+						  bvecs, nr_bvecs,
+						  eio_sync_io_callback, &sioc,
+						  0);
+			if (error) {
+				sioc.sio_error = error;
+				atomic_dec(&sioc.pending);
+			}
+
+			/* Fast forward to the next unscheduled block */
+			for (; i < j; i++) {
+				ent = &cs->ents[nr_ents++];
+				ent->dbn = EIO_DBN_GET(dmc, i);
+				ent->index = i;
+				ent->slot = k * dmc->assoc + (i - start_index);
+			}
+		}
+	}
+	eio_unplug_cache_device(dmc);
+
+	if (!atomic_dec_and_test(&sioc.pending))
+		wait_for_completion_io(&sioc.done);
+	error = sioc.sio_error;
+	if (error)
+		goto out;
 
 	/*
-	 * 7. update in-core cache metadata for clean_inprog blocks.
-	 * If there was an error, set them back to ALREADY_DIRTY
-	 * If no error, set them to VALID
+	 * 5. write to hdd in dbn order. The bvecs of a run are gathered in
+	 * wbvecs, they must stay until the writes complete.
 	 */
-	for (i = start_index; i < end_index; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
-			if (error)
-				EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
-			else {
-				EIO_CACHE_STATE_SET(dmc, i, VALID);
-				EIO_ASSERT(dmc->cache_sets[set].nr_dirty > 0);
-				dmc->cache_sets[set].nr_dirty--;
-				atomic64_dec(&dmc->nr_dirty);
+	sort(cs->ents, nr_ents, sizeof(struct eio_clean_ent),
+	     eio_clean_ent_cmp, NULL);
+	atomic_set(&sioc.pending, 1);
+	reinit_completion(&sioc.done);
+	w = 0;
+	for (e = 0; e < nr_ents; e = f) {
+		ent = &cs->ents[e];
+
+		/* Partially dirty block, write back its dirty runs */
+		if (dmc->cache_sbmap[ent->index].sb_clean) {
+			f = e + 1;
+			bvecs = setup_bio_vecs(cs->dbvecs, ent->slot,
+					       dmc->block_size, 1, &nr_bvecs);
+			error = eio_clean_subblocks(dmc, ent->index, bvecs,
+						    nr_bvecs, &sioc, &sbvecs);
+			if (error) {
+				sioc.sio_error = error;
+				break;
 			}
+			continue;
 		}
-	}
 
-err_out2:
+		nr_run = 0;
+		for (f = e; f < nr_ents; f++) {
+			if (f > e &&
+			    (cs->ents[f].dbn !=
+			     cs->ents[f - 1].dbn + dmc->block_size ||
+			     dmc->cache_sbmap[cs->ents[f].index].sb_clean))
+				break;
+			bvecs = setup_bio_vecs(cs->dbvecs, cs->ents[f].slot,
+					       dmc->block_size, 1, &nr_bvecs);
+			memcpy(&cs->wbvecs[w + nr_run], bvecs,
+			       nr_bvecs * sizeof(struct bio_vec));
+			nr_run += nr_bvecs;
+		}
 
-	up_write(&dmc->cache_sets[set].rw_lock);
+		where.bdev = dmc->disk_dev->bdev;
+		where.sector = ent->dbn;
+		where.count = (f - e) * dmc->block_size;
+
+		SECTOR_STATS(dmc->eio_stats->disk_writes,
+			     to_bytes(where.count));
+		EIO_STATS_INC(dmc->eio_stats->sorted_clean_writes);
+		atomic_inc(&sioc.pending);
+		error = eio_io_async_bvec(dmc, &where, REQ_OP_WRITE,
+					  EIO_REQ_SYNC, &cs->wbvecs[w], nr_run,
+					  eio_sync_io_callback, &sioc, 1);
+		if (error) {
+			sioc.sio_error = error;
+			atomic_dec(&sioc.pending);
+		}
+		w += nr_run;
+	}
 
-err_out1:
+	if (!atomic_dec_and_test(&sioc.pending))
+		wait_for_completion_io(&sioc.done);
+	error = sioc.sio_error;
+	eio_free_sbvecs(&sbvecs);
+	if (error)
+		goto out;
 
-	/* Reset clean flags on the set */
+	/* 6. update on-disk cache metadata of all the sets at once */
+	md_size = dmc->assoc * sizeof(struct flash_cacheblock);
+	for (k = 0; k < nr_cleaning; k++) {
+		mdpages = &cs->mdpages[k * dmc->mdpage_count];
+		bvecs = &cs->mdbvecs[k * dmc->mdpage_count];
+		eio_set_md_fill(dmc, cleaning[k], mdpages);
+		for (f = 0; f < dmc->mdpage_count; f++) {
+			bvecs[f].bv_page = mdpages[f];
+			bvecs[f].bv_offset = 0;
+			bvecs[f].bv_len = min_t(unsigned, PAGE_SIZE,
+						md_size - f * PAGE_SIZE);
+		}
 
-	if (!force) {
-		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
-		dmc->cache_sets[set].flags &=
-			~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE);
-		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+		atomic_set(&mdsioc[k].pending, 2);
+		init_completion(&mdsioc[k].done);
+		mdsioc[k].sio_error = 0;
+		where.bdev = dmc->cache_dev->bdev;
+		where.sector = dmc->md_start_sect +
+			       INDEX_TO_MD_SECTOR(cleaning[k] * dmc->assoc);
+		where.count = eio_to_sector(md_size);
+		error = eio_io_async_bvec(dmc, &where, REQ_OP_WRITE, 0,
+					  bvecs, dmc->mdpage_count,
+					  eio_sync_io_callback, &mdsioc[k], 0);
+		if (error) {
+			mdsioc[k].sio_error = error;
+			atomic_dec(&mdsioc[k].pending);
+		}
+	}
+	error = 0;
+	for (k = 0; k < nr_cleaning; k++) {
+		if (!atomic_dec_and_test(&mdsioc[k].pending))
+			wait_for_completion_io(&mdsioc[k].done);
+		set_error[k] = mdsioc[k].sio_error;
+		if (!set_error[k])
+			set_error[k] = eio_jrnl_set_commit(dmc, cleaning[k],
+							   jseq[k]);
 	}
 
-	if (dmc->cache_sets[set].nr_dirty)
-		/*
-		 * Lru touch the set, so that it can be picked
-		 * up for whole set clean by clean thread later
-		 */
-		eio_touch_set_lru(dmc, set);
-
-	return;
+out:
+	/* 7. update in-core cache metadata, as a set clean */
+	for (k = 0; k < nr_cleaning; k++) {
+		set = cleaning[k];
+		eio_clean_set_update(dmc, set, ncleans[k],
+				     error ? error : set_error[k]);
+		up_write(&dmc->cache_sets[set].rw_lock);
+		eio_clean_set_finish(dmc, set, force);
+	}
 }
 
 /*
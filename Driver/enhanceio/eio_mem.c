@@ -61,6 +61,14 @@ int eio_mem_init(struct cache_c *dmc)
 		return -1;
 	}
 
+	/*
+	 * Split a block into at most EIO_SUBBLOCKS_MAX sub-blocks.
+	 */
+	dmc->sb_shift = 0;
+	while ((dmc->block_size >> dmc->sb_shift) > EIO_SUBBLOCKS_MAX)
+		dmc->sb_shift++;
+	dmc->sb_full = (u_int16_t)((1U << (dmc->block_size >> dmc->sb_shift)) - 1);
+
 	/*
 	 * Find the number of bits required to encode the set number and
 	 * its corresponding mask value.
@@ -83,12 +91,15 @@ int eio_mem_init(struct cache_c *dmc)
 
 	/*
 	 * Now compute the largest sector number that we can shrink; then see
-	 * if the source volume is smaller.
+	 * if the source volume is smaller. Cached dbns are block aligned, so
+	 * the sector bits within a block are not stored, and bigger blocks
+	 * can address a bigger source.
 	 */
-	lsb_bits = dmc->consecutive_shift + dmc->block_shift;
+	lsb_bits = dmc->consecutive_shift;
 	msb_bits_24 = 24 - 1 - lsb_bits;        /* 1 for wrapped bit */
 	max_dbn =
-		((u_int64_t)1) << (msb_bits_24 + dmc->num_sets_bits + lsb_bits);
+		((u_int64_t)1) << (msb_bits_24 + dmc->num_sets_bits + lsb_bits +
+				   dmc->block_shift);
 	if (eio_to_sector(eio_get_device_size(dmc->disk_dev)) > max_dbn) {
 		dmc->cache_flags |= CACHE_FLAGS_MD8;
 		pr_info("Source volume too big to use small metadata");
@@ -116,7 +127,8 @@ u_int32_t eio_hash_block(struct cache_c *dmc, sector_t dbn)
  * eio_shrink_dbn
  *
  * Shrink a 5-byte "dbn" into a 3-byte "dbn" by eliminating 16 lower bits
- * of the set number this "dbn" belongs to.
+ * of the set number this "dbn" belongs to, and its sector offset within
+ * the (block aligned) cache block.
  */
 unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn)
 {
@@ -130,12 +142,13 @@ unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn)
 	if (unlikely(dbn == 0))
 		return 0;
 
-	lsb = dbn & SECTORS_PER_SET_MASK;
+	EIO_ASSERT(!(dbn & dmc->block_mask));
+	lsb = (dbn & SECTORS_PER_SET_MASK) >> dmc->block_shift;
 	EIO_DBN_TO_SET(dmc, dbn, set_number, wrapped);
 	msb = dbn >> (dmc->num_sets_bits + SECTORS_PER_SET_SHIFT);
 	dbn_24 =
-		(unsigned int)(lsb | (wrapped << SECTORS_PER_SET_SHIFT) |
-			       (msb << (SECTORS_PER_SET_SHIFT + 1)));
+		(unsigned int)(lsb | (wrapped << dmc->consecutive_shift) |
+			       (msb << (dmc->consecutive_shift + 1)));
 
 	return dbn_24;
 }
@@ -167,10 +180,10 @@ sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index)
 		return (sector_t)0;
 
 	set_number = EIO_DIV(index, dmc->assoc);
-	lsb = dbn_24 & SECTORS_PER_SET_MASK;
-	msb = dbn_24 >> (SECTORS_PER_SET_SHIFT + 1);    /* 1 for wrapped */
+	lsb = (sector_t)(dbn_24 & (dmc->assoc - 1)) << dmc->block_shift;
+	msb = dbn_24 >> (dmc->consecutive_shift + 1);   /* 1 for wrapped */
 	/* had we wrapped? */
-	if ((dbn_24 & SECTORS_PER_SET) != 0) {
+	if ((dbn_24 & dmc->assoc) != 0) {
 		dbn_40 = msb << (dmc->num_sets_bits + SECTORS_PER_SET_SHIFT);
 		dbn_40 |= (set_number + dmc->num_sets) << SECTORS_PER_SET_SHIFT;
 		dbn_40 |= lsb;
@@ -195,6 +208,12 @@ void eio_invalidate_md(struct cache_c *dmc, u_int64_t index)
 		dmc->cache_md8[index].md8_u.u_i_md8 = EIO_MD8_INVALID;
 	else
 		dmc->cache[index].md4_u.u_i_md4 = EIO_MD4_INVALID;
+	if (dmc->cache_states[index] & VALID)
+		eio_lf_update(dmc, index, dmc->cache_tags[index], -1);
+	dmc->cache_states[index] = INVALID;
+	dmc->cache_tags[index] = 0;
+	dmc->cache_sbmap[index].sb_invalid = 0;
+	dmc->cache_sbmap[index].sb_clean = 0;
 }
 
 /*
@@ -126,6 +126,15 @@ int eio_policy_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 	return p_ops->sp_clean_set(p_ops, set, to_clean);
 }
 
+void
+eio_policy_blk_access(struct eio_policy *p_ops, index_t index, sector_t dbn,
+		      int flags)
+{
+
+	if (p_ops && p_ops->sp_blk_access)
+		p_ops->sp_blk_access(p_ops, index, dbn, flags);
+}
+
 /*
  * LRU Specific functions
  */
@@ -60,6 +60,11 @@ void eio_policy_lru_pushblks(struct eio_policy *);
 void eio_policy_reclaim_lru_movetail(struct cache_c *, index_t,
 				     struct eio_policy *);
 
+/* sp_blk_access() flags */
+#define EIO_ACCESS_HIT          0x01    /* else a miss about to fill the block */
+#define EIO_ACCESS_COLD         0x02    /* background I/O, do not make the block hotter */
+#define EIO_ACCESS_HOT          0x04    /* latency critical I/O, keep the block longer */
+
 /*
  * Context that captures the cache block replacement policy.
  * There is one instance of this struct per dmc (cache)
@@ -76,6 +81,9 @@ struct eio_policy {
 	void (*sp_find_reclaim_dbn)(struct eio_policy *,
 				    index_t start_index, index_t *index);
 	int (*sp_clean_set)(struct eio_policy *, index_t set, int);
+	/* Optional: a hit on index, or a miss about to put dbn in index */
+	void (*sp_blk_access)(struct eio_policy *, index_t index,
+			      sector_t dbn, int flags);
 	struct cache_c *sp_dmc;
 };
 
@@ -96,6 +104,7 @@ int eio_repl_blk_init(struct eio_policy *);
 void eio_find_reclaim_dbn(struct eio_policy *, index_t start_index,
 			  index_t *index);
 int eio_policy_clean_set(struct eio_policy *, index_t, int);
+void eio_policy_blk_access(struct eio_policy *, index_t, sector_t, int);
 
 int eio_register_policy(struct eio_policy_header *);
 int eio_unregister_policy(struct eio_policy_header *);
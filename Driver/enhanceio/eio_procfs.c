@@ -53,24 +53,505 @@ eio_version_query(size_t buf_sz, char *bufp)
 	return 0;
 }
 
+/*
+ * Fold the per-cpu run time stats into "sum". Every field of
+ * struct eio_stats is an int64_t, so it is walked as an array.
+ */
+void eio_stats_sum(struct cache_c *dmc, struct eio_stats *sum)
+{
+	int64_t *src, *dst = (int64_t *)sum;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		src = (int64_t *)per_cpu_ptr(dmc->eio_stats, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(int64_t); i++)
+			dst[i] += src[i];
+	}
+}
+
+/*
+ * Reset the per-cpu run time stats and the io size and latency histograms.
+ */
+void eio_stats_zero(struct cache_c *dmc)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(dmc->eio_stats, cpu), 0,
+		       sizeof(struct eio_stats));
+		memset(per_cpu_ptr(dmc->size_hist, cpu), 0,
+		       sizeof(int64_t) * SIZE_HIST);
+		memset(per_cpu_ptr(dmc->lat_hist, cpu), 0,
+		       sizeof(struct eio_lat_hist));
+	}
+}
+
 static struct sysctl_table_dir *sysctl_handle_dir;
 
 /*
- * eio_zerostats_sysctl
+ * eio_zerostats_sysctl
+ */
+static int
+eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
+		     size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.zerostats = dmc->sysctl_active.zerostats;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if ((dmc->sysctl_pending.zerostats != 0) &&
+		    (dmc->sysctl_pending.zerostats != 1)) {
+			pr_err
+				("0 or 1 are the only valid values for zerostats");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.zerostats ==
+		    dmc->sysctl_active.zerostats)
+			/* same value. Nothing to work */
+			return 0;
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.zerostats = dmc->sysctl_pending.zerostats;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* apply the new tunable value */
+
+		if (dmc->sysctl_active.zerostats) {
+			/*
+			 * The number of cached blocks is not part of the per-cpu
+			 * stats and is left alone since these blocks are already
+			 * on cache dev. Making this zero may lead to -ve count
+			 * during block invalidate, and also, incorrectly indicating
+			 * how much data is cached.
+			 *
+			 * TODO - counters updated on other cpus while we zero
+			 * them may survive the reset, same as with the former
+			 * memset.
+			 */
+
+			eio_stats_zero(dmc);
+			dmc->sysctl_active.zerostats = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * eio_mem_limit_pct_sysctl
+ * - sets the eio sysctl mem_limit_pct value
+ */
+static int
+eio_mem_limit_pct_sysctl(struct ctl_table *table, int write, void __user *buffer,
+			 size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.mem_limit_pct =
+			dmc->sysctl_active.mem_limit_pct;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.mem_limit_pct < 0) ||
+		    (dmc->sysctl_pending.mem_limit_pct > 100)) {
+			pr_err
+				("only valid percents are [0 - 100] for mem_limit_pct");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.mem_limit_pct ==
+		    dmc->sysctl_active.mem_limit_pct)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.mem_limit_pct =
+			dmc->sysctl_pending.mem_limit_pct;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_seq_io_cutoff_sysctl
+ * - sets the length (in KB) after which a sequential stream bypasses
+ *   cache allocation. 0 turns the bypass off.
+ */
+static int
+eio_seq_io_cutoff_sysctl(struct ctl_table *table, int write,
+			 void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.seq_io_cutoff =
+			dmc->sysctl_active.seq_io_cutoff;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		int error;
+		uint32_t old_value;
+
+		/* do sanity check */
+
+		if (dmc->sysctl_pending.seq_io_cutoff > SEQ_IO_CUTOFF_MAX) {
+			pr_err
+				("seq_io_cutoff should be [0 - %u] KB",
+				SEQ_IO_CUTOFF_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.seq_io_cutoff ==
+		    dmc->sysctl_active.seq_io_cutoff)
+			/* new is same as old value. No need to take any action */
+			return 0;
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_value = dmc->sysctl_active.seq_io_cutoff;
+		dmc->sysctl_active.seq_io_cutoff =
+			dmc->sysctl_pending.seq_io_cutoff;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.seq_io_cutoff = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * eio_read_around_sysctl
+ * - when set, a read miss smaller than a cache block reads the whole
+ *   block from HDD and fills it into the SSD.
+ */
+static int
+eio_read_around_sysctl(struct ctl_table *table, int write,
+		       void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.read_around = dmc->sysctl_active.read_around;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		int error;
+		uint32_t old_value;
+
+		/* do sanity check */
+
+		if ((dmc->sysctl_pending.read_around != 0) &&
+		    (dmc->sysctl_pending.read_around != 1)) {
+			pr_err("read_around should be either 0 or 1");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.read_around ==
+		    dmc->sysctl_active.read_around)
+			/* new is same as old value. No need to take any action */
+			return 0;
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_value = dmc->sysctl_active.read_around;
+		dmc->sysctl_active.read_around = dmc->sysctl_pending.read_around;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.read_around = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * eio_lookup_filter_sysctl
+ * - when set, each cache set keeps a counting Bloom filter of its dbns,
+ *   so that most lookups of absent dbns skip the scan of the set.
+ */
+static int
+eio_lookup_filter_sysctl(struct ctl_table *table, int write,
+			 void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.lookup_filter =
+			dmc->sysctl_active.lookup_filter;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		int error;
+		uint32_t old_value;
+
+		/* do sanity check */
+
+		if ((dmc->sysctl_pending.lookup_filter != 0) &&
+		    (dmc->sysctl_pending.lookup_filter != 1)) {
+			pr_err("lookup_filter should be either 0 or 1");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.lookup_filter ==
+		    dmc->sysctl_active.lookup_filter)
+			/* new is same as old value. No need to take any action */
+			return 0;
+
+		if (dmc->sysctl_pending.lookup_filter) {
+			error = eio_lookup_filter_enable(dmc);
+			if (error)
+				return error;
+		} else
+			eio_lookup_filter_disable(dmc);
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_value = dmc->sysctl_active.lookup_filter;
+		dmc->sysctl_active.lookup_filter =
+			dmc->sysctl_pending.lookup_filter;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.lookup_filter = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+			if (old_value)
+				eio_lookup_filter_enable(dmc);
+			else
+				eio_lookup_filter_disable(dmc);
+
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * eio_admission_sysctl
+ * - when set, a miss may evict a valid block only if its dbn is
+ *   accessed at least as often as the victim's, as estimated by a
+ *   frequency sketch.
+ */
+static int
+eio_admission_sysctl(struct ctl_table *table, int write,
+		     void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.admission = dmc->sysctl_active.admission;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		int error;
+		uint32_t old_value;
+
+		/* do sanity check */
+
+		if ((dmc->sysctl_pending.admission != 0) &&
+		    (dmc->sysctl_pending.admission != 1)) {
+			pr_err("admission should be either 0 or 1");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.admission ==
+		    dmc->sysctl_active.admission)
+			/* new is same as old value. No need to take any action */
+			return 0;
+
+		/* The sketch is kept once allocated */
+		if (dmc->sysctl_pending.admission) {
+			error = eio_admit_enable(dmc);
+			if (error)
+				return error;
+		}
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_value = dmc->sysctl_active.admission;
+		dmc->sysctl_active.admission = dmc->sysctl_pending.admission;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.admission = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * eio_io_hints_sysctl
+ * - a mask of EIO_HINT_* rules on the readahead and metadata flags and
+ *   the I/O priority class of bios.
+ */
+static int
+eio_io_hints_sysctl(struct ctl_table *table, int write,
+		    void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.io_hints = dmc->sysctl_active.io_hints;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		int error;
+		uint32_t old_value;
+
+		/* do sanity check */
+
+		if (dmc->sysctl_pending.io_hints & ~EIO_HINT_ALL) {
+			pr_err("io_hints should be a mask of 0x%x",
+			       EIO_HINT_ALL);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.io_hints == dmc->sysctl_active.io_hints)
+			/* new is same as old value. No need to take any action */
+			return 0;
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_value = dmc->sysctl_active.io_hints;
+		dmc->sysctl_active.io_hints = dmc->sysctl_pending.io_hints;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.io_hints = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * eio_md_batch_usec_sysctl
+ * - how long the md group commit waits for more sets to update.
  */
 static int
-eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
-		     size_t *length, loff_t *ppos)
+eio_md_batch_usec_sysctl(struct ctl_table *table, int write,
+			 void __user *buffer, size_t *length, loff_t *ppos)
 {
 	struct cache_c *dmc = (struct cache_c *)table->extra1;
-	long long cached_blocks;
 	unsigned long flags = 0;
 
 	/* fetch the new tunable value or post the existing value */
 
 	if (!write) {
 		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		dmc->sysctl_pending.zerostats = dmc->sysctl_active.zerostats;
+		dmc->sysctl_pending.md_batch_usec =
+			dmc->sysctl_active.md_batch_usec;
 		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 	}
 
@@ -79,57 +560,131 @@ eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
 	/* do write processing */
 
 	if (write) {
+		int error;
+		uint32_t old_value;
+
 		/* do sanity check */
 
-		if ((dmc->sysctl_pending.zerostats != 0) &&
-		    (dmc->sysctl_pending.zerostats != 1)) {
-			pr_err
-				("0 or 1 are the only valid values for zerostats");
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("md_batch_usec is valid only for writeback cache");
 			return -EINVAL;
 		}
 
-		if (dmc->sysctl_pending.zerostats ==
-		    dmc->sysctl_active.zerostats)
-			/* same value. Nothing to work */
+		if (dmc->sysctl_pending.md_batch_usec > MD_BATCH_USEC_MAX) {
+			pr_err("md_batch_usec valid range is 0 to %d",
+			       MD_BATCH_USEC_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.md_batch_usec ==
+		    dmc->sysctl_active.md_batch_usec)
+			/* new is same as old value. No need to take any action */
 			return 0;
 
-		/* Copy to active */
+		/* update the active value with the new tunable value */
 		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		dmc->sysctl_active.zerostats = dmc->sysctl_pending.zerostats;
+		old_value = dmc->sysctl_active.md_batch_usec;
+		dmc->sysctl_active.md_batch_usec =
+			dmc->sysctl_pending.md_batch_usec;
 		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 
-		/* apply the new tunable value */
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.md_batch_usec = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 
-		if (dmc->sysctl_active.zerostats) {
-			/*
-			 * The number of cached blocks should not be zero'd since
-			 * these blocks are already on cache dev. Making this zero
-			 * may lead to -ve count during block invalidate, and also,
-			 * incorrectly indicating how much data is cached.
-			 *
-			 * TODO - should have used an spinlock, but existing spinlocks
-			 * are inadequate to fully protect this
-			 */
+			return error;
+		}
+	}
 
-			cached_blocks =
-				atomic64_read(&dmc->eio_stats.cached_blocks);
-			memset(&dmc->eio_stats, 0, sizeof(struct eio_stats));
-			atomic64_set(&dmc->eio_stats.cached_blocks,
-				     cached_blocks);
-			dmc->sysctl_active.zerostats = 0;
+	return 0;
+}
+
+/*
+ * eio_md_journal_sysctl
+ * - log the md updates to the journal instead of writing them in place.
+ */
+static int
+eio_md_journal_sysctl(struct ctl_table *table, int write,
+		      void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.md_journal = dmc->sysctl_active.md_journal;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		int error;
+		uint32_t old_value;
+
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("md_journal is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.md_journal != 0 &&
+		    dmc->sysctl_pending.md_journal != 1) {
+			pr_err("md_journal valid values are 0 and 1");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.md_journal && !dmc->jrnl_sets[0]) {
+			pr_err("md_journal: cache %s has no journal space, " \
+			       "it must be created again", dmc->cache_name);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.md_journal ==
+		    dmc->sysctl_active.md_journal)
+			/* new is same as old value. No need to take any action */
+			return 0;
+
+		/* update the active value with the new tunable value */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		old_value = dmc->sysctl_active.md_journal;
+		dmc->sysctl_active.md_journal = dmc->sysctl_pending.md_journal;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.md_journal = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+			return error;
 		}
+
+		/* Turned off, fold what the journal has into the flat md */
+		if (!dmc->sysctl_active.md_journal && dmc->jrnl_ckpt_q)
+			queue_work(dmc->jrnl_ckpt_q, &dmc->jrnl_ckpt_work);
 	}
 
 	return 0;
 }
 
 /*
- * eio_mem_limit_pct_sysctl
- * - sets the eio sysctl mem_limit_pct value
+ * eio_clean_sort_sysctl
  */
 static int
-eio_mem_limit_pct_sysctl(struct ctl_table *table, int write, void __user *buffer,
-			 size_t *length, loff_t *ppos)
+eio_clean_sort_sysctl(struct ctl_table *table, int write,
+		      void __user *buffer, size_t *length, loff_t *ppos)
 {
 	struct cache_c *dmc = (struct cache_c *)table->extra1;
 	unsigned long flags = 0;
@@ -138,8 +693,7 @@ eio_mem_limit_pct_sysctl(struct ctl_table *table, int write, void __user *buffer
 
 	if (!write) {
 		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		dmc->sysctl_pending.mem_limit_pct =
-			dmc->sysctl_active.mem_limit_pct;
+		dmc->sysctl_pending.clean_sort = dmc->sysctl_active.clean_sort;
 		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 	}
 
@@ -148,24 +702,49 @@ eio_mem_limit_pct_sysctl(struct ctl_table *table, int write, void __user *buffer
 	/* do write processing */
 
 	if (write) {
+		int error;
+		uint32_t old_value;
+
 		/* do sanity check */
-		if ((dmc->sysctl_pending.mem_limit_pct < 0) ||
-		    (dmc->sysctl_pending.mem_limit_pct > 100)) {
-			pr_err
-				("only valid percents are [0 - 100] for mem_limit_pct");
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("clean_sort is valid only for writeback cache");
 			return -EINVAL;
 		}
 
-		if (dmc->sysctl_pending.mem_limit_pct ==
-		    dmc->sysctl_active.mem_limit_pct)
-			/* same value. Nothing more to do */
+		if (dmc->sysctl_pending.clean_sort != 0 &&
+		    dmc->sysctl_pending.clean_sort != 1) {
+			pr_err("clean_sort valid values are 0 and 1");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.clean_sort ==
+		    dmc->sysctl_active.clean_sort)
+			/* new is same as old value. No need to take any action */
 			return 0;
 
-		/* Copy to active */
+		if (dmc->sysctl_pending.clean_sort && eio_clean_sort_alloc(dmc)) {
+			pr_err("clean_sort: No memory for the buffers of " \
+			       "cache %s", dmc->cache_name);
+			return -ENOMEM;
+		}
+
+		/* update the active value with the new tunable value */
 		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		dmc->sysctl_active.mem_limit_pct =
-			dmc->sysctl_pending.mem_limit_pct;
+		old_value = dmc->sysctl_active.clean_sort;
+		dmc->sysctl_active.clean_sort = dmc->sysctl_pending.clean_sort;
 		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+		/* Store the change persistently */
+		error = eio_sb_store(dmc);
+		if (error) {
+			/* restore back the old value and return error */
+			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			dmc->sysctl_active.clean_sort = old_value;
+			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+			return error;
+		}
 	}
 
 	return 0;
@@ -998,6 +1577,7 @@ eio_control_sysctl(struct ctl_table *table, int write, void __user *buffer,
 #define PROC_STATS              "stats"
 #define PROC_ERRORS             "errors"
 #define PROC_IOSZ_HIST          "io_hist"
+#define PROC_LAT_HIST           "latency_hist"
 #define PROC_CONFIG             "config"
 
 static int eio_invalidate_sysctl(struct ctl_table *table, int write,
@@ -1017,6 +1597,8 @@ static int eio_errors_show(struct seq_file *seq, void *v);
 static int eio_errors_open(struct inode *inode, struct file *file);
 static int eio_iosize_hist_show(struct seq_file *seq, void *v);
 static int eio_iosize_hist_open(struct inode *inode, struct file *file);
+static int eio_lat_hist_show(struct seq_file *seq, void *v);
+static int eio_lat_hist_open(struct inode *inode, struct file *file);
 static int eio_version_show(struct seq_file *seq, void *v);
 static int eio_version_open(struct inode *inode, struct file *file);
 static int eio_config_show(struct seq_file *seq, void *v);
@@ -1050,6 +1632,13 @@ static const struct file_operations eio_iosize_hist_operations = {
 	.release	= single_release,
 };
 
+static const struct file_operations eio_lat_hist_operations = {
+	.open		= eio_lat_hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static const struct file_operations eio_config_operations = {
 	.open		= eio_config_open,
 	.read		= seq_read,
@@ -1112,7 +1701,7 @@ static struct sysctl_table_dir {
 	},
 };
 
-#define NUM_COMMON_SYSCTLS      3
+#define NUM_COMMON_SYSCTLS      8
 
 static struct sysctl_table_common {
 	struct ctl_table_header *sysctl_header;
@@ -1146,6 +1735,46 @@ static struct sysctl_table_common {
 			.maxlen		= sizeof(int),
 			.mode		= 0644,
 			.proc_handler	= &eio_control_sysctl,
+		}, {            /* 4 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "seq_io_cutoff",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_seq_io_cutoff_sysctl,
+		}, {            /* 5 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "read_around",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_read_around_sysctl,
+		}, {            /* 6 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "lookup_filter",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_lookup_filter_sysctl,
+		}, {            /* 7 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "admission",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_admission_sysctl,
+		}, {            /* 8 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "io_hints",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_io_hints_sysctl,
 		},
 	}, .dev	= {
 		{
@@ -1180,7 +1809,7 @@ static struct sysctl_table_common {
 	},
 };
 
-#define NUM_WRITEBACK_SYSCTLS   8
+#define NUM_WRITEBACK_SYSCTLS   11
 
 static struct sysctl_table_writeback {
 	struct ctl_table_header *sysctl_header;
@@ -1259,6 +1888,33 @@ static struct sysctl_table_writeback {
 			.mode		= 0644,
 			.proc_handler	= &eio_cache_wronly_sysctl,
 		}
+		, {		/* 9 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "md_batch_usec",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_md_batch_usec_sysctl,
+		}
+		, {		/* 10 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "md_journal",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_md_journal_sysctl,
+		}
+		, {		/* 11 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "clean_sort",
+			.maxlen		= sizeof(uint32_t),
+			.mode		= 0644,
+			.proc_handler	= &eio_clean_sort_sysctl,
+		}
 		,
 	}
 	, .dev = {
@@ -1413,6 +2069,10 @@ void eio_procfs_ctr(struct cache_c *dmc)
 	entry = proc_create_data(s, 0, NULL, &eio_iosize_hist_operations, dmc);
 	kfree(s);
 
+	s = eio_cons_procfs_cachename(dmc, PROC_LAT_HIST);
+	entry = proc_create_data(s, 0, NULL, &eio_lat_hist_operations, dmc);
+	kfree(s);
+
 	s = eio_cons_procfs_cachename(dmc, PROC_CONFIG);
 	entry = proc_create_data(s, 0, NULL, &eio_config_operations, dmc);
 	kfree(s);
@@ -1443,6 +2103,10 @@ void eio_procfs_dtr(struct cache_c *dmc)
 	remove_proc_entry(s, NULL);
 	kfree(s);
 
+	s = eio_cons_procfs_cachename(dmc, PROC_LAT_HIST);
+	remove_proc_entry(s, NULL);
+	kfree(s);
+
 	s = eio_cons_procfs_cachename(dmc, PROC_CONFIG);
 	remove_proc_entry(s, NULL);
 	kfree(s);
@@ -1553,6 +2217,22 @@ static void *eio_find_sysctl_data(struct cache_c *dmc, struct ctl_table *vars)
 		return (void *)&dmc->sysctl_pending.dirty_set_low_threshold;
 	if (strcmp(vars->procname, "cache_wronly") == 0)
 		return (void *)&dmc->sysctl_pending.cache_wronly;
+	if (strcmp(vars->procname, "seq_io_cutoff") == 0)
+		return (void *)&dmc->sysctl_pending.seq_io_cutoff;
+	if (strcmp(vars->procname, "read_around") == 0)
+		return (void *)&dmc->sysctl_pending.read_around;
+	if (strcmp(vars->procname, "lookup_filter") == 0)
+		return (void *)&dmc->sysctl_pending.lookup_filter;
+	if (strcmp(vars->procname, "admission") == 0)
+		return (void *)&dmc->sysctl_pending.admission;
+	if (strcmp(vars->procname, "io_hints") == 0)
+		return (void *)&dmc->sysctl_pending.io_hints;
+	if (strcmp(vars->procname, "md_batch_usec") == 0)
+		return (void *)&dmc->sysctl_pending.md_batch_usec;
+	if (strcmp(vars->procname, "md_journal") == 0)
+		return (void *)&dmc->sysctl_pending.md_journal;
+	if (strcmp(vars->procname, "clean_sort") == 0)
+		return (void *)&dmc->sysctl_pending.clean_sort;
 	if (strcmp(vars->procname, "autoclean_threshold") == 0)
 		return (void *)&dmc->sysctl_pending.autoclean_threshold;
 	if (strcmp(vars->procname, "zero_stats") == 0)
@@ -1824,69 +2504,83 @@ static void eio_sysctl_unregister_invalidate(struct cache_c *dmc)
 static int eio_stats_show(struct seq_file *seq, void *v)
 {
 	struct cache_c *dmc = seq->private;
-	struct eio_stats *stats = &dmc->eio_stats;
+	struct eio_stats sum, *stats = &sum;
 	unsigned read_hit_pct, write_hit_pct, dirty_write_hit_pct;
 
-	if (atomic64_read(&stats->reads) > 0)
+	eio_stats_sum(dmc, stats);
+
+	if (stats->reads > 0)
 		read_hit_pct = EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->read_hits),
-				atomic64_read(&stats->reads));
+				stats->read_hits,
+				stats->reads);
 	else
 		read_hit_pct = 0;
 
-	if (atomic64_read(&stats->writes) > 0) {
+	if (stats->writes > 0) {
 		write_hit_pct =
 		EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->write_hits),
-				atomic64_read(&stats->writes));
+				stats->write_hits,
+				stats->writes);
 		dirty_write_hit_pct =
 			EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->dirty_write_hits),
-				atomic64_read(&stats->writes));
+				stats->dirty_write_hits,
+				stats->writes);
 	} else {
 		write_hit_pct = 0;
 		dirty_write_hit_pct = 0;
 	}
 
 	seq_printf(seq, "%-26s %12lld\n", "reads",
-		   (int64_t)atomic64_read(&stats->reads));
+		   stats->reads);
 	seq_printf(seq, "%-26s %12lld\n", "writes",
-		   (int64_t)atomic64_read(&stats->writes));
+		   stats->writes);
 
 	seq_printf(seq, "%-26s %12lld\n", "read_hits",
-		   (int64_t)atomic64_read(&stats->read_hits));
+		   stats->read_hits);
 	seq_printf(seq, "%-26s %12u\n", "read_hit_pct", read_hit_pct);
 
 	seq_printf(seq, "%-26s %12lld\n", "write_hits",
-		   (int64_t)atomic64_read(&stats->write_hits));
+		   stats->write_hits);
 	seq_printf(seq, "%-26s %12u\n", "write_hit_pct", write_hit_pct);
 
 	seq_printf(seq, "%-26s %12lld\n", "dirty_write_hits",
-		   (int64_t)atomic64_read(&stats->dirty_write_hits));
+		   stats->dirty_write_hits);
 	seq_printf(seq, "%-26s %12u\n", "dirty_write_hit_pct",
 		   dirty_write_hit_pct);
 
-	if ((int64_t)(atomic64_read(&stats->cached_blocks)) < 0)
-		atomic64_set(&stats->cached_blocks, 0);
+	if ((int64_t)(atomic64_read(&dmc->cached_blocks)) < 0)
+		atomic64_set(&dmc->cached_blocks, 0);
 	seq_printf(seq, "%-26s %12lld\n", "cached_blocks",
-		   (int64_t)atomic64_read(&stats->cached_blocks));
+		   (int64_t)atomic64_read(&dmc->cached_blocks));
 
 	seq_printf(seq, "%-26s %12lld\n", "rd_replace",
-		   (int64_t)atomic64_read(&stats->rd_replace));
+		   stats->rd_replace);
 	seq_printf(seq, "%-26s %12lld\n", "wr_replace",
-		   (int64_t)atomic64_read(&stats->wr_replace));
+		   stats->wr_replace);
 
 	seq_printf(seq, "%-26s %12lld\n", "noroom",
-		   (int64_t)atomic64_read(&stats->noroom));
+		   stats->noroom);
 
 	seq_printf(seq, "%-26s %12lld\n", "cleanings",
-		   (int64_t)atomic64_read(&stats->cleanings));
+		   stats->cleanings);
 	seq_printf(seq, "%-26s %12lld\n", "md_write_dirty",
-		   (int64_t)atomic64_read(&stats->md_write_dirty));
+		   stats->md_write_dirty);
 	seq_printf(seq, "%-26s %12lld\n", "md_write_clean",
-		   (int64_t)atomic64_read(&stats->md_write_clean));
+		   stats->md_write_clean);
 	seq_printf(seq, "%-26s %12lld\n", "md_ssd_writes",
-		   (int64_t)atomic64_read(&stats->md_ssd_writes));
+		   stats->md_ssd_writes);
+	seq_printf(seq, "%-26s %12lld\n", "md_commits",
+		   stats->md_commits);
+	seq_printf(seq, "%-26s %12lld\n", "jrnl_writes",
+		   stats->jrnl_writes);
+	seq_printf(seq, "%-26s %12lld\n", "jrnl_records",
+		   stats->jrnl_records);
+	seq_printf(seq, "%-26s %12lld\n", "jrnl_checkpoints",
+		   stats->jrnl_checkpoints);
+	seq_printf(seq, "%-26s %12lld\n", "sorted_cleans",
+		   stats->sorted_cleans);
+	seq_printf(seq, "%-26s %12lld\n", "sorted_clean_writes",
+		   stats->sorted_clean_writes);
 	seq_printf(seq, "%-26s %12d\n", "do_clean",
 		   dmc->sysctl_active.do_clean);
 	seq_printf(seq, "%-26s %12lld\n", "nr_blocks", dmc->size);
@@ -1897,52 +2591,83 @@ static int eio_stats_show(struct seq_file *seq, void *v)
 		   (uint32_t)atomic_read(&dmc->clean_index));
 
 	seq_printf(seq, "%-26s %12lld\n", "uncached_reads",
-		   (int64_t)atomic64_read(&stats->uncached_reads));
+		   stats->uncached_reads);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_writes",
-		   (int64_t)atomic64_read(&stats->uncached_writes));
+		   stats->uncached_writes);
+	seq_printf(seq, "%-26s %12lld\n", "mixed_writes",
+		   stats->mixed_writes);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_map_size",
-		   (int64_t)atomic64_read(&stats->uncached_map_size));
+		   stats->uncached_map_size);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_map_uncacheable",
-		   (int64_t)atomic64_read(&stats->uncached_map_uncacheable));
+		   stats->uncached_map_uncacheable);
 
 	seq_printf(seq, "%-26s %12lld\n", "disk_reads",
-		   (int64_t)atomic64_read(&stats->disk_reads));
+		   stats->disk_reads);
 	seq_printf(seq, "%-26s %12lld\n", "disk_writes",
-		   (int64_t)atomic64_read(&stats->disk_writes));
+		   stats->disk_writes);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_reads",
-		   (int64_t)atomic64_read(&stats->ssd_reads));
+		   stats->ssd_reads);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_writes",
-		   (int64_t)atomic64_read(&stats->ssd_writes));
+		   stats->ssd_writes);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_readfills",
-		   (int64_t)atomic64_read(&stats->ssd_readfills));
+		   stats->ssd_readfills);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_readfill_unplugs",
-		   (int64_t)atomic64_read(&stats->ssd_readfill_unplugs));
+		   stats->ssd_readfill_unplugs);
 
 	seq_printf(seq, "%-26s %12lld\n", "readdisk",
-		   (int64_t)atomic64_read(&stats->readdisk));
+		   stats->readdisk);
 	seq_printf(seq, "%-26s %12lld\n", "writedisk",
-		   (int64_t)atomic64_read(&stats->readdisk));
+		   stats->readdisk);
 	seq_printf(seq, "%-26s %12lld\n", "readcache",
-		   (int64_t)atomic64_read(&stats->readcache));
+		   stats->readcache);
 	seq_printf(seq, "%-26s %12lld\n", "readfill",
-		   (int64_t)atomic64_read(&stats->readfill));
+		   stats->readfill);
 	seq_printf(seq, "%-26s %12lld\n", "writecache",
-		   (int64_t)atomic64_read(&stats->writecache));
+		   stats->writecache);
+	seq_printf(seq, "%-26s %12lld\n", "inline_completions",
+		   stats->inline_completions);
 
 	seq_printf(seq, "%-26s %12lld\n", "readcount",
-		   (int64_t)atomic64_read(&stats->readcount));
+		   stats->readcount);
 	seq_printf(seq, "%-26s %12lld\n", "writecount",
-		   (int64_t)atomic64_read(&stats->writecount));
+		   stats->writecount);
 	seq_printf(seq, "%-26s %12lld\n", "kb_reads",
-		   (int64_t)atomic64_read(&stats->reads) / 2);
+		   stats->reads / 2);
 	seq_printf(seq, "%-26s %12lld\n", "kb_writes",
-		   (int64_t)atomic64_read(&stats->writes) / 2);
+		   stats->writes / 2);
 	seq_printf(seq, "%-26s %12lld\n", "rdtime_ms",
-		   (int64_t)atomic64_read(&stats->rdtime_ms));
+		   stats->rdtime_ms);
 	seq_printf(seq, "%-26s %12lld\n", "wrtime_ms",
-		   (int64_t)atomic64_read(&stats->wrtime_ms));
+		   stats->wrtime_ms);
 	seq_printf(seq, "%-26s %12lld\n", "unaligned_ios",
-		   (int64_t)atomic64_read(&stats->unaligned_ios));
+		   stats->unaligned_ios);
+	seq_printf(seq, "%-26s %12lld\n", "discards",
+		   stats->discards);
+	seq_printf(seq, "%-26s %12lld\n", "kb_seq_bypass_reads",
+		   stats->seq_bypass_reads / 2);
+	seq_printf(seq, "%-26s %12lld\n", "kb_seq_bypass_writes",
+		   stats->seq_bypass_writes / 2);
+	seq_printf(seq, "%-26s %12lld\n", "readaround_fills",
+		   stats->readaround_fills);
+	seq_printf(seq, "%-26s %12lld\n", "subblock_writes",
+		   stats->subblock_writes);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_coalesced_ios",
+		   stats->ssd_coalesced_ios);
+	seq_printf(seq, "%-26s %12lld\n", "lockless_peeks",
+		   stats->lockless_peeks);
+	seq_printf(seq, "%-26s %12lld\n", "lookup_filter_skips",
+		   stats->lookup_filter_skips);
+	seq_printf(seq, "%-26s %12lld\n", "lookup_filter_false_pos",
+		   stats->lookup_filter_false_pos);
+	seq_printf(seq, "%-26s %12lld\n", "admit_accepted",
+		   stats->admit_accepted);
+	seq_printf(seq, "%-26s %12lld\n", "admit_rejected",
+		   stats->admit_rejected);
+	seq_printf(seq, "%-26s %12lld\n", "hint_bypass", stats->hint_bypass);
+	seq_printf(seq, "%-26s %12lld\n", "hint_admit", stats->hint_admit);
+	seq_printf(seq, "%-26s %12lld\n", "pinned_blocks",
+		   (long long)atomic64_read(&dmc->nr_pinned));
+	seq_printf(seq, "%-26s %12lld\n", "pin_skips", stats->pin_skips);
 	return 0;
 }
 
@@ -1992,22 +2717,26 @@ static int eio_errors_open(struct inode *inode, struct file *file)
  */
 static int eio_iosize_hist_show(struct seq_file *seq, void *v)
 {
-	int i;
+	int i, cpu;
+	int64_t count;
 	struct cache_c *dmc = seq->private;
 
 	for (i = 1; i <= SIZE_HIST - 1; i++) {
-		if (atomic64_read(&dmc->size_hist[i]) == 0)
+		count = 0;
+		for_each_possible_cpu(cpu)
+			count += per_cpu_ptr(dmc->size_hist, cpu)[i];
+		if (count == 0)
 			continue;
 
 		if (i == 1)
 			seq_printf(seq, "%u   %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   count);
 		else if (i < 20)
 			seq_printf(seq, "%u  %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   count);
 		else
 			seq_printf(seq, "%u %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   count);
 	}
 
 	return 0;
@@ -2022,6 +2751,122 @@ static int eio_iosize_hist_open(struct inode *inode, struct file *file)
 	return single_open(file, &eio_iosize_hist_show, KPDE_DATA(inode));
 }
 
+static const char *const eio_lat_op_names[EIO_LAT_NR_OPS] = {
+	[EIO_LAT_CACHED_READ]		= "cached_read",
+	[EIO_LAT_UNCACHED_READ]		= "uncached_read",
+	[EIO_LAT_READFILL]		= "readfill",
+	[EIO_LAT_CACHED_WRITE]		= "cached_write",
+	[EIO_LAT_UNCACHED_WRITE]	= "uncached_write",
+	[EIO_LAT_DIRTY_WRITE]		= "dirty_write",
+	[EIO_LAT_MIXED_WRITE]		= "mixed_write",
+};
+
+/*
+ * Upper bound in ns of the bucket holding the permille-th bio, 0 when
+ * there is none and U64_MAX when it is the overflow bucket. Good to a
+ * factor of 2, like the buckets.
+ */
+static u64 eio_lat_percentile(const int64_t *buckets, int64_t total,
+			      unsigned int permille)
+{
+	int64_t target, sum = 0;
+	int b;
+
+	if (total <= 0)
+		return 0;
+
+	target = div_u64((u64)total * permille + 999, 1000);
+	for (b = 0; b < EIO_LAT_BUCKETS; b++) {
+		sum += buckets[b];
+		if (sum >= target)
+			break;
+	}
+	if (b >= EIO_LAT_BUCKETS - 1)
+		return U64_MAX;
+	return 1ULL << b;
+}
+
+/* One percentile column, "inf" for the overflow bucket */
+static void eio_lat_percentile_show(struct seq_file *seq,
+				    const int64_t *buckets, int64_t total,
+				    unsigned int permille)
+{
+	u64 ns = eio_lat_percentile(buckets, total, permille);
+
+	if (ns == U64_MAX)
+		seq_printf(seq, " %14s", "inf");
+	else
+		seq_printf(seq, " %14llu", ns);
+}
+
+/*
+ * eio_lat_hist_show
+ */
+static int eio_lat_hist_show(struct seq_file *seq, void *v)
+{
+	int op, b, cpu;
+	int64_t total;
+	struct eio_lat_hist *hist;
+	struct cache_c *dmc = seq->private;
+
+	hist = kzalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct eio_lat_hist *h = per_cpu_ptr(dmc->lat_hist, cpu);
+
+		for (op = 0; op < EIO_LAT_NR_OPS; op++)
+			for (b = 0; b < EIO_LAT_BUCKETS; b++)
+				hist->buckets[op][b] += h->buckets[op][b];
+	}
+
+	seq_printf(seq, "%-16s %12s %14s %14s %14s\n", "path", "count",
+		   "p50_ns", "p99_ns", "p999_ns");
+	for (op = 0; op < EIO_LAT_NR_OPS; op++) {
+		total = 0;
+		for (b = 0; b < EIO_LAT_BUCKETS; b++)
+			total += hist->buckets[op][b];
+		seq_printf(seq, "%-16s %12lld", eio_lat_op_names[op], total);
+		eio_lat_percentile_show(seq, hist->buckets[op], total, 500);
+		eio_lat_percentile_show(seq, hist->buckets[op], total, 990);
+		eio_lat_percentile_show(seq, hist->buckets[op], total, 999);
+		seq_puts(seq, "\n");
+	}
+
+	/* Raw buckets, one line per non empty bucket, "<ns" its upper bound */
+	seq_printf(seq, "\n%-16s", "<ns");
+	for (op = 0; op < EIO_LAT_NR_OPS; op++)
+		seq_printf(seq, " %14s", eio_lat_op_names[op]);
+	seq_puts(seq, "\n");
+	for (b = 0; b < EIO_LAT_BUCKETS; b++) {
+		total = 0;
+		for (op = 0; op < EIO_LAT_NR_OPS; op++)
+			total += hist->buckets[op][b];
+		if (total == 0)
+			continue;
+		if (b == EIO_LAT_BUCKETS - 1)
+			seq_printf(seq, "%-16s", "inf");
+		else
+			seq_printf(seq, "%-16llu", 1ULL << b);
+		for (op = 0; op < EIO_LAT_NR_OPS; op++)
+			seq_printf(seq, " %14lld", hist->buckets[op][b]);
+		seq_puts(seq, "\n");
+	}
+
+	kfree(hist);
+	return 0;
+}
+
+/*
+ * eio_lat_hist_open
+ */
+static int eio_lat_hist_open(struct inode *inode, struct file *file)
+{
+
+	return single_open(file, &eio_lat_hist_show, KPDE_DATA(inode));
+}
+
 /*
  * eio_version_show
  */
@@ -2050,11 +2895,17 @@ static int eio_version_open(struct inode *inode, struct file *file)
 static int eio_config_show(struct seq_file *seq, void *v)
 {
 	struct cache_c *dmc = seq->private;
+	struct eio_pin_range pins[EIO_MAX_PINS];
+	u_int32_t nr_pins, i;
+	unsigned seq_nr;
 
 	seq_printf(seq, "src_name   %s\n", dmc->disk_devname);
 	seq_printf(seq, "ssd_name   %s\n", dmc->cache_devname);
 	seq_printf(seq, "src_size   %lu\n", (long unsigned int)dmc->disk_size);
 	seq_printf(seq, "ssd_size   %lu\n", (long unsigned int)dmc->size);
+	if (dmc->stacked_disk)
+		seq_printf(seq, "stacked_dev /dev/%s\n",
+			   dmc->stacked_disk->disk_name);
 
 	seq_printf(seq, "set_size   %10u\n", dmc->assoc);
 	seq_printf(seq, "block_size %10u\n", (dmc->block_size) << SECTOR_SHIFT);
@@ -2068,6 +2919,19 @@ static int eio_config_show(struct seq_file *seq, void *v)
 		   CACHE_DEGRADED_IS_SET(dmc) ? "degraded"
 		   : (CACHE_FAILED_IS_SET(dmc) ? "failed" : "normal"));
 	seq_printf(seq, "flags      0x%08x\n", dmc->cache_flags);
+	seq_printf(seq, "lookup_filter_mem %10lu\n",
+		   READ_ONCE(dmc->lookup_filter) ?
+		   (long unsigned int)eio_lookup_filter_size(dmc) : 0UL);
+	do {
+		seq_nr = read_seqbegin(&dmc->pin_lock);
+		nr_pins = dmc->nr_pins;
+		memcpy(pins, dmc->pins, sizeof(pins));
+	} while (read_seqretry(&dmc->pin_lock, seq_nr));
+	seq_printf(seq, "pinned     %10u\n", nr_pins);
+	for (i = 0; i < nr_pins; i++)
+		seq_printf(seq, "pin        %llu+%llu\n",
+			   (unsigned long long)pins[i].start,
+			   (unsigned long long)(pins[i].end - pins[i].start));
 
 	return 0;
 }
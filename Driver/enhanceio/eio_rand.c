@@ -89,7 +89,8 @@ eio_rand_find_reclaim_dbn(struct eio_policy *p_ops, index_t start_index,
 	start_index = (start_index / dmc->assoc) * dmc->assoc;
 	for (i = 0; i < (int)dmc->assoc; i++) {
 		idx = dmc->random++ % dmc->assoc;
-		if (EIO_CACHE_STATE_GET(dmc, start_index + idx) == VALID) {
+		if (EIO_CACHE_STATE_GET(dmc, start_index + idx) == VALID &&
+		    !eio_blk_pinned(dmc, start_index + idx)) {
 			*index = start_index + idx;
 			return;
 		}
@@ -154,6 +155,7 @@ struct eio_policy *eio_rand_instance_init(void)
 	new_instance->sp_repl_blk_init = eio_rand_cache_blk_init;
 	new_instance->sp_find_reclaim_dbn = eio_rand_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_rand_clean_set;
+	new_instance->sp_blk_access = NULL;
 	new_instance->sp_dmc = NULL;
 
 	try_module_get(THIS_MODULE);
@@ -45,14 +45,25 @@ struct kcached_job *eio_alloc_cache_job(void)
 	struct kcached_job *job;
 
 	job = mempool_alloc(_job_pool, GFP_NOIO);
-	if (likely(job))
+	if (likely(job)) {
 		atomic_inc(&nr_cache_jobs);
+		job->embedded = 0;
+	}
 	return job;
 }
 
+/*
+ * An embedded job lives in its ebio, so it must be freed before
+ * the ebio is ended with eb_endio().
+ */
 void eio_free_cache_job(struct kcached_job *job)
 {
 
+	if (job->embedded) {
+		clear_bit_unlock(0, &container_of(job, struct eio_bio,
+						  eb_job)->eb_job_busy);
+		return;
+	}
 	mempool_free(job, _job_pool);
 	atomic_dec(&nr_cache_jobs);
 }
@@ -147,7 +158,12 @@ struct kcached_job *eio_new_job(struct cache_c *dmc, struct eio_bio *bio,
 
 	EIO_ASSERT((bio != NULL) || (index != -1));
 
-	job = eio_alloc_cache_job();
+	/* An ebio normally has one job at a time, use the embedded one */
+	if (bio && !test_and_set_bit_lock(0, &bio->eb_job_busy)) {
+		job = &bio->eb_job;
+		job->embedded = 1;
+	} else
+		job = eio_alloc_cache_job();
 	if (unlikely(job == NULL)) {
 		spin_lock_irqsave(&dmc->cache_spin_lock,
 				  dmc->cache_spin_lock_flags);
@@ -317,7 +333,7 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 			dmc->cache_flags &= ~CACHE_FLAGS_DEGRADED;
 		dmc->cache_flags |= CACHE_FLAGS_FAILED;
 		dmc->eio_errors.no_source_dev = 1;
-		atomic64_set(&dmc->eio_stats.cached_blocks, 0);
+		atomic64_set(&dmc->cached_blocks, 0);
 		pr_info("suspend_caching: Source Device Removed."
 			"Cache \"%s\" is in Failed mode.\n", dmc->cache_name);
 		break;
@@ -345,7 +361,7 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 				return;
 			}
 			dmc->cache_flags |= CACHE_FLAGS_DEGRADED;
-			atomic64_set(&dmc->eio_stats.cached_blocks, 0);
+			atomic64_set(&dmc->cached_blocks, 0);
 			pr_info("suspend caching: Cache \"%s\" \
 				is in Degraded mode.\n", dmc->cache_name);
 		}
@@ -0,0 +1,311 @@
+/*
+ *  eio_trace.h
+ *
+ *  Tracepoints of the I/O paths: map, lookup, readfill, clean,
+ *  metadata update and device errors. They cost a static branch each
+ *  while disabled. Enable them with perf, bpftrace or through
+ *  /sys/kernel/debug/tracing/events/enhanceio/.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM enhanceio
+
+#if !defined(_EIO_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _EIO_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* eio_lookup() outcomes */
+#define EIO_LOOKUP_HIT          0
+#define EIO_LOOKUP_INVALID      1
+#define EIO_LOOKUP_RECLAIM      2
+#define EIO_LOOKUP_NOROOM       3
+
+#define show_lookup_result(r)					\
+	__print_symbolic(r,					\
+			 { EIO_LOOKUP_HIT,	"hit" },	\
+			 { EIO_LOOKUP_INVALID,	"invalid" },	\
+			 { EIO_LOOKUP_RECLAIM,	"reclaim" },	\
+			 { EIO_LOOKUP_NOROOM,	"noroom" })
+
+#define show_bc_dir(d)						\
+	__print_symbolic(d,					\
+			 { EIO_IO_INVALID_DIR,	"none" },	\
+			 { CACHED_WRITE,	"cached_write" }, \
+			 { CACHED_READ,		"cached_read" }, \
+			 { UNCACHED_WRITE,	"uncached_write" }, \
+			 { UNCACHED_READ,	"uncached_read" }, \
+			 { UNCACHED_READ_AND_READFILL, "readfill" }, \
+			 { MIXED_WRITE,		"mixed_write" })
+
+/* eio_io_error() sources other than the cache job actions */
+#define EIO_IOERR_MDUPDATE      16
+#define EIO_IOERR_JOURNAL       17
+#define EIO_IOERR_CLEAN         18
+
+#define show_job_action(a)					\
+	__print_symbolic(a,					\
+			 { READCACHE,		"readcache" },	\
+			 { WRITECACHE,		"writecache" },	\
+			 { READDISK,		"readdisk" },	\
+			 { WRITEDISK,		"writedisk" },	\
+			 { READFILL,		"readfill" },	\
+			 { INVALIDATE,		"invalidate" },	\
+			 { EIO_IOERR_MDUPDATE,	"mdupdate" },	\
+			 { EIO_IOERR_JOURNAL,	"journal" },	\
+			 { EIO_IOERR_CLEAN,	"clean" })
+
+DECLARE_EVENT_CLASS(eio_bio_class,
+
+	TP_PROTO(struct cache_c *dmc, struct bio *bio, int dir, int error),
+
+	TP_ARGS(dmc, bio, dir, error),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(const void *,	bio)
+		__field(u64,		sector)
+		__field(unsigned int,	size)
+		__field(int,		rw)
+		__field(int,		dir)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->bio	= bio;
+		__entry->sector	= EIO_BIO_BI_SECTOR(bio);
+		__entry->size	= EIO_BIO_BI_SIZE(bio);
+		__entry->rw	= bio_data_dir(bio);
+		__entry->dir	= dir;
+		__entry->error	= error;
+	),
+
+	TP_printk("%s bio=%p %s sector=%llu size=%u path=%s error=%d",
+		  __get_str(cache), __entry->bio,
+		  __entry->rw == WRITE ? "W" : "R",
+		  (unsigned long long)__entry->sector, __entry->size,
+		  show_bc_dir(__entry->dir), __entry->error)
+);
+
+/* A bio entering eio_map() */
+DEFINE_EVENT(eio_bio_class, eio_map_enter,
+	TP_PROTO(struct cache_c *dmc, struct bio *bio, int dir, int error),
+	TP_ARGS(dmc, bio, dir, error)
+);
+
+/* eio_map() done with a bio: its I/Os are issued, or it is ended early */
+DEFINE_EVENT(eio_bio_class, eio_map_exit,
+	TP_PROTO(struct cache_c *dmc, struct bio *bio, int dir, int error),
+	TP_ARGS(dmc, bio, dir, error)
+);
+
+/* A bio completed back to its submitter */
+DEFINE_EVENT(eio_bio_class, eio_bio_complete,
+	TP_PROTO(struct cache_c *dmc, struct bio *bio, int dir, int error),
+	TP_ARGS(dmc, bio, dir, error)
+);
+
+TRACE_EVENT(eio_lookup,
+
+	TP_PROTO(struct cache_c *dmc, sector_t dbn, u32 set, index_t index,
+		 int result),
+
+	TP_ARGS(dmc, dbn, set, index, result),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(u64,		dbn)
+		__field(u32,		set)
+		__field(s64,		index)
+		__field(int,		result)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->dbn	= dbn;
+		__entry->set	= set;
+		__entry->index	= index;
+		__entry->result	= result;
+	),
+
+	TP_printk("%s dbn=%llu set=%u index=%lld %s",
+		  __get_str(cache), (unsigned long long)__entry->dbn,
+		  __entry->set, (long long)__entry->index,
+		  show_lookup_result(__entry->result))
+);
+
+DECLARE_EVENT_CLASS(eio_readfill_class,
+
+	TP_PROTO(struct cache_c *dmc, sector_t sector, index_t index,
+		 int error),
+
+	TP_ARGS(dmc, sector, index, error),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(u64,		sector)
+		__field(s64,		index)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->sector	= sector;
+		__entry->index	= index;
+		__entry->error	= error;
+	),
+
+	TP_printk("%s sector=%llu index=%lld error=%d",
+		  __get_str(cache), (unsigned long long)__entry->sector,
+		  (long long)__entry->index, __entry->error)
+);
+
+/* HDD read of a miss done, SSD fill queued */
+DEFINE_EVENT(eio_readfill_class, eio_readfill_enqueue,
+	TP_PROTO(struct cache_c *dmc, sector_t sector, index_t index,
+		 int error),
+	TP_ARGS(dmc, sector, index, error)
+);
+
+/* SSD write of a fill completed */
+DEFINE_EVENT(eio_readfill_class, eio_readfill_done,
+	TP_PROTO(struct cache_c *dmc, sector_t sector, index_t index,
+		 int error),
+	TP_ARGS(dmc, sector, index, error)
+);
+
+TRACE_EVENT(eio_clean_set_start,
+
+	TP_PROTO(struct cache_c *dmc, index_t set, int whole, int ncleans),
+
+	TP_ARGS(dmc, set, whole, ncleans),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(s64,		set)
+		__field(int,		whole)
+		__field(int,		ncleans)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->set		= set;
+		__entry->whole		= whole;
+		__entry->ncleans	= ncleans;
+	),
+
+	TP_printk("%s set=%lld whole=%d ncleans=%d",
+		  __get_str(cache), (long long)__entry->set, __entry->whole,
+		  __entry->ncleans)
+);
+
+TRACE_EVENT(eio_clean_set_end,
+
+	TP_PROTO(struct cache_c *dmc, index_t set, int ncleans, u64 bytes,
+		 int error),
+
+	TP_ARGS(dmc, set, ncleans, bytes, error),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(s64,		set)
+		__field(int,		ncleans)
+		__field(u64,		bytes)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->set		= set;
+		__entry->ncleans	= ncleans;
+		__entry->bytes		= bytes;
+		__entry->error		= error;
+	),
+
+	TP_printk("%s set=%lld ncleans=%d bytes=%llu error=%d",
+		  __get_str(cache), (long long)__entry->set, __entry->ncleans,
+		  (unsigned long long)__entry->bytes, __entry->error)
+);
+
+TRACE_EVENT(eio_mdupdate_submit,
+
+	TP_PROTO(struct cache_c *dmc, index_t set, sector_t sector,
+		 sector_t count),
+
+	TP_ARGS(dmc, set, sector, count),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(s64,		set)
+		__field(u64,		sector)
+		__field(u64,		count)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->set	= set;
+		__entry->sector	= sector;
+		__entry->count	= count;
+	),
+
+	TP_printk("%s set=%lld md_sector=%llu count=%llu",
+		  __get_str(cache), (long long)__entry->set,
+		  (unsigned long long)__entry->sector,
+		  (unsigned long long)__entry->count)
+);
+
+/*
+ * A failed I/O: a cache job, a set md update or clean, or a journal
+ * commit. "set" is -1 when the I/O is not tied to a set, "sector" is
+ * the source sector of a job and the first cache device sector written
+ * otherwise.
+ */
+TRACE_EVENT(eio_io_error,
+
+	TP_PROTO(struct cache_c *dmc, int action, s64 set, sector_t sector,
+		 int error),
+
+	TP_ARGS(dmc, action, set, sector, error),
+
+	TP_STRUCT__entry(
+		__string(cache,		dmc->cache_name)
+		__field(int,		action)
+		__field(s64,		set)
+		__field(u64,		sector)
+		__field(int,		error)
+	),
+
+	TP_fast_assign(
+		__assign_str(cache, dmc->cache_name);
+		__entry->action	= action;
+		__entry->set	= set;
+		__entry->sector	= sector;
+		__entry->error	= error;
+	),
+
+	TP_printk("%s %s set=%lld sector=%llu error=%d",
+		  __get_str(cache), show_job_action(__entry->action),
+		  (long long)__entry->set,
+		  (unsigned long long)__entry->sector, __entry->error)
+);
+
+#endif /* _EIO_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eio_trace
+#include <trace/define_trace.h>
@@ -26,16 +26,45 @@
  */
 
 #include <linux/fs.h>
+#include <linux/genhd.h>
+#include <linux/idr.h>
 #include <linux/miscdevice.h>
+#include <linux/rculist.h>
+#include <linux/srcu.h>
 #include "eio.h"
 #include "eio_ttc.h"
 
+/*
+ * eio_ttc_list buckets are RCU lists. eio_make_request_fn() walks them
+ * under eio_ttc_srcu only, the read side of SRCU being per-cpu. The
+ * srcu read section covers eio_map(), so a dmc stays valid until a
+ * synchronize_srcu() after it is taken off the list.
+ *
+ * eio_ttc_lock serializes the list updaters and the slow path readers.
+ * An updater that must also hold off new application I/O on a bucket
+ * uses eio_ttc_block()/eio_ttc_unblock(); the submission path waits on
+ * eio_ttc_wq while eio_ttc_blocked[] is set.
+ */
 static struct rw_semaphore eio_ttc_lock[EIO_HASHTBL_SIZE];
 static struct list_head eio_ttc_list[EIO_HASHTBL_SIZE];
+static int eio_ttc_blocked[EIO_HASHTBL_SIZE];
+static DECLARE_WAIT_QUEUE_HEAD(eio_ttc_wq);
+DEFINE_STATIC_SRCU(eio_ttc_srcu);
+
+/*
+ * A stacked cache does not take over the source queue. It is exported
+ * as a block device of its own, eio<N>, and never sits on the
+ * make_request_fn path of the source device.
+ */
+#define EIO_STACKED_NAME	"enhanceio"
+static int eio_stacked_major;
+static DEFINE_IDA(eio_stacked_ida);
 
 int eio_reboot_notified;
 
 static MAKE_REQUEST_FN_TYPE eio_make_request_fn(struct request_queue *, struct bio *);
+static MAKE_REQUEST_FN_TYPE eio_stacked_make_request_fn(struct request_queue *,
+							struct bio *);
 static void eio_cache_rec_fill(struct cache_c *, struct cache_rec_short *);
 static void eio_bio_end_empty_barrier(struct bio *, int);
 static void eio_issue_empty_barrier_flush(struct block_device *, struct bio *,
@@ -45,6 +74,7 @@ static int eio_mode_switch(struct cache_c *, u_int32_t);
 static int eio_policy_switch(struct cache_c *, u_int32_t);
 
 static int eio_overlap_split_bio(struct request_queue *, struct bio *);
+static void eio_overlap_discard(struct bio *, int, make_request_fn *);
 static struct bio *eio_split_new_bio(struct bio *, struct bio_container *,
 				     unsigned *, unsigned *, sector_t);
 static void eio_split_endio(struct bio *, int);
@@ -104,6 +134,12 @@ void hdd_make_request(make_request_fn *origmfn, struct bio *bio)
 		return;
 	}
 
+	/* Stacked caches reach the source through the block layer */
+	if (origmfn == NULL) {
+		generic_make_request(bio);
+		return;
+	}
+
 #ifdef COMPAT_MAKE_REQUEST_FN_SUBMITS_IO
 	origmfn(q, bio);
 #else
@@ -166,6 +202,101 @@ struct cache_c *eio_cache_lookup(char *name)
 	return NULL;
 }
 
+/*
+ * Take the bucket lock for update and hold off new I/O on the bucket.
+ * On return no eio_make_request_fn() is inside the bucket, so in-flight
+ * I/O can be drained with nr_ios.
+ */
+static void eio_ttc_block(int index)
+{
+	down_write(&eio_ttc_lock[index]);
+	WRITE_ONCE(eio_ttc_blocked[index], 1);
+	synchronize_srcu(&eio_ttc_srcu);
+}
+
+static void eio_ttc_unblock(int index)
+{
+	WRITE_ONCE(eio_ttc_blocked[index], 0);
+	wake_up_all(&eio_ttc_wq);
+	up_write(&eio_ttc_lock[index]);
+}
+
+/* Opens are counted under cache_spin_lock, see eio_cache_delete() */
+static int eio_stacked_open(struct block_device *bdev, fmode_t mode)
+{
+	struct cache_c *dmc = bdev->bd_disk->private_data;
+	unsigned long flags;
+	int error = 0;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	if (dmc->stacked_closing)
+		error = -ENXIO;
+	else
+		atomic_inc(&dmc->stacked_openers);
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	return error;
+}
+
+static void eio_stacked_release(struct gendisk *disk, fmode_t mode)
+{
+	struct cache_c *dmc = disk->private_data;
+
+	atomic_dec(&dmc->stacked_openers);
+}
+
+static const struct block_device_operations eio_stacked_fops = {
+	.owner		= THIS_MODULE,
+	.open		= eio_stacked_open,
+	.release	= eio_stacked_release,
+};
+
+static int eio_stacked_create(struct cache_c *dmc)
+{
+	struct block_device *bdev = dmc->disk_dev->bdev;
+	struct request_queue *q;
+	struct gendisk *disk;
+	int minor;
+
+	minor = ida_simple_get(&eio_stacked_ida, 0, 1 << MINORBITS, GFP_KERNEL);
+	if (minor < 0)
+		return minor;
+
+	q = blk_alloc_queue(GFP_KERNEL);
+	if (q == NULL)
+		goto out_ida;
+	blk_queue_make_request(q, eio_stacked_make_request_fn);
+	q->queuedata = dmc;
+	blk_queue_stack_limits(q, bdev_get_queue(bdev));
+	blk_queue_io_min(q, to_bytes(dmc->block_size));
+	EIO_QUEUE_WRITE_CACHE(q);
+	if (blk_queue_discard(bdev_get_queue(bdev)))
+		EIO_QUEUE_FLAG_SET(QUEUE_FLAG_DISCARD, q);
+
+	disk = alloc_disk(1);
+	if (disk == NULL)
+		goto out_queue;
+	disk->major = eio_stacked_major;
+	disk->first_minor = minor;
+	disk->fops = &eio_stacked_fops;
+	disk->private_data = dmc;
+	disk->queue = q;
+	snprintf(disk->disk_name, DISK_NAME_LEN, "eio%d", minor);
+	set_capacity(disk, bdev->bd_part->nr_sects);
+
+	atomic_set(&dmc->stacked_openers, 0);
+	dmc->stacked_disk = disk;
+	add_disk(disk);
+	pr_info("cache \"%s\" exported as /dev/%s", dmc->cache_name,
+		disk->disk_name);
+	return 0;
+
+out_queue:
+	blk_cleanup_queue(q);
+out_ida:
+	ida_simple_remove(&eio_stacked_ida, minor);
+	return -ENOMEM;
+}
+
 int eio_ttc_activate(struct cache_c *dmc)
 {
 	struct block_device *bdev;
@@ -187,9 +318,18 @@ int eio_ttc_activate(struct cache_c *dmc)
 	if (bdev == bdev->bd_contains)
 		wholedisk = 1;
 
-	dmc->dev_start_sect = bdev->bd_part->start_sect;
-	dmc->dev_end_sect =
-		bdev->bd_part->start_sect + bdev->bd_part->nr_sects - 1;
+	/*
+	 * Bios of a stacked cache address the source partition itself and
+	 * the block layer remaps them, so the cache sees partition sectors.
+	 */
+	if (CACHE_STACKED_IS_SET(dmc)) {
+		dmc->dev_start_sect = 0;
+		dmc->dev_end_sect = bdev->bd_part->nr_sects - 1;
+	} else {
+		dmc->dev_start_sect = bdev->bd_part->start_sect;
+		dmc->dev_end_sect =
+			bdev->bd_part->start_sect + bdev->bd_part->nr_sects - 1;
+	}
 
 	pr_debug("eio_ttc_activate: Device/Partition" \
 		 " sector_start: %llu, end: %llu\n",
@@ -199,7 +339,7 @@ int eio_ttc_activate(struct cache_c *dmc)
 	origmfn = NULL;
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
 
-	down_write(&eio_ttc_lock[index]);
+	eio_ttc_block(index);
 	list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
 		if (dmc1->disk_dev->bdev->bd_contains != bdev->bd_contains)
 			continue;
@@ -207,12 +347,14 @@ int eio_ttc_activate(struct cache_c *dmc)
 		if ((wholedisk) || (dmc1->dev_info == EIO_DEV_WHOLE_DISK) ||
 		    (dmc1->disk_dev->bdev == bdev)) {
 			error = -EINVAL;
-			up_write(&eio_ttc_lock[index]);
+			eio_ttc_unblock(index);
 			goto out;
 		}
 
 		/* some partition of same device already cached */
 		EIO_ASSERT(dmc1->dev_info == EIO_DEV_PARTITION);
+		if (CACHE_STACKED_IS_SET(dmc1))
+			continue;
 		origmfn = dmc1->origmfn;
 		break;
 	}
@@ -221,7 +363,11 @@ int eio_ttc_activate(struct cache_c *dmc)
 	 * Save original make_request_fn. Switch make_request_fn only once.
 	 */
 
-	if (origmfn) {
+	if (CACHE_STACKED_IS_SET(dmc)) {
+		dmc->origmfn = NULL;
+		dmc->dev_info =
+			(wholedisk) ? EIO_DEV_WHOLE_DISK : EIO_DEV_PARTITION;
+	} else if (origmfn) {
 		dmc->origmfn = origmfn;
 		dmc->dev_info = EIO_DEV_PARTITION;
 		EIO_ASSERT(wholedisk == 0);
@@ -232,7 +378,7 @@ int eio_ttc_activate(struct cache_c *dmc)
 			(wholedisk) ? EIO_DEV_WHOLE_DISK : EIO_DEV_PARTITION;
 	}
 
-	list_add_tail(&dmc->cachelist, &eio_ttc_list[index]);
+	list_add_tail_rcu(&dmc->cachelist, &eio_ttc_list[index]);
 
 	/*
 	 * Sleep for sometime, to allow previous I/Os to hit
@@ -242,7 +388,19 @@ int eio_ttc_activate(struct cache_c *dmc)
 	msleep(1);
 	eio_issue_empty_barrier_flush(dmc->disk_dev->bdev, NULL, EIO_HDD_DEVICE,
 	                              dmc->origmfn, REQ_OP_FLUSH, WRITE_FLUSH);
-	up_write(&eio_ttc_lock[index]);
+	eio_ttc_unblock(index);
+
+	if (CACHE_STACKED_IS_SET(dmc)) {
+		error = eio_stacked_create(dmc);
+		if (error) {
+			pr_err("cache_create: Cannot create stacked device, error %d",
+			       error);
+			down_write(&eio_ttc_lock[index]);
+			list_del_rcu(&dmc->cachelist);
+			up_write(&eio_ttc_lock[index]);
+			synchronize_srcu(&eio_ttc_srcu);
+		}
+	}
 
 out:
 	if (error == -EINVAL) {
@@ -293,47 +451,66 @@ int eio_ttc_deactivate(struct cache_c *dmc, int force)
 	 * in the list.
 	 */
 deactivate:
+	/* No new I/O through the stacked device from here on */
+	if (CACHE_STACKED_IS_SET(dmc) && dmc->stacked_disk) {
+		del_gendisk(dmc->stacked_disk);
+		blk_cleanup_queue(dmc->stacked_disk->queue);
+	}
+
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
 	found_partitions = 0;
 
 	/* check if barrier QUEUE is empty or not */
 	down_write(&eio_ttc_lock[index]);
 
-	if (dmc->dev_info != EIO_DEV_WHOLE_DISK)
-		list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
-			if (dmc == dmc1)
-				continue;
+	if (!CACHE_STACKED_IS_SET(dmc)) {
+		if (dmc->dev_info != EIO_DEV_WHOLE_DISK)
+			list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
+				if (dmc == dmc1 || CACHE_STACKED_IS_SET(dmc1))
+					continue;
 
-			if (dmc1->disk_dev->bdev->bd_contains !=
-				bdev->bd_contains)
-				continue;
+				if (dmc1->disk_dev->bdev->bd_contains !=
+					bdev->bd_contains)
+					continue;
 
-			EIO_ASSERT(dmc1->dev_info == EIO_DEV_PARTITION);
+				EIO_ASSERT(dmc1->dev_info == EIO_DEV_PARTITION);
 
-			/*
-			 * There are still other partitions which are cached.
-			 * Do not switch the make_request_fn.
-			 */
+				/*
+				 * There are still other partitions which are cached.
+				 * Do not switch the make_request_fn.
+				 */
 
-			found_partitions = 1;
-			break;
-		}
+				found_partitions = 1;
+				break;
+			}
 
 		if ((dmc->dev_info == EIO_DEV_WHOLE_DISK) ||
 			(found_partitions == 0))
 			rq->make_request_fn = dmc->origmfn;
+	}
 
-	list_del_init(&dmc->cachelist);
+	list_del_rcu(&dmc->cachelist);
 	up_write(&eio_ttc_lock[index]);
 
+	/* No new lookup can find dmc once the srcu readers are done */
+	synchronize_srcu(&eio_ttc_srcu);
+
 	/* wait for nr_ios to drain-out */
-	while (atomic64_read(&dmc->nr_ios) != 0)
+	while (percpu_counter_sum(&dmc->nr_ios) != 0)
 		schedule_timeout(msecs_to_jiffies(100));
 
+	if (CACHE_STACKED_IS_SET(dmc) && dmc->stacked_disk) {
+		int minor = dmc->stacked_disk->first_minor;
+
+		put_disk(dmc->stacked_disk);
+		dmc->stacked_disk = NULL;
+		ida_simple_remove(&eio_stacked_ida, minor);
+	}
+
 	return ret;
 }
 
-void eio_ttc_init(void)
+int eio_ttc_init(void)
 {
 	int i;
 
@@ -341,6 +518,20 @@ void eio_ttc_init(void)
 		init_rwsem(&eio_ttc_lock[i]);
 		INIT_LIST_HEAD(&eio_ttc_list[i]);
 	}
+
+	eio_stacked_major = register_blkdev(0, EIO_STACKED_NAME);
+	if (eio_stacked_major < 0) {
+		pr_err("ttc_init: Cannot register block device major, error %d",
+		       eio_stacked_major);
+		return eio_stacked_major;
+	}
+	return 0;
+}
+
+void eio_ttc_exit(void)
+{
+	unregister_blkdev(eio_stacked_major, EIO_STACKED_NAME);
+	ida_destroy(&eio_stacked_ida);
 }
 
 /*
@@ -372,6 +563,7 @@ static MAKE_REQUEST_FN_TYPE eio_make_request_fn(struct request_queue *q,
 	make_request_fn *origmfn;
 	struct cache_c *dmc, *dmc1;
 	struct block_device *bdev;
+	int srcu_idx;
 
 	bdev = EIO_BIO_DEV(bio);
 
@@ -382,12 +574,21 @@ re_lookup:
 
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
 
-	down_read(&eio_ttc_lock[index]);
+	srcu_idx = srcu_read_lock(&eio_ttc_srcu);
+	if (unlikely(READ_ONCE(eio_ttc_blocked[index]))) {
+		srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
+		wait_event(eio_ttc_wq, !READ_ONCE(eio_ttc_blocked[index]));
+		goto re_lookup;
+	}
 
-	list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
+	list_for_each_entry_rcu(dmc1, &eio_ttc_list[index], cachelist) {
 		if (dmc1->disk_dev->bdev->bd_contains != bdev->bd_contains)
 			continue;
 
+		/* A stacked cache is reached through its own device only */
+		if (CACHE_STACKED_IS_SET(dmc1))
+			continue;
+
 		if (dmc1->dev_info == EIO_DEV_WHOLE_DISK) {
 			dmc = dmc1;     /* found cached device */
 			break;
@@ -424,15 +625,13 @@ re_lookup:
 	}
 
 	if (unlikely(overlap)) {
-		up_read(&eio_ttc_lock[index]);
-
 		if (bio_op(bio) == REQ_OP_DISCARD) {
-			pr_err
-				("eio_mfn: Overlap I/O with Discard flag." \
-				" Discard flag is not supported.\n");
-			EIO_BIO_ENDIO(bio, -EOPNOTSUPP);
-		} else
+			eio_overlap_discard(bio, index, origmfn);
+			srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
+		} else {
+			srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
 			ret = eio_overlap_split_bio(q, bio);
+		}
 	} else if (dmc) {       /* found cached partition or device */
 		/*
 		 * Start sector of cached partition may or may not be
@@ -451,7 +650,7 @@ re_lookup:
 	}
 
 	if (!overlap)
-		up_read(&eio_ttc_lock[index]);
+		srcu_read_unlock(&eio_ttc_srcu, srcu_idx);
 
 	if (overlap || dmc)
 		MAKE_REQUEST_FN_RETURN_0;
@@ -478,6 +677,20 @@ re_lookup:
 	MAKE_REQUEST_FN_RETURN_0;
 }
 
+/*
+ * make_request_fn of the stacked device. The dmc is pinned by the queue,
+ * deactivation cleans the queue up before the dmc goes away.
+ */
+static MAKE_REQUEST_FN_TYPE eio_stacked_make_request_fn(struct request_queue *q,
+							struct bio *bio)
+{
+	struct cache_c *dmc = q->queuedata;
+
+	EIO_BIO_SET_DEV(bio, dmc->disk_dev->bdev);
+	eio_map(dmc, q, bio);
+	MAKE_REQUEST_FN_RETURN_0;
+}
+
 uint64_t eio_get_cache_count(void)
 {
 	struct cache_c *dmc;
@@ -946,7 +1159,7 @@ static int eio_dispatch_io(struct cache_c *dmc, struct eio_io_region *where,
 			pr_debug("dispatch_io: processing unaligned I/O: sector %lu, count %lu",
 	                         (where->sector + where->count - remaining),
 			         remaining);
-			atomic64_inc(&dmc->eio_stats.unaligned_ios);
+			EIO_STATS_INC(dmc->eio_stats->unaligned_ios);
 			r = do_unaligned_io(un_bio, (where->sector +
 				            where->count - remaining),
 				            remaining, where->bdev, &vecs,
@@ -1174,6 +1387,83 @@ void eio_process_zero_size_bio(struct cache_c *dmc, struct bio *origbio)
 				      op_flags);
 }
 
+/* Pass a discard from eio_map() on to the source device */
+void eio_discard_forward(struct cache_c *dmc, struct bio *bio)
+{
+	EIO_BIO_BI_SECTOR(bio) += dmc->dev_start_sect;
+	hdd_make_request(dmc->origmfn, bio);
+}
+
+/*
+ * Drop the cached copy of a discarded range and pass the discard on to
+ * the source device, now or once its dirty blocks are dropped. The bio
+ * comes from eio_map() with its sector relative to the start of the
+ * cached partition.
+ */
+void eio_process_discard_bio(struct cache_c *dmc, struct bio *bio)
+{
+	EIO_ASSERT(bio_op(bio) == REQ_OP_DISCARD);
+
+	if (!eio_discard_range(dmc, EIO_BIO_BI_SECTOR(bio),
+			       EIO_BIO_BI_SIZE(bio), bio, NULL))
+		eio_discard_forward(dmc, bio);
+}
+
+void eio_discard_fwd_put(struct eio_discard_fwd *fwd)
+{
+	if (!atomic_dec_and_test(&fwd->pending))
+		return;
+	hdd_make_request(fwd->origmfn, fwd->bio);
+	kfree(fwd);
+}
+
+/*
+ * A discard overlapping cached partitions: invalidate the part of it
+ * that falls in each of them, and pass it on once the dirty blocks they
+ * drop are gone, as eio_process_discard_bio() does. Without memory for
+ * that, their dirty blocks are kept. Called under eio_ttc_srcu.
+ */
+static void eio_overlap_discard(struct bio *bio, int index,
+				make_request_fn *origmfn)
+{
+	struct block_device *bdev = EIO_BIO_DEV(bio);
+	struct eio_discard_fwd *fwd;
+	struct cache_c *dmc;
+	sector_t start, end;
+
+	fwd = kmalloc(sizeof(*fwd), GFP_NOWAIT);
+	if (fwd) {
+		atomic_set(&fwd->pending, 1);
+		fwd->origmfn = origmfn;
+		fwd->bio = bio;
+	}
+
+	list_for_each_entry_rcu(dmc, &eio_ttc_list[index], cachelist) {
+		if (dmc->disk_dev->bdev->bd_contains != bdev->bd_contains ||
+		    CACHE_STACKED_IS_SET(dmc))
+			continue;
+
+		start = max_t(sector_t, EIO_BIO_BI_SECTOR(bio),
+			      dmc->dev_start_sect);
+		end = min_t(sector_t, EIO_BIO_BI_SECTOR(bio) +
+			    eio_to_sector(EIO_BIO_BI_SIZE(bio)) - 1,
+			    dmc->dev_end_sect);
+		if (start > end)
+			continue;
+		if (fwd)
+			atomic_inc(&fwd->pending);
+		if (!eio_discard_range(dmc, start - dmc->dev_start_sect,
+				       (unsigned)to_bytes(end - start + 1),
+				       NULL, fwd) && fwd)
+			atomic_dec(&fwd->pending);
+	}
+
+	if (fwd)
+		eio_discard_fwd_put(fwd);
+	else
+		hdd_make_request(origmfn, bio);
+}
+
 static void eio_bio_end_empty_barrier(struct bio *bio, int error)
 {
 	EIO_ENDIO_FN_START;
@@ -1224,17 +1514,17 @@ static int eio_finish_nrdirty(struct cache_c *dmc)
 	retry_count = FINISH_NRDIRTY_RETRY_COUNT;
 
 	index = EIO_HASH_BDEV(dmc->disk_dev->bdev->bd_contains->bd_dev);
-	down_write(&eio_ttc_lock[index]);
+	eio_ttc_block(index);
 
 	/* Wait for the in-flight I/Os to drain out */
-	while (atomic64_read(&dmc->nr_ios) != 0) {
+	while (percpu_counter_sum(&dmc->nr_ios) != 0) {
 		pr_debug("finish_nrdirty: Draining I/O inflight\n");
 		schedule_timeout(msecs_to_jiffies(1));
 	}
 	EIO_ASSERT(!(dmc->sysctl_active.do_clean & EIO_CLEAN_START));
 
 	dmc->sysctl_active.do_clean |= EIO_CLEAN_KEEP | EIO_CLEAN_START;
-	up_write(&eio_ttc_lock[index]);
+	eio_ttc_unblock(index);
 
 	/*
 	 * In the process of cleaning CACHE if CACHE turns to FAILED state,
@@ -1356,23 +1646,23 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	}
 
 	index = EIO_HASH_BDEV(dmc->disk_dev->bdev->bd_contains->bd_dev);
-	down_write(&eio_ttc_lock[index]);
+	eio_ttc_block(index);
 
 	/* Wait for the in-flight I/Os to drain out */
-	while (atomic64_read(&dmc->nr_ios) != 0) {
+	while (percpu_counter_sum(&dmc->nr_ios) != 0) {
 		pr_debug("cache_edit: Draining I/O inflight\n");
 		schedule_timeout(msecs_to_jiffies(1));
 	}
 
 	pr_debug("cache_edit: Blocking application I/O\n");
 
-	EIO_ASSERT(atomic64_read(&dmc->nr_ios) == 0);
+	EIO_ASSERT(percpu_counter_sum(&dmc->nr_ios) == 0);
 
 	/* policy change */
 	if ((policy != 0) && (policy != dmc->req_policy)) {
 		error = eio_policy_switch(dmc, policy);
 		if (error) {
-			up_write(&eio_ttc_lock[index]);
+			eio_ttc_unblock(index);
 			goto out;
 		}
 	}
@@ -1381,7 +1671,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	if ((mode != 0) && (mode != dmc->mode)) {
 		error = eio_mode_switch(dmc, mode);
 		if (error) {
-			up_write(&eio_ttc_lock[index]);
+			eio_ttc_unblock(index);
 			goto out;
 		}
 	}
@@ -1399,7 +1689,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	eio_procfs_dtr(dmc);
 	eio_procfs_ctr(dmc);
 
-	up_write(&eio_ttc_lock[index]);
+	eio_ttc_unblock(index);
 
 out:
 	dmc->sysctl_active.time_based_clean_interval = old_time_thresh;
@@ -1440,6 +1730,105 @@ out:
 	return error;
 }
 
+/*
+ * Pin a range of source sectors in the cache, or unpin it. The blocks of
+ * a pinned range are never evicted, and its misses are cached past the
+ * sequential bypass and admission. Ranges may not overlap, and a range
+ * is unpinned as it was pinned. They are kept in the superblock.
+ */
+int eio_cache_pin(char *cache_name, sector_t start, sector_t len, int pin)
+{
+	struct eio_pin_range old[EIO_MAX_PINS];
+	struct cache_c *dmc;
+	sector_t end = start + len;
+	u_int32_t old_nr, i;
+	unsigned long flags;
+	int error = 0;
+
+	dmc = eio_cache_lookup(cache_name);
+	if (NULL == dmc) {
+		pr_err("cache_pin: cache %s do not exist", cache_name);
+		return -EINVAL;
+	}
+
+	if (len == 0 || end < start || end > dmc->disk_size) {
+		pr_err("cache_pin: range %llu+%llu is out of the source of cache %s",
+		       (unsigned long long)start, (unsigned long long)len,
+		       cache_name);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
+	if (dmc->cache_flags & (CACHE_FLAGS_SHUTDOWN_INPROG |
+				CACHE_FLAGS_MOD_INPROG)) {
+		pr_err("cache_pin: cache %s is being shut down or modified",
+		       cache_name);
+		spin_unlock_irqrestore(&dmc->cache_spin_lock,
+				       dmc->cache_spin_lock_flags);
+		return -EINVAL;
+	}
+	dmc->cache_flags |= CACHE_FLAGS_MOD_INPROG;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock,
+			       dmc->cache_spin_lock_flags);
+
+	old_nr = dmc->nr_pins;
+	memcpy(old, dmc->pins, sizeof(old));
+	for (i = 0; i < old_nr; i++) {
+		if (start < old[i].end && end > old[i].start)
+			break;
+	}
+
+	if (pin) {
+		if (i < old_nr) {
+			pr_err("cache_pin: range %llu+%llu overlaps a pinned range",
+			       (unsigned long long)start,
+			       (unsigned long long)len);
+			error = -EINVAL;
+			goto out;
+		}
+		if (old_nr == EIO_MAX_PINS) {
+			pr_err("cache_pin: cache %s has %d pinned ranges already",
+			       cache_name, EIO_MAX_PINS);
+			error = -ENOSPC;
+			goto out;
+		}
+		write_seqlock_irqsave(&dmc->pin_lock, flags);
+		dmc->pins[old_nr].start = start;
+		dmc->pins[old_nr].end = end;
+		dmc->nr_pins = old_nr + 1;
+		write_sequnlock_irqrestore(&dmc->pin_lock, flags);
+	} else {
+		if (i == old_nr || old[i].start != start || old[i].end != end) {
+			pr_err("cache_unpin: range %llu+%llu is not pinned",
+			       (unsigned long long)start,
+			       (unsigned long long)len);
+			error = -ENOENT;
+			goto out;
+		}
+		write_seqlock_irqsave(&dmc->pin_lock, flags);
+		dmc->pins[i] = dmc->pins[old_nr - 1];
+		dmc->nr_pins = old_nr - 1;
+		write_sequnlock_irqrestore(&dmc->pin_lock, flags);
+	}
+
+	error = eio_sb_store(dmc);
+	if (error) {
+		pr_err("cache_pin: superblock update failed(error %d)", error);
+		write_seqlock_irqsave(&dmc->pin_lock, flags);
+		memcpy(dmc->pins, old, sizeof(old));
+		dmc->nr_pins = old_nr;
+		write_sequnlock_irqrestore(&dmc->pin_lock, flags);
+	}
+	eio_pin_recount(dmc);
+
+out:
+	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
+	dmc->cache_flags &= ~CACHE_FLAGS_MOD_INPROG;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock,
+			       dmc->cache_spin_lock_flags);
+	return error;
+}
+
 static int eio_mode_switch(struct cache_c *dmc, u_int32_t mode)
 {
 	int error = 0;
@@ -1560,6 +1949,9 @@ void eio_free_wb_bvecs(struct bio_vec *bvec, int allocated, int blksize)
 
 		case BLKSIZE_4K:
 		case BLKSIZE_8K:
+		case BLKSIZE_16K:
+		case BLKSIZE_32K:
+		case BLKSIZE_64K:
 			if (bvec[i].bv_page) {
 				put_page(bvec[i].bv_page);
 				bvec[i].bv_page = NULL;
@@ -1621,6 +2013,9 @@ int eio_alloc_wb_bvecs(struct bio_vec *bvec, int max, int blksize)
 
 		case BLKSIZE_4K:
 		case BLKSIZE_8K:
+		case BLKSIZE_16K:
+		case BLKSIZE_32K:
+		case BLKSIZE_64K:
 			page = alloc_page(GFP_NOIO | __GFP_ZERO);
 			if (unlikely(!page)) {
 				pr_err("eio_alloc_wb_bvecs:" \
@@ -1764,11 +2159,14 @@ int eio_reboot_handling(void)
 	eio_reboot_notified = EIO_REBOOT_HANDLING_INPROG;
 
 	for (i = 0; i < EIO_HASHTBL_SIZE; i++) {
-		down_write(&eio_ttc_lock[i]);
+		eio_ttc_block(i);
 		list_for_each_entry(dmc, &eio_ttc_list[i], cachelist) {
 
-			kfree(tempdmc);
-			tempdmc = NULL;
+			if (tempdmc) {
+				eio_stats_free(tempdmc);
+				kfree(tempdmc);
+				tempdmc = NULL;
+			}
 			if (unlikely(CACHE_FAILED_IS_SET(dmc)) ||
 			    unlikely(CACHE_DEGRADED_IS_SET(dmc))) {
 				pr_err
@@ -1778,12 +2176,12 @@ int eio_reboot_handling(void)
 				continue;
 			}
 
-			while (atomic64_read(&dmc->nr_ios) != 0) {
+			while (percpu_counter_sum(&dmc->nr_ios) != 0) {
 				pr_debug("rdonly: Draining I/O inflight\n");
 				schedule_timeout(msecs_to_jiffies(10));
 			}
 
-			EIO_ASSERT(atomic64_read(&dmc->nr_ios) == 0);
+			EIO_ASSERT(percpu_counter_sum(&dmc->nr_ios) == 0);
 			EIO_ASSERT(dmc->cache_rdonly == 0);
 
 			/*
@@ -1805,9 +2203,9 @@ int eio_reboot_handling(void)
 			 */
 
 			while (dmc->cache_flags & CACHE_FLAGS_MOD_INPROG) {
-				up_write(&eio_ttc_lock[i]);
+				eio_ttc_unblock(i);
 				schedule_timeout(msecs_to_jiffies(1));
-				down_write(&eio_ttc_lock[i]);
+				eio_ttc_block(i);
 			}
 			if (dmc->cache_flags & CACHE_FLAGS_DELETED) {
 				/*
@@ -1826,7 +2224,7 @@ int eio_reboot_handling(void)
 			dmc->cache_rdonly = 1;
 			pr_info("Cache \"%s\" marked read only\n",
 				dmc->cache_name);
-			up_write(&eio_ttc_lock[i]);
+			eio_ttc_unblock(i);
 
 			if (dmc->cold_boot && atomic64_read(&dmc->nr_dirty) &&
 			    !eio_force_warm_boot) {
@@ -1848,11 +2246,14 @@ int eio_reboot_handling(void)
 			spin_unlock_irqrestore(&dmc->cache_spin_lock,
 					       dmc->cache_spin_lock_flags);
 
-			down_write(&eio_ttc_lock[i]);
+			eio_ttc_block(i);
+		}
+		if (tempdmc) {
+			eio_stats_free(tempdmc);
+			kfree(tempdmc);
+			tempdmc = NULL;
 		}
-		kfree(tempdmc);
-		tempdmc = NULL;
-		up_write(&eio_ttc_lock[i]);
+		eio_ttc_unblock(i);
 	}
 
 	eio_reboot_notified = EIO_REBOOT_HANDLING_DONE;
@@ -1878,12 +2279,13 @@ static int eio_overlap_split_bio(struct request_queue *q, struct bio *bio)
 		EIO_BIO_ENDIO(bio, -ENOMEM);
 		return 0;
 	}
-	bc = kmalloc(sizeof(struct bio_container), GFP_NOWAIT);
+	bc = mempool_alloc(_bc_pool, GFP_NOWAIT);
 	if (!bc) {
 		EIO_BIO_ENDIO(bio, -ENOMEM);
 		kfree(bioptr);
 		return 0;
 	}
+	bc->bc_arena = NULL;
 
 	atomic_set(&bc->bc_holdcount, nbios);
 	bc->bc_bio = bio;
@@ -1904,7 +2306,7 @@ static int eio_overlap_split_bio(struct request_queue *q, struct bio *bio)
 		for (i--; i >= 0; i--)
 			bio_put(bioptr[i]);
 		EIO_BIO_ENDIO(bio, -ENOMEM);
-		kfree(bc);
+		mempool_free(bc, _bc_pool);
 		goto out;
 	}
 
@@ -1964,7 +2366,7 @@ static void eio_split_endio(struct bio *bio, int error)
 	bio_put(bio);
 	if (atomic_dec_and_test(&bc->bc_holdcount)) {
 		EIO_BIO_ENDIO(bc->bc_bio, bc->bc_error);
-		kfree(bc);
+		mempool_free(bc, _bc_pool);
 	}
 	return;
 }
@@ -109,7 +109,8 @@ extern void eio_ttc_put_device(struct eio_bdev **);
 extern struct cache_c *eio_cache_lookup(char *);
 extern int eio_ttc_activate(struct cache_c *);
 extern int eio_ttc_deactivate(struct cache_c *, int);
-extern void eio_ttc_init(void);
+extern int eio_ttc_init(void);
+extern void eio_ttc_exit(void);
 
 extern int eio_cache_create(struct cache_rec_short *);
 extern int eio_cache_delete(char *, int);
@@ -125,6 +126,7 @@ extern int eio_allocate_wb_resources(struct cache_c *);
 extern void eio_free_wb_resources(struct cache_c *);
 
 extern int eio_cache_edit(char *, u_int32_t, u_int32_t);
+extern int eio_cache_pin(char *, sector_t, sector_t, int);
 
 extern void eio_stop_async_tasks(struct cache_c *dmc);
 extern int eio_start_clean_thread(struct cache_c *dmc);
@@ -139,6 +141,9 @@ extern struct bio_vec *eio_alloc_pages(u_int32_t max_pages, int *page_count);
 extern int eio_md_store(struct cache_c *);
 extern int eio_reboot_handling(void);
 extern void eio_process_zero_size_bio(struct cache_c *dmc, struct bio *origbio);
+extern void eio_process_discard_bio(struct cache_c *dmc, struct bio *bio);
+extern void eio_discard_forward(struct cache_c *dmc, struct bio *bio);
+extern void eio_discard_fwd_put(struct eio_discard_fwd *fwd);
 extern long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg);
 extern long eio_compact_ioctl(struct file *filp, unsigned cmd,
 			      unsigned long arg);